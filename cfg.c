@@ -218,6 +218,83 @@ hgd_cfg_netd_max_filesize(config_t *cf, long long int *max_upload_size)
 	}
 }
 
+void
+hgd_cfg_netd_timeouts(config_t *cf, int *secs)
+{
+	/* -I, -H, -U, -W */
+	const char		*keys[HGD_N_DEADLINES] = {
+				    "netd.idle_timeout",
+				    "netd.header_timeout",
+				    "netd.upload_timeout",
+				    "netd.send_timeout" };
+	long long int		 tmp_secs;
+	int			 i;
+
+	for (i = 0; i < HGD_N_DEADLINES; i++) {
+		if (config_lookup_int64(cf, keys[i], &tmp_secs)) {
+			secs[i] = tmp_secs;
+			DPRINTF(HGD_D_DEBUG, "Set %s to %d", keys[i], secs[i]);
+		}
+	}
+}
+
+void
+hgd_cfg_netd_admission(config_t *cf, int *backlog, int *max_sessions,
+    int *conn_rate, int *conn_burst)
+{
+	/* -l, -M, -r, -b */
+	const char		*keys[4] = {
+				    "netd.backlog",
+				    "netd.max_sessions",
+				    "netd.conn_rate",
+				    "netd.conn_burst" };
+	int			*vals[4];
+	long long int		 tmp_val;
+	int			 i;
+
+	vals[0] = backlog;
+	vals[1] = max_sessions;
+	vals[2] = conn_rate;
+	vals[3] = conn_burst;
+
+	for (i = 0; i < 4; i++) {
+		if (config_lookup_int64(cf, keys[i], &tmp_val)) {
+			*vals[i] = tmp_val;
+			DPRINTF(HGD_D_DEBUG, "Set %s to %d", keys[i], *vals[i]);
+		}
+	}
+}
+
+void
+hgd_cfg_netd_pool(config_t *cf, int *pool_size, int *worker_sessions)
+{
+	/* -P, -R */
+	long long int		 tmp_val;
+
+	if (config_lookup_int64(cf, "netd.workers", &tmp_val)) {
+		*pool_size = tmp_val;
+		DPRINTF(HGD_D_DEBUG, "Set worker pool size to %d", *pool_size);
+	}
+
+	if (config_lookup_int64(cf, "netd.worker_sessions", &tmp_val)) {
+		*worker_sessions = tmp_val;
+		DPRINTF(HGD_D_DEBUG, "Set worker sessions to %d",
+		    *worker_sessions);
+	}
+}
+
+void
+hgd_cfg_netd_threads(config_t *cf, int *loop_threads)
+{
+	/* -t */
+	long long int		 tmp_val;
+
+	if (config_lookup_int64(cf, "netd.threads", &tmp_val)) {
+		*loop_threads = tmp_val;
+		DPRINTF(HGD_D_DEBUG, "Set loop threads to %d", *loop_threads);
+	}
+}
+
 void
 hgd_cfg_netd_sslcert(config_t *cf, char **ssl_cert_path)
 {
@@ -329,6 +406,23 @@ hgd_cfg_c_maxitems(config_t *cf, uint8_t *hud_max_items)
 	}
 }
 
+void
+hgd_cfg_c_upload_jobs(config_t *cf, uint8_t *upload_jobs)
+{
+	/* -j */
+	long long int		tmp_upload_jobs;
+
+	if (config_lookup_int64(cf, "upload_jobs", &tmp_upload_jobs)) {
+		if ((tmp_upload_jobs < 1) || (tmp_upload_jobs > UINT8_MAX)) {
+			DPRINTF(HGD_D_WARN, "Ignoring upload_jobs=%lld, "
+			    "it must be 1 to %d", tmp_upload_jobs, UINT8_MAX);
+			return;
+		}
+		*upload_jobs = tmp_upload_jobs;
+		DPRINTF(HGD_D_DEBUG, "upload jobs=%d", *upload_jobs);
+	}
+}
+
 void
 hgd_cfg_c_hostname(config_t *cf, char **host)
 {
@@ -34,6 +34,12 @@ void	 hgd_cfg_netd_votesound(config_t *cf, int *req_votes);
 void	 hgd_cfg_netd_port(config_t *cf, int *port);
 void	 hgd_cfg_netd_max_filesize(config_t *cf, long long *max_upload_size);
 void	 hgd_cfg_netd_sslcert(config_t *cf, char **ssl_cert_path);
+void	 hgd_cfg_netd_timeouts(config_t *cf, int *secs);
+void	 hgd_cfg_netd_admission(config_t *cf, int *backlog,
+	     int *max_sessions, int *conn_rate, int *conn_burst);
+void	 hgd_cfg_netd_pool(config_t *cf, int *pool_size,
+	     int *worker_sessions);
+void	 hgd_cfg_netd_threads(config_t *cf, int *loop_threads);
 void	 hgd_cfg_debug(config_t *cf, char* service, int8_t *hgd_debug);
 void	 hgd_cfg_netd_voteoff_sound(config_t *cf, char **vote_sound);
 void	 hgd_cfg_playd_purgefs(config_t *cf, uint8_t *purge_finished_fs);
@@ -41,6 +47,7 @@ void	 hgd_cfg_pluginpath(config_t *cf, char **hgd_py_plugin_dir);
 void	 hgd_cfg_playd_purgedb(config_t *cf, uint8_t *purge_finished_db);
 void	 hgd_cfg_c_colours(config_t *cf, uint8_t *colours_on);
 void	 hgd_cfg_c_maxitems(config_t *cf, uint8_t *hud_max_items);
+void	 hgd_cfg_c_upload_jobs(config_t *cf, uint8_t *upload_jobs);
 void	 hgd_cfg_c_hostname(config_t *cf, char **host);
 void	 hgd_cfg_c_port(config_t *cf, int *port);
 void	 hgd_cfg_c_password(config_t *cf, char **password, char *config_location);
@@ -42,6 +42,7 @@
 #endif
 
 #include "config.h"
+#include "client.h"
 #include "hgd.h"
 #include "net.h"
 #include "user.h"
@@ -56,11 +57,39 @@ int			 sock_fd = -1;
 SSL			*ssl = NULL;
 SSL_METHOD		*method;
 SSL_CTX			*ctx;
+struct hgd_ctx		 main_ctx;
 uint8_t			 crypto_pref = HGD_CRYPTO_PREF_IF_POSS;
 uint8_t			 server_ssl_capable = 0;
 uint8_t			 authenticated = 0;
-uint8_t			 hud_refresh_speed = 5;
+uint8_t			 hud_refresh_speed = 1;
 uint8_t			 colours_on = 1;
+uint8_t			 upload_jobs = 1;
+
+struct hgd_resp_err {
+	char		*code;
+	char		*meaning;
+};
+
+struct hgd_resp_err hgd_resp_errs[] = {
+	{ "E_INT",		"Internal error" },
+	{ "E_DENY",		"Access denied" },
+	{ "E_FLSIZE",		"File size invalid" },
+	{ "E_FLOOD",		"Flood protect triggered" },
+	{ "E_NOPLAY",		"No track is playing" },
+	{ "E_WRTRK",		"Wrong track" },
+	{ "E_DUPVOTE",		"Duplicate vote" },
+	{ "E_SSLAGN",		"Duplicate SSL negotiation" },
+	{ "E_SSLNOAVAIL",	"SSL not available" },
+	{ "E_INVCMD",		"Invalid command" },
+	{ "E_SSLREQ",		"SSL required" },
+	{ "E_SHTDWN",		"Server is going down" },
+	{ "E_KICK",		"Client misbehaving" },
+	{ "E_PERMNOCHG",	"Perms did not change" },
+	{ "E_USREXIST",		"User already exists" },
+	{ "E_USRNOEXIST",	"User does not exist" },
+	{ "E_BUSY",		"Server busy, try again later" },
+	{ 0,			0 }
+};
 
 int
 hgd_client_edit_config()
@@ -87,3 +116,581 @@ clean:
 
 	return (ret);
 }
+
+/*
+ * see if the server supports encryption
+ * return: 1 = yes, 0 = no, -1 = error
+ */
+int
+hgd_negotiate_crypto()
+{
+	int			n_toks = 0, ret = HGD_OK;
+	char			*first, *next;
+	char			*ok_tokens[2] = {"", ""};
+
+	if (crypto_pref == HGD_CRYPTO_PREF_NEVER)
+		return (0);	/* fine, no crypto then */
+
+	hgd_sock_send_line(&main_ctx, sock_fd, NULL, "encrypt?");
+	first = next = hgd_sock_recv_line(&main_ctx, sock_fd, NULL);
+
+	if (hgd_check_svr_response(next, 0) != HGD_OK) {
+		free(first);
+		return (HGD_FAIL);
+	}
+
+	do {
+		ok_tokens[n_toks] = strsep(&next, "|");
+		n_toks++;
+	} while ((n_toks < 2) && (next != NULL));
+
+	if (strcmp(ok_tokens[1], "tlsv1") == 0) {
+		server_ssl_capable = 1;
+		DPRINTF(HGD_D_INFO, "Server supports %s crypto", ok_tokens[1]);
+	}
+
+	if ((!server_ssl_capable) && (crypto_pref == HGD_CRYPTO_PREF_ALWAYS)) {
+		DPRINTF(HGD_D_ERROR,
+		    "User forced crypto, but server is incapable");
+		ret = HGD_FAIL;
+	}
+
+	free(first);
+
+	return (ret);
+}
+
+int
+hgd_encrypt(int fd)
+{
+	int			 ssl_res = 0;
+	char			*ok_str = NULL;
+	X509			*cert;
+
+	/* XXX For semi-implemented certificate verification - FAO mex */
+#if 0
+	X509_NAME		*cert_name;
+	EVP_PKEY		*public_key;
+	BIO			*bio;
+#endif
+	hgd_sock_send_line(&main_ctx, fd, NULL, "encrypt");
+
+	/* kept for the next connection, nchgdc reconnects */
+	if ((ctx == NULL) && (hgd_setup_ssl_ctx(&method, &ctx, 0, 0, 0) != 0))
+		return (HGD_FAIL);
+
+	DPRINTF(HGD_D_DEBUG, "Setting up SSL_new");
+	ssl = SSL_new(ctx);
+	if (ssl == NULL) {
+		PRINT_SSL_ERR (HGD_D_ERROR, "SSL_new");
+		return (HGD_FAIL);
+	}
+
+	ssl_res = SSL_set_fd(ssl, fd);
+	if (ssl_res == 0) {
+		PRINT_SSL_ERR (HGD_D_ERROR, "SSL_set_fd");
+		return (HGD_FAIL);
+	}
+
+	ssl_res = SSL_connect(ssl);
+	if (ssl_res != 1) {
+		PRINT_SSL_ERR (HGD_D_ERROR, "SSL_connect");
+		return (HGD_FAIL);
+	}
+
+	cert = SSL_get_peer_certificate(ssl);
+	if (!cert) {
+		DPRINTF(HGD_D_ERROR, "could not get remote cert");
+		return (HGD_FAIL);
+	}
+	X509_free(cert);
+
+/*
+ * unfinished work on checking SSL certs.  Need to work out how to get the
+ * hash from the cert to know where to write the cert to. XXX
+ */
+#if 0
+	if(SSL_get_verify_result(ssl) != X509_V_OK)
+	{
+		PRINT_SSL_ERR ("SSL_connect");
+
+		cert = SSL_get_peer_certificate(ssl);
+
+		cert->
+		/* PEM_write_x509(fp!,cert);- */
+
+		return (-1);
+	}
+#endif
+	ok_str = hgd_sock_recv_line(&main_ctx, fd, ssl);
+	if (hgd_check_svr_response(ok_str, 0) != HGD_OK) {
+		free(ok_str);
+		return (HGD_FAIL);
+	}
+	free(ok_str);
+
+	DPRINTF(HGD_D_INFO, "SSL connection established");
+
+	return (HGD_OK);
+}
+
+int
+hgd_print_pretty_server_response(char *resp_line)
+{
+	char			*p;
+	struct hgd_resp_err	*resp, *chosen = NULL;
+
+	p = strchr(resp_line, '|');
+	if (p == NULL) {
+		DPRINTF(HGD_D_ERROR, "Unspecified server error reponse");
+		return (HGD_FAIL);
+	}
+
+	p++;
+	for (resp = hgd_resp_errs; resp->code != 0; resp++) {
+		if (strcmp(p, resp->code) == 0) {
+			chosen = resp;
+			break;
+		}
+	}
+
+	if (chosen == NULL) {
+		DPRINTF(HGD_D_ERROR, "Unknown server error reponse");
+		return (HGD_FAIL);
+	}
+
+	DPRINTF(HGD_D_ERROR,
+	    "Server reponded with error '%s': %s", p, chosen->meaning);
+
+	return (HGD_OK);
+}
+
+/*
+ * if x == 1 you do not need to check the return value of this method as
+ * hgd will have exited before this returns.
+ */
+int
+hgd_check_svr_response(char *resp, uint8_t x)
+{
+	int			err = HGD_OK;
+	char			*trunc = NULL;
+
+	if (resp == NULL) {
+		DPRINTF(HGD_D_ERROR, "failed to read server response");
+		err = HGD_FAIL;
+		goto clean;
+	}
+
+	if (hgd_debug) {
+		trunc = xstrdup(resp);
+		DPRINTF(HGD_D_DEBUG, "Check reponse '%s'", trunc);
+		free(trunc);
+	}
+
+	if (strncmp(resp, "ok", 2) == 0) {
+		/* great */
+	} else if (strncmp(resp, "err", 3)) {
+		DPRINTF(HGD_D_ERROR, "Malformed server response");
+	} else {
+		/* we got an 'err' */
+		hgd_print_pretty_server_response(resp);
+		err = HGD_FAIL;
+	}
+
+clean:
+	/* frees reposonse on error and exit */
+	if ((err == HGD_FAIL) && (x)) {
+		free(resp);
+		hgd_exit_nicely();
+	}
+
+	return (err);
+}
+
+int
+hgd_client_login(int fd, SSL *ssl, char *username)
+{
+	char			*resp, *user_cmd, pass[HGD_MAX_PASS_SZ];
+	int			 login_ok = -1;
+	char			*prompt;
+
+	if (password == NULL) {
+		xasprintf(&prompt, "Password for %s@%s: ", user, host);
+		if (readpassphrase(prompt, pass, HGD_MAX_PASS_SZ,
+		    RPP_ECHO_OFF | RPP_REQUIRE_TTY) == NULL) {
+			DPRINTF(HGD_D_ERROR, "Problem reading password from user");
+			memset(pass, 0, HGD_MAX_PASS_SZ);
+			free(prompt);
+			return (HGD_FAIL);
+		}
+		free(prompt);
+	} else {
+		strncpy(pass, password, HGD_MAX_PASS_SZ);
+		if (HGD_MAX_PASS_SZ > 0)
+			pass[HGD_MAX_PASS_SZ-1] = '\0';
+	}
+
+	/* send password */
+	xasprintf(&user_cmd, "user|%s|%s", username, pass);
+	hgd_sock_send_line(&main_ctx, fd, ssl, user_cmd);
+	free(user_cmd);
+
+	resp = hgd_sock_recv_line(&main_ctx, fd, ssl);
+	login_ok = hgd_check_svr_response(resp, 0);
+
+	free(resp);
+
+	/* parallel uploads log in again, don't ask the user N times */
+	if ((login_ok == HGD_OK) && (password == NULL) && (upload_jobs > 1))
+		password = xstrdup(pass);
+	memset(pass, 0, HGD_MAX_PASS_SZ);
+
+	if (login_ok == HGD_OK) {
+		authenticated = 1;
+		DPRINTF(HGD_D_DEBUG, "Identified as %s", user);
+	} else
+		DPRINTF(HGD_D_WARN, "Login as %s failed", user);
+
+	return (login_ok);
+}
+
+/*
+ * connect to host and set up encryption. On failure nothing is left open
+ * (sock_fd is -1) and we have not exited, so the caller may try again.
+ */
+int
+hgd_setup_socket()
+{
+	struct sockaddr_in	addr;
+	char*			resp;
+	struct hostent		*he;
+	int			sockopt = 1, ret = HGD_OK;
+
+	DPRINTF(HGD_D_DEBUG, "Connecting to %s", host);
+
+	/* set up socket address */
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(host);
+	addr.sin_port = htons(port);
+
+	/* if they gave a hostname, we look up the IP */
+	if (!hgd_is_ip_addr(host)) {
+		DPRINTF(HGD_D_DEBUG, "Looking up host '%s'", host);
+		he = gethostbyname(host);
+		if (he == NULL) {
+			DPRINTF(HGD_D_ERROR,
+			    "Failure in hostname resolution: '%s'", host);
+			ret = HGD_FAIL;
+			goto clean;
+		}
+
+		addr.sin_addr = *(struct in_addr *) he->h_addr_list[0];
+		DPRINTF(HGD_D_DEBUG, "Found IP %s", inet_ntoa(addr.sin_addr));
+	}
+
+	DPRINTF(HGD_D_DEBUG, "Connecting to IP %s:%d",
+	    inet_ntoa(addr.sin_addr), port);
+
+	sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock_fd < 0) {
+		DPRINTF(HGD_D_ERROR, "can't make socket: %s", SERROR);
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR,
+		    &sockopt, sizeof(sockopt)) < 0) {
+		DPRINTF(HGD_D_WARN, "Can't set SO_REUSEADDR");
+	}
+
+	if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		DPRINTF(HGD_D_ERROR, "Can't connect to %s", host);
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	/* expect a hello message */
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+	if (hgd_check_svr_response(resp, 0) != HGD_OK) {
+		free(resp);
+		ret = HGD_FAIL;
+		goto clean;
+	}
+	free(resp);
+
+	DPRINTF(HGD_D_DEBUG, "Connected to %s", host);
+
+	/* identify ourselves */
+	if (user == NULL) {
+		/* If the user did not set their name use thier system login */
+		user = getenv("USER");
+	}
+	if (user == NULL) {
+		DPRINTF(HGD_D_ERROR, "can't get username");
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	if (hgd_negotiate_crypto() == HGD_FAIL) {
+		ret = HGD_FAIL;
+		goto clean;
+	}
+	if ((server_ssl_capable) && (crypto_pref != HGD_CRYPTO_PREF_NEVER)) {
+		if (hgd_encrypt(sock_fd) != HGD_OK) {
+			ret = HGD_FAIL;
+			goto clean;
+		}
+	}
+
+	/* annoying error message for those too lazy to set up crypto */
+	if (ssl == NULL)
+		DPRINTF(HGD_D_WARN, "Connection is not encrypted");
+
+clean:
+	if (ret != HGD_OK) {
+		if (ssl != NULL) {
+			SSL_free(ssl);
+			ssl = NULL;
+		}
+		if (sock_fd >= 0) {
+			close(sock_fd);
+			sock_fd = -1;
+		}
+	}
+
+	return (ret);
+}
+
+/*
+ * check protocol version is correct. If 'binary' is not NULL and the server
+ * offers binary replies, switch to them and set *binary.
+ */
+int
+hgd_check_svr_proto(uint8_t *binary)
+{
+	char			*v, *resp = NULL, *req;
+	int			 major = -1, minor = -1, ret = HGD_OK;
+	int			 offer = -1;
+	char			*split = "|";
+	char			*saveptr1;
+
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "proto");
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+
+	if (hgd_check_svr_response(resp, 0) != HGD_OK) {
+		DPRINTF(HGD_D_ERROR, "Could not check server proto version");
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	v = strtok_r(resp, split, &saveptr1);
+	(void) v;
+
+	/* major */
+	v = strtok_r(NULL, split, &saveptr1);
+	if (v == NULL) {
+		DPRINTF(HGD_D_ERROR, "Could not find protocol MAJOR version");
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	major = atoi(v);
+
+	/* minor */
+	v = strtok_r(NULL, split, &saveptr1);
+	if (v == NULL) {
+		DPRINTF(HGD_D_ERROR, "Could not find protocol MINOR version");
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	minor = atoi(v);
+
+	if (major == HGD_PROTO_VERSION_MAJOR && minor >= HGD_PROTO_VERSION_MINOR) {
+		if (minor > HGD_PROTO_VERSION_MINOR) {
+			DPRINTF(HGD_D_INFO, "Server is running a newer minor version"
+			    "of the server.Server=%d,%d, Client=%d,%d", major, minor,
+			    HGD_PROTO_VERSION_MAJOR, HGD_PROTO_VERSION_MINOR);
+		}
+	} else {
+		DPRINTF(HGD_D_ERROR, "Protocol mismatch: "
+		    "Server=%d,%d, Client=%d,%d", major, minor,
+		    HGD_PROTO_VERSION_MAJOR, HGD_PROTO_VERSION_MINOR);
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+
+	DPRINTF(HGD_D_DEBUG, "Protocol version matches server");
+
+	/* binary protocol on offer, since 17.3 */
+	v = strtok_r(NULL, split, &saveptr1);
+	if (v != NULL)
+		offer = atoi(v);
+
+	if ((binary == NULL) || (offer != HGD_PROTO_BINARY))
+		goto clean;
+
+	free(resp);
+	xasprintf(&req, "proto|%d", HGD_PROTO_BINARY);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, req);
+	free(req);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+
+	if (hgd_check_svr_response(resp, 0) != HGD_OK) {
+		DPRINTF(HGD_D_WARN, "Server refused binary protocol");
+		goto clean;
+	}
+
+	DPRINTF(HGD_D_DEBUG, "Using binary protocol %d", offer);
+	*binary = 1;
+
+clean:
+	if (resp)
+		free(resp);
+
+	return (ret);
+}
+
+/*
+ * upload a single file. If 'slot' is not NULL, we are an upload worker and
+ * progress is reported through the slot instead of being drawn.
+ */
+int
+hgd_queue_track(char *filename, struct hgd_upload_slot *slot)
+{
+	FILE			*f;
+	struct stat		st;
+	ssize_t			written = 0, fsize, chunk_sz;
+	char			chunk[HGD_BINARY_CHUNK];
+	char			*q_req = 0, *resp1 = 0, *resp2 = 0;
+	char			 stars_buf[81], *trunc_filename = 0;
+	int			 iters = 0, barspace, percent, ret = HGD_FAIL;
+	float			 n_stars;
+
+	/* maximum length of filename in progress bar */
+	trunc_filename = xstrdup(basename(filename));
+	hgd_truncate_string(trunc_filename, 40);
+
+	DPRINTF(HGD_D_INFO, "Uploading file '%s'", filename);
+
+	if (stat(filename, &st) < 0) {
+		DPRINTF(HGD_D_ERROR, "Can't stat '%s'", filename);
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	if (st.st_mode & S_IFDIR) {
+		DPRINTF(HGD_D_ERROR, "Can't upload directories");
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	fsize = st.st_size;
+	if (slot) {
+		slot->written = 0;
+		slot->size = fsize;
+	}
+
+	/* send request to upload */
+	xasprintf(&q_req, "q|%s|%d", filename, fsize);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, q_req);
+
+	/* check we are allowed */
+	resp1 = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+	if (hgd_check_svr_response(resp1, 0) == HGD_FAIL)
+		goto clean;
+
+	DPRINTF(HGD_D_DEBUG, "opening '%s' for reading", filename);
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		DPRINTF(HGD_D_ERROR, "fopen %s: %s", filename, SERROR);
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	/* prepare progress bar */
+	barspace =  (float) (HGD_TERM_WIDTH - strlen(
+	    basename(trunc_filename)) - 2) - 7;
+	memset(stars_buf, ' ', HGD_TERM_WIDTH);
+	stars_buf[HGD_TERM_WIDTH] = 0;
+
+	/*
+	 * start sending the file
+	 */
+	written = 0;
+	while (written != fsize) {
+
+		/* update progress bar */
+		if ((slot == NULL) && (iters % 50 == 0) && (hgd_debug <= 1)) {
+			percent = (float) written/fsize * 100;
+			n_stars = barspace * ((float) written/fsize) + 1;
+			memset(stars_buf, '*', n_stars);
+
+			/* progress bar caps */
+			stars_buf[0] = '|';
+			stars_buf[barspace - 1] = '|';
+			stars_buf[barspace] = 0;
+
+			printf("\r%s: %s %3d%%",
+			    trunc_filename, stars_buf, percent);
+			fflush(stdout);
+		}
+		iters++;
+
+		if (fsize - written < HGD_BINARY_CHUNK)
+			chunk_sz = fsize - written;
+		else
+			chunk_sz = HGD_BINARY_CHUNK;
+
+		if (fread(chunk, chunk_sz, 1, f) != 1) {
+			DPRINTF(HGD_D_WARN, "Retrying fread");
+			continue;
+		}
+
+		if (hgd_sock_send_bin(&main_ctx, sock_fd, ssl,
+		    chunk, chunk_sz) != HGD_OK) {
+			DPRINTF(HGD_D_ERROR, "Failed to send '%s'", filename);
+			fclose(f);
+			goto clean;
+		}
+
+		written += chunk_sz;
+		if (slot)
+			slot->written = written;
+		DPRINTF(HGD_D_DEBUG, "Progress %d/%d bytes",
+		    (int)  written, (int) fsize);
+	}
+
+	if ((slot == NULL) && (hgd_debug <= 1)) {
+		memset(stars_buf, ' ', HGD_TERM_WIDTH);
+
+		hgd_set_line_colour(ANSI_GREEN);
+		printf("\r%s\r%s: OK\n", stars_buf, basename(trunc_filename));
+		hgd_set_line_colour(ANSI_WHITE);
+	}
+
+	fclose(f);
+
+	resp2 = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+	if (hgd_check_svr_response(resp2, 0) == HGD_FAIL) {
+		ret = HGD_FAIL;
+		goto clean;
+	}
+
+	DPRINTF(HGD_D_INFO, "Transfer complete");
+
+	ret = HGD_OK;
+clean:
+	if (trunc_filename)
+		free(trunc_filename);
+	if (resp1)
+		free(resp1);
+	if (resp2)
+		free(resp2);
+	if (q_req)
+		free(q_req);
+
+	return (ret);
+}
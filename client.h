@@ -55,8 +55,28 @@ extern int		 port, sock_fd;
 extern SSL		*ssl;
 extern SSL_METHOD	*method;
 extern SSL_CTX		*ctx;
+extern struct hgd_ctx	 main_ctx;
 extern uint8_t		 crypto_pref, server_ssl_capable, authenticated;
-extern uint8_t		 hud_refresh_speed, colours_on;
+extern uint8_t		 hud_refresh_speed, colours_on, upload_jobs;
+
+/*
+ * progress of an upload, updated by hgd_queue_track() as it goes.
+ * Read by whoever started the upload (another process or thread).
+ */
+struct hgd_upload_slot {
+	volatile off_t		 written;	/* bytes sent of current file */
+	volatile off_t		 size;		/* size of current file */
+	volatile int		 file;		/* index into args or -1 */
+};
 
 
 int			 hgd_client_edit_config();
+int			 hgd_negotiate_crypto();
+int			 hgd_encrypt(int fd);
+int			 hgd_print_pretty_server_response(char *resp_line);
+int			 hgd_check_svr_response(char *resp, uint8_t x);
+int			 hgd_client_login(int fd, SSL *ssl, char *username);
+int			 hgd_setup_socket();
+int			 hgd_check_svr_proto(uint8_t *binary);
+int			 hgd_queue_track(char *filename,
+			     struct hgd_upload_slot *slot);
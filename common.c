@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdarg.h>
@@ -35,6 +36,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 
 #ifdef __linux__
 #include <bsd/readpassphrase.h>
@@ -52,12 +54,206 @@ uint8_t				  restarting = 0;
 uint8_t				  exit_ok = 0;
 pid_t				  pid = 0;
 
+/*
+ * Set by programs at the start of main(). An embedder which leaves them be
+ * logs as "libhgd" and, on a failure we can't recover from, just exits.
+ */
+const char			 *hgd_component = "libhgd";
+void				(*hgd_exit_cb)(void) = NULL;
+
 char				 *debug_names[] = {
 				    "error", "warn", "info", "debug"};
 int				 syslog_error_map[] = {
 				    LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG
 				 };
 
+/*
+ * Buffered logging.
+ *
+ * DPRINTF formats into a per-process buffer which is written to stderr
+ * with a single write(2), and to syslog, when a warning or error is
+ * logged, when the buffer fills, when a second has passed since the last
+ * flush or when hgd_log_flush() is called. The last is done before
+ * anything which might block (poll(2), waitpid(2) and so on), so that
+ * nothing sits in the buffer while we wait. Syslog is opened once.
+ */
+struct hgd_log_msg {
+	int			 level;
+	int			 hdr_off;
+	int			 hdr_len;
+	int			 body_off;
+	int			 body_len;
+};
+
+struct hgd_log_buf {
+	char			 buf[HGD_LOG_BUF_SZ];
+	int			 len;
+	struct hgd_log_msg	 msgs[HGD_LOG_MAX_MSGS];
+	int			 n_msgs;
+	time_t			 last_flush;
+	pid_t			 pid;
+};
+
+struct hgd_log_buf		 hgd_logbuf;
+pthread_mutex_t			 hgd_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* called with hgd_log_lock held */
+void
+hgd_log_flush_locked(void)
+{
+	struct hgd_log_msg	*m;
+	ssize_t			 wr;
+	int			 i, off = 0;
+
+	while (off < hgd_logbuf.len) {
+		wr = write(STDERR_FILENO,
+		    hgd_logbuf.buf + off, hgd_logbuf.len - off);
+		if (wr <= 0) {
+			if ((wr < 0) && (errno == EINTR))
+				continue;
+			break; /* nowhere to complain to */
+		}
+		off += wr;
+	}
+
+	for (i = 0; i < hgd_logbuf.n_msgs; i++) {
+		m = &hgd_logbuf.msgs[i];
+		syslog(syslog_error_map[m->level], "%.*s %.*s",
+		    m->hdr_len, hgd_logbuf.buf + m->hdr_off,
+		    m->body_len, hgd_logbuf.buf + m->body_off);
+	}
+
+	hgd_logbuf.len = 0;
+	hgd_logbuf.n_msgs = 0;
+	hgd_logbuf.last_flush = time(NULL);
+}
+
+void
+hgd_log(int level, const char *file, const char *func, int line,
+    const char *fmt, ...)
+{
+	va_list			 ap;
+	struct hgd_log_msg	*m;
+	int			 avail, n, pos, tries;
+	int			 saved_errno = errno; /* for SERROR */
+
+	pthread_mutex_lock(&hgd_log_lock);
+
+	if (hgd_logbuf.pid == 0)
+		hgd_logbuf.pid = getpid();
+
+	if (hgd_logbuf.n_msgs == HGD_LOG_MAX_MSGS)
+		hgd_log_flush_locked();
+
+	/* try to append, if it won't fit flush and try once more */
+	for (tries = 0; tries < 2; tries++) {
+		m = &hgd_logbuf.msgs[hgd_logbuf.n_msgs];
+		m->level = level;
+		m->hdr_off = hgd_logbuf.len;
+
+		avail = HGD_LOG_BUF_SZ - hgd_logbuf.len;
+		n = snprintf(hgd_logbuf.buf + hgd_logbuf.len, avail,
+		    "[%s - %08d %s:%s():%d]\n\t", debug_names[level],
+		    (int) hgd_logbuf.pid, file, func, line);
+		if ((n < 0) || (n >= avail))
+			goto no_fit;
+
+		m->hdr_len = n - 2; /* syslog gets no "\n\t" */
+		pos = hgd_logbuf.len + n;
+		m->body_off = pos;
+
+		avail = HGD_LOG_BUF_SZ - pos;
+		errno = saved_errno;
+		va_start(ap, fmt);
+		n = vsnprintf(hgd_logbuf.buf + pos, avail, fmt, ap);
+		va_end(ap);
+		if ((n < 0) || (n + 1 >= avail))
+			goto no_fit;
+
+		m->body_len = n;
+		pos += n;
+		hgd_logbuf.buf[pos++] = '\n';
+		hgd_logbuf.len = pos;
+		hgd_logbuf.n_msgs++;
+		break;
+no_fit:
+		if ((tries == 0) && (hgd_logbuf.len > 0)) {
+			hgd_log_flush_locked();
+			continue;
+		}
+
+		/* on its own, it is too long, so truncate it */
+		m->hdr_len = 0;
+		m->body_off = m->hdr_off;
+		m->body_len = HGD_LOG_BUF_SZ - 1 - m->hdr_off;
+		hgd_logbuf.buf[HGD_LOG_BUF_SZ - 1] = '\n';
+		hgd_logbuf.len = HGD_LOG_BUF_SZ;
+		hgd_logbuf.n_msgs++;
+		break;
+	}
+
+	if ((level <= HGD_D_WARN) ||
+	    (hgd_logbuf.len > HGD_LOG_BUF_SZ / 2) ||
+	    (time(NULL) != hgd_logbuf.last_flush))
+		hgd_log_flush_locked();
+
+	pthread_mutex_unlock(&hgd_log_lock);
+
+	errno = saved_errno;
+}
+
+void
+hgd_log_flush(void)
+{
+	pthread_mutex_lock(&hgd_log_lock);
+	if (hgd_logbuf.len > 0)
+		hgd_log_flush_locked();
+	pthread_mutex_unlock(&hgd_log_lock);
+}
+
+/* fork(2) handlers: don't log the same messages twice, and a new pid */
+void
+hgd_log_prefork(void)
+{
+	pthread_mutex_lock(&hgd_log_lock);
+	hgd_log_flush_locked();
+}
+
+void
+hgd_log_postfork_parent(void)
+{
+	pthread_mutex_unlock(&hgd_log_lock);
+}
+
+void
+hgd_log_postfork_child(void)
+{
+	hgd_logbuf.pid = 0;
+	pthread_mutex_unlock(&hgd_log_lock);
+}
+
+void
+hgd_log_init(int facility)
+{
+	static int		done_atfork = 0;
+
+	openlog(hgd_component, LOG_NDELAY, facility);
+
+	if (!done_atfork) {
+		pthread_atfork(hgd_log_prefork,
+		    hgd_log_postfork_parent, hgd_log_postfork_child);
+		atexit(hgd_log_flush);
+		done_atfork = 1;
+	}
+}
+
+void
+hgd_log_close(void)
+{
+	hgd_log_flush();
+	closelog();
+}
+
 /* permission descriptions */
 struct hgd_user_perm hgd_user_perms[] = {
 	{ HGD_AUTH_ADMIN,	"ADMIN" },
@@ -123,7 +319,7 @@ xmalloc(size_t sz)
 	ptr = malloc(sz);
 	if (!ptr) {
 		DPRINTF(HGD_D_ERROR, "Could not allocate");
-		hgd_exit_nicely();
+		hgd_fatal();
 	}
 
 	return (ptr);
@@ -138,7 +334,7 @@ xcalloc(size_t sz, size_t size)
 	ptr = calloc(sz, size);
 	if (!ptr) {
 		DPRINTF(HGD_D_ERROR, "Could not allocate");
-		hgd_exit_nicely();
+		hgd_fatal();
 	}
 
 	return (ptr);
@@ -152,7 +348,7 @@ xrealloc(void *old_p, size_t sz)
 	ptr = realloc(old_p, sz);
 	if (!ptr) {
 		DPRINTF(HGD_D_ERROR, "Could not reallocate");
-		hgd_exit_nicely();
+		hgd_fatal();
 	}
 
 	return (ptr);
@@ -180,12 +376,41 @@ xasprintf(char **buf, char *fmt, ...)
 
 	if (ret == -1) {
 		DPRINTF(HGD_D_ERROR, "Can't allocate");
-		hgd_exit_nicely();
+		hgd_fatal();
 	}
 
 	return (ret);
 }
 
+/*
+ * give up: through the program's hgd_exit_cb, which should not return, so
+ * that it can clean up first, else straight out.
+ */
+void
+hgd_fatal(void)
+{
+	if (hgd_exit_cb != NULL)
+		hgd_exit_cb();
+
+	hgd_log_flush();
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * a fresh context for the db.c and net.c calls: no database open and no
+ * I/O deadlines. Each thread calling into those needs its own, and a
+ * thread should clear on_dying (see hgd_sock_wait()).
+ */
+void
+hgd_ctx_init(struct hgd_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->deadline_missed = HGD_DEADLINE_NONE;
+	ctx->rcv_armed_fd = -1;
+	ctx->snd_armed_fd = -1;
+	ctx->on_dying = hgd_exit_cb;
+}
+
 void
 hgd_kill_sighandler(int sig)
 {
@@ -224,7 +449,7 @@ hgd_mk_state_dir()
 	if (mkdir(state_path, S_IRWXU) != 0) {
 		if (errno != EEXIST) {
 			DPRINTF(HGD_D_ERROR, "%s: %s", state_path, SERROR);
-			hgd_exit_nicely();
+			hgd_fatal();
 		}
 	}
 
@@ -232,7 +457,7 @@ hgd_mk_state_dir()
 	if (mkdir(filestore_path, S_IRWXU) != 0) {
 		if (errno != EEXIST) {
 			DPRINTF(HGD_D_ERROR, "%s:%s", filestore_path, SERROR);
-			hgd_exit_nicely();
+			hgd_fatal();
 		}
 	}
 
@@ -626,20 +851,17 @@ clean:
 }
 
 /*
- * checks to see if a component is running.
- *
- * if success is returned, then you trust *running, else
- * you can not be sure.
+ * read the pid of a component from its pid file.
+ * *pid is 0 if there is no pid file, i.e. it is not running.
  */
 int
-hgd_check_component_status(char *component, int *running)
+hgd_read_component_pid(char *component, pid_t *pid)
 {
 	char			*path = NULL, pid_str[HGD_PID_STR_SZ];
 	int			 ret = HGD_FAIL;
 	FILE			*pidfile = NULL;
-	pid_t			 cpid;
 
-	*running = 0;
+	*pid = 0;
 
 	xasprintf(&path, "%s/%s.pid", state_path, component);
 
@@ -656,12 +878,41 @@ hgd_check_component_status(char *component, int *running)
 		goto clean;
 	}
 
-	cpid = atoi(pid_str);
-	if (cpid == 0) {
+	*pid = atoi(pid_str);
+	if (*pid == 0) {
 		DPRINTF(HGD_D_ERROR, "pid not found in pid file");
 		goto clean;
 	}
 
+	ret = HGD_OK;
+clean:
+	free(path);
+
+	if (pidfile != NULL)
+		fclose(pidfile);
+
+	return (ret);
+}
+
+/*
+ * checks to see if a component is running.
+ *
+ * if success is returned, then you trust *running, else
+ * you can not be sure.
+ */
+int
+hgd_check_component_status(char *component, int *running)
+{
+	pid_t			 cpid;
+
+	*running = 0;
+
+	if (hgd_read_component_pid(component, &cpid) != HGD_OK)
+		return (HGD_FAIL);
+
+	if (cpid == 0)
+		return (HGD_OK);
+
 	/* funky hack to decide if a process is running */
 	switch (kill(cpid, 0)) {
 	case 0:
@@ -670,21 +921,36 @@ hgd_check_component_status(char *component, int *running)
 	case ESRCH:
 		/* stale pid file */
 		DPRINTF(HGD_D_ERROR, "stale PID file");
-		goto clean;
+		return (HGD_FAIL);
 		break;
 	default:
 		DPRINTF(HGD_D_ERROR, "Can't determine if %s is running: %s",
 		    hgd_component, SERROR);
-		goto clean;
+		return (HGD_FAIL);
 		break;
 	};
 
-	ret = HGD_OK;
-clean:
-	free(path);
+	return (HGD_OK);
+}
 
-	if (pidfile != NULL)
-		fclose(pidfile);
+/* send a signal to a running component */
+int
+hgd_signal_component(char *component, int sig)
+{
+	pid_t			 cpid;
 
-	return (ret);
+	if (hgd_read_component_pid(component, &cpid) != HGD_OK)
+		return (HGD_FAIL);
+
+	if (cpid == 0) {
+		DPRINTF(HGD_D_ERROR, "%s is not running", component);
+		return (HGD_FAIL);
+	}
+
+	if (kill(cpid, sig) < 0) {
+		DPRINTF(HGD_D_ERROR, "Can't signal %s: %s", component, SERROR);
+		return (HGD_FAIL);
+	}
+
+	return (HGD_OK);
 }
@@ -26,13 +26,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sqlite3.h>
 
 #include "hgd.h"
 #include "db.h"
+#include "stats.h"
 
-sqlite3				*db = NULL;
 char				*db_path = NULL;
 
 int
@@ -49,9 +50,38 @@ hgd_get_db_vers_cb(void *arg, int argc, char **data, char **names)
 	return (SQLITE_OK);
 }
 
-/* Optionally create, and open database */
-sqlite3 *
-hgd_open_db(char *db_path, uint8_t create)
+/*
+ * Called by sqlite when the database is locked by another process.
+ * Back off and retry for up to HGD_DB_BUSY_TIMEOUT msecs, counting retries.
+ */
+int
+hgd_db_busy_cb(void *arg, int tries)
+{
+	struct timespec		ts;
+	int			ms;
+
+	(void) arg;
+
+	/* sum of delays so far, they double from 1ms up to 100ms */
+	ms = (tries < 7) ? (1 << tries) - 1 : 127 + (tries - 7) * 100;
+	if (ms >= HGD_DB_BUSY_TIMEOUT) {
+		DPRINTF(HGD_D_WARN, "Database busy, giving up");
+		return (0);
+	}
+
+	HGD_STATS_INC(db_busy_retries);
+
+	ms = (tries < 7) ? 1 << tries : 100;
+	ts.tv_sec = 0;
+	ts.tv_nsec = ms * 1000000L;
+	nanosleep(&ts, NULL);
+
+	return (1);
+}
+
+/* Optionally create, and open database as ctx's connection */
+int
+hgd_open_db(struct hgd_ctx *ctx, char *db_path, uint8_t create)
 {
 	int			 sql_res;
 	sqlite3			*db;
@@ -65,14 +95,15 @@ hgd_open_db(char *db_path, uint8_t create)
 		if (stat(db_path, &st) < 0) {
 			DPRINTF(HGD_D_ERROR, "Can't stat %s: %s", db_path, SERROR);
 			DPRINTF(HGD_D_ERROR, "Did you run 'hgd-admin db-init'?");
-			return (NULL);
+			return (HGD_FAIL);
 		}
 	}
 
 	/* open the database */
 	if (sqlite3_open(db_path, &db) != SQLITE_OK) {
-		DPRINTF(HGD_D_ERROR, "Can't open %s: %s", db_path, DERROR);
-		return (NULL);
+		DPRINTF(HGD_D_ERROR, "Can't open %s: %s", db_path,
+		    sqlite3_errmsg(db));
+		return (HGD_FAIL);
 	}
 
 	/* make database secure */
@@ -81,13 +112,14 @@ hgd_open_db(char *db_path, uint8_t create)
 		    db_path, SERROR);
 	}
 
-	DPRINTF(HGD_D_DEBUG, "Setting database timeout");
-	sql_res = sqlite3_busy_timeout(db, 2000);
+	DPRINTF(HGD_D_DEBUG, "Setting database busy handler");
+	sql_res = sqlite3_busy_handler(db, hgd_db_busy_cb, NULL);
 
 	if (sql_res != SQLITE_OK) {
-		DPRINTF(HGD_D_ERROR, "Can't set busy timout: %s", DERROR);
+		DPRINTF(HGD_D_ERROR, "Can't set busy handler: %s",
+		    sqlite3_errmsg(db));
 		sqlite3_close(db);
-		return (NULL);
+		return (HGD_FAIL);
 	}
 
 	/* if we are not creating a db, it should be the right version */
@@ -99,7 +131,8 @@ hgd_open_db(char *db_path, uint8_t create)
 		if (sql_res != SQLITE_OK) {
 			DPRINTF(HGD_D_ERROR,
 			    "Can't get db schema version, "
-			    "is your database too old?: %s", DERROR);
+			    "is your database too old?: %s",
+			    sqlite3_errmsg(db));
 			db_schema_err = 1;
 		} else if (db_vers != atoi(HGD_DB_SCHEMA_VERS)) {
 			DPRINTF(HGD_D_ERROR, "Database schema version "
@@ -116,10 +149,129 @@ hgd_open_db(char *db_path, uint8_t create)
 				"database,you can make a new one with: "
 				"'hgd-admin db-init'");
 			sqlite3_close(db);
-			return (NULL);
+			return (HGD_FAIL);
 		}
 	}
-	return (db);
+	ctx->db = db;
+	return (HGD_OK);
+}
+
+/*
+ * prepare sql on db. With caching on (hgd_db_cache_stmts()), a statement
+ * handed back by hgd_db_finish() is kept and handed out again the next
+ * time the same sql is asked for. sql is remembered by address, so it
+ * must be a string constant. Returns an sqlite result code.
+ */
+int
+hgd_db_prepare(struct hgd_ctx *ctx, const char *sql, sqlite3_stmt **stmt)
+{
+	struct hgd_db_stmt	*c, *free_slot = NULL;
+	int			 i, sql_res;
+
+	for (i = 0; (ctx->stmts != NULL) && (i < HGD_DB_STMT_CACHE); i++) {
+		c = &ctx->stmts[i];
+		if ((c->sql == sql) && (!c->in_use)) {
+			c->in_use = 1;
+			*stmt = c->stmt;
+			return (SQLITE_OK);
+		}
+		if ((c->sql == NULL) && (free_slot == NULL))
+			free_slot = c;
+	}
+
+	sql_res = sqlite3_prepare_v2(ctx->db, sql, -1, stmt, NULL);
+	if ((sql_res == SQLITE_OK) && (free_slot != NULL)) {
+		free_slot->sql = sql;
+		free_slot->stmt = *stmt;
+		free_slot->in_use = 1;
+	}
+
+	return (sql_res);
+}
+
+/* done with a statement from hgd_db_prepare(), NULL is ignored */
+void
+hgd_db_finish(struct hgd_ctx *ctx, sqlite3_stmt *stmt)
+{
+	struct hgd_db_stmt	*c;
+	int			 i;
+
+	if (stmt == NULL)
+		return;
+
+	for (i = 0; (ctx->stmts != NULL) && (i < HGD_DB_STMT_CACHE); i++) {
+		c = &ctx->stmts[i];
+		if ((c->sql != NULL) && (c->stmt == stmt)) {
+			/* ends any read transaction the statement held */
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			c->in_use = 0;
+			return;
+		}
+	}
+
+	sqlite3_finalize(stmt);
+}
+
+/*
+ * keep statements prepared between calls, for a context with a long
+ * lived connection. Turning it off finalizes those kept.
+ */
+void
+hgd_db_cache_stmts(struct hgd_ctx *ctx, uint8_t on)
+{
+	int			 i;
+
+	if ((on) && (ctx->stmts == NULL))
+		ctx->stmts = xcalloc(HGD_DB_STMT_CACHE, sizeof(*ctx->stmts));
+
+	if ((on) || (ctx->stmts == NULL))
+		return;
+
+	for (i = 0; i < HGD_DB_STMT_CACHE; i++) {
+		if (ctx->stmts[i].sql != NULL)
+			sqlite3_finalize(ctx->stmts[i].stmt);
+	}
+
+	free(ctx->stmts);
+	ctx->stmts = NULL;
+}
+
+/* close ctx's db, which sqlite won't do while it has statements prepared */
+void
+hgd_close_db(struct hgd_ctx *ctx)
+{
+	hgd_db_cache_stmts(ctx, 0);
+
+	if (ctx->db != NULL)
+		sqlite3_close(ctx->db);
+	ctx->db = NULL;
+}
+
+/*
+ * the connection to make a write on: ctx's own, or the writer which it
+ * shares with other threads, held until hgd_db_write_end(). SQLite would
+ * serialise the writes anyway, but on one connection they queue on a
+ * mutex rather than backing off in hgd_db_busy_cb().
+ */
+struct hgd_ctx *
+hgd_db_write_begin(struct hgd_ctx *ctx)
+{
+	if (ctx->writer != NULL)
+		ctx = ctx->writer;
+
+	if (ctx->lock != NULL)
+		pthread_mutex_lock(ctx->lock);
+
+	return (ctx);
+}
+
+/* done with the connection hgd_db_write_begin() gave */
+void
+hgd_db_write_end(struct hgd_ctx *ctx)
+{
+	if (ctx->lock != NULL)
+		pthread_mutex_unlock(ctx->lock);
 }
 
 /*
@@ -128,6 +280,7 @@ hgd_open_db(char *db_path, uint8_t create)
 int
 hgd_make_new_db(char *db_path)
 {
+	struct hgd_ctx		new_ctx;
 	int			sql_res;
 	sqlite3			*db;
 
@@ -138,14 +291,16 @@ hgd_make_new_db(char *db_path)
 		return (HGD_FAIL);
 	}
 
-	db = hgd_open_db(db_path, 1); /* and create */
-	if (!db)
+	hgd_ctx_init(&new_ctx);
+	if (hgd_open_db(&new_ctx, db_path, 1) != HGD_OK) /* and create */
 		return (HGD_FAIL);
+	db = new_ctx.db;
 
 	/* no-one else should do this at the same time */
 	sql_res = sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
 	if (sql_res != SQLITE_OK) {
-		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s", DERROR);
+		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s",
+		    sqlite3_errmsg(db));
 		sqlite3_close(db);
 		return (HGD_FAIL);
 	}
@@ -158,7 +313,8 @@ hgd_make_new_db(char *db_path)
 	    NULL, NULL, NULL);
 
 	if (sql_res != SQLITE_OK) {
-		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s", DERROR);
+		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s",
+		    sqlite3_errmsg(db));
 		sqlite3_close(db);
 		return (HGD_FAIL);
 	}
@@ -169,7 +325,8 @@ hgd_make_new_db(char *db_path)
 	    NULL, NULL, NULL);
 
 	if (sql_res != SQLITE_OK) {
-		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s", DERROR);
+		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s",
+		    sqlite3_errmsg(db));
 		sqlite3_close(db);
 		return (HGD_FAIL);
 	}
@@ -194,7 +351,8 @@ hgd_make_new_db(char *db_path)
 	    NULL, NULL, NULL);
 
 	if (sql_res != SQLITE_OK) {
-		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s", DERROR);
+		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s",
+		    sqlite3_errmsg(db));
 		sqlite3_close(db);
 		return (HGD_FAIL);
 	}
@@ -207,7 +365,7 @@ hgd_make_new_db(char *db_path)
 
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s",
-		    DERROR);
+		    sqlite3_errmsg(db));
 		sqlite3_close(db);
 		return (HGD_FAIL);
 	}
@@ -224,14 +382,15 @@ hgd_make_new_db(char *db_path)
 
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s",
-		    DERROR);
+		    sqlite3_errmsg(db));
 		sqlite3_close(db);
 		return (HGD_FAIL);
 	}
 
 	sql_res = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
 	if (sql_res != SQLITE_OK) {
-		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s", DERROR);
+		DPRINTF(HGD_D_ERROR, "Can't initialise db: %s",
+		    sqlite3_errmsg(db));
 		sqlite3_close(db);
 		return (HGD_FAIL);
 	}
@@ -272,11 +431,11 @@ hgd_get_playing_item_cb(void *arg, int argc, char **data, char **names)
 }
 
 int
-hgd_get_playing_item(struct hgd_playlist_item *playing)
+hgd_get_playing_item(struct hgd_ctx *ctx, struct hgd_playlist_item *playing)
 {
 	int				 sql_res;
 
-	sql_res = sqlite3_exec(db,
+	sql_res = sqlite3_exec(ctx->db,
 	    "SELECT id, filename, tag_artist, tag_title, user, tag_album, "
 	    "tag_genre, tag_duration, tag_bitrate, tag_samplerate, "
 	    "tag_channels, tag_year FROM playlist WHERE playing=1 LIMIT 1",
@@ -303,13 +462,14 @@ hgd_get_num_votes_cb(void *arg, int argc, char **data, char **names)
 }
 
 int
-hgd_get_num_votes(int *nvotes)
+hgd_get_num_votes(struct hgd_ctx *ctx, int *nvotes)
 {
 	int			sql_res;
 	char			*sql;
 
 	xasprintf(&sql, "SELECT COUNT (*) FROM votes;");
-	sql_res = sqlite3_exec(db, sql, hgd_get_num_votes_cb, nvotes, NULL);
+	sql_res = sqlite3_exec(ctx->db, sql, hgd_get_num_votes_cb, nvotes,
+	    NULL);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_ERROR, "Can't get votes: %s", DERROR);
 		free(sql);
@@ -322,7 +482,7 @@ hgd_get_num_votes(int *nvotes)
 }
 
 int
-hgd_user_has_voted(char *user, int *v)
+hgd_user_has_voted(struct hgd_ctx *ctx, char *user, int *v)
 {
 	int			 ret = HGD_FAIL;
 	int			 sql_res;
@@ -332,7 +492,7 @@ hgd_user_has_voted(char *user, int *v)
 	/* we start assuming they have not voted */
 	*v = 0;
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s",
 		    DERROR);
@@ -356,12 +516,19 @@ hgd_user_has_voted(char *user, int *v)
 
 	ret = HGD_OK; /* everything went ok */
 clean:
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
 	return (ret);
 }
 
+/*
+ * insert a track, but only if the user has fewer than 'limit' unfinished
+ * tracks queued (a negative limit means no limit). The check and insert
+ * are one statement, so concurrent uploads by the same user can not race
+ * past the flood limit.
+ */
 int
-hgd_insert_track(char *filename, struct hgd_media_tag *t, char *user)
+hgd_insert_track(struct hgd_ctx *ctx, char *filename, struct hgd_media_tag *t,
+    char *user, int limit)
 {
 	int			 ret = HGD_FAIL;
 	int			 sql_res;
@@ -369,10 +536,12 @@ hgd_insert_track(char *filename, struct hgd_media_tag *t, char *user)
 	char			*sql = "INSERT INTO playlist "
 	    "(filename, tag_artist, tag_title, tag_album, tag_duration, "
 	    "tag_samplerate, tag_bitrate, tag_channels, tag_genre, tag_year, "
-	    "user, playing, finished) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, "
-	    "?, ?, 0, 0)";
+	    "user, playing, finished) SELECT ?, ?, ?, ?, ?, ?, ?, ?, ?, "
+	    "?, ?11, 0, 0 WHERE ?12 < 0 OR (SELECT COUNT(*) FROM playlist "
+	    "WHERE user=?11 AND finished=0) < ?12";
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	ctx = hgd_db_write_begin(ctx);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s",
 		    DERROR);
@@ -391,6 +560,7 @@ hgd_insert_track(char *filename, struct hgd_media_tag *t, char *user)
 	sql_res &= sqlite3_bind_text(stmt, 9, t->genre, -1, SQLITE_TRANSIENT);
 	sql_res &= sqlite3_bind_int(stmt, 10, t->year);
 	sql_res &= sqlite3_bind_text(stmt, 11, user, -1, SQLITE_TRANSIENT);
+	sql_res &= sqlite3_bind_int(stmt, 12, limit);
 
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't bind sql: %s", DERROR);
@@ -403,21 +573,30 @@ hgd_insert_track(char *filename, struct hgd_media_tag *t, char *user)
 		goto clean;
 	}
 
+	if (sqlite3_changes(ctx->db) == 0) {
+		DPRINTF(HGD_D_INFO, "User '%s' queue is full", user);
+		ret = HGD_FAIL_FLOOD;
+		goto clean;
+	}
+
 	ret = HGD_OK; /* everything went ok */
+	hgd_db_sync_stats(ctx);
 clean:
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
+	hgd_db_write_end(ctx);
 	return (ret);
 }
 
 int
-hgd_insert_vote(char *user)
+hgd_insert_vote(struct hgd_ctx *ctx, char *user)
 {
 	int			 ret = HGD_FAIL;
 	int			 sql_res;
 	sqlite3_stmt		*stmt;
 	char			*sql = "INSERT INTO votes (user) VALUES (?)";
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	ctx = hgd_db_write_begin(ctx);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s",
 		    DERROR);
@@ -441,11 +620,48 @@ hgd_insert_vote(char *user)
 	}
 
 	ret = HGD_OK; /* everything went ok */
+	hgd_db_sync_stats(ctx);
 clean:
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
+	hgd_db_write_end(ctx);
 	return (ret);
 }
 
+int
+hgd_db_sync_stats_cb(void *arg, int argc, char **data, char **names)
+{
+	(void) arg;
+	(void) argc;
+	(void) names;
+
+	HGD_STATS_SET(queue_len, atoi(data[0]));
+	HGD_STATS_SET(votes, atoi(data[1]));
+
+	return (SQLITE_OK);
+}
+
+/*
+ * Refresh the playlist gauges in the shared stats. Called whenever we
+ * change the playlist or votes, so that reading the metrics never needs
+ * the database.
+ */
+void
+hgd_db_sync_stats(struct hgd_ctx *ctx)
+{
+	int			sql_res;
+
+	if (hgd_stats == NULL)
+		return;
+
+	sql_res = sqlite3_exec(ctx->db,
+	    "SELECT (SELECT COUNT(*) FROM playlist WHERE finished=0), "
+	    "(SELECT COUNT(*) FROM votes)",
+	    hgd_db_sync_stats_cb, NULL, NULL);
+
+	if (sql_res != SQLITE_OK)
+		DPRINTF(HGD_D_WARN, "Can't count playlist: %s", DERROR);
+}
+
 int
 hgd_get_playlist_cb(void *arg, int argc, char **data, char **names)
 {
@@ -488,7 +704,7 @@ hgd_get_playlist_cb(void *arg, int argc, char **data, char **names)
  * report back items in the playlist
  */
 int
-hgd_get_playlist(struct hgd_playlist *list)
+hgd_get_playlist(struct hgd_ctx *ctx, struct hgd_playlist *list)
 {
 	int			sql_res;
 
@@ -497,7 +713,7 @@ hgd_get_playlist(struct hgd_playlist *list)
 
 	DPRINTF(HGD_D_DEBUG, "Playlist request");
 
-	sql_res = sqlite3_exec(db,
+	sql_res = sqlite3_exec(ctx->db,
 	    "SELECT id, filename, tag_artist, tag_title, user, tag_album, "
 	    "tag_genre, tag_duration, tag_bitrate, tag_samplerate, "
 	    "tag_channels, tag_year FROM playlist",
@@ -527,6 +743,7 @@ hgd_get_next_track_cb(void *item, int argc, char **data, char **names)
 	item_t->id = atoi(data[0]);
 	xasprintf(&(item_t->filename), "%s/%s", filestore_path, data[1]);
 	item_t->user = xstrdup(data[2]);
+	item_t->tags.duration = data[3] ? atoi(data[3]) : 0;
 	item_t->playing = 0;
 	item_t->finished = 0;
 
@@ -535,12 +752,12 @@ hgd_get_next_track_cb(void *item, int argc, char **data, char **names)
 
 /* get the next track (if there is one) */
 int
-hgd_get_next_track(struct hgd_playlist_item *track)
+hgd_get_next_track(struct hgd_ctx *ctx, struct hgd_playlist_item *track)
 {
 	int			 sql_res;
 
-	sql_res = sqlite3_exec(db,
-	    "SELECT id, filename, user "
+	sql_res = sqlite3_exec(ctx->db,
+	    "SELECT id, filename, user, tag_duration "
 	    "FROM playlist WHERE finished=0 LIMIT 1",
 	    hgd_get_next_track_cb, track, NULL);
 
@@ -554,14 +771,14 @@ hgd_get_next_track(struct hgd_playlist_item *track)
 
 /* mark it as playing in the database */
 int
-hgd_mark_playing(int id)
+hgd_mark_playing(struct hgd_ctx *ctx, int id)
 {
 	int			 sql_res, ret = HGD_FAIL;
 	sqlite3_stmt		*stmt;
 	char			*sql = "UPDATE playlist SET playing=1 "
 				    "WHERE id=?";
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
 		goto clean;
@@ -582,12 +799,12 @@ hgd_mark_playing(int id)
 
 	ret = HGD_OK;
 clean:
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
 	return (ret);
 }
 
 int
-hgd_mark_finished(int id, uint8_t purge)
+hgd_mark_finished(struct hgd_ctx *ctx, int id, uint8_t purge)
 {
 	int			 sql_res;
 	char			*q_purge = "DELETE FROM playlist WHERE "
@@ -607,7 +824,7 @@ hgd_mark_finished(int id, uint8_t purge)
 		DPRINTF(HGD_D_DEBUG, "Marking finished up db");
 	}
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
 		goto clean;
@@ -627,57 +844,60 @@ hgd_mark_finished(int id, uint8_t purge)
 	}
 
 	ret = HGD_OK;
+	hgd_db_sync_stats(ctx);
 clean:
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
 	return (ret);
 }
 
 int
-hgd_clear_votes()
+hgd_clear_votes(struct hgd_ctx *ctx)
 {
 	char			*query = "DELETE FROM votes;";
 	int			sql_res;
 
-	sql_res = sqlite3_exec(db, query, NULL, NULL, NULL);
+	sql_res = sqlite3_exec(ctx->db, query, NULL, NULL, NULL);
 
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't clear vote list");
 		return (HGD_FAIL);
 	}
+	hgd_db_sync_stats(ctx);
 
 	return (HGD_OK);
 }
 
 int
-hgd_init_playstate()
+hgd_init_playstate(struct hgd_ctx *ctx)
 {
 	int			 sql_res;
 
 	DPRINTF(HGD_D_DEBUG, "Clearing 'playing' flags");
-	sql_res = sqlite3_exec(db, "UPDATE playlist SET playing=0;",
+	sql_res = sqlite3_exec(ctx->db, "UPDATE playlist SET playing=0;",
 	    NULL, NULL, NULL);
 
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_ERROR, "Can't clear db flags: %s", DERROR);
 		return (HGD_FAIL);
 	}
+	hgd_db_sync_stats(ctx);
 
 	return (HGD_OK);
 }
 
 int
-hgd_clear_playlist()
+hgd_clear_playlist(struct hgd_ctx *ctx)
 {
 	char			*query = "DELETE FROM playlist;";
 	int			sql_res;
 
-	sql_res = sqlite3_exec(db, query, NULL, NULL, NULL);
+	sql_res = sqlite3_exec(ctx->db, query, NULL, NULL, NULL);
 
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_ERROR, "Can't clear playlist");
 		return (HGD_FAIL);
 	}
-	hgd_clear_votes();
+	hgd_clear_votes(ctx);
 
 	return (HGD_OK);
 }
@@ -688,7 +908,7 @@ hgd_clear_playlist()
  * you probably want hgd_user_add() from admin.c
  */
 int
-hgd_user_add_db(char *user, char *salt, char *hash)
+hgd_user_add_db(struct hgd_ctx *ctx, char *user, char *salt, char *hash)
 {
 	int			 sql_res, ret = HGD_FAIL;
 	sqlite3_stmt		*stmt;
@@ -696,7 +916,8 @@ hgd_user_add_db(char *user, char *salt, char *hash)
 				   "(username, salt, hash, perms) "
 				   " VALUES (?, ?, ?, 0)";
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	ctx = hgd_db_write_begin(ctx);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
 		goto clean;
@@ -723,12 +944,13 @@ hgd_user_add_db(char *user, char *salt, char *hash)
 
 	ret = HGD_OK;
 clean:
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
+	hgd_db_write_end(ctx);
 	return (ret);
 }
 
 int
-hgd_user_mod_perms_db(struct hgd_user *user)
+hgd_user_mod_perms_db(struct hgd_ctx *ctx, struct hgd_user *user)
 {
 	int			sql_res;
 	sqlite3_stmt		*stmt;
@@ -737,7 +959,8 @@ hgd_user_mod_perms_db(struct hgd_user *user)
 
 	DPRINTF(HGD_D_DEBUG, "Updating user info for %s", user->name);
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	ctx = hgd_db_write_begin(ctx);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
 		ret = HGD_FAIL;
@@ -766,7 +989,8 @@ hgd_user_mod_perms_db(struct hgd_user *user)
 	}
 
 clean:
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
+	hgd_db_write_end(ctx);
 	return (ret);
 }
 
@@ -776,7 +1000,7 @@ clean:
  * caller must free dynamic fields
  */
 int
-hgd_get_user(char *user, struct hgd_user *result)
+hgd_get_user(struct hgd_ctx *ctx, char *user, struct hgd_user *result)
 {
 	int			 sql_res, res = HGD_OK;
 	sqlite3_stmt		*stmt;
@@ -784,7 +1008,7 @@ hgd_get_user(char *user, struct hgd_user *result)
 
 	DPRINTF(HGD_D_DEBUG, "Getting user info for '%s'", user);
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
 		res = HGD_FAIL;
@@ -814,12 +1038,12 @@ hgd_get_user(char *user, struct hgd_user *result)
 	result->perms = sqlite3_column_int(stmt, 1);
 
 clean:
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
 	return (res);
 }
 
 struct hgd_user *
-hgd_authenticate_user(char *user, char *pass)
+hgd_authenticate_user(struct hgd_ctx *ctx, char *user, char *pass)
 {
 	int			 sql_res;
 	sqlite3_stmt		*stmt;
@@ -831,7 +1055,7 @@ hgd_authenticate_user(char *user, char *pass)
 
 	DPRINTF(HGD_D_DEBUG, "Get user info for '%s'", user);
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
 		goto clean;
@@ -871,7 +1095,7 @@ clean:
 	if (hash)
 		free(hash);
 
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
 	return (user_info);
 }
 
@@ -879,7 +1103,7 @@ clean:
  * remove user from db forever
  */
 int
-hgd_user_del_db(char *uname)
+hgd_user_del_db(struct hgd_ctx *ctx, char *uname)
 {
 	int			 sql_res, ret = HGD_FAIL, lookup_ret;
 	sqlite3_stmt		*stmt = NULL;
@@ -887,13 +1111,14 @@ hgd_user_del_db(char *uname)
 	struct hgd_user		 user;
 
 	/* look up the user so that we can report non-existency */
-	if ((lookup_ret = hgd_get_user(uname, &user)) != HGD_OK) {
+	ctx = hgd_db_write_begin(ctx);
+	if ((lookup_ret = hgd_get_user(ctx, uname, &user)) != HGD_OK) {
 		ret = lookup_ret;
 		goto clean;
 	}
 	free(user.name);
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
 		goto clean;
@@ -915,7 +1140,8 @@ hgd_user_del_db(char *uname)
 	ret = HGD_OK;
 clean:
 	if (stmt)
-		sqlite3_finalize(stmt);
+		hgd_db_finish(ctx, stmt);
+	hgd_db_write_end(ctx);
 
 	return (ret);
 }
@@ -943,13 +1169,13 @@ hgd_get_all_users_cb(void *arg, int argc, char **data, char **names)
 }
 
 int
-hgd_num_tracks_user(char *username)
+hgd_num_tracks_user(struct hgd_ctx *ctx, char *username)
 {
 	int			 sql_res, ret = HGD_FAIL;
 	sqlite3_stmt		*stmt;
 	char			*sql = "SELECT COUNT(*) FROM playlist WHERE user=? AND finished=0";
 
-	sql_res = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
 	if (sql_res != SQLITE_OK) {
 		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
 		goto clean;
@@ -970,18 +1196,18 @@ hgd_num_tracks_user(char *username)
 
 	ret = sqlite3_column_int(stmt, 0);
 clean:
-	sqlite3_finalize(stmt);
+	hgd_db_finish(ctx, stmt);
 	return (ret);
 }
 
 /* get all users from the db, caler must free */
 struct hgd_user_list *
-hgd_get_all_users()
+hgd_get_all_users(struct hgd_ctx *ctx)
 {
 	int			 sql_res;
 	struct hgd_user_list	*list = xcalloc(1, sizeof(struct hgd_user_list));
 
-	sql_res = sqlite3_exec(db,
+	sql_res = sqlite3_exec(ctx->db,
 	    "SELECT username, perms FROM users",
 	    hgd_get_all_users_cb, list, NULL);
 
@@ -992,3 +1218,95 @@ hgd_get_all_users()
 
 	return (list);
 }
+
+/*
+ * get a number which changes whenever another connection commits to the
+ * database. Cheap, so it may be polled.
+ */
+int
+hgd_get_data_version(struct hgd_ctx *ctx, int *version)
+{
+	int			 sql_res, ret = HGD_FAIL;
+	sqlite3_stmt		*stmt;
+
+	sql_res = hgd_db_prepare(ctx, "PRAGMA data_version", &stmt);
+	if (sql_res != SQLITE_OK) {
+		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
+		goto clean;
+	}
+
+	sql_res = sqlite3_step(stmt);
+	if (sql_res != SQLITE_ROW) {
+		DPRINTF(HGD_D_WARN, "Can't step sql: %s", DERROR);
+		goto clean;
+	}
+
+	*version = sqlite3_column_int(stmt, 0);
+	ret = HGD_OK;
+clean:
+	hgd_db_finish(ctx, stmt);
+	return (ret);
+}
+
+/*
+ * a number which changes whenever the database may have changed, either
+ * by another connection (data_version) or by this one (total_changes).
+ */
+int
+hgd_get_playlist_gen(struct hgd_ctx *ctx, uint64_t *gen)
+{
+	int			version;
+
+	if (hgd_get_data_version(ctx, &version) != HGD_OK)
+		return (HGD_FAIL);
+
+	*gen = ((uint64_t) (unsigned int) version << 32) |
+	    (unsigned int) sqlite3_total_changes(ctx->db);
+
+	return (HGD_OK);
+}
+
+/*
+ * get just the ids of the unfinished tracks, in playlist order, and the id
+ * of the playing track (or -1). Caller must free ids.
+ */
+int
+hgd_get_playlist_ids(struct hgd_ctx *ctx, int **ids, int *n_ids,
+    int *playing_id)
+{
+	int			 sql_res, ret = HGD_FAIL;
+	sqlite3_stmt		*stmt;
+	char			*sql = "SELECT id, playing FROM playlist "
+	    "WHERE finished=0 ORDER BY id";
+
+	*ids = NULL;
+	*n_ids = 0;
+	*playing_id = -1;
+
+	sql_res = hgd_db_prepare(ctx, sql, &stmt);
+	if (sql_res != SQLITE_OK) {
+		DPRINTF(HGD_D_WARN, "Can't prepare sql: %s", DERROR);
+		goto clean;
+	}
+
+	while ((sql_res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		*ids = xrealloc(*ids, sizeof(int) * (*n_ids + 1));
+		(*ids)[*n_ids] = sqlite3_column_int(stmt, 0);
+		if (sqlite3_column_int(stmt, 1))
+			*playing_id = (*ids)[*n_ids];
+		(*n_ids)++;
+	}
+
+	if (sql_res != SQLITE_DONE) {
+		DPRINTF(HGD_D_WARN, "Can't step sql: %s", DERROR);
+		free(*ids);
+		*ids = NULL;
+		*n_ids = 0;
+		goto clean;
+	}
+
+	ret = HGD_OK;
+clean:
+	hgd_db_finish(ctx, stmt);
+	return (ret);
+}
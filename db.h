@@ -18,45 +18,85 @@
 #ifndef __DB_H
 #define __DB_H
 
-/* sqlite database error string (from global db ptr) */
-#define DERROR			sqlite3_errmsg(db)
+/* sqlite database error string (from the db of the ctx in scope) */
+#define DERROR			sqlite3_errmsg(ctx->db)
 
 #include <sqlite3.h>
 
 #include "hgd.h"
 
 #define	HGD_DB_SCHEMA_VERS	"1"
+/* how long to wait for a locked database (msecs) */
+#define HGD_DB_BUSY_TIMEOUT	2000
+/* statements kept prepared by a long lived connection, see struct hgd_ctx */
+#define HGD_DB_STMT_CACHE	16
+
+struct hgd_db_stmt {
+	const char		*sql;		/* NULL if slot unused */
+	sqlite3_stmt		*stmt;
+	uint8_t			 in_use;
+};
 
-extern sqlite3			*db;
 extern char			*db_path;
 
-sqlite3				*hgd_open_db(char *, uint8_t);
+int				 hgd_open_db(struct hgd_ctx *ctx, char *,
+				     uint8_t);
+void				 hgd_close_db(struct hgd_ctx *ctx);
+int				 hgd_db_prepare(struct hgd_ctx *ctx,
+				     const char *sql, sqlite3_stmt **stmt);
+void				 hgd_db_finish(struct hgd_ctx *ctx,
+				     sqlite3_stmt *stmt);
+void				 hgd_db_cache_stmts(struct hgd_ctx *ctx,
+				     uint8_t on);
+struct hgd_ctx			*hgd_db_write_begin(struct hgd_ctx *ctx);
+void				 hgd_db_write_end(struct hgd_ctx *ctx);
+int				 hgd_db_busy_cb(void *, int);
+void				 hgd_db_sync_stats(struct hgd_ctx *ctx);
 int				 hgd_get_playing_item_cb(void *arg,
 				     int argc, char **data, char **names);
-int				 hgd_get_playing_item(
+int				 hgd_get_playing_item(struct hgd_ctx *ctx,
 				     struct hgd_playlist_item *playing);
 int				 hgd_get_num_votes_cb(void *arg,
 				     int argc, char **data, char **names);
-int				 hgd_get_num_votes(int *nv);
-int				 hgd_insert_track(char *filename,
-				     struct hgd_media_tag *, char *user);
-int				 hgd_insert_vote(char *user);
-int				 hgd_get_playlist(struct hgd_playlist *list);
-int				 hgd_get_next_track(
+int				 hgd_get_num_votes(struct hgd_ctx *ctx,
+				     int *nv);
+int				 hgd_insert_track(struct hgd_ctx *ctx,
+				     char *filename, struct hgd_media_tag *,
+				     char *user, int limit);
+int				 hgd_insert_vote(struct hgd_ctx *ctx,
+				     char *user);
+int				 hgd_get_playlist(struct hgd_ctx *ctx,
+				     struct hgd_playlist *list);
+int				 hgd_get_next_track(struct hgd_ctx *ctx,
 				     struct hgd_playlist_item *track);
-int				 hgd_mark_playing(int id);
-int				 hgd_mark_finished(int id, uint8_t purge);
-int				 hgd_clear_votes(void);
-int				 hgd_clear_playlist(void);
-int				 hgd_init_playstate(void);
-int				 hgd_user_add_db(char *usr, char *slt, char *hash);
-struct hgd_user			*hgd_authenticate_user(char *user, char *pass);
-int				 hgd_user_del_db(char *user);
-struct hgd_user_list		*hgd_get_all_users(void);
-int				 hgd_num_tracks_user(char *username);
+int				 hgd_mark_playing(struct hgd_ctx *ctx,
+				     int id);
+int				 hgd_mark_finished(struct hgd_ctx *ctx,
+				     int id, uint8_t purge);
+int				 hgd_clear_votes(struct hgd_ctx *ctx);
+int				 hgd_clear_playlist(struct hgd_ctx *ctx);
+int				 hgd_init_playstate(struct hgd_ctx *ctx);
+int				 hgd_user_add_db(struct hgd_ctx *ctx,
+				     char *usr, char *slt, char *hash);
+struct hgd_user			*hgd_authenticate_user(struct hgd_ctx *ctx,
+				     char *user, char *pass);
+int				 hgd_user_del_db(struct hgd_ctx *ctx,
+				     char *user);
+struct hgd_user_list		*hgd_get_all_users(struct hgd_ctx *ctx);
+int				 hgd_num_tracks_user(struct hgd_ctx *ctx,
+				     char *username);
 int				 hgd_make_new_db(char *db_path);
-int				 hgd_user_mod_perms_db(struct hgd_user *user);
-int				 hgd_user_has_voted(char *user, int *v);
-int				 hgd_get_user(char *user, struct hgd_user *result);
+int				 hgd_user_mod_perms_db(struct hgd_ctx *ctx,
+				     struct hgd_user *user);
+int				 hgd_user_has_voted(struct hgd_ctx *ctx,
+				     char *user, int *v);
+int				 hgd_get_data_version(struct hgd_ctx *ctx,
+				     int *version);
+int				 hgd_get_playlist_gen(struct hgd_ctx *ctx,
+				     uint64_t *gen);
+int				 hgd_get_playlist_ids(struct hgd_ctx *ctx,
+				     int **ids, int *n_ids, int *playing_id);
+int				 hgd_get_user(struct hgd_ctx *ctx,
+				     char *user, struct hgd_user *result);
 
 #endif
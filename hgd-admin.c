@@ -22,6 +22,7 @@
 
 #include <err.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,12 +39,12 @@
 #include "db.h"
 #include "user.h"
 #include "mplayer.h"
-
-const char			*hgd_component = HGD_COMPONENT_HGD_ADMIN;
+#include "stats.h"
 
 uint8_t				 purge_finished_db = 1;
 uint8_t				 purge_finished_fs = 1;
 uint8_t				 clear_playlist_on_start = 0;
+struct hgd_ctx			 main_ctx;
 
 /*
  * clean up, exit. if exit_ok = 0, an error (signal/error)
@@ -56,8 +57,7 @@ hgd_exit_nicely()
 
 	if (mplayer_fifo_path)
 		free(mplayer_fifo_path);
-	if (db)
-		sqlite3_close(db);
+	hgd_close_db(&main_ctx);
 	if (state_path)
 		free(state_path);
 	if (db_path)
@@ -79,7 +79,9 @@ hgd_usage()
         printf("Commands include:\n");
         printf("    db-init				Initialise database.\n");
         printf("    pause				Pause MPlayer.\n");
+        printf("    py-reload				Reload Python plugins.\n");
         printf("    skip				Next track.\n");
+        printf("    stats				Show daemon statistics.\n");
         printf("    status				Show daemon status'.\n");
         printf("    user-add <username> [password]	Add a user.\n");
         printf("    user-del <username>			Delete a user.\n");
@@ -114,7 +116,7 @@ hgd_acmd_mkadmin(char **args)
 {
 	int		ret = HGD_FAIL;
 
-	switch (hgd_user_mod_perms(args[0], HGD_AUTH_ADMIN, 1)) {
+	switch (hgd_user_mod_perms(&main_ctx, args[0], HGD_AUTH_ADMIN, 1)) {
 	case HGD_OK: /* FALLTHRU */
 	case HGD_FAIL_PERMNOCHG:
 		ret = HGD_OK;
@@ -132,7 +134,7 @@ hgd_acmd_noadmin(char **args)
 {
 	int		ret = HGD_FAIL;
 
-	switch (hgd_user_mod_perms(args[0], HGD_AUTH_ADMIN, 0)) {
+	switch (hgd_user_mod_perms(&main_ctx, args[0], HGD_AUTH_ADMIN, 0)) {
 	case HGD_OK: /* FALLTHRU */
 	case HGD_FAIL_PERMNOCHG:
 		ret = HGD_OK;
@@ -151,13 +153,11 @@ hgd_acmd_user_list_print(char **args)
 	int			 i, ret = HGD_FAIL;
 	char			*permstr = NULL;
 
-	if (db == NULL)
-		db = hgd_open_db(db_path, 0);
-
-	if (db == NULL)
+	if ((main_ctx.db == NULL) &&
+	    (hgd_open_db(&main_ctx, db_path, 0) != HGD_OK))
 		goto clean;
 
-	if (hgd_user_list(&list) != HGD_OK)
+	if (hgd_user_list(&main_ctx, &list) != HGD_OK)
 		goto clean;
 
 	for (i = 0; i < list->n_users; i++) {
@@ -181,6 +181,10 @@ int
 hgd_acmd_skip(char **args)
 {
 	(void) args;
+
+	/* so that hgd-playd can time the skip, don't care if we can't */
+	hgd_stats_open(1);
+
 	return(hgd_skip_track());
 }
 
@@ -191,10 +195,17 @@ hgd_acmd_pause(char **args)
 	return (hgd_pause_track());
 }
 
+int
+hgd_acmd_py_reload(char **args)
+{
+	(void) args;
+	return (hgd_signal_component(HGD_COMPONENT_HGD_PLAYD, SIGUSR1));
+}
+
 int
 hgd_acmd_user_add(char **args)
 {
-	return (hgd_user_add(args[0], args[1]));
+	return (hgd_user_add(&main_ctx, args[0], args[1]));
 }
 
 int
@@ -202,28 +213,24 @@ hgd_acmd_user_add_prompt(char **args)
 {
 	char			 pass[HGD_MAX_PASS_SZ];
 
-	if (db == NULL)
-		db = hgd_open_db(db_path, 0);
-
-	if (db == NULL)
+	if ((main_ctx.db == NULL) &&
+	    (hgd_open_db(&main_ctx, db_path, 0) != HGD_OK))
 		return (HGD_FAIL);
 
 	if (hgd_readpassphrase_confirmed(pass, NULL) != HGD_OK)
 		return (HGD_FAIL);
 
-	return (hgd_user_add(args[0], pass));
+	return (hgd_user_add(&main_ctx, args[0], pass));
 }
 
 int
 hgd_acmd_user_del(char **args)
 {
-	if (db == NULL)
-		db = hgd_open_db(db_path, 0);
-
-	if (db == NULL)
+	if ((main_ctx.db == NULL) &&
+	    (hgd_open_db(&main_ctx, db_path, 0) != HGD_OK))
 		return (HGD_FAIL);
 
-	if (hgd_user_del(args[0]) != HGD_OK)
+	if (hgd_user_del(&main_ctx, args[0]) != HGD_OK)
 		return (HGD_FAIL);
 
 	return (HGD_OK);
@@ -260,10 +267,27 @@ hgd_acmd_status(char **args)
 	return (HGD_OK);
 }
 
+int
+hgd_acmd_stats(char **args)
+{
+	(void) args;
+
+	if (hgd_stats_open(0) != HGD_OK)
+		return (HGD_FAIL);
+
+	printf("\n  HGD statistics:\n");
+	hgd_stats_print(stdout);
+	hgd_stats_close(); /* read only, the db must not count into it */
+
+	return (HGD_OK);
+}
+
 struct hgd_admin_cmd admin_cmds[] = {
 	{ "db-init", 0, hgd_acmd_init_db },
 	{ "pause", 0, hgd_acmd_pause },
+	{ "py-reload", 0, hgd_acmd_py_reload },
 	{ "skip", 0, hgd_acmd_skip },
+	{ "stats", 0, hgd_acmd_stats },
 	{ "status", 0, hgd_acmd_status },
 	{ "user-add", 2, hgd_acmd_user_add },
 	{ "user-add", 1, hgd_acmd_user_add_prompt },
@@ -343,8 +367,13 @@ main(int argc, char **argv)
 	char			*config_path[4] = {NULL, NULL, NULL, NULL};
 	int			 num_config = 2, ch;
 
+	/* before anything which might log or fail */
+	hgd_component = HGD_COMPONENT_HGD_ADMIN;
+	hgd_exit_cb = hgd_exit_nicely;
+
 	/* syslog as early as possible */
 	HGD_INIT_SYSLOG();
+	hgd_ctx_init(&main_ctx);
 
 #ifdef HAVE_LIBCONFIG
 	config_path[0] = NULL;
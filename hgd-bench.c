@@ -0,0 +1,1261 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Martin Ellis <ellism88@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * hgd-bench: load generator for hgd-netd.
+ *
+ * Forks a process per simulated client (like hgd-netd does per connection),
+ * each of which runs a random mix of commands and records how long each
+ * took in a shared sample table. When all are done, the parent reports
+ * throughput and latency percentiles per command.
+ *
+ * With -P, benchmarks hgd-playd instead: queue some tracks, skip some of
+ * them, and report the player timings hgd-playd recorded meanwhile. Best
+ * used with 'hgd-playd -m null'.
+ *
+ * With -R, replays the sessions in a capture file written by 'hgd-netd -C',
+ * keeping their timing (or speeding it up with -A).
+ */
+
+#define _GNU_SOURCE	/* linux */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <bsd/readpassphrase.h>
+#else
+#include <readpassphrase.h>
+#endif
+
+#include "config.h"
+#include "hgd.h"
+#include "net.h"
+#include "stats.h"
+
+#define HGD_BENCH_DFL_CLIENTS	10
+#define HGD_BENCH_DFL_OPS	100
+#define HGD_BENCH_DFL_MIX	"ls:60,np:30,vo:5,q:5"
+#define HGD_BENCH_DFL_PAYLOAD	64	/* KB */
+#define HGD_BENCH_Q_NAME	"hgd-bench.mp3"
+#define HGD_BENCH_DFL_SKIP	50	/* percent of tracks to skip with -P */
+#define HGD_BENCH_POLL_MS	5
+#define HGD_BENCH_SKIP_DELAY_MS	50	/* let the player get going first */
+#define HGD_BENCH_MAX_REPLAY_CMDS 32	/* distinct commands in a replay */
+
+/* the commands we can run */
+#define HGD_BENCH_LS		0
+#define HGD_BENCH_NP		1
+#define HGD_BENCH_VO		2
+#define HGD_BENCH_Q		3
+#define HGD_BENCH_N_CMDS	4
+
+char				*bench_cmd_names[HGD_BENCH_N_CMDS] = {
+				    "ls", "np", "vo", "q" };
+
+struct hgd_bench_sample {
+	uint32_t		 usecs;
+	uint8_t			 cmd;
+	uint8_t			 ok;
+	uint8_t			 done;		/* slot was used */
+};
+
+/* shared between the client processes and the parent */
+struct hgd_bench_client {
+	uint64_t		 usecs;		/* wall time of the whole run */
+	uint32_t		 n_done;
+	uint8_t			 failed;	/* couldn't connect/login */
+	uint32_t		 skipped;	/* replay: commands not sent */
+	uint64_t		 max_lag;	/* replay: worst lateness */
+};
+
+/* a session from a capture file */
+struct hgd_bench_replay_cmd {
+	uint64_t		 at;		/* usecs into the capture */
+	char			*line;
+	int			 name;		/* index into replay_names */
+};
+
+struct hgd_bench_session {
+	int			 pid;		/* hgd-netd child in the capture */
+	uint64_t		 at;		/* usecs into the capture */
+	uint8_t			 closed;
+	int			 n_cmds;
+	int			 first_sample;
+	struct hgd_bench_replay_cmd *cmds;
+};
+
+char				*host = NULL, *user = NULL;
+char				 password[HGD_MAX_PASS_SZ];
+int				 port = HGD_DFL_PORT;
+uint8_t				 crypto_pref = HGD_CRYPTO_PREF_NEVER;
+int				 n_clients = HGD_BENCH_DFL_CLIENTS;
+int				 n_ops = HGD_BENCH_DFL_OPS;
+size_t				 payload_sz = HGD_BENCH_DFL_PAYLOAD * 1024;
+int				 n_tracks = 0;		/* -P */
+int				 skip_pct = HGD_BENCH_DFL_SKIP;
+int				 mix[HGD_BENCH_N_CMDS];
+int				 mix_total = 0;
+char				*replay_path = NULL;		/* -R */
+double				 replay_speed = 1;		/* -A */
+struct hgd_bench_session	*sessions = NULL;
+int				 n_sessions = 0;
+char				*replay_names[HGD_BENCH_MAX_REPLAY_CMDS];
+int				 n_replay_names = 0;
+int				 n_replay_samples = 0;
+
+struct hgd_bench_sample		*samples = NULL;
+struct hgd_bench_client		*clients = NULL;
+
+/* per client process */
+int				 sock_fd = -1;
+SSL				*ssl = NULL;
+SSL_METHOD			*method = NULL;
+SSL_CTX				*ctx = NULL;
+struct hgd_ctx			 main_ctx;
+char				*payload = NULL;
+uint8_t				 binary = 0;	/* replay: after 'proto|18' */
+
+void
+hgd_exit_nicely()
+{
+	if (!exit_ok)
+		DPRINTF(HGD_D_ERROR,
+		    "hgd-bench was interrupted or crashed - cleaning up");
+
+	if (ssl) {
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+	}
+	if (ctx)
+		hgd_cleanup_ssl(&ctx);
+	if (sock_fd >= 0)
+		close(sock_fd);
+
+	free(payload);
+	free(host);
+
+	HGD_CLOSE_SYSLOG();
+	exit (!exit_ok);
+}
+
+uint64_t
+hgd_bench_now_usecs(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* parse a mix like "ls:60,np:30,vo:5,q:5" into weights */
+int
+hgd_bench_parse_mix(char *spec)
+{
+	char			*copy, *next, *item, *weight;
+	int			 i, found, ret = HGD_FAIL;
+
+	memset(mix, 0, sizeof(mix));
+	mix_total = 0;
+
+	copy = next = xstrdup(spec);
+	while ((item = strsep(&next, ",")) != NULL) {
+		weight = strchr(item, ':');
+		if (weight == NULL) {
+			DPRINTF(HGD_D_ERROR, "Mix item '%s' has no weight", item);
+			goto clean;
+		}
+		*weight++ = '\0';
+
+		found = 0;
+		for (i = 0; i < HGD_BENCH_N_CMDS; i++) {
+			if (strcmp(item, bench_cmd_names[i]) == 0) {
+				mix[i] = atoi(weight);
+				found = 1;
+			}
+		}
+
+		if ((!found) || (atoi(weight) < 0)) {
+			DPRINTF(HGD_D_ERROR, "Bad mix item '%s'", item);
+			goto clean;
+		}
+	}
+
+	for (i = 0; i < HGD_BENCH_N_CMDS; i++)
+		mix_total += mix[i];
+
+	if (mix_total == 0) {
+		DPRINTF(HGD_D_ERROR, "Mix has no weight");
+		goto clean;
+	}
+
+	ret = HGD_OK;
+clean:
+	free(copy);
+
+	return (ret);
+}
+
+/* read a reply line, is it an 'ok'? */
+int
+hgd_bench_expect_ok(char **resp_out)
+{
+	char			*resp;
+	int			 ret;
+
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+	if (resp == NULL)
+		return (HGD_FAIL);
+
+	ret = (strncmp(resp, "ok", 2) == 0) ? HGD_OK : HGD_FAIL;
+
+	if (resp_out != NULL)
+		*resp_out = resp;
+	else
+		free(resp);
+
+	return (ret);
+}
+
+/* ask for and set up SSL on the connection */
+int
+hgd_bench_encrypt(void)
+{
+	hgd_sock_send_line(&main_ctx, sock_fd, NULL, "encrypt");
+
+	if (hgd_setup_ssl_ctx(&method, &ctx, 0, 0, 0) != 0)
+		return (HGD_FAIL);
+
+	if (((ssl = SSL_new(ctx)) == NULL) ||
+	    (SSL_set_fd(ssl, sock_fd) == 0) ||
+	    (SSL_connect(ssl) != 1)) {
+		PRINT_SSL_ERR(HGD_D_ERROR, "SSL setup");
+		return (HGD_FAIL);
+	}
+
+	return (hgd_bench_expect_ok(NULL));
+}
+
+/* connect, optionally encrypt and log in */
+int
+hgd_bench_connect(uint8_t login)
+{
+	struct sockaddr_in	 addr;
+	struct hostent		*he;
+	char			*cmd;
+	int			 ret = HGD_FAIL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	if ((he = gethostbyname(host)) == NULL) {
+		DPRINTF(HGD_D_ERROR, "Can't resolve '%s'", host);
+		goto clean;
+	}
+	memcpy(&addr.sin_addr, he->h_addr_list[0], sizeof(addr.sin_addr));
+
+	if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		DPRINTF(HGD_D_ERROR, "can't make socket: %s", SERROR);
+		goto clean;
+	}
+
+	if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		DPRINTF(HGD_D_ERROR, "Can't connect to %s: %s", host, SERROR);
+		goto clean;
+	}
+
+	/* greeting */
+	if (hgd_bench_expect_ok(NULL) != HGD_OK)
+		goto clean;
+
+	if ((crypto_pref != HGD_CRYPTO_PREF_NEVER) &&
+	    (hgd_bench_encrypt() != HGD_OK))
+		goto clean;
+
+	if (login) {
+		xasprintf(&cmd, "user|%s|%s", user, password);
+		hgd_sock_send_line(&main_ctx, sock_fd, ssl, cmd);
+		free(cmd);
+
+		if (hgd_bench_expect_ok(NULL) != HGD_OK) {
+			DPRINTF(HGD_D_ERROR, "Login as '%s' failed", user);
+			goto clean;
+		}
+	}
+
+	ret = HGD_OK;
+clean:
+	return (ret);
+}
+
+/* run one command, wait for the whole reply */
+int
+hgd_bench_run_cmd(int cmd)
+{
+	char			*resp = NULL, *line, *q_req, *p;
+	int			 i, n_items, ret = HGD_FAIL;
+	size_t			 sent, chunk;
+
+	switch (cmd) {
+	case HGD_BENCH_LS:
+		hgd_sock_send_line(&main_ctx, sock_fd, ssl, "ls");
+		if (hgd_bench_expect_ok(&resp) != HGD_OK)
+			goto clean;
+
+		p = strchr(resp, '|');
+		n_items = (p != NULL) ? atoi(p + 1) : 0;
+		for (i = 0; i < n_items; i++) {
+			if ((line = hgd_sock_recv_line(&main_ctx,
+			    sock_fd, ssl)) == NULL)
+				goto clean;
+			free(line);
+		}
+		break;
+	case HGD_BENCH_NP:
+		hgd_sock_send_line(&main_ctx, sock_fd, ssl, "np");
+		if (hgd_bench_expect_ok(NULL) != HGD_OK)
+			goto clean;
+		break;
+	case HGD_BENCH_VO:
+		/* mostly E_NOPLAY or E_DUPVOTE, which still costs the server */
+		hgd_sock_send_line(&main_ctx, sock_fd, ssl, "vo");
+		if (hgd_bench_expect_ok(NULL) != HGD_OK)
+			goto clean;
+		break;
+	case HGD_BENCH_Q:
+		xasprintf(&q_req, "q|%s|%d", HGD_BENCH_Q_NAME, (int) payload_sz);
+		hgd_sock_send_line(&main_ctx, sock_fd, ssl, q_req);
+		free(q_req);
+
+		if (hgd_bench_expect_ok(NULL) != HGD_OK)
+			goto clean;
+
+		for (sent = 0; sent < payload_sz; sent += chunk) {
+			chunk = payload_sz - sent;
+			if (chunk > HGD_BINARY_CHUNK)
+				chunk = HGD_BINARY_CHUNK;
+			hgd_sock_send_bin(&main_ctx, sock_fd, ssl,
+			    payload + sent, chunk);
+		}
+
+		if (hgd_bench_expect_ok(NULL) != HGD_OK)
+			goto clean;
+		break;
+	default:
+		goto clean;
+	}
+
+	ret = HGD_OK;
+clean:
+	free(resp);
+
+	return (ret);
+}
+
+/* body of a client process */
+void
+hgd_bench_client(int id)
+{
+	struct hgd_bench_client	*me = &clients[id];
+	struct hgd_bench_sample	*s;
+	unsigned int		 seed = (unsigned int) (getpid() ^ time(NULL));
+	uint64_t		 start, op_start;
+	int			 op, cmd, pick;
+
+	/* vo and q need a login */
+	if (hgd_bench_connect(mix[HGD_BENCH_VO] || mix[HGD_BENCH_Q])
+	    != HGD_OK) {
+		me->failed = 1;
+		hgd_exit_nicely();
+	}
+
+	if (mix[HGD_BENCH_Q]) {
+		payload = xmalloc(payload_sz);
+		memset(payload, 0, payload_sz);
+	}
+
+	start = hgd_bench_now_usecs();
+	for (op = 0; op < n_ops; op++) {
+		pick = rand_r(&seed) % mix_total;
+		for (cmd = 0; pick >= mix[cmd]; cmd++)
+			pick -= mix[cmd];
+
+		s = &samples[id * n_ops + op];
+		s->cmd = cmd;
+
+		op_start = hgd_bench_now_usecs();
+		s->ok = (hgd_bench_run_cmd(cmd) == HGD_OK);
+		s->usecs = hgd_bench_now_usecs() - op_start;
+		s->done = 1;
+
+		me->n_done++;
+	}
+	me->usecs = hgd_bench_now_usecs() - start;
+
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "bye");
+	hgd_bench_expect_ok(NULL);
+
+	exit_ok = 1;
+	hgd_exit_nicely();
+}
+
+int
+hgd_bench_cmp_u32(const void *a, const void *b)
+{
+	uint32_t		x = *(const uint32_t *) a;
+	uint32_t		y = *(const uint32_t *) b;
+
+	return ((x > y) - (x < y));
+}
+
+/* value at the given fraction of a sorted array */
+uint32_t
+hgd_bench_percentile(uint32_t *sorted, int n, double frac)
+{
+	int			i = (int) (frac * n);
+
+	if (i >= n)
+		i = n - 1;
+
+	return (sorted[i]);
+}
+
+/* throughput and latency per command, from the first n_samples samples */
+void
+hgd_bench_report_cmds(char **names, int n_names, int n_samples, double secs)
+{
+	uint32_t		*lat;
+	int			 cmd, i, n, n_err;
+
+	lat = xcalloc(n_samples > 0 ? n_samples : 1, sizeof(uint32_t));
+
+	printf("    %-12s %8s %8s %10s %10s %10s %10s %10s\n", "cmd", "ops",
+	    "errors", "ops/s", "p50 (us)", "p99 (us)", "p999 (us)", "max (us)");
+
+	for (cmd = 0; cmd < n_names; cmd++) {
+		n = n_err = 0;
+		for (i = 0; i < n_samples; i++) {
+			if ((!samples[i].done) || (samples[i].cmd != cmd))
+				continue;
+			lat[n++] = samples[i].usecs;
+			if (!samples[i].ok)
+				n_err++;
+		}
+
+		if (n == 0)
+			continue;
+
+		qsort(lat, n, sizeof(uint32_t), hgd_bench_cmp_u32);
+		printf("    %-12s %8d %8d %10.1f %10u %10u %10u %10u\n",
+		    names[cmd], n, n_err, secs > 0 ? n / secs : 0,
+		    hgd_bench_percentile(lat, n, 0.50),
+		    hgd_bench_percentile(lat, n, 0.99),
+		    hgd_bench_percentile(lat, n, 0.999), lat[n - 1]);
+	}
+	printf("\n");
+
+	free(lat);
+}
+
+void
+hgd_bench_report(uint64_t wall_usecs)
+{
+	int			 i, total = 0, failed = 0;
+	double			 secs = (double) wall_usecs / 1000000;
+
+	for (i = 0; i < n_clients; i++) {
+		total += clients[i].n_done;
+		failed += clients[i].failed;
+	}
+
+	printf("\n  %d clients, %d ops each, mix %s=%d %s=%d %s=%d %s=%d, %s\n",
+	    n_clients, n_ops,
+	    bench_cmd_names[0], mix[0], bench_cmd_names[1], mix[1],
+	    bench_cmd_names[2], mix[2], bench_cmd_names[3], mix[3],
+	    (crypto_pref == HGD_CRYPTO_PREF_NEVER) ? "plain" : "TLS");
+	if (failed)
+		printf("  %d clients failed to connect\n", failed);
+	printf("  %d ops in %.3fs: %.1f ops/s\n\n", total, secs,
+	    secs > 0 ? total / secs : 0);
+
+	hgd_bench_report_cmds(bench_cmd_names, HGD_BENCH_N_CMDS,
+	    n_clients * n_ops, secs);
+}
+
+/* ask the server for the player timings (needs admin) */
+int
+hgd_bench_get_timings(struct hgd_stats_timing *timings)
+{
+	char			*resp = NULL, *line, *next, *name;
+	int			 i, j, n_lines, ret = HGD_FAIL;
+
+	memset(timings, 0, sizeof(*timings) * HGD_STATS_N_TIMINGS);
+
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "stats");
+	if (hgd_bench_expect_ok(&resp) != HGD_OK) {
+		DPRINTF(HGD_D_ERROR, "Can't get stats, are you an admin?");
+		goto clean;
+	}
+	n_lines = atoi(strchr(resp, '|') + 1);
+
+	for (i = 0; i < n_lines; i++) {
+		if ((line = hgd_sock_recv_line(&main_ctx,
+		    sock_fd, ssl)) == NULL)
+			goto clean;
+
+		/* timing|<name>|<count>|<usecs>|<last>|<max> */
+		next = line;
+		if (strcmp(strsep(&next, "|"), "timing") != 0) {
+			free(line);
+			continue;
+		}
+		name = strsep(&next, "|");
+
+		for (j = 0; j < HGD_STATS_N_TIMINGS; j++) {
+			if ((name == NULL) || (next == NULL) ||
+			    (strcmp(name, hgd_stats_timing_names[j]) != 0))
+				continue;
+			sscanf(next, "%llu|%llu|%llu|%llu",
+			    (unsigned long long *) &timings[j].count,
+			    (unsigned long long *) &timings[j].usecs,
+			    (unsigned long long *) &timings[j].last_usecs,
+			    (unsigned long long *) &timings[j].max_usecs);
+		}
+		free(line);
+	}
+
+	ret = HGD_OK;
+clean:
+	free(resp);
+
+	return (ret);
+}
+
+/* what's playing? 0 if nothing */
+int
+hgd_bench_now_playing(int *id)
+{
+	char			*resp = NULL, *p;
+
+	*id = 0;
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "np");
+	if (hgd_bench_expect_ok(&resp) != HGD_OK) {
+		free(resp);
+		return (HGD_FAIL);
+	}
+
+	/* ok|<playing?>|<id>|... */
+	if (((p = strchr(resp, '|')) != NULL) && (atoi(p + 1) == 1) &&
+	    ((p = strchr(p + 1, '|')) != NULL))
+		*id = atoi(p + 1);
+
+	free(resp);
+
+	return (HGD_OK);
+}
+
+/* how many tracks are queued, including the one playing */
+int
+hgd_bench_queue_len(int *len)
+{
+	char			*resp = NULL, *line;
+	int			 i;
+
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "ls");
+	if (hgd_bench_expect_ok(&resp) != HGD_OK) {
+		free(resp);
+		return (HGD_FAIL);
+	}
+
+	*len = atoi(strchr(resp, '|') + 1);
+	for (i = 0; i < *len; i++) {
+		if ((line = hgd_sock_recv_line(&main_ctx,
+		    sock_fd, ssl)) == NULL)
+			return (HGD_FAIL);
+		free(line);
+	}
+	free(resp);
+
+	return (HGD_OK);
+}
+
+/*
+ * benchmark hgd-playd: queue tracks, skip some as they start and when
+ * the playlist is empty, report what hgd-playd timed.
+ */
+int
+hgd_bench_playd(void)
+{
+	struct hgd_stats_timing	 before[HGD_STATS_N_TIMINGS];
+	struct hgd_stats_timing	 after[HGD_STATS_N_TIMINGS];
+	struct hgd_stats_timing	*a, *b;
+	struct timespec		 ts;
+	unsigned int		 seed = (unsigned int) getpid();
+	const char		*descrs[HGD_STATS_N_TIMINGS] = {
+				    "gap between tracks",
+				    "db to play start",
+				    "skip to player stopped" };
+	int			 i, id, last_id = 0, len, queued = 0, skips = 0;
+	int			 ret = HGD_FAIL;
+
+	if (hgd_bench_connect(1) != HGD_OK)
+		goto clean;
+
+	if (hgd_bench_get_timings(before) != HGD_OK)
+		goto clean;
+
+	payload = xmalloc(payload_sz);
+	memset(payload, 0, payload_sz);
+
+	for (i = 0; i < n_tracks; i++) {
+		if (hgd_bench_run_cmd(HGD_BENCH_Q) == HGD_OK)
+			queued++;
+	}
+	printf("  queued %d of %d tracks\n", queued, n_tracks);
+
+	ts.tv_sec = 0;
+	while (1) {
+		if ((hgd_bench_now_playing(&id) != HGD_OK) ||
+		    (hgd_bench_queue_len(&len) != HGD_OK))
+			goto clean;
+
+		if (len == 0)
+			break;
+
+		if ((id != 0) && (id != last_id)) {
+			last_id = id;
+			if ((int) (rand_r(&seed) % 100) < skip_pct) {
+				ts.tv_nsec = HGD_BENCH_SKIP_DELAY_MS * 1000000L;
+				nanosleep(&ts, NULL);
+
+				hgd_sock_send_line(&main_ctx,
+				    sock_fd, ssl, "skip");
+				if (hgd_bench_expect_ok(NULL) == HGD_OK)
+					skips++;
+			}
+		}
+
+		ts.tv_nsec = HGD_BENCH_POLL_MS * 1000000L;
+		nanosleep(&ts, NULL);
+	}
+	printf("  skipped %d tracks\n", skips);
+
+	if (hgd_bench_get_timings(after) != HGD_OK)
+		goto clean;
+
+	printf("\n    %-24s %8s %10s %10s\n", "hgd-playd", "count",
+	    "avg (ms)", "max (ms)");
+	for (i = 0; i < HGD_STATS_N_TIMINGS; i++) {
+		a = &after[i];
+		b = &before[i];
+		printf("    %-24s %8llu %10.2f %10.2f\n", descrs[i],
+		    (unsigned long long) (a->count - b->count),
+		    (a->count > b->count) ? (double) (a->usecs - b->usecs) /
+		    (a->count - b->count) / 1000 : 0,
+		    (double) a->max_usecs / 1000);
+	}
+	printf("\n    (max is since the stats were reset)\n\n");
+
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "bye");
+	hgd_bench_expect_ok(NULL);
+
+	ret = HGD_OK;
+clean:
+	return (ret);
+}
+
+/* index of the command in a captured line, for the report */
+int
+hgd_bench_replay_name(char *line)
+{
+	char			 name[HGD_MAX_LINE];
+	int			 i;
+
+	strncpy(name, line, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	name[strcspn(name, "|")] = '\0';
+
+	for (i = 0; i < n_replay_names; i++) {
+		if (strcmp(replay_names[i], name) == 0)
+			return (i);
+	}
+
+	/* the last slot catches everything else */
+	if (n_replay_names == HGD_BENCH_MAX_REPLAY_CMDS - 1) {
+		replay_names[n_replay_names] = xstrdup("(other)");
+		return (n_replay_names++);
+	} else if (n_replay_names == HGD_BENCH_MAX_REPLAY_CMDS)
+		return (HGD_BENCH_MAX_REPLAY_CMDS - 1);
+
+	replay_names[n_replay_names] = xstrdup(name);
+
+	return (n_replay_names++);
+}
+
+/*
+ * Load a hgd-netd capture file (hgd-netd -C) into sessions. Lines are
+ * <usecs since epoch>|<pid>|<what the client sent>.
+ */
+int
+hgd_bench_load_capture(void)
+{
+	FILE			*f;
+	char			 buf[HGD_MAX_LINE + 64], *line, *p;
+	struct hgd_bench_session *sess;
+	unsigned long long	 stamp, first = 0;
+	int			 i, pid, n_alloc = 0, n_bad = 0, ret = HGD_FAIL;
+
+	if ((f = fopen(replay_path, "r")) == NULL) {
+		DPRINTF(HGD_D_ERROR, "Can't open '%s': %s",
+		    replay_path, SERROR);
+		return (HGD_FAIL);
+	}
+
+	while (fgets(buf, sizeof(buf), f) != NULL) {
+		if ((p = strchr(buf, '\n')) != NULL)
+			*p = '\0';
+
+		if ((sscanf(buf, "%llu|%d|", &stamp, &pid) != 2) ||
+		    ((p = strchr(buf, '|')) == NULL) ||
+		    ((line = strchr(p + 1, '|')) == NULL)) {
+			n_bad++;
+			continue;
+		}
+		line++;
+
+		if (first == 0)
+			first = stamp;
+
+		/* the session this pid has open, if any */
+		sess = NULL;
+		for (i = n_sessions - 1; i >= 0; i--) {
+			if ((sessions[i].pid == pid) && (!sessions[i].closed)) {
+				sess = &sessions[i];
+				break;
+			}
+		}
+
+		if (strcmp(line, HGD_CAPTURE_CLOSE) == 0) {
+			if (sess != NULL)
+				sess->closed = 1;
+			continue;
+		}
+
+		/* new session, or one that was going before the capture */
+		if ((sess == NULL) || (strcmp(line, HGD_CAPTURE_OPEN) == 0)) {
+			if (sess != NULL)
+				sess->closed = 1;
+
+			if (n_sessions == n_alloc) {
+				n_alloc = n_alloc ? n_alloc * 2 : 64;
+				sessions = xrealloc(sessions,
+				    n_alloc * sizeof(*sessions));
+			}
+			sess = &sessions[n_sessions++];
+			memset(sess, 0, sizeof(*sess));
+			sess->pid = pid;
+			sess->at = stamp - first;
+
+			if (strcmp(line, HGD_CAPTURE_OPEN) == 0)
+				continue;
+		}
+
+		sess->cmds = xrealloc(sess->cmds,
+		    (sess->n_cmds + 1) * sizeof(*sess->cmds));
+		sess->cmds[sess->n_cmds].at = stamp - first;
+		sess->cmds[sess->n_cmds].line = xstrdup(line);
+		sess->cmds[sess->n_cmds].name = hgd_bench_replay_name(line);
+		sess->n_cmds++;
+	}
+
+	if (ferror(f)) {
+		DPRINTF(HGD_D_ERROR, "Can't read '%s': %s",
+		    replay_path, SERROR);
+		goto clean;
+	}
+
+	if (n_bad)
+		DPRINTF(HGD_D_WARN, "Ignored %d bad lines in '%s'",
+		    n_bad, replay_path);
+
+	/* each session gets a run of sample slots */
+	for (i = 0; i < n_sessions; i++) {
+		sessions[i].first_sample = n_replay_samples;
+		n_replay_samples += sessions[i].n_cmds;
+	}
+
+	if (n_sessions == 0) {
+		DPRINTF(HGD_D_ERROR, "No sessions in '%s'", replay_path);
+		goto clean;
+	}
+
+	ret = HGD_OK;
+clean:
+	fclose(f);
+
+	return (ret);
+}
+
+/* sleep until 'at' into the capture (scaled), note if we are late */
+void
+hgd_bench_replay_wait(uint64_t t0, uint64_t at, uint64_t *lag)
+{
+	struct timespec		 ts;
+	uint64_t		 due, now;
+
+	due = t0 + (uint64_t) (at / replay_speed);
+	now = hgd_bench_now_usecs();
+
+	if (now < due) {
+		ts.tv_sec = (due - now) / 1000000;
+		ts.tv_nsec = ((due - now) % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	} else if ((lag != NULL) && (now - due > *lag))
+		*lag = now - due;
+}
+
+/*
+ * Send a captured line and read the whole reply. Logins use the captured
+ * user name with our password. Follows the session's 'proto' choice, as
+ * ls and np reply in frames after 'proto|18'. Sets 'lost' if the
+ * connection went away.
+ */
+int
+hgd_bench_replay_cmd(char *line, uint8_t *lost)
+{
+	struct hgd_frame	 f;
+	char			*resp = NULL, *sub = NULL, *reply, *p, *q;
+	char			 chunk[HGD_BINARY_CHUNK];
+	int			 i, n_lines, ret = HGD_FAIL;
+	long long		 size, sent, len;
+
+	if (strcmp(line, "encrypt") == 0) {
+		if ((ret = hgd_bench_encrypt()) != HGD_OK)
+			*lost = 1;
+		return (ret);
+	}
+
+	/* user|<name>|* and user-add|<name>|* */
+	if ((strncmp(line, "user|", 5) == 0) ||
+	    (strncmp(line, "user-add|", 9) == 0)) {
+		p = strchr(line, '|');
+		if ((p = strchr(p + 1, '|')) != NULL) {
+			xasprintf(&sub, "%.*s|%s", (int) (p - line), line,
+			    password);
+			line = sub;
+		}
+	}
+
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, line);
+
+	/* a single frame, an HGD_BIN_T_ERR one on failure */
+	if ((binary) && ((strcmp(line, "ls") == 0) ||
+	    (strcmp(line, "pl") == 0) || (strcmp(line, "np") == 0))) {
+		if (hgd_sock_recv_frame(&main_ctx,
+		    sock_fd, ssl, &f) != HGD_OK) {
+			*lost = 1;
+			goto clean;
+		}
+		if (f.type != HGD_BIN_T_ERR)
+			ret = HGD_OK;
+		hgd_frame_free(&f);
+		goto clean;
+	}
+
+	if ((resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl)) == NULL) {
+		*lost = 1;
+		goto clean;
+	}
+
+	if (strncmp(resp, "ok", 2) != 0)
+		goto clean;	/* err|..., still a reply */
+
+	if (strncmp(line, "proto|", 6) == 0)
+		binary = (atoi(line + 6) == HGD_PROTO_BINARY);
+
+	/* q|<filename>|<size>: the server is waiting for the file */
+	if ((strncmp(line, "q|", 2) == 0) &&
+	    ((q = strrchr(line, '|')) != line + 1)) {
+		size = strtoll(q + 1, NULL, 10);
+		memset(chunk, 0, sizeof(chunk));
+		for (sent = 0; sent < size; sent += len) {
+			len = size - sent;
+			if (len > (long long) sizeof(chunk))
+				len = sizeof(chunk);
+			hgd_sock_send_bin(&main_ctx, sock_fd, ssl, chunk, len);
+		}
+
+		free(resp);
+		if ((resp = hgd_sock_recv_line(&main_ctx,
+		    sock_fd, ssl)) == NULL) {
+			*lost = 1;
+			goto clean;
+		}
+		if (strncmp(resp, "ok", 2) != 0)
+			goto clean;
+	}
+
+	/* ok|<n> followed by n lines */
+	if ((strcmp(line, "ls") == 0) || (strcmp(line, "pl") == 0) ||
+	    (strcmp(line, "user-list") == 0) || (strcmp(line, "stats") == 0)) {
+		n_lines = ((p = strchr(resp, '|')) != NULL) ? atoi(p + 1) : 0;
+		for (i = 0; i < n_lines; i++) {
+			if ((reply = hgd_sock_recv_line(&main_ctx,
+			    sock_fd, ssl)) == NULL) {
+				*lost = 1;
+				goto clean;
+			}
+			free(reply);
+		}
+	}
+
+	ret = HGD_OK;
+clean:
+	free(resp);
+	free(sub);
+
+	return (ret);
+}
+
+/* body of a replayed session's process */
+void
+hgd_bench_replay_session(int id, uint64_t t0)
+{
+	struct hgd_bench_session *sess = &sessions[id];
+	struct hgd_bench_client	*me = &clients[id];
+	struct hgd_bench_sample	*s;
+	uint64_t		 start, op_start;
+	uint8_t			 lost = 0;
+	int			 i;
+
+	start = hgd_bench_now_usecs();
+	if (hgd_bench_connect(0) != HGD_OK) {
+		me->failed = 1;
+		hgd_exit_nicely();
+	}
+
+	for (i = 0; (i < sess->n_cmds) && (!lost); i++) {
+		/* would block until the client hangs up */
+		if (strcmp(sess->cmds[i].line, "watch") == 0) {
+			me->skipped++;
+			continue;
+		}
+
+		hgd_bench_replay_wait(t0, sess->cmds[i].at, &me->max_lag);
+
+		s = &samples[sess->first_sample + i];
+		s->cmd = sess->cmds[i].name;
+
+		op_start = hgd_bench_now_usecs();
+		s->ok = (hgd_bench_replay_cmd(sess->cmds[i].line, &lost) ==
+		    HGD_OK);
+		s->usecs = hgd_bench_now_usecs() - op_start;
+		s->done = 1;
+
+		me->n_done++;
+
+		if (strcmp(sess->cmds[i].line, "bye") == 0)
+			break;
+	}
+	me->usecs = hgd_bench_now_usecs() - start;
+
+	exit_ok = 1;
+	hgd_exit_nicely();
+}
+
+/* re-drive the sessions in a capture file, at replay_speed times */
+int
+hgd_bench_replay(void)
+{
+	char			*prompt;
+	int			 i, j, pid, status, total = 0, failed = 0;
+	int			 skipped = 0, need_pass = 0;
+	uint64_t		 t0, lag = 0;
+	double			 secs;
+
+	if (hgd_bench_load_capture() != HGD_OK)
+		return (HGD_FAIL);
+
+	for (i = 0; i < n_sessions; i++) {
+		for (j = 0; j < sessions[i].n_cmds; j++) {
+			if ((strncmp(sessions[i].cmds[j].line, "user|", 5) == 0) ||
+			    (strncmp(sessions[i].cmds[j].line,
+			    "user-add|", 9) == 0))
+				need_pass = 1;
+		}
+	}
+
+	/* the capture has no passwords: all users get this one */
+	if (need_pass) {
+		xasprintf(&prompt, "Password for replayed users@%s: ", host);
+		if (readpassphrase(prompt, password, sizeof(password),
+		    RPP_ECHO_OFF | RPP_REQUIRE_TTY) == NULL) {
+			DPRINTF(HGD_D_ERROR, "Problem reading password");
+			free(prompt);
+			return (HGD_FAIL);
+		}
+		free(prompt);
+	}
+
+	n_clients = n_sessions;
+	samples = mmap(NULL, (n_replay_samples + 1) * sizeof(*samples),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	clients = mmap(NULL, n_sessions * sizeof(*clients),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if ((samples == MAP_FAILED) || (clients == MAP_FAILED)) {
+		DPRINTF(HGD_D_ERROR, "Can't map sample table: %s", SERROR);
+		return (HGD_FAIL);
+	}
+
+	DPRINTF(HGD_D_INFO, "Replaying %d sessions at %gx", n_sessions,
+	    replay_speed);
+
+	/* fork each session when it is due, not all at once */
+	t0 = hgd_bench_now_usecs();
+	for (i = 0; i < n_sessions; i++) {
+		hgd_bench_replay_wait(t0, sessions[i].at, NULL);
+
+		pid = fork();
+		if (pid < 0) {
+			DPRINTF(HGD_D_ERROR, "Can't fork: %s", SERROR);
+			clients[i].failed = 1;
+		} else if (pid == 0)
+			hgd_bench_replay_session(i, t0); /* does not return */
+
+		while (waitpid(-1, &status, WNOHANG) > 0)
+			;
+	}
+
+	while (wait(&status) > 0)
+		;
+	secs = (double) (hgd_bench_now_usecs() - t0) / 1000000;
+
+	for (i = 0; i < n_sessions; i++) {
+		total += clients[i].n_done;
+		failed += clients[i].failed;
+		skipped += clients[i].skipped;
+		if (clients[i].max_lag > lag)
+			lag = clients[i].max_lag;
+	}
+
+	printf("\n  replayed %d sessions from '%s' at %gx in %.3fs\n",
+	    n_sessions, replay_path, replay_speed, secs);
+	if (failed)
+		printf("  %d sessions failed to connect\n", failed);
+	if (skipped)
+		printf("  %d watch commands skipped\n", skipped);
+	printf("  %d ops: %.1f ops/s, up to %.1fms behind schedule\n\n",
+	    total, secs > 0 ? total / secs : 0, (double) lag / 1000);
+
+	hgd_bench_report_cmds(replay_names, n_replay_names,
+	    n_replay_samples, secs);
+
+	return (HGD_OK);
+}
+
+void
+hgd_usage(void)
+{
+	printf("usage: hgd-bench <options>\n");
+	printf("    -A <factor>		With -R, replay this many times faster "
+	    "(default: 1)\n");
+	printf("    -e			Use SSL encryption\n");
+	printf("    -h			Show this message and exit\n");
+	printf("    -k <percent>	With -P, percentage of tracks to skip "
+	    "(default: %d)\n", HGD_BENCH_DFL_SKIP);
+	printf("    -m <mix>		Command mix (default: '%s')\n",
+	    HGD_BENCH_DFL_MIX);
+	printf("    -N <num>		Number of concurrent clients "
+	    "(default: %d)\n", HGD_BENCH_DFL_CLIENTS);
+	printf("    -n <num>		Commands per client (default: %d)\n",
+	    HGD_BENCH_DFL_OPS);
+	printf("    -P <tracks>		Benchmark hgd-playd with this many "
+	    "tracks\n");
+	printf("    -p <port>		Set connection port\n");
+	printf("    -R <path>		Replay a capture from 'hgd-netd -C'\n");
+	printf("    -S <kbytes>		Size of uploads (default: %d)\n",
+	    HGD_BENCH_DFL_PAYLOAD);
+	printf("    -s <host/ip>	Set connection address\n");
+	printf("    -u <username>	Set username\n");
+	printf("    -v			Show version and exit\n");
+	printf("    -x <level>		Set debug level (0-3)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	char			*prompt, *mix_spec = HGD_BENCH_DFL_MIX;
+	int			 ch, i, pid, status;
+	uint64_t		 start;
+
+	/* before anything which might log or fail */
+	hgd_component = HGD_COMPONENT_HGD_BENCH;
+	hgd_exit_cb = hgd_exit_nicely;
+
+	/* open syslog as soon as possible */
+	HGD_INIT_SYSLOG();
+	hgd_ctx_init(&main_ctx);
+
+	host = xstrdup(HGD_DFL_HOST);
+	user = getenv("USER");
+
+	while ((ch = getopt(argc, argv, "A:ehk:m:N:n:P:p:R:S:s:u:vx:")) != -1) {
+		switch (ch) {
+		case 'A':
+			replay_speed = atof(optarg);
+			break;
+		case 'e':
+			crypto_pref = HGD_CRYPTO_PREF_ALWAYS;
+			break;
+		case 'k':
+			skip_pct = atoi(optarg);
+			break;
+		case 'm':
+			mix_spec = optarg;
+			break;
+		case 'N':
+			n_clients = atoi(optarg);
+			break;
+		case 'n':
+			n_ops = atoi(optarg);
+			break;
+		case 'P':
+			n_tracks = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'S':
+			/* 0 is refused below */
+			i = atoi(optarg);
+			payload_sz = (i > 0) ? (size_t) i * 1024 : 0;
+			break;
+		case 's':
+			free(host);
+			host = xstrdup(optarg);
+			break;
+		case 'u':
+			user = optarg;
+			break;
+		case 'v':
+			hgd_print_version();
+			exit_ok = 1;
+			hgd_exit_nicely();
+			break;
+		case 'x':
+			hgd_debug = atoi(optarg);
+			if (hgd_debug > 3)
+				hgd_debug = 3;
+			break;
+		case 'h':
+		default:
+			hgd_usage();
+			exit_ok = 1;
+			hgd_exit_nicely();
+			break;
+		};
+	}
+
+	if ((n_clients < 1) || (n_ops < 1) || (payload_sz == 0) ||
+	    (replay_speed <= 0) || (hgd_bench_parse_mix(mix_spec) != HGD_OK)) {
+		hgd_usage();
+		hgd_exit_nicely();
+	}
+
+	/* sessions encrypt if and when they did in the capture */
+	if (replay_path != NULL) {
+		crypto_pref = HGD_CRYPTO_PREF_NEVER;
+		if (hgd_bench_replay() == HGD_OK)
+			exit_ok = 1;
+		memset(password, 0, sizeof(password));
+		hgd_exit_nicely();
+	}
+
+	if ((n_tracks > 0) || mix[HGD_BENCH_VO] || mix[HGD_BENCH_Q]) {
+		if (user == NULL) {
+			DPRINTF(HGD_D_ERROR, "can't get username");
+			hgd_exit_nicely();
+		}
+
+		xasprintf(&prompt, "Password for %s@%s: ", user, host);
+		if (readpassphrase(prompt, password, sizeof(password),
+		    RPP_ECHO_OFF | RPP_REQUIRE_TTY) == NULL) {
+			DPRINTF(HGD_D_ERROR, "Problem reading password");
+			free(prompt);
+			hgd_exit_nicely();
+		}
+		free(prompt);
+	}
+
+	if (n_tracks > 0) {
+		if (hgd_bench_playd() == HGD_OK)
+			exit_ok = 1;
+		memset(password, 0, sizeof(password));
+		hgd_exit_nicely();
+	}
+
+	/* results are written straight into shared memory by the clients */
+	samples = mmap(NULL, n_clients * n_ops * sizeof(*samples),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	clients = mmap(NULL, n_clients * sizeof(*clients),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if ((samples == MAP_FAILED) || (clients == MAP_FAILED)) {
+		DPRINTF(HGD_D_ERROR, "Can't map sample table: %s", SERROR);
+		hgd_exit_nicely();
+	}
+
+	DPRINTF(HGD_D_INFO, "Starting %d clients", n_clients);
+	start = hgd_bench_now_usecs();
+	for (i = 0; i < n_clients; i++) {
+		pid = fork();
+		if (pid < 0) {
+			DPRINTF(HGD_D_ERROR, "Can't fork: %s", SERROR);
+			clients[i].failed = 1;
+		} else if (pid == 0)
+			hgd_bench_client(i);	/* does not return */
+	}
+
+	while (wait(&status) > 0)
+		;
+
+	hgd_bench_report(hgd_bench_now_usecs() - start);
+	memset(password, 0, sizeof(password));
+
+	exit_ok = 1;
+	hgd_exit_nicely();
+	_exit (EXIT_SUCCESS); /* NOREACH */
+}
@@ -0,0 +1,798 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Martin Ellis <ellism88@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * hgd-db-bench: time the db.c entry points against a synthetic database.
+ *
+ * Builds a fresh hgd.db with the requested number of users, queued tracks,
+ * finished (history) tracks and votes, then calls each db.c function in
+ * turn and reports latency percentiles. This is done twice: once with the
+ * database to ourselves, then again while forked writer processes hammer
+ * it (as hgd-netd children and hgd-playd would), so lock contention shows.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "hgd.h"
+#include "db.h"
+#include "stats.h"
+#include "user.h"
+
+#define HGD_DBB_DFL_USERS	100
+#define HGD_DBB_DFL_QUEUED	50
+#define HGD_DBB_DFL_HISTORY	1000
+#define HGD_DBB_DFL_VOTES	10
+#define HGD_DBB_DFL_ITERS	200
+#define HGD_DBB_DFL_WRITERS	4
+#define HGD_DBB_DFL_PAUSE	5	/* msecs between writer rounds */
+#define HGD_DBB_PASS		"bench"
+#define HGD_DBB_USER_SZ		32
+#define HGD_DBB_DIR_TEMPLATE	"/tmp/hgd-db-bench.XXXXXXXX"
+
+struct hgd_dbb_op {
+	char			*name;
+	int			(*func)(void);
+	uint8_t			 once;		/* only run once per phase */
+};
+
+int				 n_users = HGD_DBB_DFL_USERS;
+int				 n_queued = HGD_DBB_DFL_QUEUED;
+int				 n_history = HGD_DBB_DFL_HISTORY;
+int				 n_votes = HGD_DBB_DFL_VOTES;
+int				 n_iters = HGD_DBB_DFL_ITERS;
+int				 n_writers = HGD_DBB_DFL_WRITERS;
+int				 writer_pause = HGD_DBB_DFL_PAUSE;
+uint8_t				 keep_db = 0;
+uint8_t				 made_dir = 0;
+struct hgd_ctx			 main_ctx;
+
+/* the track the last insert_track op queued */
+int				 last_track_id = -1;
+
+/* shared with the writer processes */
+volatile uint8_t		*writers_stop = NULL;
+uint64_t			*writer_ops = NULL;
+
+void
+hgd_exit_nicely()
+{
+	char			*stats_path;
+
+	if (!exit_ok)
+		DPRINTF(HGD_D_ERROR,
+		    "hgd-db-bench was interrupted or crashed - cleaning up");
+
+	hgd_close_db(&main_ctx);
+	hgd_stats_close();
+
+	if ((made_dir) && (!keep_db)) {
+		if (db_path != NULL)
+			unlink(db_path);
+		xasprintf(&stats_path, "%s/%s", state_path, HGD_STATS_FILE);
+		unlink(stats_path);
+		free(stats_path);
+		if (rmdir(state_path) < 0)
+			DPRINTF(HGD_D_WARN, "Can't remove '%s': %s",
+			    state_path, SERROR);
+	} else if (db_path != NULL)
+		printf("  database left in '%s'\n", db_path);
+
+	free(state_path);
+	free(db_path);
+	free(filestore_path);
+
+	HGD_CLOSE_SYSLOG();
+	exit (!exit_ok);
+}
+
+uint64_t
+hgd_dbb_now_usecs(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* a random user from the ones we made */
+void
+hgd_dbb_rand_user(char *buf, size_t sz)
+{
+	snprintf(buf, sz, "bench%d", rand() % n_users);
+}
+
+int
+hgd_dbb_add_track(char *user, int n)
+{
+	struct hgd_media_tag	 tags;
+	char			 filename[PATH_MAX];
+	char			 artist[32], title[32];
+
+	snprintf(filename, sizeof(filename), "bench-%d.mp3", n);
+	snprintf(artist, sizeof(artist), "Artist %d", n % 97);
+	snprintf(title, sizeof(title), "Title %d", n);
+
+	memset(&tags, 0, sizeof(tags));
+	tags.artist = artist;
+	tags.title = title;
+	tags.album = "Benchmarks";
+	tags.genre = "Noise";
+	tags.duration = 180;
+	tags.bitrate = 128;
+	tags.samplerate = 44100;
+	tags.channels = 2;
+	tags.year = 2011;
+
+	if (hgd_insert_track(&main_ctx, filename, &tags, user, -1) != HGD_OK)
+		return (HGD_FAIL);
+
+	return ((int) sqlite3_last_insert_rowid(main_ctx.db));
+}
+
+int
+hgd_dbb_add_votes(void)
+{
+	char			 user[HGD_DBB_USER_SZ];
+	int			 i;
+
+	for (i = 0; i < n_votes; i++) {
+		snprintf(user, sizeof(user), "bench%d", i);
+		if (hgd_insert_vote(&main_ctx, user) == HGD_FAIL)
+			return (HGD_FAIL);
+	}
+
+	return (HGD_OK);
+}
+
+/* fill a fresh database, all in one transaction so it doesn't take ages */
+int
+hgd_dbb_populate(void)
+{
+	char			 user[HGD_DBB_USER_SZ], pass[16];
+	int			 i, id, ret = HGD_FAIL;
+	uint64_t		 start = hgd_dbb_now_usecs();
+
+	if (sqlite3_exec(main_ctx.db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+		DPRINTF(HGD_D_ERROR, "Can't begin transaction: %s",
+		    sqlite3_errmsg(main_ctx.db));
+		return (HGD_FAIL);
+	}
+
+	for (i = 0; i < n_users; i++) {
+		snprintf(user, sizeof(user), "bench%d", i);
+		snprintf(pass, sizeof(pass), HGD_DBB_PASS); /* gets zeroed */
+		if (hgd_user_add(&main_ctx, user, pass) != HGD_OK)
+			goto clean;
+	}
+
+	for (i = 0; i < n_history; i++) {
+		hgd_dbb_rand_user(user, sizeof(user));
+		if ((id = hgd_dbb_add_track(user, i)) == HGD_FAIL)
+			goto clean;
+		if (hgd_mark_finished(&main_ctx, id, 0) != HGD_OK)
+			goto clean;
+	}
+
+	for (i = 0; i < n_queued; i++) {
+		hgd_dbb_rand_user(user, sizeof(user));
+		if ((id = hgd_dbb_add_track(user, n_history + i)) == HGD_FAIL)
+			goto clean;
+		/* so that there is something playing */
+		if ((i == 0) && (hgd_mark_playing(&main_ctx, id) != HGD_OK))
+			goto clean;
+	}
+
+	if (hgd_dbb_add_votes() != HGD_OK)
+		goto clean;
+
+	ret = HGD_OK;
+clean:
+	if (sqlite3_exec(main_ctx.db, ret == HGD_OK ? "COMMIT" : "ROLLBACK",
+	    NULL, NULL, NULL) != SQLITE_OK) {
+		DPRINTF(HGD_D_ERROR, "Can't end transaction: %s",
+		    sqlite3_errmsg(main_ctx.db));
+		ret = HGD_FAIL;
+	}
+
+	if (ret == HGD_OK)
+		printf("  populated %d users, %d queued, %d history, "
+		    "%d votes in %.3fs\n", n_users, n_queued, n_history,
+		    n_votes, (hgd_dbb_now_usecs() - start) / 1000000.0);
+
+	return (ret);
+}
+
+/*
+ * Wrappers around each db.c entry point. Each should leave the database
+ * as it found it, more or less, so that later iterations see the same
+ * amount of data.
+ */
+int
+hgd_dbb_get_playlist(void)
+{
+	struct hgd_playlist	 list;
+	int			 ret;
+
+	memset(&list, 0, sizeof(list));
+	ret = hgd_get_playlist(&main_ctx, &list);
+	hgd_free_playlist(&list);
+
+	return (ret);
+}
+
+int
+hgd_dbb_get_next_track(void)
+{
+	struct hgd_playlist_item track;
+	int			 ret;
+
+	memset(&track, 0, sizeof(track));
+	ret = hgd_get_next_track(&main_ctx, &track);
+	hgd_free_playlist_item(&track);
+
+	return (ret);
+}
+
+int
+hgd_dbb_get_playing_item(void)
+{
+	struct hgd_playlist_item playing;
+	int			 ret;
+
+	memset(&playing, 0, sizeof(playing));
+	ret = hgd_get_playing_item(&main_ctx, &playing);
+	hgd_free_playlist_item(&playing);
+
+	return (ret);
+}
+
+int
+hgd_dbb_get_num_votes(void)
+{
+	int			 nv;
+
+	return (hgd_get_num_votes(&main_ctx, &nv));
+}
+
+int
+hgd_dbb_user_has_voted(void)
+{
+	char			 user[HGD_DBB_USER_SZ];
+	int			 v;
+
+	hgd_dbb_rand_user(user, sizeof(user));
+	return (hgd_user_has_voted(&main_ctx, user, &v));
+}
+
+int
+hgd_dbb_authenticate_user(void)
+{
+	char			 user[HGD_DBB_USER_SZ], pass[16];
+	struct hgd_user		*u;
+
+	hgd_dbb_rand_user(user, sizeof(user));
+	snprintf(pass, sizeof(pass), HGD_DBB_PASS);
+
+	if ((u = hgd_authenticate_user(&main_ctx, user, pass)) == NULL)
+		return (HGD_FAIL);
+
+	hgd_free_user(u);
+	free(u);
+
+	return (HGD_OK);
+}
+
+int
+hgd_dbb_num_tracks_user(void)
+{
+	char			 user[HGD_DBB_USER_SZ];
+
+	hgd_dbb_rand_user(user, sizeof(user));
+	return (hgd_num_tracks_user(&main_ctx, user) < 0 ? HGD_FAIL : HGD_OK);
+}
+
+int
+hgd_dbb_get_all_users(void)
+{
+	struct hgd_user_list	*list;
+
+	if ((list = hgd_get_all_users(&main_ctx)) == NULL)
+		return (HGD_FAIL);
+
+	hgd_free_user_list(list);
+	free(list);
+
+	return (HGD_OK);
+}
+
+int
+hgd_dbb_get_user(void)
+{
+	char			 user[HGD_DBB_USER_SZ];
+	struct hgd_user		 u;
+	int			 ret;
+
+	hgd_dbb_rand_user(user, sizeof(user));
+	memset(&u, 0, sizeof(u));
+	ret = hgd_get_user(&main_ctx, user, &u);
+	hgd_free_user(&u);
+
+	return (ret);
+}
+
+int
+hgd_dbb_get_data_version(void)
+{
+	int			 version;
+
+	return (hgd_get_data_version(&main_ctx, &version));
+}
+
+int
+hgd_dbb_get_playlist_gen(void)
+{
+	uint64_t		 gen;
+
+	return (hgd_get_playlist_gen(&main_ctx, &gen));
+}
+
+int
+hgd_dbb_get_playlist_ids(void)
+{
+	int			*ids = NULL, n_ids, playing_id;
+	int			 ret;
+
+	ret = hgd_get_playlist_ids(&main_ctx, &ids, &n_ids, &playing_id);
+	free(ids);
+
+	return (ret);
+}
+
+int
+hgd_dbb_insert_track(void)
+{
+	char			 user[HGD_DBB_USER_SZ];
+
+	hgd_dbb_rand_user(user, sizeof(user));
+	last_track_id = hgd_dbb_add_track(user, rand());
+
+	return (last_track_id == HGD_FAIL ? HGD_FAIL : HGD_OK);
+}
+
+int
+hgd_dbb_mark_playing(void)
+{
+	if (last_track_id < 0)
+		return (HGD_FAIL);
+
+	return (hgd_mark_playing(&main_ctx, last_track_id));
+}
+
+/* the track we queued becomes history, so the queue stays the same size */
+int
+hgd_dbb_mark_finished(void)
+{
+	if (last_track_id < 0)
+		return (HGD_FAIL);
+
+	return (hgd_mark_finished(&main_ctx, last_track_id, 0));
+}
+
+int
+hgd_dbb_insert_vote(void)
+{
+	char			 user[HGD_DBB_USER_SZ];
+	int			 ret;
+
+	hgd_dbb_rand_user(user, sizeof(user));
+	ret = hgd_insert_vote(&main_ctx, user);
+
+	return (ret == HGD_FAIL_DUPVOTE ? HGD_OK : ret);
+}
+
+int
+hgd_dbb_mod_perms(void)
+{
+	struct hgd_user		 u;
+	char			 user[HGD_DBB_USER_SZ];
+
+	hgd_dbb_rand_user(user, sizeof(user));
+	u.name = user;
+	u.perms = HGD_AUTH_NONE;
+
+	return (hgd_user_mod_perms_db(&main_ctx, &u));
+}
+
+int
+hgd_dbb_user_add_db(void)
+{
+	return (hgd_user_add_db(&main_ctx, "bench-tmp", "salt", "hash"));
+}
+
+int
+hgd_dbb_user_del_db(void)
+{
+	return (hgd_user_del_db(&main_ctx, "bench-tmp"));
+}
+
+int
+hgd_dbb_init_playstate(void)
+{
+	return (hgd_init_playstate(&main_ctx));
+}
+
+/* votes are put back afterwards */
+int
+hgd_dbb_clear_votes(void)
+{
+	return (hgd_clear_votes(&main_ctx));
+}
+
+/* run in this order, each iteration */
+struct hgd_dbb_op		 ops[] = {
+	{ "get_playlist",	hgd_dbb_get_playlist,		0 },
+	{ "get_next_track",	hgd_dbb_get_next_track,		0 },
+	{ "get_playing_item",	hgd_dbb_get_playing_item,	0 },
+	{ "get_num_votes",	hgd_dbb_get_num_votes,		0 },
+	{ "user_has_voted",	hgd_dbb_user_has_voted,		0 },
+	{ "authenticate_user",	hgd_dbb_authenticate_user,	0 },
+	{ "num_tracks_user",	hgd_dbb_num_tracks_user,	0 },
+	{ "get_all_users",	hgd_dbb_get_all_users,		0 },
+	{ "get_user",		hgd_dbb_get_user,		0 },
+	{ "get_data_version",	hgd_dbb_get_data_version,	0 },
+	{ "get_playlist_gen",	hgd_dbb_get_playlist_gen,	0 },
+	{ "get_playlist_ids",	hgd_dbb_get_playlist_ids,	0 },
+	{ "insert_track",	hgd_dbb_insert_track,		0 },
+	{ "mark_playing",	hgd_dbb_mark_playing,		0 },
+	{ "mark_finished",	hgd_dbb_mark_finished,		0 },
+	{ "insert_vote",	hgd_dbb_insert_vote,		0 },
+	{ "user_mod_perms_db",	hgd_dbb_mod_perms,		0 },
+	{ "user_add_db",	hgd_dbb_user_add_db,		0 },
+	{ "user_del_db",	hgd_dbb_user_del_db,		0 },
+	{ "init_playstate",	hgd_dbb_init_playstate,		0 },
+	{ "clear_votes",	hgd_dbb_clear_votes,		1 },
+	{ NULL,			NULL,				0 }
+};
+
+/*
+ * A writer: what a busy server does to the database, as fast as it can.
+ * Has its own connection, like a hgd-netd child.
+ */
+void
+hgd_dbb_writer(int which)
+{
+	char			 user[HGD_DBB_USER_SZ];
+	int			 id;
+
+	/* never use the parent's connection after fork */
+	hgd_ctx_init(&main_ctx);
+	srand(getpid());
+
+	/* we expect to be told the database is locked, a lot */
+	if (hgd_debug < HGD_D_INFO)
+		hgd_debug = HGD_D_ERROR;
+
+	if (hgd_open_db(&main_ctx, db_path, 0) != HGD_OK)
+		_exit (EXIT_FAILURE);
+
+	while (!*writers_stop) {
+		hgd_dbb_rand_user(user, sizeof(user));
+		if ((id = hgd_dbb_add_track(user, rand())) != HGD_FAIL) {
+			hgd_mark_playing(&main_ctx, id);
+			hgd_mark_finished(&main_ctx, id, 0);
+		}
+		hgd_insert_vote(&main_ctx, user);
+		writer_ops[which]++;
+
+		if (writer_pause > 0)
+			usleep(writer_pause * 1000);
+	}
+
+	hgd_close_db(&main_ctx);
+	_exit (EXIT_SUCCESS);
+}
+
+int
+hgd_dbb_cmp_u32(const void *a, const void *b)
+{
+	uint32_t		x = *(const uint32_t *) a;
+	uint32_t		y = *(const uint32_t *) b;
+
+	return ((x > y) - (x < y));
+}
+
+/* value at the given fraction of a sorted array */
+uint32_t
+hgd_dbb_percentile(uint32_t *sorted, int n, double frac)
+{
+	int			i = (int) (frac * n);
+
+	if (i >= n)
+		i = n - 1;
+
+	return (sorted[i]);
+}
+
+void
+hgd_dbb_report_op(char *name, uint32_t *lat, int n, int n_err)
+{
+	uint64_t		 sum = 0;
+	int			 i;
+
+	if (n == 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		sum += lat[i];
+
+	qsort(lat, n, sizeof(uint32_t), hgd_dbb_cmp_u32);
+	printf("    %-18s %6d %6d %10.1f %10u %10u %10u\n", name, n, n_err,
+	    (double) sum / n, hgd_dbb_percentile(lat, n, 0.50),
+	    hgd_dbb_percentile(lat, n, 0.99), lat[n - 1]);
+}
+
+/* time every op n_iters times, with 'writers' writer processes running */
+int
+hgd_dbb_phase(int writers)
+{
+	uint32_t		**lat;
+	int			 *n_err, i, op, n_ops, pid, status;
+	uint64_t		 t, start, busy_before = 0, total_writes = 0;
+	double			 secs;
+
+	for (n_ops = 0; ops[n_ops].name != NULL; n_ops++)
+		;
+
+	lat = xcalloc(n_ops, sizeof(uint32_t *));
+	n_err = xcalloc(n_ops, sizeof(int));
+	for (op = 0; op < n_ops; op++)
+		lat[op] = xcalloc(n_iters, sizeof(uint32_t));
+
+	*writers_stop = 0;
+	memset(writer_ops, 0, n_writers * sizeof(uint64_t));
+	for (i = 0; i < writers; i++) {
+		pid = fork();
+		if (pid < 0) {
+			DPRINTF(HGD_D_ERROR, "Can't fork: %s", SERROR);
+			writers = i;
+			break;
+		} else if (pid == 0)
+			hgd_dbb_writer(i);	/* does not return */
+	}
+
+	if (hgd_stats)
+		busy_before = hgd_stats->db_busy_retries;
+
+	start = hgd_dbb_now_usecs();
+	for (i = 0; i < n_iters; i++) {
+		for (op = 0; op < n_ops; op++) {
+			if (ops[op].once)
+				continue;
+			t = hgd_dbb_now_usecs();
+			if (ops[op].func() != HGD_OK)
+				n_err[op]++;
+			lat[op][i] = hgd_dbb_now_usecs() - t;
+		}
+	}
+
+	for (op = 0; op < n_ops; op++) {
+		if (!ops[op].once)
+			continue;
+		t = hgd_dbb_now_usecs();
+		if (ops[op].func() != HGD_OK)
+			n_err[op]++;
+		lat[op][0] = hgd_dbb_now_usecs() - t;
+	}
+	secs = (hgd_dbb_now_usecs() - start) / 1000000.0;
+
+	*writers_stop = 1;
+	while (wait(&status) > 0)
+		;
+
+	for (i = 0; i < writers; i++)
+		total_writes += writer_ops[i];
+
+	if (writers == 0)
+		printf("\n  single reader, %d iterations in %.3fs\n",
+		    n_iters, secs);
+	else
+		printf("\n  %d concurrent writers (%dms pause), %d iterations "
+		    "in %.3fs, writers did %llu rounds (%.1f/s)\n", writers,
+		    writer_pause, n_iters, secs, (unsigned long long) total_writes,
+		    secs > 0 ? total_writes / secs : 0);
+	if (hgd_stats)
+		printf("  busy retries (all processes): %llu\n", (unsigned long long)
+		    (hgd_stats->db_busy_retries - busy_before));
+	printf("\n    %-18s %6s %6s %10s %10s %10s %10s\n", "function", "calls",
+	    "errors", "avg (us)", "p50 (us)", "p99 (us)", "max (us)");
+
+	for (op = 0; op < n_ops; op++)
+		hgd_dbb_report_op(ops[op].name, lat[op],
+		    ops[op].once ? 1 : n_iters, n_err[op]);
+
+	for (op = 0; op < n_ops; op++)
+		free(lat[op]);
+	free(lat);
+	free(n_err);
+
+	/* put back what clear_votes took */
+	return (hgd_dbb_add_votes());
+}
+
+void
+hgd_usage(void)
+{
+	printf("usage: hgd-db-bench <options>\n");
+	printf("    -d <path>		Set state directory "
+	    "(default: a new temporary one)\n");
+	printf("    -H <num>		Finished tracks in the history "
+	    "(default: %d)\n", HGD_DBB_DFL_HISTORY);
+	printf("    -h			Show this message and exit\n");
+	printf("    -k			Keep the database afterwards\n");
+	printf("    -i <msecs>		Writer pause between rounds "
+	    "(default: %d)\n", HGD_DBB_DFL_PAUSE);
+	printf("    -n <num>		Iterations per phase (default: %d)\n",
+	    HGD_DBB_DFL_ITERS);
+	printf("    -T <num>		Queued tracks (default: %d)\n",
+	    HGD_DBB_DFL_QUEUED);
+	printf("    -U <num>		Users (default: %d)\n",
+	    HGD_DBB_DFL_USERS);
+	printf("    -V <num>		Votes (default: %d)\n",
+	    HGD_DBB_DFL_VOTES);
+	printf("    -v			Show version and exit\n");
+	printf("    -w <num>		Concurrent writers in the second "
+	    "phase (default: %d)\n", HGD_DBB_DFL_WRITERS);
+	printf("    -x <level>		Set debug level (0-3)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	char			 template[] = HGD_DBB_DIR_TEMPLATE;
+	int			 ch;
+	struct stat		 st;
+
+	/* before anything which might log or fail */
+	hgd_component = HGD_COMPONENT_HGD_DB_BENCH;
+	hgd_exit_cb = hgd_exit_nicely;
+
+	/* open syslog as soon as possible */
+	HGD_INIT_SYSLOG();
+	hgd_ctx_init(&main_ctx);
+
+	while ((ch = getopt(argc, argv, "d:H:hi:kn:T:U:V:vw:x:")) != -1) {
+		switch (ch) {
+		case 'd':
+			free(state_path);
+			state_path = xstrdup(optarg);
+			break;
+		case 'H':
+			n_history = atoi(optarg);
+			break;
+		case 'i':
+			writer_pause = atoi(optarg);
+			break;
+		case 'k':
+			keep_db = 1;
+			break;
+		case 'n':
+			n_iters = atoi(optarg);
+			break;
+		case 'T':
+			n_queued = atoi(optarg);
+			break;
+		case 'U':
+			n_users = atoi(optarg);
+			break;
+		case 'V':
+			n_votes = atoi(optarg);
+			break;
+		case 'v':
+			hgd_print_version();
+			exit_ok = 1;
+			hgd_exit_nicely();
+			break;
+		case 'w':
+			n_writers = atoi(optarg);
+			break;
+		case 'x':
+			hgd_debug = atoi(optarg);
+			if (hgd_debug > 3)
+				hgd_debug = 3;
+			break;
+		case 'h':
+		default:
+			hgd_usage();
+			exit_ok = 1;
+			hgd_exit_nicely();
+			break;
+		};
+	}
+
+	if ((n_users < 1) || (n_queued < 0) || (n_history < 0) ||
+	    (n_votes < 0) || (n_iters < 1) || (n_writers < 0)) {
+		hgd_usage();
+		hgd_exit_nicely();
+	}
+	if (n_votes > n_users)
+		n_votes = n_users;	/* one each */
+
+	if (state_path == NULL) {
+		if (mkdtemp(template) == NULL) {
+			DPRINTF(HGD_D_ERROR, "Can't make temp dir: %s", SERROR);
+			hgd_exit_nicely();
+		}
+		state_path = xstrdup(template);
+		made_dir = 1;
+	}
+
+	xasprintf(&db_path, "%s/%s", state_path, HGD_DB_NAME);
+	xasprintf(&filestore_path, "%s/%s", state_path, HGD_FILESTORE_NAME);
+
+	if (stat(db_path, &st) == 0) {
+		DPRINTF(HGD_D_ERROR, "'%s' already exists, won't clobber it",
+		    db_path);
+		free(db_path);
+		db_path = NULL;
+		hgd_exit_nicely();
+	}
+
+	if ((hgd_make_new_db(db_path) != HGD_OK) ||
+	    (hgd_open_db(&main_ctx, db_path, 0) != HGD_OK))
+		hgd_exit_nicely();
+
+	srand(getpid());
+	if (hgd_dbb_populate() != HGD_OK)
+		hgd_exit_nicely();
+
+	/* after populating, else every insert would recount the playlist */
+	hgd_stats_open(1);
+
+	writers_stop = mmap(NULL, sizeof(*writers_stop),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	writer_ops = mmap(NULL, (n_writers + 1) * sizeof(*writer_ops),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if ((writers_stop == MAP_FAILED) || (writer_ops == MAP_FAILED)) {
+		DPRINTF(HGD_D_ERROR, "Can't map writer table: %s", SERROR);
+		hgd_exit_nicely();
+	}
+
+	if (hgd_dbb_phase(0) != HGD_OK)
+		hgd_exit_nicely();
+
+	if ((n_writers > 0) && (hgd_dbb_phase(n_writers) != HGD_OK))
+		hgd_exit_nicely();
+	printf("\n");
+
+	exit_ok = 1;
+	hgd_exit_nicely();
+	_exit (EXIT_SUCCESS); /* NOREACH */
+}
@@ -33,9 +33,6 @@
 #include "py.h"
 #include "hgd.h"
 
-/* must be outside HAVE_PYTHON */
-const char			*hgd_component = HGD_COMPONENT_HGD_MK_PYDOC;
-
 /*
  * clean up, exit. if exit_ok = 0, an error (signal/error)
  */
@@ -116,6 +113,10 @@ main(int argc, char **argv)
 {
 	int			ch;
 
+	/* before anything which might log or fail */
+	hgd_component = HGD_COMPONENT_HGD_MK_PYDOC;
+	hgd_exit_cb = hgd_exit_nicely;
+
 	/* open syslog as early as possible */
 	HGD_INIT_SYSLOG();
 
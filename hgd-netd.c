@@ -15,12 +15,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "config.h"
@@ -36,12 +39,16 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef HAVE_LIBCONFIG
@@ -52,20 +59,36 @@
 #include "hgd.h"
 #include "mplayer.h"
 #include "net.h"
+#include "stats.h"
 #include <openssl/ssl.h>
 #ifdef HAVE_TAGLIB
 #include <tag_c.h>
 #endif
 
-const char			*hgd_component = HGD_COMPONENT_HGD_NETD;
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+extern char			**environ;	/* for posix_spawnp() */
 
 int				port = HGD_DFL_PORT;
 int				sock_backlog = HGD_DFL_BACKLOG;
+int				max_sessions = -1;	/* -M, unset */
+int				conn_rate = HGD_DFL_CONN_RATE;
+int				conn_burst = HGD_DFL_CONN_BURST;
+volatile sig_atomic_t		n_sessions = 0;	/* not yet reaped */
+int				pool_size = 0;	/* -P, 0 forks per client */
+int				worker_sessions = HGD_DFL_WORKER_SESSIONS;
+int				worker_slot = -1;	/* ours, if a worker */
+struct hgd_worker		*workers = NULL;
+int				loop_threads = -1;	/* -t, 0 for per core */
+struct hgd_core			*cores = NULL;
+int				n_cores = 0;
 int				svr_fd = -1;
+int				metrics_fd = -1;
 int				flood_limit = HGD_MAX_USER_QUEUE;
 int				background = 1;
 long long int			max_upload_size = HGD_DFL_MAX_UPLOAD;
-uint8_t				num_bad_commands = 0;
 uint8_t				lookup_client_dns = 1;
 
 int				req_votes = HGD_DFL_REQ_VOTES;
@@ -73,9 +96,25 @@ uint8_t				single_client = 0;
 
 char				*vote_sound = NULL;
 
+/* -C: log what clients send, for 'hgd-bench -R' */
+char				*capture_path = NULL;
+int				 capture_fd = -1;
+
+int				 parse_bench_iters = 0;	/* -T */
+
+/* per client address connection allowances, shared with pool workers */
+struct hgd_conn_table		*conn_table = NULL;
+
 SSL_METHOD			*method = NULL;
 SSL_CTX				*ctx = NULL;
 
+/* our database handle and socket deadlines, see struct hgd_ctx */
+struct hgd_ctx			 main_ctx;
+
+/* -t: the one connection which the cores' threads make their writes on */
+struct hgd_ctx			 writer_ctx;
+pthread_mutex_t			 writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
 uint8_t				 crypto_pref = HGD_CRYPTO_PREF_IF_POSS;
 uint8_t				 ssl_capable = 0;
 char				*ssl_cert_path = NULL;
@@ -91,8 +130,12 @@ hgd_exit_nicely()
 	if (!exit_ok)
 		DPRINTF(HGD_D_ERROR, "hgd-netd was interrupted or crashed");
 
+	hgd_metrics_close(HGD_COMPONENT_HGD_NETD, metrics_fd);
+	hgd_stats_unregister(HGD_STATS_NETD);
+
 	if (svr_fd >= 0) {
-		if (shutdown(svr_fd, SHUT_RDWR) == -1)
+		/* a worker may share the socket with the others */
+		if ((worker_slot < 0) && (shutdown(svr_fd, SHUT_RDWR) == -1))
 			DPRINTF(HGD_D_WARN,
 			    "Can't shutdown socket: %s", SERROR);
 		close(svr_fd);
@@ -103,11 +146,15 @@ hgd_exit_nicely()
 		free(filestore_path);
 	if (state_path)
 		free(state_path);
-	if (db)
-		sqlite3_close(db);
+	hgd_close_db(&main_ctx);
+	hgd_cleanup_net(&main_ctx);
 
+	hgd_stats_close();
 	hgd_cleanup_ssl(&ctx);
 
+	if (capture_fd >= 0)
+		close(capture_fd);
+
 	if (restarting)
 		hgd_restart_myself();
 
@@ -195,9 +242,12 @@ hgd_get_tag_metadata(char *filename, struct hgd_media_tag *meta)
 	return (HGD_OK);
 }
 
-/* return some kind of host identifier, free when done */
+/*
+ * return some kind of host identifier, free when done. The name is only
+ * looked up if lookup is set, else it is the address.
+ */
 char *
-hgd_identify_client(struct sockaddr_in *cli_addr)
+hgd_identify_client(struct sockaddr_in *cli_addr, uint8_t lookup)
 {
 	char			cli_host[NI_MAXHOST];
 	char			cli_serv[NI_MAXSERV];
@@ -207,7 +257,7 @@ hgd_identify_client(struct sockaddr_in *cli_addr)
 	DPRINTF(HGD_D_DEBUG, "Servicing client");
 
 	/* first try to get a valid DNS name for the client */
-	if (lookup_client_dns) {
+	if (lookup) {
 		found_name = getnameinfo((struct sockaddr *) cli_addr,
 		    sizeof(struct sockaddr_in),
 		    cli_host, sizeof(cli_host), cli_serv,
@@ -239,6 +289,55 @@ found:
 	return (ret);
 }
 
+/*
+ * errors for commands which, in binary mode, always reply with a frame
+ */
+void
+hgd_reply_err(struct hgd_session *sess, char *err)
+{
+	if (sess->binary) {
+		hgd_outbuf_frame_begin(&sess->out, HGD_BIN_T_ERR);
+		hgd_outbuf_frame_str(&sess->out, err);
+		hgd_outbuf_frame_end(&sess->out);
+	} else
+		hgd_outbuf_line(&sess->out, "err|%s", err);
+}
+
+/*
+ * refuse a command before its handler sees it. Those whose replies are
+ * frames in binary mode get their error as one too, see hgd_reply_err().
+ */
+void
+hgd_reply_refusal(struct hgd_session *sess, char *cmd, char *err)
+{
+	if ((strcmp(cmd, "ls") == 0) || (strcmp(cmd, "pl") == 0) ||
+	    (strcmp(cmd, "np") == 0))
+		hgd_reply_err(sess, err);
+	else
+		hgd_outbuf_line(&sess->out, "err|%s", err);
+}
+
+/* a track in a binary reply, the same fields as an 'ls' line */
+void
+hgd_frame_track(struct hgd_outbuf *ob, struct hgd_playlist_item *it,
+    int votes_needed, int voted)
+{
+	hgd_outbuf_frame_int(ob, it->id);
+	hgd_outbuf_frame_str(ob, it->filename + strlen(HGD_UNIQ_FILE_PFX));
+	hgd_outbuf_frame_str(ob, it->tags.artist);
+	hgd_outbuf_frame_str(ob, it->tags.title);
+	hgd_outbuf_frame_str(ob, it->user);
+	hgd_outbuf_frame_str(ob, it->tags.album);
+	hgd_outbuf_frame_str(ob, it->tags.genre);
+	hgd_outbuf_frame_int(ob, it->tags.duration);
+	hgd_outbuf_frame_int(ob, it->tags.bitrate);
+	hgd_outbuf_frame_int(ob, it->tags.samplerate);
+	hgd_outbuf_frame_int(ob, it->tags.channels);
+	hgd_outbuf_frame_int(ob, it->tags.year);
+	hgd_outbuf_frame_int(ob, votes_needed);
+	hgd_outbuf_frame_int(ob, voted);
+}
+
 /*
  * respond to client what is currently playing.
  *
@@ -246,59 +345,67 @@ found:
  * ok|0				nothing playing
  * ok|1|id|filename|user	track is playing
  * err|...			failure
+ *
+ * or a HGD_BIN_T_NP frame in binary mode.
  */
 int
 hgd_cmd_now_playing(struct hgd_session *sess, char **args)
 {
 	struct hgd_playlist_item	 playing;
-	char				*reply;
 	int				 num_votes;
 	int				 voted;
 
 	(void) args; /* silence compiler */
 
 	memset(&playing, 0, sizeof(playing));
-	if (hgd_get_playing_item(&playing) == HGD_FAIL) {
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_INT);
+	if (hgd_get_playing_item(sess->ctx, &playing) == HGD_FAIL) {
+		hgd_reply_err(sess, HGD_RESP_E_INT);
 		hgd_free_playlist_item(&playing);
 		return (HGD_FAIL);
 	}
 
 	if (playing.filename == NULL) {
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok|0");
+		if (sess->binary) {
+			hgd_outbuf_frame_begin(&sess->out, HGD_BIN_T_NP);
+			hgd_outbuf_frame_int(&sess->out, 0);
+			hgd_outbuf_frame_end(&sess->out);
+		} else
+			hgd_outbuf_line(&sess->out, "ok|0");
 	} else {
-		if ((hgd_get_num_votes(&num_votes)) != HGD_OK) {
+		if ((hgd_get_num_votes(sess->ctx, &num_votes)) != HGD_OK) {
 			DPRINTF(HGD_D_ERROR, "can't get votes");
-			hgd_sock_send_line(sess->sock_fd, sess->ssl,
-			    "err|" HGD_RESP_E_INT);
+			hgd_reply_err(sess, HGD_RESP_E_INT);
 			return (HGD_FAIL);
 		}
 
 		if (sess->user != NULL) {
-			if (hgd_user_has_voted(
+			if (hgd_user_has_voted(sess->ctx,
 			    sess->user->name, &voted) != HGD_OK) {
 				DPRINTF(HGD_D_WARN, "cant decide if voted: %s",
 				    sess->user->name);
-				hgd_sock_send_line(sess->sock_fd, sess->ssl,
-				    "err|" HGD_RESP_E_INT);
+				hgd_reply_err(sess, HGD_RESP_E_INT);
 				return (HGD_FAIL);
 			}
 		} else
 			voted = -1;
 
-		xasprintf(&reply, "ok|1|%d|%s|%s|%s|%s|"
-		    "%s|%s|%d|%d|%d|%d|%d|%d|%d", /* added in 0.5 */
-		    playing.id, playing.filename + strlen(HGD_UNIQ_FILE_PFX),
-		    playing.tags.artist, playing.tags.title, playing.user,
-		    playing.tags.album, playing.tags.genre,
-		    playing.tags.duration, playing.tags.bitrate,
-		    playing.tags.samplerate, playing.tags.channels,
-		    playing.tags.year, (req_votes - num_votes),
-		    voted);
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, reply);
-
-		free(reply);
+		if (sess->binary) {
+			hgd_outbuf_frame_begin(&sess->out, HGD_BIN_T_NP);
+			hgd_outbuf_frame_int(&sess->out, 1);
+			hgd_frame_track(&sess->out, &playing,
+			    req_votes - num_votes, voted);
+			hgd_outbuf_frame_end(&sess->out);
+		} else
+			hgd_outbuf_line(&sess->out, "ok|1|%d|%s|%s|%s|%s|"
+			    "%s|%s|%d|%d|%d|%d|%d|%d|%d", /* added in 0.5 */
+			    playing.id,
+			    playing.filename + strlen(HGD_UNIQ_FILE_PFX),
+			    playing.tags.artist, playing.tags.title,
+			    playing.user, playing.tags.album,
+			    playing.tags.genre, playing.tags.duration,
+			    playing.tags.bitrate, playing.tags.samplerate,
+			    playing.tags.channels, playing.tags.year,
+			    (req_votes - num_votes), voted);
 	}
 
 	hgd_free_playlist_item(&playing);
@@ -320,10 +427,9 @@ hgd_cmd_user(struct hgd_session *sess, char **args)
 	    sess->cli_str, args[0]);
 
 	/* get salt */
-	info = hgd_authenticate_user(args[0], args[1]);
+	info = hgd_authenticate_user(sess->ctx, args[0], args[1]);
 	if (info == NULL) {
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_DENY);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_DENY);
 		return (HGD_FAIL);
 	}
 
@@ -331,11 +437,92 @@ hgd_cmd_user(struct hgd_session *sess, char **args)
 
 	/* only if successful do we assign the info struct */
 	sess->user = info;
-	hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+	hgd_outbuf_line(&sess->out, "ok");
 
 	return (HGD_OK);
 }
 
+/*
+ * an upload is over, ret says whether all of it arrived. If it did, queue
+ * the track, else throw away what did. Either way reply, and free up.
+ */
+int
+hgd_upload_end(struct hgd_session *sess, struct hgd_upload *up, int ret)
+{
+	struct hgd_media_tag	tags;
+
+	HGD_STATS_ADD(bytes_uploaded, up->got);
+	/* a failed upload still took time */
+	HGD_STATS_ADD(upload_usecs, hgd_stats_now_usecs() - up->start);
+
+	if (up->got != up->len)
+		ret = HGD_FAIL;
+
+	if (ret != HGD_OK) {
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
+
+		/* try to clean up a partial upload */
+		if (fsync(up->f) < 0)
+			DPRINTF(HGD_D_WARN,
+			    "can't sync partial file: %s", SERROR);
+
+		if (close(up->f) < 0)
+			DPRINTF(HGD_D_WARN,
+			    "can't close partial file: %s", SERROR);
+		up->f = -1;
+
+		if (unlink(up->path) < 0) {
+			DPRINTF(HGD_D_WARN,
+			    "can't unlink partial upload: '%s': %s",
+			    up->path, SERROR);
+		}
+
+		goto clean;
+	}
+
+	/*
+	 * get tag metadata
+	 * no error that there is no #ifdef HAVE_TAGLIB
+	 */
+	hgd_get_tag_metadata(up->path, &tags);
+
+	/*
+	 * insert track into db. The flood limit is checked again here, as
+	 * the same user may have been uploading over several connections.
+	 */
+	switch (hgd_insert_track(sess->ctx, basename(up->path),
+		    &tags, sess->user->name, flood_limit)) {
+	case HGD_OK:
+		break;
+	case HGD_FAIL_FLOOD:
+		DPRINTF(HGD_D_WARN,
+		    "User '%s' trigger flood protection", sess->user->name);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_FLOOD);
+		unlink(up->path); /* don't much care if this fails */
+		ret = HGD_FAIL;
+		break;
+	default:
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
+		ret = HGD_FAIL;
+		break;
+	}
+
+	hgd_free_media_tags(&tags);
+
+	if (ret == HGD_OK) {
+		hgd_outbuf_line(&sess->out, "ok");
+		DPRINTF(HGD_D_INFO, "Transfer of '%s' complete", up->name);
+	}
+clean:
+	if (up->f != -1)
+		close(up->f);
+	free(up->path);
+	free(up->name);
+	free(up);
+
+	return (ret);
+}
+
 /*
  * queue a track
  *
@@ -351,22 +538,19 @@ hgd_cmd_user(struct hgd_session *sess, char **args)
 int
 hgd_cmd_queue(struct hgd_session *sess, char **args)
 {
-	char			*filename_p = args[0], *payload = NULL;
+	char			*filename_p = args[0];
 	size_t			bytes = atoi(args[1]);
 	char			*unique_fn = NULL;
-	int			f = -1, ret = HGD_OK;
-	size_t			bytes_recvd = 0, to_write;
-	ssize_t			write_ret;
+	int			f = -1;
 	char			*filename;
-	struct hgd_media_tag	tags;
+	struct hgd_upload	*up;
 
 	if ((flood_limit >= 0) &&
-	    (hgd_num_tracks_user(sess->user->name) >= flood_limit)) {
+	    (hgd_num_tracks_user(sess->ctx, sess->user->name) >= flood_limit)) {
 
 		DPRINTF(HGD_D_WARN,
 		    "User '%s' trigger flood protection", sess->user->name);
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_FLOOD);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_FLOOD);
 
 		return (HGD_FAIL);
 	}
@@ -376,10 +560,8 @@ hgd_cmd_queue(struct hgd_session *sess, char **args)
 
 	if ((bytes == 0) || ((long long int) bytes > max_upload_size)) {
 		DPRINTF(HGD_D_WARN, "Incorrect file size");
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_FLSIZE);
-		ret = HGD_FAIL;
-		goto clean;
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_FLSIZE);
+		return (HGD_FAIL);
 	}
 
 	/* prepare to recieve the media file and stash away */
@@ -390,158 +572,260 @@ hgd_cmd_queue(struct hgd_session *sess, char **args)
 	if (f < 0) {
 		DPRINTF(HGD_D_ERROR, "mkstemp: %s: %s",
 		    filestore_path, SERROR);
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "err|" HGD_RESP_E_INT);
-		ret = HGD_FAIL;
-		goto clean;
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
+		free(unique_fn);
+		return (HGD_FAIL);
 	}
 
-	hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok|...");
+	/* the client waits for this before sending the payload */
+	hgd_outbuf_line(&sess->out, "ok|...");
+	if (hgd_outbuf_flush(sess->ctx,
+	    &sess->out, sess->sock_fd, sess->ssl) != HGD_OK) {
+		unlink(unique_fn); /* don't much care if this fails */
+		close(f);
+		free(unique_fn);
+		return (HGD_FAIL);
+	}
 
 	DPRINTF(HGD_D_INFO, "Recving %d byte payload '%s' from %s into %s",
 	    (int) bytes, filename, sess->user->name, unique_fn);
 
-	/* recieve bytes in small chunks so that we dont use moar RAM */
-	while (bytes_recvd != bytes) {
+	up = xcalloc(1, sizeof(*up));
+	up->f = f;
+	up->path = unique_fn;
+	up->name = xstrdup(filename);
+	up->len = bytes;
+	up->start = hgd_stats_now_usecs();
+
+	/* a core takes the payload as it comes, see hgd_core_upload() */
+	if (sess->evented) {
+		up->chunk_since = time(NULL);
+		sess->upload = up;
+		return (HGD_OK);
+	}
 
-		if (bytes - bytes_recvd < HGD_BINARY_RECV_SZ)
-			to_write = bytes - bytes_recvd;
-		else
-			to_write = HGD_BINARY_RECV_SZ;
+	/* recieve bytes in small chunks so that we dont use moar RAM */
+	return (hgd_upload_end(sess, up, hgd_sock_recv_file(sess->ctx,
+	    sess->sock_fd, sess->ssl, f, bytes, &up->got)));
+}
 
-		payload = NULL;
+/* take a fresh snapshot of the playlist for 'watch' */
+int
+hgd_watch_snapshot(struct hgd_ctx *ctx, struct hgd_watch *w)
+{
+	if (w->ids != NULL) {
+		free(w->ids);
+		w->ids = NULL;
+	}
 
-		DPRINTF(HGD_D_DEBUG, "Waiting for chunk of length %d bytes",
-		    (int) to_write);
+	/* version first, so that a change during the snapshot is not lost */
+	if (hgd_get_data_version(ctx, &w->data_version) != HGD_OK)
+		return (HGD_FAIL);
 
-		payload = hgd_sock_recv_bin(sess->sock_fd,
-		    sess->ssl, to_write);
+	if (hgd_get_playlist_ids(ctx, &w->ids, &w->n_ids,
+	    &w->playing_id) != HGD_OK)
+		return (HGD_FAIL);
 
-		if (payload == NULL) {
-			DPRINTF(HGD_D_ERROR, "failed to recv binary");
-			hgd_sock_send_line(sess->sock_fd,
-			    sess->ssl, "err|" HGD_RESP_E_INT);
+	if (hgd_get_num_votes(ctx, &w->num_votes) != HGD_OK)
+		return (HGD_FAIL);
 
-			/* try to clean up a partial upload */
-			if (fsync(f) < 0)
-				DPRINTF(HGD_D_WARN,
-				    "can't sync partial file: %s", SERROR);
+	return (HGD_OK);
+}
 
-			if (close(f) < 0)
-				DPRINTF(HGD_D_WARN,
-				    "can't close partial file: %s", SERROR);
-			f = -1;
+void
+hgd_watch_push_event(char ***evs, int *n_evs, char *ev)
+{
+	*evs = xrealloc(*evs, sizeof(char *) * (*n_evs + 1));
+	(*evs)[(*n_evs)++] = ev;
+}
 
-			if (unlink(unique_fn) < 0) {
-				DPRINTF(HGD_D_WARN,
-				    "can't unlink partial upload: '%s': %s",
-				    unique_fn, SERROR);
-			}
+/*
+ * work out what happened between two snapshots. Both id lists are in
+ * ascending order, so we can walk them together. Returns the number of
+ * events stored in evs, which the caller must free.
+ */
+int
+hgd_watch_diff(struct hgd_watch *old, struct hgd_watch *new, char ***evs)
+{
+	int			 o = 0, n = 0, n_evs = 0;
+	char			*ev;
+
+	*evs = NULL;
+
+	while ((o < old->n_ids) || (n < new->n_ids)) {
+		if ((n == new->n_ids) ||
+		    ((o < old->n_ids) && (old->ids[o] < new->ids[n]))) {
+			xasprintf(&ev, "finished|%d", old->ids[o++]);
+			hgd_watch_push_event(evs, &n_evs, ev);
+		} else if ((o == old->n_ids) || (new->ids[n] < old->ids[o])) {
+			xasprintf(&ev, "queued|%d", new->ids[n++]);
+			hgd_watch_push_event(evs, &n_evs, ev);
+		} else {
+			o++;
+			n++;
+		}
+	}
 
-			ret = HGD_FAIL;
-			goto clean;
+	if (new->playing_id != old->playing_id) {
+		if (new->playing_id != -1) {
+			xasprintf(&ev, "started|%d", new->playing_id);
+			hgd_watch_push_event(evs, &n_evs, ev);
 		}
-		write_ret = write(f, payload, to_write);
+	} else if ((new->playing_id != -1) &&
+	    (new->num_votes != old->num_votes)) {
+		xasprintf(&ev, "votes|%d|%d",
+		    new->playing_id, req_votes - new->num_votes);
+		hgd_watch_push_event(evs, &n_evs, ev);
+	}
 
-		if (write_ret < to_write) {
-			/*
-			 * We are not sure if this is possible.
-			 * It has not *yet* happened.
-			 */
-			DPRINTF(HGD_D_ERROR,
-			    "Short write: %d vs %d",
-			    (int) write_ret, (int) to_write);
-			ret = HGD_FAIL;
-			goto clean;
+	return (n_evs);
+}
 
-		} else if (write_ret < 0) {
-			DPRINTF(HGD_D_ERROR, "Failed to write %d bytes: %s",
-			    (int) to_write, SERROR);
-			hgd_sock_send_line(sess->sock_fd,
-			    sess->ssl, "err|" HGD_RESP_E_INT);
-			unlink(unique_fn); /* don't much care if this fails */
-			ret = HGD_FAIL;
-			goto clean;
-		}
+/*
+ * the playlist's data version is now 'version'. If that moved on since the
+ * session's snapshot, take another and work out what changed. Returns the
+ * number of events stored in evs, which the caller must free, or -1.
+ */
+int
+hgd_watch_check(struct hgd_session *sess, int version, char ***evs)
+{
+	struct hgd_watch	 now;
+	int			 n_evs;
+
+	*evs = NULL;
+	if (version == sess->watch->data_version)
+		return (0);
+
+	memset(&now, 0, sizeof(now));
+	if (hgd_watch_snapshot(sess->ctx, &now) != HGD_OK) {
+		if (now.ids)
+			free(now.ids);
+		return (-1);
+	}
+
+	n_evs = hgd_watch_diff(sess->watch, &now, evs);
+
+	free(sess->watch->ids);
+	*sess->watch = now;
+
+	return (n_evs);
+}
 
-		bytes_recvd += to_write;
-		DPRINTF(HGD_D_DEBUG, "Recvd binary chunk of length %d bytes",
-		    (int) to_write);
-		DPRINTF(HGD_D_DEBUG, "Expecting a further %d bytes",
-		    (int) (bytes - bytes_recvd));
+/* reply to 'watch' with the events, freeing them */
+void
+hgd_watch_reply(struct hgd_session *sess, char **evs, int n_evs)
+{
+	int			 i;
 
-		free(payload);
+	hgd_outbuf_line(&sess->out, "ok|%d", n_evs);
+
+	for (i = 0; i < n_evs; i++) {
+		DPRINTF(HGD_D_DEBUG, "watch event: %s", evs[i]);
+		hgd_outbuf_line(&sess->out, "%s", evs[i]);
+		free(evs[i]);
 	}
-	payload = NULL;
 
-	/*
-	 * get tag metadata
-	 * no error that there is no #ifdef HAVE_TAGLIB
-	 */
-	hgd_get_tag_metadata(unique_fn, &tags);
+	if (evs)
+		free(evs);
+}
 
-	/* insert track into db */
-	if (hgd_insert_track(basename(unique_fn),
-		    &tags, sess->user->name) != HGD_OK) {
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_INT);
-		goto clean;
+/*
+ * wait for the playlist to change, then report what changed. This replaces
+ * clients polling with 'ls'; the client issues 'ls' only when told to.
+ * We give up after HGD_WATCH_TIMEOUT seconds, or as soon as the client
+ * sends something, replying with no events. A session on a core (-t) must
+ * not hold up the others, so it is parked instead, for hgd_core_watch()
+ * to finish.
+ */
+int
+hgd_cmd_watch(struct hgd_session *sess, char **args)
+{
+	struct pollfd		 pfd;
+	char			**evs = NULL;
+	int			 n_evs = 0, version;
+	time_t			 start = time(NULL);
+
+	(void) args;
+
+	if (sess->watch == NULL) {
+		sess->watch = xcalloc(1, sizeof(struct hgd_watch));
+		if (hgd_watch_snapshot(sess->ctx, sess->watch) != HGD_OK)
+			goto fail;
 	}
 
-	hgd_free_media_tags(&tags);
+	pfd.fd = sess->sock_fd;
+	pfd.events = POLLIN;
 
-	hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
-	DPRINTF(HGD_D_INFO, "Transfer of '%s' complete", filename);
-clean:
-	if (f != -1)
-		close(f);
-	if (payload)
-		free(payload);
-	if (unique_fn)
-		free(unique_fn);
+	while ((!dying) && (!restarting)) {
+		if (hgd_get_data_version(sess->ctx, &version) != HGD_OK)
+			goto fail;
 
-	if (bytes_recvd != bytes)
-		ret = HGD_FAIL;
+		if ((n_evs = hgd_watch_check(sess, version, &evs)) < 0)
+			goto fail;
 
-	return (ret);
+		if (n_evs > 0)
+			break;
+
+		if (sess->evented) {
+			sess->watch_since = start;
+			return (HGD_OK);
+		}
+
+		if (time(NULL) - start >= HGD_WATCH_TIMEOUT)
+			break;
+
+		/* client spoke (or hung up), so stop waiting */
+		hgd_log_flush();
+		if (poll(&pfd, 1, HGD_WATCH_POLL_MS) != 0)
+			break;
+	}
+
+	hgd_watch_reply(sess, evs, n_evs);
+	return (HGD_OK);
+fail:
+	hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
+	return (HGD_FAIL);
 }
 
 /*
- * report back items in the playlist
+ * report back items in the playlist, as lines or a HGD_BIN_T_PLAYLIST frame
  */
 int
 hgd_cmd_playlist(struct hgd_session *sess, char **args)
 {
-	char			*resp;
 	struct hgd_playlist	 list;
 	int			 i, num_votes;
 	int			 voted = 0;
 
 	(void) args;
 
-	if (hgd_get_playlist(&list) == HGD_FAIL) {
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_INT);
+	/* a watching client diffs against what it is about to see */
+	if ((sess->watch != NULL) &&
+	    (hgd_watch_snapshot(sess->ctx, sess->watch) != HGD_OK)) {
+		hgd_reply_err(sess, HGD_RESP_E_INT);
 		return (HGD_FAIL);
 	}
 
-	/* and respond to client */
-	xasprintf(&resp, "ok|%d", list.n_items);
-	hgd_sock_send_line(sess->sock_fd, sess->ssl, resp);
-	free(resp);
+	if (hgd_get_playlist(sess->ctx, &list) == HGD_FAIL) {
+		hgd_reply_err(sess, HGD_RESP_E_INT);
+		return (HGD_FAIL);
+	}
 
-	if ((hgd_get_num_votes(&num_votes)) != HGD_OK) {
+	/* everything that can fail is done before the reply starts */
+	if ((hgd_get_num_votes(sess->ctx, &num_votes)) != HGD_OK) {
 		DPRINTF(HGD_D_ERROR, "can't get votes");
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_INT);
+		hgd_reply_err(sess, HGD_RESP_E_INT);
+		hgd_free_playlist(&list);
 		return (HGD_FAIL);
 	}
 
 	if (sess->user != NULL) {
-		if (hgd_user_has_voted(sess->user->name, &voted) != HGD_OK) {
+		if (hgd_user_has_voted(sess->ctx,
+		    sess->user->name, &voted) != HGD_OK) {
 			DPRINTF(HGD_D_WARN, "problem determining if voted: %s",
 			    sess->user->name);
-			hgd_sock_send_line(sess->sock_fd, sess->ssl,
-			    "err|" HGD_RESP_E_INT);
+			hgd_reply_err(sess, HGD_RESP_E_INT);
+			hgd_free_playlist(&list);
 			return (HGD_FAIL);
 		}
 	}
@@ -549,8 +833,24 @@ hgd_cmd_playlist(struct hgd_session *sess, char **args)
 		voted = -1;
 	}
 
+	if (sess->binary) {
+		hgd_outbuf_frame_begin(&sess->out, HGD_BIN_T_PLAYLIST);
+		hgd_outbuf_frame_int(&sess->out, list.n_items);
+		for (i = 0; i < list.n_items; i++) {
+			hgd_frame_track(&sess->out, list.items[i],
+			    (i == 0 ? (req_votes - num_votes) : req_votes),
+			    (i == 0 ? voted : 0));
+		}
+		hgd_outbuf_frame_end(&sess->out);
+		goto clean;
+	}
+
+	/* and respond to client */
+	hgd_outbuf_line(&sess->out, "ok|%d", list.n_items);
+
 	for (i = 0; i < list.n_items; i++) {
-		xasprintf(&resp, "%d|%s|%s|%s|%s|%s|%s|%d|%d|%d|%d|%d|%d|%d",
+		hgd_outbuf_line(&sess->out,
+		    "%d|%s|%s|%s|%s|%s|%s|%d|%d|%d|%d|%d|%d|%d",
 		    list.items[i]->id,
 		    list.items[i]->filename + strlen(HGD_UNIQ_FILE_PFX),
 		    list.items[i]->tags.artist,
@@ -566,21 +866,40 @@ hgd_cmd_playlist(struct hgd_session *sess, char **args)
 		    (i == 0 ? (req_votes - num_votes) : req_votes),
 		    (i == 0 ? voted : 0)
 		);
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, resp);
-		DPRINTF(HGD_D_DEBUG, "%s\n", resp);
-		free(resp);
 	}
 
+clean:
 	hgd_free_playlist(&list);
 
 	return (HGD_OK);
 }
 
+/*
+ * play the vote-off sound. Whoever is serving the voter has other clients
+ * to see to, so we don't wait for it: the player is reaped on SIGCHLD, see
+ * hgd_sigchld_reap().
+ */
+void
+hgd_play_vote_sound(void)
+{
+	char			*argv[] = { "mplayer", "-really-quiet",
+				    vote_sound, NULL };
+	pid_t			 pid;
+	int			 err;
+
+	DPRINTF(HGD_D_DEBUG, "Play voteoff sound: '%s'", vote_sound);
+
+	err = posix_spawnp(&pid, "mplayer", NULL, NULL, argv, environ);
+	if (err != 0)
+		DPRINTF(HGD_D_WARN, "Vote-off noise failed to play: %s: %s",
+		    vote_sound, strerror(err));
+}
+
 int
 hgd_cmd_vote_off(struct hgd_session *sess, char **args)
 {
 	char				*ipc_path = NULL;
-	char				*scmd, id_str[HGD_ID_STR_SZ], *read;
+	char				 id_str[HGD_ID_STR_SZ], *read;
 	FILE				*ipc_file;
 	int				 open_ret, num_votes;
 	int				 ret = HGD_FAIL;
@@ -601,14 +920,12 @@ hgd_cmd_vote_off(struct hgd_session *sess, char **args)
 			break; /* good */
 		case HGD_FAIL_ENOENT:
 			DPRINTF(HGD_D_WARN, "nothing playing to vote off");
-			hgd_sock_send_line(sess->sock_fd, sess->ssl,
-			    "err|" HGD_RESP_E_NOPLAY);
+			hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_NOPLAY);
 			goto clean;
 			break;
 		default:
 			DPRINTF(HGD_D_ERROR, "failed to open ipc file");
-			hgd_sock_send_line(sess->sock_fd, sess->ssl,
-			    "err|" HGD_RESP_E_INT);
+			hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 			goto clean;
 			break;
 	};
@@ -619,8 +936,7 @@ hgd_cmd_vote_off(struct hgd_session *sess, char **args)
 	if (read == NULL) {
 		if (!feof(ipc_file)) {
 			DPRINTF(HGD_D_WARN, "Can't find track id in ipc file");
-			hgd_sock_send_line(sess->sock_fd, sess->ssl,
-			    "err|" HGD_RESP_E_INT);
+			hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 			goto clean;
 		}
 	}
@@ -628,64 +944,49 @@ hgd_cmd_vote_off(struct hgd_session *sess, char **args)
 	/* this check only happens for the "safe" varient for vo */
 	if ((args != NULL) && (atoi(id_str) != atoi(args[0]))) {
 		DPRINTF(HGD_D_INFO, "Track to voteoff isn't playing");
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_WRTRK);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_WRTRK);
 		goto clean;
 	}
 
 	/* insert vote */
-	switch (hgd_insert_vote(sess->user->name)) {
+	switch (hgd_insert_vote(sess->ctx, sess->user->name)) {
 	case HGD_OK:
 		break; /* good */
 	case HGD_FAIL_DUPVOTE:
 		/* duplicate vote */
 		DPRINTF(HGD_D_INFO, "User '%s' already voted",
 		    sess->user->name);
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_DUPVOTE);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_DUPVOTE);
 		return (HGD_OK);
 		break;
 	default:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_INT);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 		return (HGD_FAIL);
 	};
 
 	/* play a sound on voting */
-	if (vote_sound != NULL) {
-		DPRINTF(HGD_D_DEBUG, "Play voteoff sound: '%s'", vote_sound);
-		xasprintf(&scmd, "mplayer -really-quiet %s", vote_sound);
-
-		if (system(scmd) != 0) {
-			/* unreachable as mplayer doesn't return non-zero :\ */
-			DPRINTF(HGD_D_WARN,
-			    "Vote-off noise failed to play: %s", vote_sound);
-		}
-
-		free(scmd);
-	}
+	if (vote_sound != NULL)
+		hgd_play_vote_sound();
 
 	/* are we at the vote limit yet? */
-	if ((hgd_get_num_votes(&num_votes)) != HGD_OK) {
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_INT);
+	if ((hgd_get_num_votes(sess->ctx, &num_votes)) != HGD_OK) {
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 		return (HGD_FAIL);
 	}
 
 	if (num_votes < req_votes) {
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+		hgd_outbuf_line(&sess->out, "ok");
 		return (HGD_OK);
 	}
 
 	DPRINTF(HGD_D_INFO, "Vote limit exceeded - skip track");
 	if (hgd_skip_track() != HGD_OK) {
 		DPRINTF(HGD_D_ERROR, "Failed to skip track");
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_INT);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 		goto clean;
 	}
 
-	hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+	hgd_outbuf_line(&sess->out, "ok");
 	ret = HGD_OK;
 clean:
 	if (ipc_path)
@@ -707,9 +1008,9 @@ hgd_cmd_encrypt_questionmark(struct hgd_session *sess, char **unused)
 	(void) unused;
 
 	if ((crypto_pref != HGD_CRYPTO_PREF_NEVER) && (ssl_capable))
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok|tlsv1");
+		hgd_outbuf_line(&sess->out, "ok|tlsv1");
 	else
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok|nocrypto");
+		hgd_outbuf_line(&sess->out, "ok|nocrypto");
 
 	return (HGD_OK);
 }
@@ -717,18 +1018,70 @@ hgd_cmd_encrypt_questionmark(struct hgd_session *sess, char **unused)
 int
 hgd_cmd_proto(struct hgd_session *sess, char **unused)
 {
-	char			*reply;
-
 	(void) unused;
 
-	xasprintf(&reply, "ok|%d|%d", HGD_PROTO_VERSION_MAJOR,
-	    HGD_PROTO_VERSION_MINOR);
-	hgd_sock_send_line(sess->sock_fd, sess->ssl, reply);
-	free(reply);
+	/* the last field is the binary protocol on offer, added in 17.3 */
+	hgd_outbuf_line(&sess->out, "ok|%d|%d|%d", HGD_PROTO_VERSION_MAJOR,
+	    HGD_PROTO_VERSION_MINOR, HGD_PROTO_BINARY);
 
 	return (HGD_OK);
 }
 
+/*
+ * switch ls and np replies between text (proto|17) and binary frames
+ * (proto|18). The reply to this command is always text.
+ */
+int
+hgd_cmd_proto_select(struct hgd_session *sess, char **args)
+{
+	int			 vers = atoi(args[0]);
+
+	if ((vers != HGD_PROTO_VERSION_MAJOR) && (vers != HGD_PROTO_BINARY)) {
+		DPRINTF(HGD_D_INFO, "Client asked for protocol %d", vers);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INVCMD);
+		return (HGD_FAIL);
+	}
+
+	sess->binary = (vers == HGD_PROTO_BINARY);
+	hgd_outbuf_line(&sess->out, "ok|%d", vers);
+
+	return (HGD_OK);
+}
+
+/*
+ * carry on with an evented session's TLS handshake as far as the client's
+ * messages so far allow, see hgd_cmd_encrypt(). Until it is done,
+ * sess->tls_want says what to poll for.
+ */
+void
+hgd_session_handshake(struct hgd_session *sess)
+{
+	int			ssl_ret;
+
+	ssl_ret = SSL_accept(sess->ssl);
+	if (ssl_ret != 1) {
+		switch (SSL_get_error(sess->ssl, ssl_ret)) {
+		case SSL_ERROR_WANT_READ:
+			sess->tls_want = POLLIN;
+			return;
+		case SSL_ERROR_WANT_WRITE:
+			sess->tls_want = POLLOUT;
+			return;
+		default:
+			PRINT_SSL_ERR(HGD_D_ERROR, "SSL_accept");
+			DPRINTF(HGD_D_INFO, "SSL connection failed");
+			sess->hangup = 1; /* be paranoid and kick client */
+			return;
+		}
+	}
+	HGD_STATS_INC(tls_handshakes);
+
+	DPRINTF(HGD_D_INFO, "SSL connection established");
+	sess->tls_since = 0;
+	hgd_outbuf_line(&sess->out, "ok");
+	hgd_outbuf_flush(sess->ctx, &sess->out, sess->sock_fd, sess->ssl);
+}
+
 int
 hgd_cmd_encrypt(struct hgd_session *sess, char **unused)
 {
@@ -738,15 +1091,13 @@ hgd_cmd_encrypt(struct hgd_session *sess, char **unused)
 
 	if (sess->ssl != NULL) {
 		DPRINTF(HGD_D_WARN, "User tried to enable encyption twice");
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_SSLAGN);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_SSLAGN);
 		return (HGD_FAIL);
 	}
 
 	if ((!ssl_capable) || (crypto_pref == HGD_CRYPTO_PREF_NEVER)) {
 		DPRINTF(HGD_D_WARN, "User tried encrypt, when not possible");
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_SSLNOAVAIL);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_SSLNOAVAIL);
 		return (HGD_FAIL);
 	}
 
@@ -764,12 +1115,28 @@ hgd_cmd_encrypt(struct hgd_session *sess, char **unused)
 		goto clean;
 	}
 
+	/* a core can't wait for the client, see hgd_core_step() */
+	if (sess->evented) {
+		sess->tls_since = time(NULL);
+		hgd_session_handshake(sess);
+		return (sess->hangup ? HGD_FAIL : HGD_OK);
+	}
+
 	DPRINTF(HGD_D_DEBUG, "SSL_accept");
+	hgd_sock_arm_deadline(sess->ctx, sess->sock_fd, HGD_DEADLINE_HEADER);
+	errno = 0;
 	ssl_err = SSL_accept(sess->ssl);
 	if (ssl_err != 1) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			/* hgd_service_client() reaps us */
+			DPRINTF(HGD_D_INFO, "Header deadline passed");
+			sess->ctx->deadline_missed = HGD_DEADLINE_HEADER;
+			return (HGD_FAIL);
+		}
 		PRINT_SSL_ERR(HGD_D_ERROR, "SSL_accept");
 		goto clean;
 	}
+	HGD_STATS_INC(tls_handshakes);
 
 	/* This cannot fail so no error check */
 	SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
@@ -779,10 +1146,10 @@ clean:
 
 	if (ret == HGD_FAIL) {
 		DPRINTF(HGD_D_INFO, "SSL connection failed");
-		hgd_exit_nicely(); /* be paranoid and kick client */
+		sess->hangup = 1; /* be paranoid and kick client */
 	} else {
 		DPRINTF(HGD_D_INFO, "SSL connection established");
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+		hgd_outbuf_line(&sess->out, "ok");
 	}
 
 	return (ret);
@@ -795,18 +1162,16 @@ hgd_cmd_user_add(struct hgd_session *sess, char **params)
 
 	(void) sess;
 
-	switch (hgd_user_add(params[0], params[1])) {
+	switch (hgd_user_add(sess->ctx, params[0], params[1])) {
 	case HGD_OK:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+		hgd_outbuf_line(&sess->out, "ok");
 		ret = HGD_OK;
 		break;
 	case HGD_FAIL_USREXIST:
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_USREXIST);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_USREXIST);
 		break;
 	default:
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_INT);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 	}
 
 	return (ret);
@@ -819,18 +1184,16 @@ hgd_cmd_user_del(struct hgd_session *sess, char **params)
 
 	(void) sess;
 
-	switch (hgd_user_del(params[0])) {
+	switch (hgd_user_del(sess->ctx, params[0])) {
 	case HGD_OK:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+		hgd_outbuf_line(&sess->out, "ok");
 		ret = HGD_OK;
 		break;
 	case HGD_FAIL_USRNOEXIST:
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_USRNOEXIST);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_USRNOEXIST);
 		break;
 	default:
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_INT);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 	}
 
 	return (ret);
@@ -841,26 +1204,19 @@ hgd_cmd_user_list(struct hgd_session *sess, char **args)
 {
 	struct hgd_user_list	*list;
 	int			 i, ret = HGD_FAIL;
-	char			*msg, *msg1 = NULL;
 
 	(void) sess;
 
-	if (hgd_user_list(&list) != HGD_OK) {
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-			"err|" HGD_RESP_E_INT);
+	if (hgd_user_list(sess->ctx, &list) != HGD_OK) {
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 		goto clean;
 	}
 
-	xasprintf(&msg, "ok|%d", list->n_users);
-	hgd_sock_send_line(sess->sock_fd, sess->ssl, msg);
-	free(msg);
+	hgd_outbuf_line(&sess->out, "ok|%d", list->n_users);
 
 	for (i = 0; i < list->n_users; i++) {
-		xasprintf(&msg1, "%s|%d",
+		hgd_outbuf_line(&sess->out, "%s|%d",
 		    list->users[i]->name, list->users[i]->perms);
-		hgd_sock_send_line(
-		    sess->sock_fd, sess->ssl, msg1);
-		free(msg1);
 	}
 
 	ret = HGD_OK;
@@ -873,6 +1229,79 @@ clean:
 	return (ret);
 }
 
+/*
+ * dump the server counters. Latency buckets are counts of commands
+ * taking less than 2^n usecs, the last bucket being unbounded.
+ */
+int
+hgd_cmd_stats(struct hgd_session *sess, char **unused)
+{
+	struct hgd_stats	*s = hgd_stats;
+	struct hgd_stats_cmd	*c;
+	struct hgd_stats_timing	*t;
+	uint32_t		 i;
+	int			 b;
+
+	(void) unused;
+
+	if (s == NULL) {
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
+		return (HGD_FAIL);
+	}
+
+	hgd_outbuf_line(&sess->out, "ok|%d",
+	    11 + HGD_STATS_N_TIMINGS + s->n_cmds);
+	hgd_outbuf_line(&sess->out, "conns-accepted|%llu",
+	    (unsigned long long) s->conns_accepted);
+	hgd_outbuf_line(&sess->out, "conns-active|%lld",
+	    (long long) s->conns_active);
+	hgd_outbuf_line(&sess->out, "tls-handshakes|%llu",
+	    (unsigned long long) s->tls_handshakes);
+	hgd_outbuf_line(&sess->out, "bytes-uploaded|%llu",
+	    (unsigned long long) s->bytes_uploaded);
+	hgd_outbuf_line(&sess->out, "db-busy-retries|%llu",
+	    (unsigned long long) s->db_busy_retries);
+	hgd_outbuf_line(&sess->out, "reaped-idle|%llu",
+	    (unsigned long long) s->reaped_idle);
+	hgd_outbuf_line(&sess->out, "reaped-header|%llu",
+	    (unsigned long long) s->reaped_header);
+	hgd_outbuf_line(&sess->out, "reaped-upload|%llu",
+	    (unsigned long long) s->reaped_upload);
+	hgd_outbuf_line(&sess->out, "reaped-send|%llu",
+	    (unsigned long long) s->reaped_send);
+	hgd_outbuf_line(&sess->out, "refused-busy|%llu",
+	    (unsigned long long) s->refused_busy);
+	hgd_outbuf_line(&sess->out, "refused-rate|%llu",
+	    (unsigned long long) s->refused_rate);
+
+	for (i = 0; i < HGD_STATS_N_TIMINGS; i++) {
+		t = &s->timings[i];
+		hgd_outbuf_line(&sess->out, "timing|%s|%llu|%llu|%llu|%llu",
+		    hgd_stats_timing_names[i], (unsigned long long) t->count,
+		    (unsigned long long) t->usecs,
+		    (unsigned long long) t->last_usecs,
+		    (unsigned long long) t->max_usecs);
+	}
+
+	for (i = 0; i < s->n_cmds; i++) {
+		c = &s->cmds[i];
+
+		hgd_outbuf_printf(&sess->out, "cmd|%.*s|%llu|%llu",
+		    HGD_STATS_CMD_NAME_SZ, c->name,
+		    (unsigned long long) c->count,
+		    (unsigned long long) c->usecs);
+
+		/* histogram built in place, the last bucket ends the line */
+		for (b = 0; b < HGD_STATS_N_BUCKETS - 1; b++)
+			hgd_outbuf_printf(&sess->out, "|%llu",
+			    (unsigned long long) c->buckets[b]);
+		hgd_outbuf_line(&sess->out, "|%llu",
+		    (unsigned long long) c->buckets[b]);
+	}
+
+	return (HGD_OK);
+}
+
 int
 hgd_cmd_pause(struct hgd_session *sess, char **unused)
 {
@@ -884,13 +1313,11 @@ hgd_cmd_pause(struct hgd_session *sess, char **unused)
 	ret = hgd_pause_track();
 
 	if (ret == HGD_OK)
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+		hgd_outbuf_line(&sess->out, "ok");
 	else if (ret == HGD_FAIL_NOPLAY)
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_NOPLAY);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_NOPLAY);
 	else
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_DENY);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_DENY);
 
 	return (ret);
 }
@@ -907,15 +1334,13 @@ hgd_cmd_skip(struct hgd_session *sess, char **unused)
 
 	switch (ret) {
 	case HGD_FAIL_NOPLAY:
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_NOPLAY);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_NOPLAY);
 		break;
 	case HGD_OK:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+		hgd_outbuf_line(&sess->out, "ok");
 		break;
 	default:
-		hgd_sock_send_line(sess->sock_fd,
-		    sess->ssl, "err|" HGD_RESP_E_INT);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 		break;
 	};
 
@@ -927,22 +1352,19 @@ hgd_cmd_user_mkadmin(struct hgd_session *sess, char **args)
 {
 	int		ret = HGD_FAIL;
 
-	switch(hgd_user_mod_perms(args[0], HGD_AUTH_ADMIN, 1)) {
+	switch(hgd_user_mod_perms(sess->ctx, args[0], HGD_AUTH_ADMIN, 1)) {
 	case HGD_OK:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+		hgd_outbuf_line(&sess->out, "ok");
 		ret = HGD_OK;
 		break;
 	case HGD_FAIL_USRNOEXIST:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_USRNOEXIST);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_USRNOEXIST);
 		break;
 	case HGD_FAIL_PERMNOCHG:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_PERMNOCHG);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_PERMNOCHG);
 		break;
 	default:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_INT);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 	};
 
 	return (ret);
@@ -953,22 +1375,19 @@ hgd_cmd_user_noadmin(struct hgd_session *sess, char **args)
 {
 	int		ret = HGD_FAIL;
 
-	switch(hgd_user_mod_perms(args[0], HGD_AUTH_ADMIN, 0)) {
+	switch(hgd_user_mod_perms(sess->ctx, args[0], HGD_AUTH_ADMIN, 0)) {
 	case HGD_OK:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl, "ok");
+		hgd_outbuf_line(&sess->out, "ok");
 		ret = HGD_OK;
 		break;
 	case HGD_FAIL_USRNOEXIST:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_USRNOEXIST);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_USRNOEXIST);
 		break;
 	case HGD_FAIL_PERMNOCHG:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_PERMNOCHG);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_PERMNOCHG);
 		break;
 	default:
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_INT);
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
 	};
 
 	return (ret);
@@ -983,19 +1402,15 @@ int
 hgd_cmd_id(struct hgd_session *sess, char **args)
 {
 	int			 vote = -1;
-	char			*resp = NULL;
 
-	if (hgd_user_has_voted(sess->user->name, &vote) != HGD_OK) {
+	if (hgd_user_has_voted(sess->ctx, sess->user->name, &vote) != HGD_OK) {
 		DPRINTF(HGD_D_WARN, "problem determining if voted: %s",
 		    sess->user->name);
 		return (HGD_FAIL);
 	}
 
-	xasprintf(&resp, "ok|%s|%u|%d", sess->user->name, sess->user->perms, vote);
-
-	hgd_sock_send_line(sess->sock_fd, sess->ssl, resp);
-
-	free(resp);
+	hgd_outbuf_line(&sess->out, "ok|%s|%u|%d",
+	    sess->user->name, sess->user->perms, vote);
 
 	return (HGD_OK);
 }
@@ -1014,6 +1429,7 @@ struct hgd_cmd_despatch		cmd_despatches[] = {
 	{"pl",		0,	1,	0,	HGD_AUTH_NONE,	hgd_cmd_playlist},
 	{"np",		0,	1,	0,	HGD_AUTH_NONE,	hgd_cmd_now_playing},
 	{"proto",	0,	0,	0,	HGD_AUTH_NONE,	hgd_cmd_proto},
+	{"proto",	1,	0,	0,	HGD_AUTH_NONE,	hgd_cmd_proto_select},
 	{"q",		2,	1,	1,	HGD_AUTH_NONE,	hgd_cmd_queue},
 	{"user",	2,	1,	0,	HGD_AUTH_NONE,	hgd_cmd_user},
 	{"vo",		0,	1,	1,	HGD_AUTH_NONE,	hgd_cmd_vote_off_noarg},
@@ -1025,349 +1441,1899 @@ struct hgd_cmd_despatch		cmd_despatches[] = {
 	{"user-noadmin",1,	1,	1,	HGD_AUTH_ADMIN,	hgd_cmd_user_noadmin},
 	{"pause",	0,	1,	1,	HGD_AUTH_ADMIN,	hgd_cmd_pause},
 	{"skip",	0,	1,	1,	HGD_AUTH_ADMIN, hgd_cmd_skip},
+	{"watch",	0,	1,	0,	HGD_AUTH_NONE,	hgd_cmd_watch},
+	{"stats",	0,	1,	1,	HGD_AUTH_ADMIN,	hgd_cmd_stats},
 	{NULL,		0,	0,	0,	HGD_AUTH_NONE,	NULL}	/* terminate */
 };
 
-/* enusure atleast 1 more than the commamd with the most args */
-uint8_t
-hgd_parse_line(struct hgd_session *sess, char *line)
-{
-	char			*tokens[HGD_MAX_PROTO_TOKS];
-	char			*next = line;
-	uint8_t			n_toks = 0;
-	struct hgd_cmd_despatch *desp, *correct_desp;
-	uint8_t			bye = 0;
+/*
+ * Commands are looked up by hashing (name, n_args) into cmd_hash_slots,
+ * which holds indices into cmd_despatches. hgd_cmd_hash_init() searches
+ * for a seed under which no two commands collide, so a lookup is one hash
+ * and one strcmp.
+ */
+#define HGD_CMD_HASH_SZ		64	/* power of 2 */
+#define HGD_CMD_HASH_MAX_SEEDS	10000
 
-	DPRINTF(HGD_D_DEBUG, "Parsing line: %s", line);
-	if (line == NULL) return HGD_FAIL;
+int8_t				cmd_hash_slots[HGD_CMD_HASH_SZ];
+uint32_t			cmd_hash_seed = 0;
 
-	/* tokenise */
-	do {
-		tokens[n_toks] = xstrdup(strsep(&next, "|"));
-		DPRINTF(HGD_D_DEBUG, "tok %d: \"%s\"", n_toks, tokens[n_toks]);
-	} while ((n_toks++ < HGD_MAX_PROTO_TOKS) && (next != NULL));
+uint32_t
+hgd_cmd_hash(const char *name, int n_args, uint32_t seed)
+{
+	uint32_t		h = 2166136261U ^ seed;	/* FNV-1a */
 
-	DPRINTF(HGD_D_DEBUG, "Got %d tokens", n_toks);
-	if ((n_toks == 0) || (strlen(tokens[0]) == 0)) {
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_INVCMD);
-		num_bad_commands++;
-		goto clean;
+	for (; *name != '\0'; name++) {
+		h ^= (uint8_t) *name;
+		h *= 16777619U;
 	}
+	h ^= (uint8_t) n_args;
+	h *= 16777619U;
+	h ^= h >> 16;	/* else the low bits only see the low bits of the seed */
 
-	/* now we look up which function to call */
-	correct_desp = NULL;
-	for (desp = cmd_despatches; desp->cmd != NULL; desp ++) {
+	return (h & (HGD_CMD_HASH_SZ - 1));
+}
 
-		if (strcmp(desp->cmd, tokens[0]) != 0)
-			continue;
+/* once, before forking */
+int
+hgd_cmd_hash_init(void)
+{
+	struct hgd_cmd_despatch	*desp;
+	uint32_t		 seed, slot;
+	int			 i;
 
-		if (n_toks - 1 != desp->n_args)
-			continue;
+	for (seed = 0; seed < HGD_CMD_HASH_MAX_SEEDS; seed++) {
+		memset(cmd_hash_slots, -1, sizeof(cmd_hash_slots));
 
-		/* command is valid \o/ */
-		correct_desp = desp;
-		break;
+		for (i = 0, desp = cmd_despatches; desp->cmd != NULL;
+		    desp++, i++) {
+			slot = hgd_cmd_hash(desp->cmd, desp->n_args, seed);
+			if (cmd_hash_slots[slot] != -1)
+				break;
+			cmd_hash_slots[slot] = i;
+		}
+
+		if (desp->cmd == NULL) {
+			DPRINTF(HGD_D_DEBUG, "Command hash seed is %u", seed);
+			cmd_hash_seed = seed;
+			return (HGD_OK);
+		}
+	}
+
+	DPRINTF(HGD_D_ERROR, "No perfect command hash, grow HGD_CMD_HASH_SZ");
+	return (HGD_FAIL);
+}
+
+struct hgd_cmd_despatch *
+hgd_cmd_lookup(char *name, int n_args)
+{
+	struct hgd_cmd_despatch	*desp;
+	int			 i;
+
+	i = cmd_hash_slots[hgd_cmd_hash(name, n_args, cmd_hash_seed)];
+	if (i < 0)
+		return (NULL);
+
+	desp = &cmd_despatches[i];
+	if ((desp->n_args != n_args) || (strcmp(desp->cmd, name) != 0))
+		return (NULL);
+
+	return (desp);
+}
+
+/* stats slot of each cmd_despatches entry, filled by hgd_stats_setup() */
+int				cmd_stats_slots[
+				    sizeof(cmd_despatches) /
+				    sizeof(cmd_despatches[0])];
+
+/*
+ * Map the stats and register the commands. This is done before forking,
+ * so that the children only ever need to look slots up.
+ */
+void
+hgd_stats_setup(void)
+{
+	struct hgd_cmd_despatch	*desp;
+	int			 i;
+
+	if (hgd_stats_open(1) != HGD_OK)
+		DPRINTF(HGD_D_WARN, "Running without stats");
+
+	for (i = 0, desp = cmd_despatches; desp->cmd != NULL; desp++, i++)
+		cmd_stats_slots[i] = hgd_stats_cmd_slot(desp->cmd);
+
+	/* any children from a previous run are gone */
+	HGD_STATS_SET(conns_active, 0);
+	HGD_STATS_SET(votes_needed, req_votes);
+}
+
+/* enusure atleast 1 more than the commamd with the most args */
+uint8_t
+hgd_parse_line(struct hgd_session *sess, char *line)
+{
+	char			*tokens[HGD_MAX_PROTO_TOKS];
+	char			*next = line;
+	uint8_t			n_toks = 0;
+	struct hgd_cmd_despatch *correct_desp;
+	uint8_t			bye = 0;
+	uint64_t		start;
+	int			ret;
+
+	DPRINTF(HGD_D_DEBUG, "Parsing line: %s", line);
+	if (line == NULL) return HGD_FAIL;
+
+	/* tokenise, in place: the tokens point into the line */
+	while ((next != NULL) && (n_toks < HGD_MAX_PROTO_TOKS)) {
+		tokens[n_toks] = strsep(&next, "|");
+		DPRINTF(HGD_D_DEBUG, "tok %d: \"%s\"", n_toks, tokens[n_toks]);
+		n_toks++;
+	}
+
+	DPRINTF(HGD_D_DEBUG, "Got %d tokens", n_toks);
+	if ((next != NULL) || (strlen(tokens[0]) == 0)) {
+		hgd_reply_refusal(sess, tokens[0], HGD_RESP_E_INVCMD);
+		sess->bad_commands++;
+		goto clean;
 	}
 
+	/* now we look up which function to call */
+	correct_desp = hgd_cmd_lookup(tokens[0], n_toks - 1);
+
 	/* command not found */
 	if (correct_desp == NULL) {
 		DPRINTF(HGD_D_DEBUG, "Despatching '%s' handler", tokens[0]);
 
 		DPRINTF(HGD_D_INFO, "Invalid command");
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_INVCMD);
-		num_bad_commands++;
+		hgd_reply_refusal(sess, tokens[0], HGD_RESP_E_INVCMD);
+		sess->bad_commands++;
+
+		goto clean;
+	}
+
+	/* bye has special meaning */
+	if (strcmp(correct_desp->cmd, "bye") == 0) {
+		bye = 1;
+		goto clean;
+	}
+
+	/* if the server is *only* accepting SSL connections, a number
+	 * of commands will be out of bounds until encryption is
+	 * estabished.
+	 */
+	if ((crypto_pref == HGD_CRYPTO_PREF_ALWAYS) &&
+	    (correct_desp->secure) &&
+	    (sess->ssl == NULL)) {
+		DPRINTF(HGD_D_INFO, "Client '%s' is trying to bypass SSL",
+		    sess->cli_str);
+		hgd_reply_refusal(sess, tokens[0], HGD_RESP_E_SSLREQ);
+		sess->bad_commands++;
+		goto clean;
+	}
+
+	/* user should be authenticated for some comands */
+	if (correct_desp->auth_needed && sess->user == NULL) {
+		DPRINTF(HGD_D_INFO, "User not authenticated to use '%s'",
+		    correct_desp->cmd);
+		hgd_reply_refusal(sess, tokens[0], HGD_RESP_E_DENY);
+		sess->bad_commands++;
+		goto clean;
+	}
+
+	/* if admin command, check user is an admin */
+	if (correct_desp->authlevel != HGD_AUTH_NONE) {
+		DPRINTF(HGD_D_DEBUG, "Checking authlevel..."
+		    "expecting %d, got %d",
+		    correct_desp->authlevel, sess->user->perms);
+		if (!(sess->user->perms & correct_desp->authlevel)) {
+			DPRINTF(HGD_D_INFO,
+			    "'%s': unauthorised use of admin command",
+			    sess->cli_str);
+			hgd_reply_refusal(sess, tokens[0],
+			    HGD_RESP_E_DENY);
+			sess->bad_commands++;
+			goto clean;
+		}
+	}
+
+	/* otherwise despatch */
+	start = hgd_stats_now_usecs();
+	ret = correct_desp->handler(sess, &tokens[1]);
+	hgd_stats_cmd_done(cmd_stats_slots[correct_desp - cmd_despatches],
+	    hgd_stats_now_usecs() - start);
+
+	if (ret != HGD_OK) {
+		/*
+		 * This happens often, ie when a client tries to
+		 * vote off twice, and that is fine, so we put the message
+		 * in INFO rather than WARN.
+		 */
+		DPRINTF(HGD_D_INFO, "despatch of '%s' for '%s' returned -1",
+		    tokens[0], sess->cli_str);
+		sess->bad_commands++;
+	} else
+		sess->bad_commands = 0;
+
+clean:
+	/* the whole reply goes out in one go */
+	hgd_outbuf_flush(sess->ctx, &sess->out, sess->sock_fd, sess->ssl);
+	return (bye);
+}
+
+/*
+ * -T: time hgd_parse_line() on commands which don't touch the database,
+ * covering tokenising, lookup, the permission checks and a handler.
+ * Replies go to a socketpair that we drain between calls.
+ */
+void
+hgd_parse_bench(int iters)
+{
+	struct hgd_session	 sess;
+	struct timespec		 t0, t1;
+	char			*lines[] = {
+				    "proto",		/* despatched */
+				    "encrypt?",		/* despatched */
+				    "bye",		/* special */
+				    "vo",		/* needs auth */
+				    "user-list",	/* needs auth */
+				    "nosuchcmd",	/* unknown */
+				    "np|1",		/* wrong arity */
+				    "q|a|b|c",		/* too many tokens */
+				    NULL };
+	char			 line[HGD_MAX_LINE], drain[HGD_MAX_LINE];
+	int			 sv[2], i, n;
+	size_t			 len;
+	uint64_t		 nsecs;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		DPRINTF(HGD_D_ERROR, "Can't make socketpair: %s", SERROR);
+		return;
+	}
+
+	memset(&sess, 0, sizeof(sess));
+	sess.ctx = &main_ctx;
+	sess.sock_fd = sv[0];
+	sess.cli_str = "parse-bench";
+	hgd_outbuf_init(&sess.out);
+
+	printf("\n    %-12s %10s %12s\n", "line", "ns/op", "ops/s");
+	for (n = 0; lines[n] != NULL; n++) {
+		len = strlen(lines[n]) + 1;
+		nsecs = 0;
+
+		for (i = 0; i < iters; i++) {
+			/* parsing is destructive */
+			memcpy(line, lines[n], len);
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			hgd_parse_line(&sess, line);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+
+			nsecs += (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+			    t1.tv_nsec - t0.tv_nsec;
+			sess.bad_commands = 0;
+			while (recv(sv[1], drain, sizeof(drain),
+			    MSG_DONTWAIT) > 0)
+				;
+		}
+
+		printf("    %-12s %10.1f %12.0f\n", lines[n],
+		    (double) nsecs / iters,
+		    nsecs ? (double) iters * 1000000000ULL / nsecs : 0);
+	}
+	printf("\n");
+	fflush(stdout);	/* hgd_exit_nicely() won't */
+
+	hgd_outbuf_free(&sess.out);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/*
+ * Append a line from a client to the capture file as
+ * <usecs since epoch>|<pid>|<line>. The pid identifies the session, as
+ * a process serves one client at a time, between the open and close
+ * markers. On a core (-t) the socket stands in for the pid, as it is just
+ * as unique while the session lasts. Passwords are starred out; uploaded
+ * files never pass through here, only the q line announcing their size.
+ */
+void
+hgd_capture(struct hgd_session *sess, char *line)
+{
+	struct timespec		 ts;
+	char			*redacted = NULL, *rec = NULL, *p;
+
+	if ((capture_fd < 0) || (line == NULL))
+		return;
+
+	/* user|<name>|<pass> and user-add|<name>|<pass> */
+	if ((strncmp(line, "user|", 5) == 0) ||
+	    (strncmp(line, "user-add|", 9) == 0)) {
+		p = strchr(line, '|');
+		if ((p = strchr(p + 1, '|')) != NULL) {
+			xasprintf(&redacted, "%.*s|*", (int) (p - line), line);
+			line = redacted;
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	xasprintf(&rec, "%llu|%d|%s\n", (unsigned long long)
+	    ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+	    sess->evented ? sess->sock_fd : (int) getpid(), line);
+
+	/* one write, so that lines from different sessions don't mix */
+	if (write(capture_fd, rec, strlen(rec)) < 0)
+		DPRINTF(HGD_D_WARN, "Can't write capture: %s", SERROR);
+
+	free(rec);
+	free(redacted);
+}
+
+/* say how far behind the client got, its send queue high water mark */
+void
+hgd_log_send_queue(struct hgd_session *sess)
+{
+	if (sess->out.queue_max > 0)
+		DPRINTF(HGD_D_INFO, "Client '%s' had up to %d bytes queued",
+		    sess->cli_str, sess->out.queue_max);
+}
+
+/*
+ * the client missed a deadline (ctx->deadline_missed). Count it and
+ * have the session hang up without a goodbye, it isn't listening anyway.
+ */
+void
+hgd_reap_client(struct hgd_session *sess)
+{
+	const char		*why;
+
+	switch (sess->ctx->deadline_missed) {
+	case HGD_DEADLINE_IDLE:
+		HGD_STATS_INC(reaped_idle);
+		why = "idle";
+		break;
+	case HGD_DEADLINE_HEADER:
+		HGD_STATS_INC(reaped_header);
+		why = "header";
+		break;
+	case HGD_DEADLINE_SEND:
+		HGD_STATS_INC(reaped_send);
+		why = "send";
+		break;
+	default:
+		HGD_STATS_INC(reaped_upload);
+		why = "upload";
+		break;
+	}
+
+	DPRINTF(HGD_D_INFO, "Client '%s' missed the %s deadline, dropping",
+	    sess->cli_str, why);
+	sess->hangup = 1;
+}
+
+/*
+ * set up a session for a newly accepted client and greet it. evented
+ * sessions are served by a core (-t), see hgd_core_run().
+ */
+void
+hgd_session_begin(struct hgd_session *sess, struct hgd_ctx *ctx, int cli_fd,
+    struct sockaddr_in *cli_addr, uint8_t evented)
+{
+	memset(sess, 0, sizeof(*sess));
+	sess->ctx = ctx;
+	sess->sock_fd = cli_fd;
+	sess->cli_addr = cli_addr;
+	sess->evented = evented;
+	sess->last_active = time(NULL);
+	hgd_outbuf_init(&sess->out);
+
+	/* a core waits for no one: not the resolver, nor the client */
+	sess->cli_str = hgd_identify_client(cli_addr,
+	    lookup_client_dns && !evented);
+	if (evented) {
+		(void) fcntl(cli_fd, F_SETFL, O_NONBLOCK);
+		sess->out.nowait = 1;
+	}
+
+	/* a pool worker or a core may have served someone else before */
+	sess->ctx->deadline_missed = HGD_DEADLINE_NONE;
+
+	if (sess->cli_str == NULL)
+		xasprintf(&sess->cli_str, "unknown"); /* shouldn't happen */
+
+	DPRINTF(HGD_D_INFO, "Client connection: '%s'", sess->cli_str);
+
+	/* oh hai */
+	hgd_outbuf_line(&sess->out, "ok|" HGD_RESP_O_GREET);
+	hgd_outbuf_flush(sess->ctx, &sess->out, cli_fd, sess->ssl);
+	hgd_capture(sess, HGD_CAPTURE_OPEN);
+	if (sess->ctx->deadline_missed != HGD_DEADLINE_NONE)
+		hgd_reap_client(sess);
+}
+
+/*
+ * after each command: log it, and hang up on a client which missed a
+ * deadline or keeps sending rubbish. Returns 1 if we did.
+ */
+uint8_t
+hgd_session_settle(struct hgd_session *sess)
+{
+	hgd_log_flush(); /* log a command at a time */
+	sess->last_active = time(NULL);
+
+	if (sess->ctx->deadline_missed != HGD_DEADLINE_NONE)
+		hgd_reap_client(sess);
+	else if (sess->bad_commands >= HGD_MAX_BAD_COMMANDS) {
+		DPRINTF(HGD_D_INFO,"Client abused server, "
+		    "kicking '%s'", sess->cli_str);
+		/* laters */
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_KICK);
+		hgd_outbuf_flush(sess->ctx, &sess->out, sess->sock_fd,
+		    sess->ssl);
+		sess->hangup = 1;
+	}
+
+	return (sess->hangup);
+}
+
+/*
+ * reply to a command the client sent, NULL if it went away. Returns 1 if
+ * that was the last, as the client said bye or went away, or we hung up.
+ */
+uint8_t
+hgd_session_command(struct hgd_session *sess, char *line)
+{
+	uint8_t			 exit;
+
+	hgd_capture(sess, line); /* before parsing chops it up */
+	exit = hgd_parse_line(sess, line);
+
+	return (hgd_session_settle(sess) || exit);
+}
+
+/* receive a command and reply to it, as above */
+uint8_t
+hgd_session_step(struct hgd_session *sess)
+{
+	char			*recv_line;
+	uint8_t			 exit;
+
+	recv_line = hgd_sock_recv_line(sess->ctx, sess->sock_fd, sess->ssl);
+	exit = hgd_session_command(sess, recv_line);
+	free(recv_line);
+
+	return (exit);
+}
+
+/* say goodbye and free the session's members */
+void
+hgd_session_end(struct hgd_session *sess)
+{
+	uint8_t			 ssl_ret = 0, i;
+
+	/* an upload cut short by our going down */
+	if (sess->upload != NULL) {
+		(void) hgd_upload_end(sess, sess->upload, HGD_FAIL);
+		sess->upload = NULL;
+	}
+
+	/* nor can we say anything part way through a handshake */
+	if (sess->tls_since != 0)
+		sess->hangup = 1;
+
+	/* laters, unless we already hung up on them */
+	if (!sess->hangup) {
+		if (restarting || dying) {
+			/*
+			 * we send an error that a client will pick up upon
+			 * their next request. Clients should expect this at
+			 * any time.
+			 */
+			hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_SHTDWN);
+		} else
+			hgd_outbuf_line(&sess->out, "ok|" HGD_RESP_O_BYE);
+		hgd_outbuf_flush(sess->ctx, &sess->out, sess->sock_fd,
+		    sess->ssl);
+	}
+	hgd_capture(sess, HGD_CAPTURE_CLOSE);
+	hgd_log_send_queue(sess);
+
+	/* free up the hgd_session members */
+	if (sess->cli_str != NULL)
+		free(sess->cli_str);
+
+	if (sess->ssl != NULL) {
+		/*
+		 * as per SSL_shutdown() manual, we call at most twice. Not
+		 * at all if we hung up, the client may have stopped reading.
+		 * A core only sends its half, it can't wait for the client's.
+		 */
+		for (i = 0; (!sess->hangup) && (i < 2); i++) {
+			ssl_ret = SSL_shutdown(sess->ssl);
+			if ((ssl_ret == 1) || (sess->evented))
+				break;
+		}
+
+		if ((!sess->hangup) && (!sess->evented) && (ssl_ret != 1))
+			DPRINTF(HGD_D_WARN, "couldn't shutdown SSL");
+
+		SSL_free(sess->ssl);
+	}
+
+	if (sess->user) {
+		if (sess->user->name)
+			free(sess->user->name);
+		free(sess->user);
+	}
+
+	if (sess->watch) {
+		if (sess->watch->ids)
+			free(sess->watch->ids);
+		free(sess->watch);
+	}
+
+	free(sess->in);
+	hgd_outbuf_free(&sess->out);
+}
+
+void
+hgd_service_client(int cli_fd, struct sockaddr_in *cli_addr)
+{
+	struct hgd_session	 sess;
+
+	hgd_session_begin(&sess, &main_ctx, cli_fd, cli_addr, 0);
+
+	/* main command recieve loop */
+	while (!sess.hangup && !dying && !restarting) {
+		if (hgd_session_step(&sess))
+			break;
+	}
+
+	/*
+	 * client service procs should not respawn as liesteners,
+	 * that would suck. This may need tweaking later, as the exit
+	 * message may be misinterpreted (?) Handling HUP is hard.
+	 */
+	if (restarting) {
+		dying = 1;
+		restarting = 0;
+		exit_ok = 1;
+	}
+
+	hgd_session_end(&sess);
+}
+
+void
+hgd_sigchld(int sig)
+{
+	int			saved_errno = errno;
+
+	(void) sig;
+
+	/* clear up exit status from proc table, signals may have merged */
+	while (waitpid(-1, NULL, WNOHANG) > 0) {
+		HGD_STATS_ADD(conns_active, -1);
+		__sync_fetch_and_sub(&n_sessions, 1);
+	}
+
+	errno = saved_errno;
+	signal(SIGCHLD, hgd_sigchld);
+}
+
+/*
+ * for a process serving clients, whose only children are vote-off sounds.
+ * Unlike hgd_sigchld(), there are no sessions to count down.
+ */
+void
+hgd_sigchld_reap(int sig)
+{
+	int			saved_errno = errno;
+
+	(void) sig;
+
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+
+	errno = saved_errno;
+	signal(SIGCHLD, hgd_sigchld_reap);
+}
+
+/*
+ * charge a new connection to its client address. Each address has a
+ * bucket of conn_burst connections, refilled at conn_rate a minute.
+ * Addresses hash into a small open addressed table, and an address not
+ * found within HGD_CONN_BUCKET_PROBE slots takes the stalest of them.
+ */
+int
+hgd_admit_rate(struct in_addr addr)
+{
+	struct hgd_conn_bucket	*b = NULL, *stalest = NULL;
+	uint64_t		 now, cap;
+	uint32_t		 slot;
+	int			 i, ret = HGD_OK;
+
+	if ((conn_rate <= 0) || (conn_table == NULL))
+		return (HGD_OK);
+
+	/* pool workers admit clients side by side */
+	if (pthread_mutex_lock(&conn_table->lock) == EOWNERDEAD) {
+		/* a worker died holding it, the counts are still counts */
+		pthread_mutex_consistent(&conn_table->lock);
+	}
+
+	now = hgd_stats_now_usecs();
+	cap = (conn_burst > 1 ? conn_burst : 1) * HGD_MINUTE_USECS;
+	slot = (ntohl(addr.s_addr) * 2654435761u) >> 16;
+
+	for (i = 0; i < HGD_CONN_BUCKET_PROBE; i++) {
+		b = &conn_table->buckets[(slot + i) % HGD_CONN_BUCKETS];
+		if ((b->last_usecs != 0) && (b->addr == addr.s_addr))
+			break;
+		if ((stalest == NULL) || (b->last_usecs < stalest->last_usecs))
+			stalest = b;
+		b = NULL;
+	}
+
+	if (b == NULL) {
+		b = stalest;
+		b->addr = addr.s_addr;
+		b->credit = cap;
+	} else if (now > b->last_usecs) {
+		b->credit += (now - b->last_usecs) * conn_rate;
+		if (b->credit > cap)
+			b->credit = cap;
+	}
+	b->last_usecs = now;
+
+	if (b->credit < HGD_MINUTE_USECS)
+		ret = HGD_FAIL;
+	else
+		b->credit -= HGD_MINUTE_USECS;
+
+	pthread_mutex_unlock(&conn_table->lock);
+	return (ret);
+}
+
+/*
+ * map the connection allowances, shared so that pool workers charge the
+ * same ones, with a lock which works across processes. NULL if we can't.
+ */
+struct hgd_conn_table *
+hgd_conn_table_map(void)
+{
+	struct hgd_conn_table	*table;
+	pthread_mutexattr_t	 attr;
+	int			 err;
+
+	table = mmap(NULL, sizeof(*table) +
+	    sizeof(struct hgd_conn_bucket) * HGD_CONN_BUCKETS,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (table == MAP_FAILED) {
+		DPRINTF(HGD_D_WARN, "Can't map connection allowances: %s",
+		    SERROR);
+		return (NULL);
+	}
+
+	pthread_mutexattr_init(&attr);
+	if (((err = pthread_mutexattr_setpshared(&attr,
+	    PTHREAD_PROCESS_SHARED)) != 0) ||
+	    ((err = pthread_mutexattr_setrobust(&attr,
+	    PTHREAD_MUTEX_ROBUST)) != 0) ||
+	    ((err = pthread_mutex_init(&table->lock, &attr)) != 0)) {
+		DPRINTF(HGD_D_WARN, "Can't lock connection allowances: %s",
+		    strerror(err));
+		munmap(table, sizeof(*table) +
+		    sizeof(struct hgd_conn_bucket) * HGD_CONN_BUCKETS);
+		table = NULL;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	return (table);
+}
+
+/*
+ * decide, before forking, whether to serve a new client. If not, the
+ * client is sent E_BUSY in place of a greeting and dropped. This must
+ * not block the listener, so the reply is a single non-blocking send.
+ * Pool workers fork nothing, so for them only the rate limit applies. A
+ * client arriving while every worker is busy isn't refused, it waits in
+ * the listen backlog, see WORKER POOL in hgd-netd(1).
+ */
+int
+hgd_admit(int cli_fd, struct sockaddr_in *cli_addr)
+{
+	const char		*refusal = "err|" HGD_RESP_E_BUSY "\r\n";
+
+	if ((max_sessions > 0) && (n_sessions >= max_sessions)) {
+		DPRINTF(HGD_D_WARN, "Refusing %s: %d sessions already",
+		    inet_ntoa(cli_addr->sin_addr), (int) n_sessions);
+		HGD_STATS_INC(refused_busy);
+	} else if (hgd_admit_rate(cli_addr->sin_addr) != HGD_OK) {
+		DPRINTF(HGD_D_WARN, "Refusing %s: connecting too often",
+		    inet_ntoa(cli_addr->sin_addr));
+		HGD_STATS_INC(refused_rate);
+	} else
+		return (HGD_OK);
+
+	if (send(cli_fd, refusal, strlen(refusal),
+	    MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		DPRINTF(HGD_D_DEBUG, "Can't send refusal: %s", SERROR);
+
+	close(cli_fd);
+	return (HGD_FAIL);
+}
+
+/* make a socket bound to our port */
+int
+hgd_bind_socket(void)
+{
+	struct sockaddr_in	addr;
+	int			fd, sockopt = 1;
+
+	DPRINTF(HGD_D_DEBUG, "Setting up socket");
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		DPRINTF(HGD_D_ERROR, "socket(): %s", SERROR);
+		return (-1);
+	}
+
+	/* allow socket to be re-used right away after we exit */
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+		     &sockopt, sizeof(sockopt)) < 0) {
+		DPRINTF(HGD_D_WARN, "Can't set SO_REUSEADDR");
+	}
+
+	/* configure socket */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		DPRINTF(HGD_D_ERROR, "Bind to port %d: %s", port, SERROR);
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/* ready a newly accepted client socket for hgd_service_client() */
+void
+hgd_client_sockopts(int cli_fd)
+{
+	int			sockopt = 1, flags;
+
+	if (setsockopt(cli_fd, SOL_SOCKET, SO_REUSEADDR,
+		    &sockopt, sizeof(sockopt)) < 0) {
+		DPRINTF(HGD_D_WARN, "Can't set SO_REUSEADDR");
+	}
+
+	/*
+	 * replies are already coalesced by hgd_outbuf_flush(), so
+	 * Nagle would only hold back the tail of a multi-record
+	 * SSL reply until the client's delayed ACK.
+	 */
+	if (setsockopt(cli_fd, IPPROTO_TCP, TCP_NODELAY,
+		    &sockopt, sizeof(sockopt)) < 0) {
+		DPRINTF(HGD_D_WARN, "Can't set TCP_NODELAY");
+	}
+
+	/* some systems pass on a shared pool socket's O_NONBLOCK */
+	if (((flags = fcntl(cli_fd, F_GETFL)) != -1) && (flags & O_NONBLOCK))
+		(void) fcntl(cli_fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+/* main loop that deals with network requests */
+int
+hgd_listen_loop(void)
+{
+	struct sockaddr_in	cli_addr;
+	int			cli_fd, child_pid = 0;
+	socklen_t		cli_addr_len;
+	int			data_ready;
+	struct pollfd		pfd[2];
+
+start:
+
+	if ((svr_fd = hgd_bind_socket()) < 0)
+		return (HGD_FAIL);
+
+	if (listen(svr_fd, sock_backlog) < 0) {
+		DPRINTF(HGD_D_ERROR, "Listen: %s", SERROR);
+		return (HGD_FAIL);
+	}
+
+	DPRINTF(HGD_D_INFO, "Socket ready and listening on port %d", port);
+
+	/* setup signal handler */
+	signal(SIGCHLD, hgd_sigchld);
+
+	while (1) {
+		DPRINTF(HGD_D_INFO, "waiting for client connection");
+
+		/* spin until something is ready, answering metrics scrapes */
+		pfd[0].fd = svr_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = metrics_fd; /* ignored by poll if -1 */
+		pfd[1].events = POLLIN;
+		data_ready = 0;
+
+		while (!dying && !restarting && !data_ready) {
+			pfd[0].revents = pfd[1].revents = 0;
+			hgd_log_flush();
+			if (poll(pfd, 2, INFTIM) == -1) {
+				if (errno != EINTR) {
+					DPRINTF(HGD_D_ERROR, "Poll error");
+					dying = 1;
+				}
+				continue;
+			}
+
+			if (pfd[1].revents & POLLIN)
+				hgd_metrics_serve(metrics_fd);
+
+			data_ready = pfd[0].revents;
+		}
+
+		if (dying || restarting) {
+			if (restarting)
+				exit_ok = 1;
+			return (HGD_FAIL);
+		}
+
+		cli_addr_len = sizeof(cli_addr);
+		cli_fd = accept(svr_fd, (struct sockaddr *) &cli_addr,
+		    &cli_addr_len);
+
+		if (cli_fd < 0) {
+			DPRINTF(HGD_D_WARN, "Server failed to accept");
+			close(svr_fd);
+			/*
+			 * accept will fail next time aswell :\
+			 * it seems the fix is to re-initialise the socket
+			 */
+			goto start;
+		}
+
+		if ((!single_client) &&
+		    (hgd_admit(cli_fd, &cli_addr) != HGD_OK))
+			continue;
+
+		hgd_client_sockopts(cli_fd);
+
+		/* counted before the fork, so SIGCHLD can't beat us to it */
+		HGD_STATS_INC(conns_accepted);
+		HGD_STATS_INC(conns_active);
+		__sync_fetch_and_add(&n_sessions, 1);
+
+		/* ok, let's deal with that request then */
+		if (!single_client)
+			child_pid = fork();
+
+		/*
+		 * remember child pid can not return or
+		 * the pid file will be removed.
+		 */
+		if (!child_pid) {
+
+			/* turn off HUP handler */
+			//signal(SIGHUP, SIG_DFL);
+
+			/* our children aren't sessions */
+			signal(SIGCHLD, hgd_sigchld_reap);
+
+			/* the listener answers scrapes, not us */
+			if ((!single_client) && (metrics_fd >= 0)) {
+				close(metrics_fd);
+				metrics_fd = -1;
+			}
+
+			/*
+			 * nor do we listen. hgd_exit_nicely() would shut the
+			 * listening socket down under our parent's feet.
+			 */
+			if (!single_client) {
+				close(svr_fd);
+				svr_fd = -1;
+			}
+
+			if (hgd_open_db(&main_ctx, db_path, 0) != HGD_OK)
+				hgd_exit_nicely();
+
+			hgd_service_client(cli_fd, &cli_addr);
+			DPRINTF(HGD_D_DEBUG, "client service complete");
+
+			if (single_client)
+				HGD_STATS_ADD(conns_active, -1);
+
+			/* and we are done with this client */
+			if (shutdown(cli_fd, SHUT_RDWR) == -1)
+				DPRINTF(HGD_D_WARN, "Can't shutdown socket");
+			close(cli_fd);
+
+			close(svr_fd);
+			svr_fd = -1; /* prevent shutdown of svr_fd */
+			exit_ok = 1;
+			hgd_exit_nicely();
+		} /* child block ends */
+
+		if (child_pid < 0) {
+			DPRINTF(HGD_D_WARN, "Can't fork: %s", SERROR);
+			HGD_STATS_ADD(conns_active, -1);
+			__sync_fetch_and_sub(&n_sessions, 1);
+		}
+
+		close (cli_fd);
+		DPRINTF(HGD_D_DEBUG, "client servicer PID = '%d'", child_pid);
+		/* otherwise, back round for the next client */
+	}
+}
+
+/* a no-op, but a worker exiting interrupts the pool master's poll() */
+void
+hgd_sigchld_pool(int sig)
+{
+	(void) sig;
+
+	signal(SIGCHLD, hgd_sigchld_pool);
+}
+
+/*
+ * a pool worker (-P). Serve clients one after another on one database
+ * connection, taking turns with the other workers to accept on the
+ * master's socket. A worker only accepts while it is free, so a client
+ * never queues behind a busy one. Retire after worker_sessions clients,
+ * and the master starts a fresh worker. Never returns.
+ */
+void
+hgd_worker(int slot)
+{
+	struct sockaddr_in	cli_addr;
+	socklen_t		cli_addr_len;
+	struct pollfd		pfd;
+	int			cli_fd, ready, served = 0;
+	uint8_t			failed = 0;
+
+	worker_slot = slot;
+	signal(SIGCHLD, hgd_sigchld_reap);
+
+	/* a client going away mid-reply must not take the worker with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* the master answers scrapes, not us */
+	if (metrics_fd >= 0) {
+		close(metrics_fd);
+		metrics_fd = -1;
+	}
+
+	if (hgd_open_db(&main_ctx, db_path, 0) != HGD_OK)
+		hgd_exit_nicely();
+	hgd_db_cache_stmts(&main_ctx, 1);
+
+	DPRINTF(HGD_D_INFO, "Worker %d ready", slot);
+
+	pfd.fd = svr_fd;
+	pfd.events = POLLIN;
+
+	while (!dying && !restarting) {
+		if ((worker_sessions > 0) && (served >= worker_sessions))
+			break;
+
+		pfd.revents = 0;
+		hgd_log_flush();
+		ready = poll(&pfd, 1, INFTIM);
+		if (ready == -1) {
+			if (errno != EINTR) {
+				DPRINTF(HGD_D_ERROR, "Poll error: %s", SERROR);
+				failed = 1;
+				break;
+			}
+			continue;
+		}
+
+		cli_addr_len = sizeof(cli_addr);
+		cli_fd = accept(svr_fd, (struct sockaddr *) &cli_addr,
+		    &cli_addr_len);
+
+		if (cli_fd < 0) {
+			/* another worker may beat us to it */
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+			    (errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			DPRINTF(HGD_D_ERROR, "Worker failed to accept: %s",
+			    SERROR);
+			failed = 1;
+			break;
+		}
+
+		if (hgd_admit(cli_fd, &cli_addr) != HGD_OK)
+			continue;
+
+		hgd_client_sockopts(cli_fd);
+
+		HGD_STATS_INC(conns_accepted);
+		HGD_STATS_INC(conns_active);
+
+		hgd_service_client(cli_fd, &cli_addr);
+		DPRINTF(HGD_D_DEBUG, "client service complete");
+
+		HGD_STATS_ADD(conns_active, -1);
+		served++;
+
+		/* and we are done with this client */
+		if (shutdown(cli_fd, SHUT_RDWR) == -1)
+			DPRINTF(HGD_D_WARN, "Can't shutdown socket");
+		close(cli_fd);
+	}
+
+	DPRINTF(HGD_D_INFO, "Worker %d exiting after %d clients",
+	    slot, served);
+
+	/* the master restarts, if anyone */
+	restarting = 0;
+	exit_ok = !failed;
+	hgd_exit_nicely();
+}
+
+void
+hgd_start_worker(int slot)
+{
+	pid_t			pid;
+
+	pid = fork();
+	if (pid == 0)
+		hgd_worker(slot); /* NOREACH */
+
+	if (pid < 0) {
+		DPRINTF(HGD_D_WARN, "Can't fork worker: %s", SERROR);
+		workers[slot].respawn_at = time(NULL) + HGD_WORKER_RESPAWN_SECS;
+		return;
+	}
+
+	DPRINTF(HGD_D_DEBUG, "worker %d PID = '%d'", slot, pid);
+	workers[slot].pid = pid;
+}
+
+/*
+ * pre-forked mode (-P). Keep pool_size workers serving clients, starting
+ * another whenever one retires or dies, and meanwhile answer metrics
+ * scrapes. A crashed worker isn't replaced straight away, in case the
+ * replacement would crash just the same.
+ */
+int
+hgd_pool_loop(void)
+{
+	struct pollfd		pfd;
+	pid_t			pid;
+	time_t			now;
+	int			i, status;
+
+	if ((svr_fd = hgd_bind_socket()) < 0)
+		return (HGD_FAIL);
+
+	/* accepted on by all, so we can't block if beaten to it */
+	if ((listen(svr_fd, sock_backlog) < 0) ||
+	    (fcntl(svr_fd, F_SETFL, O_NONBLOCK) < 0)) {
+		DPRINTF(HGD_D_ERROR, "Listen: %s", SERROR);
+		return (HGD_FAIL);
+	}
+	DPRINTF(HGD_D_INFO, "%d workers sharing port %d", pool_size, port);
+
+	workers = xcalloc(pool_size, sizeof(struct hgd_worker));
+	signal(SIGCHLD, hgd_sigchld_pool);
+
+	pfd.fd = metrics_fd; /* ignored by poll if -1 */
+	pfd.events = POLLIN;
+
+	while (!dying && !restarting) {
+		now = time(NULL);
+		for (i = 0; i < pool_size; i++) {
+			if ((workers[i].pid == 0) &&
+			    (now >= workers[i].respawn_at))
+				hgd_start_worker(i);
+		}
+
+		/* SIGCHLD wakes us, the timeout is for delayed respawns */
+		pfd.revents = 0;
+		hgd_log_flush();
+		if (poll(&pfd, 1, HGD_WORKER_RESPAWN_SECS * 1000) == -1) {
+			if (errno != EINTR) {
+				DPRINTF(HGD_D_ERROR, "Poll error");
+				dying = 1;
+			}
+		} else if (pfd.revents & POLLIN)
+			hgd_metrics_serve(metrics_fd);
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < pool_size; i++) {
+				if (workers[i].pid == pid)
+					break;
+			}
+			if (i == pool_size)
+				continue;
+
+			workers[i].pid = 0;
+			if ((WIFEXITED(status)) && (WEXITSTATUS(status) == 0))
+				continue;
+
+			DPRINTF(HGD_D_WARN, "Worker %d died (status %d), "
+			    "replacing it in %d secs", i, status,
+			    HGD_WORKER_RESPAWN_SECS);
+			workers[i].respawn_at =
+			    time(NULL) + HGD_WORKER_RESPAWN_SECS;
+		}
+	}
+
+	/* workers must not outlive us, or a restarted us */
+	for (i = 0; i < pool_size; i++) {
+		if (workers[i].pid > 0)
+			kill(workers[i].pid, SIGTERM);
+	}
+	hgd_log_flush();
+	for (i = 0; i < pool_size; i++) {
+		if (workers[i].pid > 0)
+			waitpid(workers[i].pid, NULL, 0);
+	}
+	free(workers);
+	workers = NULL;
+
+	if (restarting)
+		exit_ok = 1;
+
+	return (HGD_FAIL);
+}
+
+/*
+ * a parked 'watch' (see hgd_cmd_watch()) is over once the playlist changes,
+ * after HGD_WATCH_TIMEOUT, or when the client speaks (spoke), much as if
+ * it had been waiting all along. version is the core's latest look at the
+ * playlist, which is what the core's sessions snapshot from.
+ */
+void
+hgd_core_watch(struct hgd_session *sess, int version, uint8_t spoke)
+{
+	char			**evs = NULL;
+	int			 n_evs = 0;
+	time_t			 now = time(NULL);
+
+	if (!spoke) {
+		n_evs = hgd_watch_check(sess, version, &evs);
+		if ((n_evs == 0) &&
+		    (now - sess->watch_since < HGD_WATCH_TIMEOUT))
+			return;
+	}
+
+	if (n_evs < 0)
+		hgd_outbuf_line(&sess->out, "err|" HGD_RESP_E_INT);
+	else
+		hgd_watch_reply(sess, evs, n_evs);
+
+	sess->watch_since = 0;
+	sess->last_active = now;
+
+	hgd_outbuf_flush(sess->ctx, &sess->out, sess->sock_fd, sess->ssl);
+	if (sess->ctx->deadline_missed != HGD_DEADLINE_NONE)
+		hgd_reap_client(sess);
+}
+
+/*
+ * when a session on a core runs out of time, and which deadline that is
+ * (*which), 0 if never. A handshake or a line which has begun is held to
+ * the header deadline, each chunk of an upload to the upload deadline,
+ * replies the client isn't taking to the send deadline and a client
+ * between commands to the idle deadline.
+ */
+time_t
+hgd_core_deadline(struct hgd_session *sess, int *which)
+{
+	time_t			since;
+	int			secs;
+
+	if (sess->tls_since != 0) {
+		*which = HGD_DEADLINE_HEADER;
+		since = sess->tls_since;
+	} else if (sess->upload != NULL) {
+		*which = HGD_DEADLINE_UPLOAD;
+		since = sess->upload->chunk_since;
+	} else if (sess->out.want != 0) {
+		*which = HGD_DEADLINE_SEND;
+		since = sess->out.stalled;
+	} else if (sess->in_len > 0) {
+		*which = HGD_DEADLINE_HEADER;
+		since = sess->in_since;
+	} else {
+		*which = HGD_DEADLINE_IDLE;
+		since = sess->last_active;
+	}
+
+	secs = sess->ctx->deadline_secs[*which];
+	return ((secs > 0) ? since + secs : 0);
+}
+
+/*
+ * how long a core may sleep: until its soonest deadline, or its next look
+ * at the playlist if anyone is parked in 'watch'.
+ */
+int
+hgd_core_timeout(struct hgd_core *core, time_t now)
+{
+	struct hgd_session	*sess;
+	time_t			 deadline;
+	int			 i, which, left, wait_ms = INFTIM;
+
+	for (i = 0; i < core->n_sess; i++) {
+		sess = core->sess[i];
+		if (sess->watch_since != 0)
+			left = HGD_WATCH_POLL_MS;
+		else if ((deadline = hgd_core_deadline(sess, &which)) != 0) {
+			left = (deadline - now) * 1000;
+			if (left < 0)
+				left = 0;
+		} else
+			continue;
+
+		if ((wait_ms == INFTIM) || (left < wait_ms))
+			wait_ms = left;
+	}
+
+	for (i = 0; i < core->n_closing; i++) {
+		left = (core->closing[i].until - now) * 1000;
+		if (left < 0)
+			left = 0;
+		if ((wait_ms == INFTIM) || (left < wait_ms))
+			wait_ms = left;
+	}
+
+	return (wait_ms);
+}
+
+/*
+ * a session on a core is over, hang up and forget it. After our TLS goodbye
+ * the client sends its own, which would be met with a reset if the socket
+ * were gone, so that socket is kept for a moment (see hgd_core_linger()).
+ */
+void
+hgd_core_drop(struct hgd_core *core, struct hgd_session *sess)
+{
+	struct hgd_core_closing	*cl;
+	uint8_t			 linger;
+
+	linger = (sess->ssl != NULL) && (!sess->hangup) &&
+	    (sess->tls_since == 0);
+	hgd_session_end(sess);
+
+	if (linger) {
+		if (shutdown(sess->sock_fd, SHUT_WR) == -1)
+			DPRINTF(HGD_D_DEBUG, "Can't shutdown socket: %s",
+			    SERROR);
+		core->closing = xrealloc(core->closing,
+		    sizeof(*core->closing) * (core->n_closing + 1));
+		cl = &core->closing[core->n_closing++];
+		cl->fd = sess->sock_fd;
+		cl->until = time(NULL) + HGD_CORE_LINGER_SECS;
+	} else {
+		if (shutdown(sess->sock_fd, SHUT_RDWR) == -1)
+			DPRINTF(HGD_D_DEBUG, "Can't shutdown socket: %s",
+			    SERROR);
+		close(sess->sock_fd);
+	}
+
+	free(sess->cli_addr);
+	free(sess);
+
+	HGD_STATS_ADD(conns_active, -1);
+	__sync_fetch_and_sub(&n_sessions, 1);
+}
+
+/*
+ * take on the clients which hgd_threads_loop() sent us. Returns HGD_FAIL
+ * once it has closed our pipe.
+ */
+int
+hgd_core_accept(struct hgd_core *core)
+{
+	struct hgd_core_conn	 conn;
+	struct hgd_session	*sess;
+	struct sockaddr_in	*cli_addr;
+	ssize_t			 n;
+
+	while ((n = read(core->wake[0], &conn, sizeof(conn))) ==
+	    sizeof(conn)) {
+		cli_addr = xmalloc(sizeof(*cli_addr));
+		*cli_addr = conn.addr;
+
+		sess = xmalloc(sizeof(*sess));
+		hgd_session_begin(sess, &core->ctx, conn.fd, cli_addr, 1);
+		if (sess->hangup) {
+			hgd_core_drop(core, sess);
+			continue;
+		}
+
+		core->sess = xrealloc(core->sess,
+		    sizeof(*core->sess) * (core->n_sess + 1));
+		core->sess[core->n_sess++] = sess;
+	}
+
+	return ((n == 0) ? HGD_FAIL : HGD_OK);
+}
+
+/*
+ * see off the first n sockets hgd_core_drop() kept, whose poll results are
+ * in pfd: throw away what the client sends and close once it has closed
+ * too, or its time is up.
+ */
+void
+hgd_core_linger(struct hgd_core *core, struct pollfd *pfd, int n, time_t now)
+{
+	struct hgd_core_closing	*cl;
+	char			 junk[HGD_MAX_LINE];
+	ssize_t			 got;
+	int			 i;
+
+	/* backwards, as a closed socket swaps in the last */
+	for (i = n - 1; i >= 0; i--) {
+		cl = &core->closing[i];
+
+		got = 1;
+		if (pfd[i].revents != 0) {
+			got = recv(cl->fd, junk, sizeof(junk), MSG_DONTWAIT);
+			if ((got == -1) && ((errno == EAGAIN) ||
+			    (errno == EWOULDBLOCK) || (errno == EINTR)))
+				got = 1;
+		}
+
+		if ((got > 0) && (now < cl->until))
+			continue;
+
+		close(cl->fd);
+		*cl = core->closing[--core->n_closing];
+	}
+}
+
+/*
+ * read what a session on a core has sent of its next command, without
+ * waiting, into sess->in. A plain line is peeked at first so that we take
+ * no more than it, leaving an upload or a handshake which follows on the
+ * socket. Over SSL each line comes in its own HGD_MAX_LINE frame. Returns
+ * 1 and the line (free when done) once all of it is here, 0 until then, -1
+ * if the client went away.
+ */
+int
+hgd_core_read_line(struct hgd_session *sess, char **line)
+{
+	char			*eol = NULL;
+	ssize_t			 n;
+	int			 ssl_err;
+
+	if (sess->in == NULL)
+		sess->in = xmalloc(HGD_MAX_LINE + 1);
+
+	if (sess->ssl != NULL) {
+		n = SSL_read(sess->ssl, sess->in + sess->in_len,
+		    HGD_MAX_LINE - sess->in_len);
+		if (n <= 0) {
+			ssl_err = SSL_get_error(sess->ssl, n);
+			if ((ssl_err == SSL_ERROR_WANT_READ) ||
+			    (ssl_err == SSL_ERROR_WANT_WRITE))
+				return (0);
+			if (ssl_err != SSL_ERROR_ZERO_RETURN)
+				PRINT_SSL_ERR(HGD_D_WARN, "SSL_read");
+			return (-1);
+		}
+
+		sess->in_len += n;
+		if (sess->in_len < HGD_MAX_LINE)
+			goto partial;
+
+		/* get rid of \r\n */
+		sess->in[HGD_MAX_LINE] = 0;
+		eol = strstr(sess->in, "\r\n");
+		if (eol == NULL)
+			DPRINTF(HGD_D_WARN,
+			    "could not locate \\r\\n terminator");
+		else
+			*eol = 0;
+		goto done;
+	}
 
-		goto clean;
+	n = recv(sess->sock_fd, sess->in + sess->in_len,
+	    HGD_MAX_LINE - 1 - sess->in_len, MSG_PEEK | MSG_DONTWAIT);
+	if (n == 0)
+		return (-1);
+	if (n < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+		    (errno == EINTR))
+			return (0);
+		DPRINTF(HGD_D_WARN, "recv: %s", SERROR);
+		return (-1);
 	}
 
-	/* bye has special meaning */
-	if (strcmp(correct_desp->cmd, "bye") == 0) {
-		bye = 1;
-		goto clean;
+	eol = memchr(sess->in + sess->in_len, '\n', n);
+	if (eol != NULL)
+		n = eol - (sess->in + sess->in_len) + 1;
+
+	if (recv(sess->sock_fd, sess->in + sess->in_len, n,
+	    MSG_DONTWAIT) != n) {
+		DPRINTF(HGD_D_WARN, "recv: %s", SERROR);
+		return (-1);
+	}
+	sess->in_len += n;
+
+	if (eol == NULL) {
+		if (sess->in_len < HGD_MAX_LINE - 1)
+			goto partial;
+		DPRINTF(HGD_D_ERROR, "Socket line was long");
+		sess->in[sess->in_len] = 0;
+		goto done;
 	}
 
-	/* if the server is *only* accepting SSL connections, a number
-	 * of commands will be out of bounds until encryption is
-	 * estabished.
-	 */
-	if ((crypto_pref == HGD_CRYPTO_PREF_ALWAYS) &&
-	    (correct_desp->secure) &&
-	    (sess->ssl == NULL)) {
-		DPRINTF(HGD_D_INFO, "Client '%s' is trying to bypass SSL",
+	/* get rid of \r\n */
+	*eol = 0;
+	if ((eol > sess->in) && (eol[-1] == '\r'))
+		eol[-1] = 0;
+done:
+	*line = xstrdup(sess->in);
+	sess->in_len = 0;
+	sess->in_since = 0;
+	return (1);
+partial:
+	if (sess->in_since == 0)
+		sess->in_since = time(NULL);
+	return (0);
+}
+
+/* an evented upload is over, see hgd_upload_end() */
+void
+hgd_core_upload_end(struct hgd_session *sess, int ret)
+{
+	if (hgd_upload_end(sess, sess->upload, ret) != HGD_OK) {
+		DPRINTF(HGD_D_INFO, "despatch of 'q' for '%s' returned -1",
 		    sess->cli_str);
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_SSLREQ);
-		num_bad_commands++;
-		goto clean;
-	}
+		sess->bad_commands++;
+	} else
+		sess->bad_commands = 0;
+	sess->upload = NULL;
 
-	/* user should be authenticated for some comands */
-	if (correct_desp->auth_needed && sess->user == NULL) {
-		DPRINTF(HGD_D_INFO, "User not authenticated to use '%s'",
-		    correct_desp->cmd);
-		hgd_sock_send_line(sess->sock_fd, sess->ssl,
-		    "err|" HGD_RESP_E_DENY);
-		num_bad_commands++;
-		goto clean;
-	}
+	hgd_outbuf_flush(sess->ctx, &sess->out, sess->sock_fd, sess->ssl);
+	hgd_session_settle(sess);
+}
 
-	/* if admin command, check user is an admin */
-	if (correct_desp->authlevel != HGD_AUTH_NONE) {
-		DPRINTF(HGD_D_DEBUG, "Checking authlevel..."
-		    "expecting %d, got %d",
-		    correct_desp->authlevel, sess->user->perms);
-		if (!(sess->user->perms & correct_desp->authlevel)) {
-			DPRINTF(HGD_D_INFO,
-			    "'%s': unauthorised use of admin command",
-			    sess->cli_str);
-			hgd_sock_send_line(sess->sock_fd, sess->ssl,
-			    "err|" HGD_RESP_E_DENY);
-			num_bad_commands++;
-			goto clean;
+/*
+ * take what has arrived of a session's upload (see hgd_cmd_queue()),
+ * without waiting, and finish it once all of it has.
+ */
+void
+hgd_core_upload(struct hgd_session *sess)
+{
+	struct hgd_upload	*up = sess->upload;
+	char			 payload[HGD_BINARY_RECV_SZ];
+	ssize_t			 chunk, n;
+	int			 ssl_err;
+
+	chunk = up->len - up->got;
+	if (chunk > HGD_BINARY_RECV_SZ)
+		chunk = HGD_BINARY_RECV_SZ;
+
+	if (sess->ssl != NULL) {
+		n = SSL_read(sess->ssl, payload, chunk);
+		if (n <= 0) {
+			ssl_err = SSL_get_error(sess->ssl, n);
+			if ((ssl_err == SSL_ERROR_WANT_READ) ||
+			    (ssl_err == SSL_ERROR_WANT_WRITE))
+				return;
+			PRINT_SSL_ERR(HGD_D_ERROR, "SSL_read");
+			goto fail;
+		}
+	} else {
+		n = recv(sess->sock_fd, payload, chunk, MSG_DONTWAIT);
+		if ((n < 0) && ((errno == EAGAIN) ||
+		    (errno == EWOULDBLOCK) || (errno == EINTR)))
+			return;
+		if (n <= 0) {
+			DPRINTF(HGD_D_ERROR, "failed to recv binary: %s",
+			    (n == 0) ? "client went away" : SERROR);
+			goto fail;
 		}
 	}
 
-	/* otherwise despatch */
-	if (correct_desp->handler(sess, &tokens[1]) != HGD_OK) {
-		/*
-		 * This happens often, ie when a client tries to
-		 * vote off twice, and that is fine, so we put the message
-		 * in INFO rather than WARN.
-		 */
-		DPRINTF(HGD_D_INFO, "despatch of '%s' for '%s' returned -1",
-		    tokens[0], sess->cli_str);
-		num_bad_commands++;
-	} else
-		num_bad_commands = 0;
+	if (write(up->f, payload, n) != n) {
+		DPRINTF(HGD_D_ERROR, "Failed to write %d bytes: %s",
+		    (int) n, SERROR);
+		goto fail;
+	}
 
-clean:
-	/* free tokens */
-	for (; n_toks > 0; )
-		free(tokens[--n_toks]);
+	/* the deadline is for each HGD_BINARY_RECV_SZ, as when blocking */
+	if (up->got / HGD_BINARY_RECV_SZ != (up->got + n) / HGD_BINARY_RECV_SZ)
+		up->chunk_since = time(NULL);
+	up->got += n;
 
-	return (bye);
+	if (up->got == up->len)
+		hgd_core_upload_end(sess, HGD_OK);
+	return;
+fail:
+	hgd_core_upload_end(sess, HGD_FAIL);
 }
 
+/*
+ * a session on a core missed a deadline (see hgd_core_deadline()). A cut
+ * short upload is still answered, as it would be when blocking.
+ */
 void
-hgd_service_client(int cli_fd, struct sockaddr_in *cli_addr)
+hgd_core_expire(struct hgd_session *sess, int which)
 {
-	struct hgd_session	 sess;
-	char			*recv_line;
-	uint8_t			 exit, ssl_ret = 0, i;
+	if (sess->upload != NULL) {
+		(void) hgd_upload_end(sess, sess->upload, HGD_FAIL);
+		sess->upload = NULL;
+		hgd_outbuf_flush(sess->ctx, &sess->out, sess->sock_fd,
+		    sess->ssl);
+	}
 
-	sess.cli_str = hgd_identify_client(cli_addr);
-	sess.sock_fd = cli_fd;
-	sess.cli_addr = cli_addr;
-	sess.user = NULL;
-	sess.ssl = NULL;
+	sess->ctx->deadline_missed = which;
+	hgd_reap_client(sess);
+}
 
-	if (sess.cli_str == NULL)
-		xasprintf(&sess.cli_str, "unknown"); /* shouldn't happen */
+/*
+ * what a core polls a session's socket for. While replies wait, nothing
+ * more is read from the client, but an upload's payload, which the client
+ * won't wait to send.
+ */
+short
+hgd_core_events(struct hgd_session *sess)
+{
+	if (sess->tls_since != 0)
+		return (sess->tls_want);
 
-	DPRINTF(HGD_D_INFO, "Client connection: '%s'", sess.cli_str);
+	if ((sess->out.want != 0) && (sess->upload == NULL))
+		return (sess->out.want);
 
-	/* oh hai */
-	hgd_sock_send_line(cli_fd, sess.ssl, "ok|" HGD_RESP_O_GREET);
+	return (POLLIN | sess->out.want);
+}
 
-	/* main command recieve loop */
-	do {
-		recv_line = hgd_sock_recv_line(sess.sock_fd, sess.ssl);
-		exit = hgd_parse_line(&sess, recv_line);
-		free(recv_line);
-		if (num_bad_commands >= HGD_MAX_BAD_COMMANDS) {
-			DPRINTF(HGD_D_INFO,"Client abused server, "
-			    "kicking '%s'", sess.cli_str);
-			/* laters */
-			hgd_sock_send_line(cli_fd, sess.ssl,
-			    "err|" HGD_RESP_E_KICK);
-			close(sess.sock_fd);
-			exit_ok = 1;
-			hgd_exit_nicely();
-		}
-	} while (!exit && !dying && !restarting);
+/*
+ * do what a session on a core is ready for, without waiting: send replies
+ * which were held up, carry on a handshake or an upload, or take the next
+ * command. Returns 1 if the session is over.
+ */
+uint8_t
+hgd_core_step(struct hgd_session *sess)
+{
+	char			*line;
+	uint8_t			 over;
+	int			 got;
+
+	if (sess->out.want != 0) {
+		hgd_outbuf_flush(sess->ctx, &sess->out, sess->sock_fd,
+		    sess->ssl);
+		if ((sess->out.want != 0) && (sess->upload == NULL))
+			return (0);
+	}
 
-	/*
-	 * client service procs should not respawn as liesteners,
-	 * that would suck. This may need tweaking later, as the exit
-	 * message may be misinterpreted (?) Handling HUP is hard.
-	 */
-	if (restarting) {
-		dying = 1;
-		restarting = 0;
-		exit_ok = 1;
+	if (sess->tls_since != 0) {
+		hgd_session_handshake(sess);
+		return (sess->hangup);
 	}
 
-	/* laters */
-	if (restarting || dying) {
-		/*
-		 * we send an error that a client will pick up upon their next
-		 * request. Clients should expect this at any time.
-		 */
-		hgd_sock_send_line(cli_fd, sess.ssl, "err|" HGD_RESP_E_SHTDWN);
-	} else
-		hgd_sock_send_line(cli_fd, sess.ssl, "ok|" HGD_RESP_O_BYE);
+	if (sess->upload != NULL) {
+		hgd_core_upload(sess);
+		return (sess->hangup);
+	}
 
-	/* free up the hgd_session members */
-	if (sess.cli_str != NULL)
-		free(sess.cli_str);
-
-	if (sess.ssl != NULL) {
-		/* as per SSL_shutdown() manual, we call at most twice */
-		for (i = 0; i < 2; i++) {
-			ssl_ret = SSL_shutdown(sess.ssl);
-			if (ssl_ret == 1)
-				break;
+	if ((got = hgd_core_read_line(sess, &line)) == 0)
+		return (0);
+	if (got < 0)
+		return (1);
+
+	over = hgd_session_command(sess, line);
+	free(line);
+
+	return (over);
+}
+
+/*
+ * a core (-t). Serve all of the clients handed to us, doing whatever each
+ * is ready for and never waiting on any one of them: lines, uploads, TLS
+ * handshakes and replies all go as far as they can and carry on when the
+ * socket is next ready (see hgd_core_step()). A client waiting between
+ * commands, or parked in 'watch', costs only its socket and buffers.
+ * Commands are run on our own read connection, with its statements
+ * prepared; writes go to the shared writer_ctx.
+ */
+void *
+hgd_core_run(void *arg)
+{
+	struct hgd_core		*core = arg;
+	struct hgd_session	*sess;
+	struct pollfd		*pfd = NULL;
+	time_t			 now, deadline;
+	int			 i, n_polled, n_closing, n_parked, wait_ms;
+	int			 which;
+	int			 version = 0;
+	uint8_t			 open = 1, over, ready;
+
+	DPRINTF(HGD_D_INFO, "Core %d ready", core->id);
+
+	while ((open) && (!dying) && (!restarting)) {
+		n_polled = core->n_sess;
+		n_closing = core->n_closing;
+		n_parked = 0;
+		pfd = xrealloc(pfd, sizeof(*pfd) * (n_polled + n_closing + 1));
+
+		pfd[0].fd = core->wake[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+
+		wait_ms = hgd_core_timeout(core, time(NULL));
+		for (i = 0; i < n_polled; i++) {
+			sess = core->sess[i];
+			pfd[i + 1].fd = sess->sock_fd;
+			pfd[i + 1].events = hgd_core_events(sess);
+			pfd[i + 1].revents = 0;
+
+			if (sess->watch_since != 0)
+				n_parked++;
+
+			/* SSL may have read ahead of the last command */
+			if ((pfd[i + 1].events & POLLIN) &&
+			    (sess->ssl != NULL) && (SSL_pending(sess->ssl) > 0))
+				wait_ms = 0;
 		}
 
-		if (ssl_ret != 1)
-			DPRINTF(HGD_D_WARN, "couldn't shutdown SSL");
+		for (i = 0; i < n_closing; i++) {
+			pfd[n_polled + i + 1].fd = core->closing[i].fd;
+			pfd[n_polled + i + 1].events = POLLIN;
+			pfd[n_polled + i + 1].revents = 0;
+		}
 
-		SSL_free(sess.ssl);
-	}
+		hgd_log_flush();
+		if (poll(pfd, n_polled + n_closing + 1, wait_ms) == -1) {
+			if (errno == EINTR)
+				continue;
+			DPRINTF(HGD_D_ERROR, "Poll error: %s", SERROR);
+			break;
+		}
+
+		/* one look at the playlist does for everyone watching */
+		if ((n_parked > 0) &&
+		    (hgd_get_data_version(&core->ctx, &version) != HGD_OK))
+			DPRINTF(HGD_D_WARN, "Can't get playlist version");
+
+		/* backwards, as a dropped session swaps in the last */
+		now = time(NULL);
+		for (i = n_polled - 1; i >= 0; i--) {
+			sess = core->sess[i];
+			over = 0;
+
+			/* our context is everyone's, each starts afresh */
+			sess->ctx->deadline_missed = HGD_DEADLINE_NONE;
+
+			ready = (pfd[i + 1].revents != 0) ||
+			    ((pfd[i + 1].events & POLLIN) &&
+			    (sess->ssl != NULL) &&
+			    (SSL_pending(sess->ssl) > 0));
+			if (ready) {
+				if (sess->watch_since != 0)
+					hgd_core_watch(sess, version, 1);
+				if (!sess->hangup)
+					over = hgd_core_step(sess);
+			} else if (sess->watch_since != 0)
+				hgd_core_watch(sess, version, 0);
+
+			/* a trickle of bytes doesn't put a deadline off */
+			deadline = 0;
+			if ((!over) && (!sess->hangup) &&
+			    (sess->watch_since == 0))
+				deadline = hgd_core_deadline(sess, &which);
+			if ((deadline != 0) && (now >= deadline))
+				hgd_core_expire(sess, which);
+
+			/* nothing more we say would get there */
+			if (sess->out.broken)
+				sess->hangup = 1;
+
+			if ((over) || (sess->hangup)) {
+				hgd_core_drop(core, sess);
+				core->sess[i] = core->sess[--core->n_sess];
+			}
+		}
+
+		hgd_core_linger(core, &pfd[n_polled + 1], n_closing, now);
 
-	if (sess.user) {
-		if (sess.user->name)
-			free(sess.user->name);
-		free(sess.user);
+		if (pfd[0].revents != 0)
+			open = (hgd_core_accept(core) == HGD_OK);
 	}
-}
 
-void
-hgd_sigchld(int sig)
-{
-	(void) sig;
+	/* we are going down, see everyone off */
+	while (core->n_sess > 0)
+		hgd_core_drop(core, core->sess[--core->n_sess]);
+	while (core->n_closing > 0)
+		close(core->closing[--core->n_closing].fd);
 
-	waitpid(-1, NULL, 0); /* clear up exit status from proc table */
-	signal(SIGCHLD, hgd_sigchld);
+	free(core->sess);
+	core->sess = NULL;
+	free(core->closing);
+	core->closing = NULL;
+	free(pfd);
+
+	DPRINTF(HGD_D_INFO, "Core %d exiting", core->id);
+	hgd_log_flush();
+
+	return (NULL);
 }
 
-/* main loop that deals with network requests */
+/* open a core's read connection and start its thread */
 int
-hgd_listen_loop(void)
+hgd_core_start(struct hgd_core *core, int id)
 {
-	struct sockaddr_in	addr, cli_addr;
-	int			cli_fd, child_pid = 0;
-	socklen_t		cli_addr_len;
-	int			sockopt = 1, data_ready;
-	struct pollfd		pfd;
+	core->id = id;
 
-start:
+	hgd_ctx_init(&core->ctx);
+	memcpy(core->ctx.deadline_secs, main_ctx.deadline_secs,
+	    sizeof(core->ctx.deadline_secs));
+	core->ctx.writer = &writer_ctx;
+	core->ctx.on_dying = NULL;
 
-	DPRINTF(HGD_D_DEBUG, "Setting up socket");
+	if (hgd_open_db(&core->ctx, db_path, 0) != HGD_OK)
+		return (HGD_FAIL);
+	hgd_db_cache_stmts(&core->ctx, 1);
 
-	if ((svr_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		DPRINTF(HGD_D_ERROR, "socket(): %s", SERROR);
+	if (pipe(core->wake) < 0) {
+		DPRINTF(HGD_D_ERROR, "Can't make pipe: %s", SERROR);
+		hgd_close_db(&core->ctx);
 		return (HGD_FAIL);
 	}
+	(void) fcntl(core->wake[0], F_SETFL, O_NONBLOCK);
 
-	/* allow socket to be re-used right away after we exit */
-	if (setsockopt(svr_fd, SOL_SOCKET, SO_REUSEADDR,
-		     &sockopt, sizeof(sockopt)) < 0) {
-		DPRINTF(HGD_D_WARN, "Can't set SO_REUSEADDR");
+	if (pthread_create(&core->thread, NULL, hgd_core_run, core) != 0) {
+		DPRINTF(HGD_D_ERROR, "Can't start core %d", id);
+		close(core->wake[0]);
+		close(core->wake[1]);
+		hgd_close_db(&core->ctx);
+		return (HGD_FAIL);
 	}
 
-	/* configure socket */
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port = htons(port);
+	return (HGD_OK);
+}
 
-	if (bind(svr_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-		DPRINTF(HGD_D_ERROR, "Bind to port %d: %s", port, SERROR);
+/*
+ * threaded mode (-t). Run a core on each of loop_threads threads, one per
+ * CPU by default, and accept clients for them, handing each new client to
+ * the next core in turn. Each core reads on its own database connection;
+ * writes from all of them queue for one shared connection.
+ */
+int
+hgd_threads_loop(void)
+{
+	struct sockaddr_in	 cli_addr;
+	struct hgd_core_conn	 conn;
+	struct hgd_core		*core;
+	struct pollfd		 pfd[2];
+	socklen_t		 cli_addr_len;
+	sigset_t		 sigs, old_sigs;
+	int			 cli_fd, i, next = 0;
+
+	if ((svr_fd = hgd_bind_socket()) < 0)
 		return (HGD_FAIL);
-	}
 
 	if (listen(svr_fd, sock_backlog) < 0) {
 		DPRINTF(HGD_D_ERROR, "Listen: %s", SERROR);
 		return (HGD_FAIL);
 	}
 
-	DPRINTF(HGD_D_INFO, "Socket ready and listening on port %d", port);
-
-	/* setup signal handler */
-	signal(SIGCHLD, hgd_sigchld);
-
-	while (1) {
-		DPRINTF(HGD_D_INFO, "waiting for client connection");
+	/* a client going away mid-reply must not take everyone with it */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, hgd_sigchld_reap);
 
-		/* spin until something is ready */
-		pfd.fd = svr_fd;
-		pfd.events = POLLIN;
-		data_ready = 0;
+	hgd_ctx_init(&writer_ctx);
+	if (hgd_open_db(&writer_ctx, db_path, 0) != HGD_OK)
+		return (HGD_FAIL);
+	hgd_db_cache_stmts(&writer_ctx, 1);
+	writer_ctx.lock = &writer_lock;
+
+	n_cores = loop_threads;
+	if (n_cores == 0)
+		n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cores < 1)
+		n_cores = 1;
+	cores = xcalloc(n_cores, sizeof(struct hgd_core));
+
+	/* signals are for us, the cores see the flags they set */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+
+	for (i = 0; i < n_cores; i++) {
+		if (hgd_core_start(&cores[i], i) != HGD_OK)
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
 
-		while (!dying && !restarting && !data_ready) {
-			data_ready = poll(&pfd, 1, INFTIM);
-			if (data_ready == -1) {
-				if (errno != EINTR) {
-					DPRINTF(HGD_D_ERROR, "Poll error");
-					dying = 1;
-				}
-				data_ready = 0;
+	if (i < n_cores) {
+		n_cores = i;
+		dying = 1;
+	} else
+		DPRINTF(HGD_D_INFO, "%d cores listening on port %d",
+		    n_cores, port);
+
+	pfd[0].fd = svr_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = metrics_fd; /* ignored by poll if -1 */
+	pfd[1].events = POLLIN;
+
+	while (!dying && !restarting) {
+		pfd[0].revents = pfd[1].revents = 0;
+		hgd_log_flush();
+		if (poll(pfd, 2, INFTIM) == -1) {
+			if (errno != EINTR) {
+				DPRINTF(HGD_D_ERROR, "Poll error");
+				dying = 1;
 			}
+			continue;
 		}
 
-		if (dying || restarting) {
-			if (restarting)
-				exit_ok = 1;
-			return (HGD_FAIL);
-		}
+		if (pfd[1].revents & POLLIN)
+			hgd_metrics_serve(metrics_fd);
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
 
 		cli_addr_len = sizeof(cli_addr);
 		cli_fd = accept(svr_fd, (struct sockaddr *) &cli_addr,
 		    &cli_addr_len);
 
 		if (cli_fd < 0) {
-			DPRINTF(HGD_D_WARN, "Server failed to accept");
-			close(svr_fd);
-			/*
-			 * accept will fail next time aswell :\
-			 * it seems the fix is to re-initialise the socket
-			 */
-			goto start;
-		}
-
-		if (setsockopt(cli_fd, SOL_SOCKET, SO_REUSEADDR,
-			    &sockopt, sizeof(sockopt)) < 0) {
-			DPRINTF(HGD_D_WARN, "Can't set SO_REUSEADDR");
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			DPRINTF(HGD_D_ERROR, "Server failed to accept: %s",
+			    SERROR);
+			dying = 1;
+			continue;
 		}
 
-		/* ok, let's deal with that request then */
-		if (!single_client)
-			child_pid = fork();
-
-		/*
-		 * remember child pid can not return or
-		 * the pid file will be removed.
-		 */
-		if (!child_pid) {
+		if (hgd_admit(cli_fd, &cli_addr) != HGD_OK)
+			continue;
 
-			/* turn off HUP handler */
-			//signal(SIGHUP, SIG_DFL);
+		hgd_client_sockopts(cli_fd);
 
-			db = hgd_open_db(db_path, 0);
-			if (db == NULL)
-				hgd_exit_nicely();
+		HGD_STATS_INC(conns_accepted);
+		HGD_STATS_INC(conns_active);
+		__sync_fetch_and_add(&n_sessions, 1);
 
-			hgd_service_client(cli_fd, &cli_addr);
-			DPRINTF(HGD_D_DEBUG, "client service complete");
+		conn.fd = cli_fd;
+		conn.addr = cli_addr;
+		core = &cores[next];
+		next = (next + 1) % n_cores;
 
-			/* and we are done with this client */
-			if (shutdown(cli_fd, SHUT_RDWR) == -1)
-				DPRINTF(HGD_D_WARN, "Can't shutdown socket");
+		if (write(core->wake[1], &conn, sizeof(conn)) != sizeof(conn)) {
+			DPRINTF(HGD_D_WARN, "Can't hand client to core %d: %s",
+			    core->id, SERROR);
 			close(cli_fd);
+			HGD_STATS_ADD(conns_active, -1);
+			__sync_fetch_and_sub(&n_sessions, 1);
+		}
+	}
 
-			close(svr_fd);
-			svr_fd = -1; /* prevent shutdown of svr_fd */
-			exit_ok = 1;
-			hgd_exit_nicely();
-		} /* child block ends */
+	/* closing its pipe wakes a core, and it says goodbye to its clients */
+	for (i = 0; i < n_cores; i++)
+		close(cores[i].wake[1]);
 
-		close (cli_fd);
-		DPRINTF(HGD_D_DEBUG, "client servicer PID = '%d'", child_pid);
-		/* otherwise, back round for the next client */
+	for (i = 0; i < n_cores; i++) {
+		pthread_join(cores[i].thread, NULL);
+		close(cores[i].wake[0]);
+		hgd_close_db(&cores[i].ctx);
+		hgd_cleanup_net(&cores[i].ctx);
 	}
+
+	free(cores);
+	cores = NULL;
+	hgd_close_db(&writer_ctx);
+
+	if (restarting)
+		exit_ok = 1;
+
+	return (HGD_FAIL);
 }
 
 int
@@ -1399,6 +3365,11 @@ hgd_read_config(char **config_locations)
 	hgd_cfg_netd_port(cf, &port);
 	hgd_cfg_netd_max_filesize(cf, &max_upload_size);
 	hgd_cfg_netd_sslcert(cf, &ssl_cert_path);
+	hgd_cfg_netd_timeouts(cf, main_ctx.deadline_secs);
+	hgd_cfg_netd_admission(cf, &sock_backlog, &max_sessions,
+	    &conn_rate, &conn_burst);
+	hgd_cfg_netd_pool(cf, &pool_size, &worker_sessions);
+	hgd_cfg_netd_threads(cf, &loop_threads);
 	hgd_cfg_debug(cf, "netd", &hgd_debug);
 	hgd_cfg_netd_voteoff_sound(cf, &vote_sound);
 
@@ -1409,11 +3380,39 @@ hgd_read_config(char **config_locations)
 	return (HGD_OK);
 }
 
+/*
+ * -M when not given. Sessions on -t cores are only sockets, so there we
+ * take as many clients as half the open file limit, leaving the rest for
+ * uploads and connections being closed. 0 for no cap.
+ */
+int
+hgd_dfl_max_sessions(void)
+{
+	struct rlimit		rl;
+
+	if ((loop_threads < 0) || (single_client))
+		return (HGD_DFL_MAX_SESSIONS);
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		DPRINTF(HGD_D_WARN, "Can't get open file limit: %s", SERROR);
+		return (HGD_DFL_MAX_SESSIONS);
+	}
+
+	if ((rl.rlim_cur == RLIM_INFINITY) || (rl.rlim_cur / 2 > INT_MAX))
+		return (0);
+
+	DPRINTF(HGD_D_DEBUG, "Serving at most %d clients",
+	    (int) (rl.rlim_cur / 2));
+	return (rl.rlim_cur / 2);
+}
+
 void
 hgd_usage(void)
 {
 	printf("usage: hgd-netd <options>\n");
 	printf("    -B			Do not daemonise, run in foreground\n");
+	printf("    -b <num>		Set connections allowed in a burst\n");
+	printf("    -C <path>		Capture client commands to a file\n");
 #ifdef HAVE_LIBCONFIG
 	printf("    -c <path>		Path to a config file to use\n");
 #endif
@@ -1424,12 +3423,23 @@ hgd_usage(void)
 	printf("    -f			Don't fork - service single client (debug)\n");
 	printf("    -F			Flood limit (-1 for no limit)\n");
 	printf("    -h			Show this message and exit\n");
+	printf("    -H <secs>		Set time to finish a command line\n");
+	printf("    -I <secs>		Set time to wait for a command\n");
 	printf("    -k <path>		Set path to SSL private key file\n");
+	printf("    -l <num>		Set listen backlog\n");
+	printf("    -M <num>		Set maximum concurrent sessions\n");
 	printf("    -n <num>		Set number of votes required to vote-off\n");
+	printf("    -P <num>		Pre-fork a pool of worker processes\n");
 	printf("    -p <port>		Set network port number\n");
+	printf("    -R <num>		Retire workers after <num> clients\n");
+	printf("    -r <num>		Set connections per minute per address\n");
 	printf("    -s <mbs>		Set maximum upload size (in MB)\n");
 	printf("    -S <path>		Set path to SSL certificate file\n");
+	printf("    -T <num>		Time command parsing and exit (debug)\n");
+	printf("    -t <num>		Serve clients on <num> threads\n");
+	printf("    -U <secs>		Set time to send an upload chunk\n");
 	printf("    -v			Show version and exit\n");
+	printf("    -W <secs>		Set time to send a reply\n");
 	printf("    -x <level>		Set debug level (0-3)\n");
 	printf("    -y <path>		Set path to noise to play when voting off\n");
 }
@@ -1440,9 +3450,14 @@ main(int argc, char **argv)
 	char			*config_path[4] = {NULL, NULL, NULL, NULL};
 	int			 num_config = 2, ch;
 
+	/* before anything which might log or fail */
+	hgd_component = HGD_COMPONENT_HGD_NETD;
+	hgd_exit_cb = hgd_exit_nicely;
+
 	/* as early as possible */
 	hgd_register_sig_handlers();
 	HGD_INIT_SYSLOG_DAEMON();
+	hgd_ctx_init(&main_ctx);
 
 #ifdef HAVE_LIBCONFIG
 	config_path[0] = NULL;
@@ -1452,9 +3467,14 @@ main(int argc, char **argv)
 	state_path = xstrdup(HGD_DFL_DIR);
 	ssl_key_path = xstrdup(HGD_DFL_KEY_FILE);
 	ssl_cert_path = xstrdup(HGD_DFL_CERT_FILE);
+	main_ctx.deadline_secs[HGD_DEADLINE_IDLE] = HGD_DFL_IDLE_TIMEOUT;
+	main_ctx.deadline_secs[HGD_DEADLINE_HEADER] = HGD_DFL_HEADER_TIMEOUT;
+	main_ctx.deadline_secs[HGD_DEADLINE_UPLOAD] = HGD_DFL_UPLOAD_TIMEOUT;
+	main_ctx.deadline_secs[HGD_DEADLINE_SEND] = HGD_DFL_SEND_TIMEOUT;
 
 	DPRINTF(HGD_D_DEBUG, "Parsing options:1");
-	while ((ch = getopt(argc, argv, "Bc:Dd:EefF:hk:n:p:s:S:vx:y:")) != -1) {
+	while ((ch = getopt(argc, argv,
+	    "Bb:C:c:Dd:EefF:hH:I:k:l:M:n:P:p:R:r:s:S:T:t:U:vW:x:y:")) != -1) {
 		switch (ch) {
 		case 'c':
 			if (num_config < 3) {
@@ -1489,12 +3509,23 @@ main(int argc, char **argv)
 	hgd_read_config(config_path + num_config);
 
 	DPRINTF(HGD_D_DEBUG, "Parsing options:2");
-	while ((ch = getopt(argc, argv, "Bc:Dd:EefF:hk:n:p:s:S:vx:y:")) != -1) {
+	while ((ch = getopt(argc, argv,
+	    "Bb:C:c:Dd:EefF:hH:I:k:l:M:n:P:p:R:r:s:S:T:t:U:vW:x:y:")) != -1) {
 		switch (ch) {
 		case 'B':
 			background = 0;
 			DPRINTF(HGD_D_DEBUG, "Not \"backgrounding\" daemon.");
 			break;
+		case 'b':
+			conn_burst = atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set connection burst to %d",
+			    conn_burst);
+			break;
+		case 'C':
+			free(capture_path);
+			capture_path = xstrdup(optarg);
+			DPRINTF(HGD_D_DEBUG, "Capturing to '%s'", capture_path);
+			break;
 		case 'c':
 			break; /* already handled */
 		case 'D':
@@ -1523,21 +3554,58 @@ main(int argc, char **argv)
 			DPRINTF(HGD_D_DEBUG, "Set flood limit to %d",
 			    flood_limit);
 			break;
+		case 'H':
+			main_ctx.deadline_secs[HGD_DEADLINE_HEADER] =
+			    atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set header timeout to %d",
+			    main_ctx.deadline_secs[HGD_DEADLINE_HEADER]);
+			break;
+		case 'I':
+			main_ctx.deadline_secs[HGD_DEADLINE_IDLE] =
+			    atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set idle timeout to %d",
+			    main_ctx.deadline_secs[HGD_DEADLINE_IDLE]);
+			break;
 		case 'k':
 			free(ssl_key_path);
 			ssl_key_path = optarg;
 			DPRINTF(HGD_D_DEBUG,
 			    "set ssl private key path to '%s'", ssl_key_path);
 			break;
+		case 'l':
+			sock_backlog = atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set listen backlog to %d",
+			    sock_backlog);
+			break;
+		case 'M':
+			max_sessions = atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set max sessions to %d",
+			    max_sessions);
+			break;
 		case 'n':
 			req_votes = atoi(optarg);
 			DPRINTF(HGD_D_DEBUG,
 			    "Set required-votes to %d", req_votes);
 			break;
+		case 'P':
+			pool_size = atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set worker pool size to %d",
+			    pool_size);
+			break;
 		case 'p':
 			port = atoi(optarg);
 			DPRINTF(HGD_D_DEBUG, "Set port to %d", port);
 			break;
+		case 'R':
+			worker_sessions = atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set worker sessions to %d",
+			    worker_sessions);
+			break;
+		case 'r':
+			conn_rate = atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set connection rate to %d",
+			    conn_rate);
+			break;
 		case 's':
 			max_upload_size = strtoll(optarg, NULL, 0) * HGD_MB;
 			DPRINTF(HGD_D_DEBUG, "Set max upload size to %lld",
@@ -1549,11 +3617,31 @@ main(int argc, char **argv)
 			DPRINTF(HGD_D_DEBUG,
 			    "set ssl cert path to '%s'", ssl_cert_path);
 			break;
+		case 'T':
+			parse_bench_iters = atoi(optarg);
+			break;
+		case 't':
+			loop_threads = atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set loop threads to %d",
+			    loop_threads);
+			break;
+		case 'U':
+			main_ctx.deadline_secs[HGD_DEADLINE_UPLOAD] =
+			    atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set upload timeout to %d",
+			    main_ctx.deadline_secs[HGD_DEADLINE_UPLOAD]);
+			break;
 		case 'v':
 			hgd_print_version();
 			exit_ok = 1;
 			hgd_exit_nicely();
 			break;
+		case 'W':
+			main_ctx.deadline_secs[HGD_DEADLINE_SEND] =
+			    atoi(optarg);
+			DPRINTF(HGD_D_DEBUG, "Set send timeout to %d",
+			    main_ctx.deadline_secs[HGD_DEADLINE_SEND]);
+			break;
 		case 'x':
 			DPRINTF(HGD_D_DEBUG, "set debug to %d", atoi(optarg));
 			hgd_debug = atoi(optarg);
@@ -1578,6 +3666,15 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (hgd_cmd_hash_init() != HGD_OK)
+		hgd_exit_nicely();
+
+	if (parse_bench_iters > 0) {
+		hgd_parse_bench(parse_bench_iters);
+		exit_ok = 1;
+		hgd_exit_nicely();
+	}
+
 	/* set up paths */
 	xasprintf(&db_path, "%s/%s", state_path, HGD_DB_NAME);
 	xasprintf(&filestore_path, "%s/%s", state_path, HGD_FILESTORE_NAME);
@@ -1585,12 +3682,28 @@ main(int argc, char **argv)
 	umask(~S_IRWXU);
 	hgd_mk_state_dir();
 
-	db = hgd_open_db(db_path, 0);
-	if (db == NULL)
+	/* before we daemonise and lose our working directory */
+	if (capture_path != NULL) {
+		capture_fd = open(capture_path,
+		    O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (capture_fd < 0) {
+			DPRINTF(HGD_D_ERROR, "Can't open capture file '%s': %s",
+			    capture_path, SERROR);
+			hgd_exit_nicely();
+		}
+		DPRINTF(HGD_D_WARN, "Capturing client commands to '%s'",
+		    capture_path);
+		free(capture_path);
+		capture_path = NULL;
+	}
+
+	if (hgd_open_db(&main_ctx, db_path, 0) != HGD_OK)
 		hgd_exit_nicely();
 
-	sqlite3_close(db); /* re-opened later */
-	db = NULL;
+	hgd_stats_setup();
+	hgd_db_sync_stats(&main_ctx);
+
+	hgd_close_db(&main_ctx); /* re-opened later */
 
 	/* unless the user actively disables SSL, we try to be capable */
 	if (crypto_pref != HGD_CRYPTO_PREF_NEVER) {
@@ -1616,12 +3729,27 @@ main(int argc, char **argv)
 	if (background)
 		hgd_daemonise();
 
+	/* now we know our pid */
+	hgd_stats_register(HGD_STATS_NETD);
+	metrics_fd = hgd_metrics_listen(HGD_COMPONENT_HGD_NETD);
+
 	if (hgd_write_pid_file() != HGD_OK) {
 		DPRINTF(HGD_D_ERROR, "Can't write PID away");
 		return (HGD_FAIL);
 	}
 
-	hgd_listen_loop();
+	if ((conn_table = hgd_conn_table_map()) == NULL)
+		DPRINTF(HGD_D_WARN, "Not rate limiting connections");
+
+	if (max_sessions < 0)
+		max_sessions = hgd_dfl_max_sessions();
+
+	if ((loop_threads >= 0) && (!single_client))
+		hgd_threads_loop();
+	else if ((pool_size > 0) && (!single_client))
+		hgd_pool_loop();
+	else
+		hgd_listen_loop();
 
 	if (hgd_unlink_pid_file() != HGD_OK)
 		DPRINTF(HGD_D_ERROR, "Can't unlink pidfile");
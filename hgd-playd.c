@@ -29,6 +29,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,13 +47,43 @@
 #include "db.h"
 #include "hgd.h"
 #include "mplayer.h"
-
-const char			*hgd_component = HGD_COMPONENT_HGD_PLAYD;
+#include "stats.h"
 
 uint8_t				 purge_finished_db = 1;
 uint8_t				 purge_finished_fs = 1;
 uint8_t				 clear_playlist_on_start = 0;
 int				 background = 1;
+struct hgd_ctx			 main_ctx;
+#ifdef HAVE_PYTHON
+volatile sig_atomic_t		 py_reload_requested = 0;
+#endif
+/* when the last track stopped, 0 if we have been idle since */
+uint64_t			 last_track_end = 0;
+/* when the track about to be played was looked up */
+uint64_t			 track_fetched = 0;
+int				 metrics_fd = -1;
+
+/* a way of playing a track, run in a forked child which must not return */
+struct hgd_player {
+	char			*name;
+	void			(*play)(struct hgd_playlist_item *, char *);
+};
+
+void				 hgd_mplayer_play(struct hgd_playlist_item *,
+				     char *);
+void				 hgd_null_play(struct hgd_playlist_item *,
+				     char *);
+
+struct hgd_player		 players[] = {
+	{ "mplayer",		hgd_mplayer_play },
+	/* plays silence for the track's duration, for testing */
+	{ "null",		hgd_null_play },
+	{ NULL,			NULL }
+};
+
+struct hgd_player		*player = &players[0];
+/* the null player plays for this fraction of the track's duration */
+double				 null_play_scale = 1.0;
 
 /*
  * clean up, exit. if exit_ok = 0, an error (signal/error)
@@ -63,12 +94,15 @@ hgd_exit_nicely()
 	if (!exit_ok)
 		DPRINTF(HGD_D_ERROR, "hgd-playd was interrupted or crashed\n");
 
+	hgd_metrics_close(HGD_COMPONENT_HGD_PLAYD, metrics_fd);
+	hgd_stats_unregister(HGD_STATS_PLAYD);
+
 	if (mplayer_fifo_path)
 		free(mplayer_fifo_path);
-	if (db)
-		sqlite3_close(db);
+	hgd_close_db(&main_ctx);
 	if (state_path)
 		free(state_path);
+	hgd_stats_close();
 	if (db_path)
 		free (db_path);
 	if (filestore_path)
@@ -87,6 +121,74 @@ hgd_exit_nicely()
 	exit (!exit_ok);
 }
 
+void
+hgd_mplayer_play(struct hgd_playlist_item *t, char *pipe_arg)
+{
+	execlp("mplayer", "mplayer", "-really-quiet", "-slave",
+	    "-input", pipe_arg, t->filename, "-vo", "null",
+	    (char *) NULL);
+
+	/* if we get here, the shit hit the fan with execlp */
+	DPRINTF(HGD_D_ERROR, "execlp() failed");
+	hgd_exit_nicely(); /* child should always exit */
+}
+
+/*
+ * Pretend to play for the tagged duration of the track (scaled), obeying
+ * "pause" and "stop" on the input fifo like mplayer would. We are a fork
+ * of a threaded process, so stick to async-signal-safe calls.
+ */
+void
+hgd_null_play(struct hgd_playlist_item *t, char *pipe_arg)
+{
+	struct pollfd		 pfd;
+	char			 buf[128];
+	int64_t			 left_ms;
+	uint64_t		 start;
+	uint8_t			 paused = 0;
+	ssize_t			 n;
+
+	(void) pipe_arg;
+
+	left_ms = (t->tags.duration > 0 ?
+	    t->tags.duration : HGD_NULL_PLAY_DFL_SECS) * 1000 * null_play_scale;
+
+	/*
+	 * if the fifo can't be opened, poll() ignores the -1 and we just
+	 * sleep. We hold a write end open too, else poll() would report
+	 * POLLHUP forever once the first command's writer has gone.
+	 */
+	pfd.fd = open(mplayer_fifo_path, O_RDONLY | O_NONBLOCK);
+	if (pfd.fd >= 0)
+		open(mplayer_fifo_path, O_WRONLY | O_NONBLOCK);
+	pfd.events = POLLIN;
+
+	while ((left_ms > 0) || (paused)) {
+		start = hgd_stats_now_usecs();
+		hgd_log_flush();
+		if (poll(&pfd, 1, paused ? INFTIM : (int) left_ms) < 1)
+			n = 0;
+		else
+			n = read(pfd.fd, buf, sizeof(buf) - 1);
+
+		if (!paused)
+			left_ms -= (hgd_stats_now_usecs() - start) / 1000;
+
+		if (n <= 0)
+			continue;
+		buf[n] = '\0';
+
+		if ((strstr(buf, "stop") != NULL) ||
+		    (strstr(buf, "quit") != NULL))
+			break;
+
+		if (strstr(buf, "pause") != NULL)
+			paused = !paused;
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
 /*
  * Please do not be tempted to move this to mplayer.c --
  * This would cause hgd-admin and hgd-netd to pull in python
@@ -98,9 +200,10 @@ hgd_play_track(struct hgd_playlist_item *t, uint8_t purge_fs, uint8_t purge_db)
 	char			*ipc_path = 0, *pipe_arg = 0;
 	FILE			*ipc_file;
 	struct stat		st;
+	uint64_t		started, skipped;
 
 	DPRINTF(HGD_D_INFO, "Playing '%s' for '%s'", t->filename, t->user);
-	if (hgd_mark_playing(t->id) == HGD_FAIL)
+	if (hgd_mark_playing(&main_ctx, t->id) == HGD_FAIL)
 		goto clean;
 
 	/*
@@ -144,7 +247,7 @@ hgd_play_track(struct hgd_playlist_item *t, uint8_t purge_fs, uint8_t purge_db)
 	}
 
 #ifdef HAVE_PYTHON
-	hgd_execute_py_hook("pre_play");
+	hgd_execute_py_hook(HGD_PY_HOOK_PRE_PLAY);
 #endif
 
 	if (hgd_make_mplayer_input_fifo() != HGD_OK)
@@ -152,23 +255,24 @@ hgd_play_track(struct hgd_playlist_item *t, uint8_t purge_fs, uint8_t purge_db)
 
 	xasprintf(&pipe_arg, "file=%s", mplayer_fifo_path);
 
+	/* how long was the silence between this track and the last? */
+	started = hgd_stats_now_usecs();
+	if (last_track_end != 0)
+		hgd_stats_timing(HGD_STATS_TRACK_GAP, started - last_track_end);
+	if (track_fetched != 0)
+		hgd_stats_timing(HGD_STATS_PLAY_START, started - track_fetched);
+
 	pid = fork();
 	if (pid < 0) {
 		DPRINTF(HGD_D_ERROR, "Could not fork: %s", SERROR);
 	} else if (!pid) {
-
 		/* child - your the d00d who will play this track */
-		execlp("mplayer", "mplayer", "-really-quiet", "-slave",
-		    "-input", pipe_arg, t->filename, "-vo", "null",
-		    (char *) NULL);
-
-		/* if we get here, the shit hit the fan with execlp */
-		DPRINTF(HGD_D_ERROR, "execlp() failed");
-		hgd_exit_nicely(); /* child should always exit */
+		player->play(t, pipe_arg);
 	} else {
-		DPRINTF(HGD_D_INFO,
-		    "Mplayer spawned, waiting to finish: pid=%d", pid);
+		DPRINTF(HGD_D_INFO, "Player '%s' spawned, waiting to finish: "
+		    "pid=%d", player->name, pid);
 
+		hgd_log_flush();
 		if (waitpid(pid, &status, 0) < 0) {
 			/* it is ok for this to fail if we are restarting */
 			if (errno != EINTR)
@@ -181,6 +285,15 @@ hgd_play_track(struct hgd_playlist_item *t, uint8_t purge_fs, uint8_t purge_db)
 				}
 			}
 		}
+		last_track_end = hgd_stats_now_usecs();
+
+		/* were we told to skip? how long did the player take to go? */
+		skipped = (hgd_stats != NULL) ? hgd_stats->skip_requested : 0;
+		if ((skipped != 0) && (skipped >= started)) {
+			hgd_stats_timing(HGD_STATS_SKIP,
+			    last_track_end - skipped);
+			HGD_STATS_SET(skip_requested, 0);
+		}
 
 		/* unlink ipc file */
 		if (hgd_file_open_and_lock(
@@ -214,14 +327,14 @@ hgd_play_track(struct hgd_playlist_item *t, uint8_t purge_fs, uint8_t purge_db)
 		}
 	}
 #ifdef HAVE_PYTHON
-	hgd_execute_py_hook("post_play");
+	hgd_execute_py_hook(HGD_PY_HOOK_POST_PLAY);
 #endif
 
 	DPRINTF(HGD_D_DEBUG, "Finished playing (exit %d)", status);
 
 	/* if we are restarting, we replay the track on restart */
 	if ((!restarting) && (!dying) &&
-	    (hgd_mark_finished(t->id, purge_db) == HGD_FAIL))
+	    (hgd_mark_finished(&main_ctx, t->id, purge_db) == HGD_FAIL))
 		DPRINTF(HGD_D_WARN,
 		    "Could not purge/mark finished -- trying to continue");
 
@@ -236,6 +349,30 @@ clean:
 	return (ret);
 }
 
+#ifdef HAVE_PYTHON
+void
+hgd_py_reload_sighandler(int sig)
+{
+	(void) sig;
+	py_reload_requested = 1;
+}
+
+/* SIGUSR1 asks us to reload the Python user scripts */
+void
+hgd_register_py_reload_handler(void)
+{
+	struct sigaction	sa;
+
+	sa.sa_handler = hgd_py_reload_sighandler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART; /* don't interrupt a playing track */
+
+	if (sigaction(SIGUSR1, &sa, NULL) != 0)
+		DPRINTF(HGD_D_WARN,
+		    "registering sighandler failed: %s", SERROR);
+}
+#endif
+
 int
 hgd_play_loop(void)
 {
@@ -247,7 +384,16 @@ hgd_play_loop(void)
 	while ((!dying) && (!restarting)) {
 		memset(&track, 0, sizeof(track));
 
-		if (hgd_get_next_track(&track) == HGD_FAIL) {
+#ifdef HAVE_PYTHON
+		/* not in the handler, it needs locks */
+		if (py_reload_requested) {
+			py_reload_requested = 0;
+			hgd_reload_py();
+		}
+#endif
+
+		track_fetched = hgd_stats_now_usecs();
+		if (hgd_get_next_track(&main_ctx, &track) == HGD_FAIL) {
 			ret = HGD_FAIL;
 			break;
 		}
@@ -256,18 +402,20 @@ hgd_play_loop(void)
 			DPRINTF(HGD_D_DEBUG, "next track is: '%s'",
 			    track.filename);
 
-			hgd_clear_votes();
+			hgd_clear_votes(&main_ctx);
 			if (hgd_play_track(&track,
 			    purge_finished_fs, purge_finished_db) != HGD_OK) {
 				ret = HGD_FAIL;
 				break;
 			}
-			hgd_clear_votes();
+			hgd_clear_votes(&main_ctx);
 		} else {
 			DPRINTF(HGD_D_DEBUG, "no tracks to play");
+			last_track_end = 0; /* idle time is not a gap */
 #ifdef HAVE_PYTHON
-			hgd_execute_py_hook("nothing_to_play");
+			hgd_execute_py_hook(HGD_PY_HOOK_NOTHING_TO_PLAY);
 #endif
+			hgd_log_flush();
 			sleep(1);
 		}
 		hgd_free_playlist_item(&track);
@@ -318,11 +466,13 @@ hgd_usage(void)
 	printf("    -C			Clear playlist on startup\n");
 	printf("    -d <path>		Set hgd state directory\n");
 	printf("    -h			Show this message and exit\n");
+	printf("    -m <player>		Player to use: mplayer (default) or null\n");
 	printf("    -p			Don't purge finished tracks from filesystem\n");
 #ifdef HAVE_PYTHON
 	printf("    -P <path>		Location of Python plugins\n");
 #endif
 	printf("    -q			Don't purge finished tracks in database\n");
+	printf("    -s <scale>		Null player plays for scale * duration\n");
 	printf("    -v			Show version and exit\n");
 	printf("    -x <level>		Set debug level (0-3)\n");
 }
@@ -333,9 +483,14 @@ main(int argc, char **argv)
 	char			*config_path[4] = {NULL, NULL, NULL, NULL};
 	int			 num_config = 2, ch;
 
+	/* before anything which might log or fail */
+	hgd_component = HGD_COMPONENT_HGD_PLAYD;
+	hgd_exit_cb = hgd_exit_nicely;
+
 	/* early as possible */
 	hgd_register_sig_handlers();
 	HGD_INIT_SYSLOG_DAEMON();
+	hgd_ctx_init(&main_ctx);
 
 #ifdef HAVE_LIBCONFIG
 	config_path[0] = NULL;
@@ -346,7 +501,7 @@ main(int argc, char **argv)
 	state_path = xstrdup(HGD_DFL_DIR);
 
 	DPRINTF(HGD_D_DEBUG, "Parsing options:1");
-	while ((ch = getopt(argc, argv, "Bc:Cd:hpP:qvx:")) != -1) {
+	while ((ch = getopt(argc, argv, "Bc:Cd:hm:pP:qs:vx:")) != -1) {
 		switch (ch) {
 		case 'c':
 			if (num_config < 3) {
@@ -388,7 +543,7 @@ main(int argc, char **argv)
 		hgd_exit_nicely();
 
 	DPRINTF(HGD_D_DEBUG, "Parsing options");
-	while ((ch = getopt(argc, argv, "Bc:Cd:hpP:qvx:")) != -1) {
+	while ((ch = getopt(argc, argv, "Bc:Cd:hm:pP:qs:vx:")) != -1) {
 		switch (ch) {
 		case 'B':
 			background = 0;
@@ -406,6 +561,17 @@ main(int argc, char **argv)
 			state_path = xstrdup(optarg);
 			DPRINTF(HGD_D_DEBUG, "set hgd dir to '%s'", state_path);
 			break;
+		case 'm':
+			for (player = players; player->name != NULL; player++) {
+				if (strcmp(player->name, optarg) == 0)
+					break;
+			}
+			if (player->name == NULL) {
+				DPRINTF(HGD_D_ERROR, "Unknown player '%s'", optarg);
+				hgd_exit_nicely();
+			}
+			DPRINTF(HGD_D_DEBUG, "Using player '%s'", player->name);
+			break;
 		case 'p':
 			DPRINTF(HGD_D_DEBUG, "No purging from fs");
 			purge_finished_fs = 0;
@@ -422,6 +588,11 @@ main(int argc, char **argv)
 			DPRINTF(HGD_D_DEBUG, "No purging from db");
 			purge_finished_db = 0;
 			break;
+		case 's':
+			null_play_scale = atof(optarg);
+			DPRINTF(HGD_D_DEBUG, "Null player scale %f",
+			    null_play_scale);
+			break;
 		case 'v':
 			hgd_print_version();
 			exit_ok = 1;
@@ -453,15 +624,17 @@ main(int argc, char **argv)
 	umask(~S_IRWXU);
 	hgd_mk_state_dir();
 
-	db = hgd_open_db(db_path, 0);
-	if (db == NULL)
+	if (hgd_open_db(&main_ctx, db_path, 0) != HGD_OK)
 		hgd_exit_nicely();
 
-	if (hgd_init_playstate() != HGD_OK)
+	if (hgd_stats_open(1) != HGD_OK)
+		DPRINTF(HGD_D_WARN, "Running without stats");
+
+	if (hgd_init_playstate(&main_ctx) != HGD_OK)
 		hgd_exit_nicely();
 
 	if (clear_playlist_on_start) {
-		if (hgd_clear_playlist() != HGD_OK)
+		if (hgd_clear_playlist(&main_ctx) != HGD_OK)
 			hgd_exit_nicely();
 	}
 
@@ -475,8 +648,15 @@ main(int argc, char **argv)
 		DPRINTF(HGD_D_ERROR, "Failed to initialise Python");
 		hgd_exit_nicely();
 	}
+	hgd_register_py_reload_handler();
 #endif
 
+	/* scrapes are answered from a thread, we block while playing */
+	hgd_stats_register(HGD_STATS_PLAYD);
+	metrics_fd = hgd_metrics_listen(HGD_COMPONENT_HGD_PLAYD);
+	if (metrics_fd >= 0)
+		hgd_metrics_start_thread(metrics_fd);
+
 	if (hgd_write_pid_file() != HGD_OK) {
 		DPRINTF(HGD_D_ERROR, "Can't write PID away");
 		return (HGD_FAIL);
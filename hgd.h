@@ -30,6 +30,8 @@
 #define HGD_COMPONENT_HGDC		"hgdc"
 #define HGD_COMPONENT_HGD_MK_PYDOC	"hgd-mk-pydoc"
 #define HGD_COMPONENT_HGD_ADMIN		"hgd-admin"
+#define HGD_COMPONENT_HGD_BENCH		"hgd-bench"
+#define HGD_COMPONENT_HGD_DB_BENCH	"hgd-db-bench"
 
 /* misc */
 #define HGD_DFL_REQ_VOTES	3
@@ -38,6 +40,7 @@
 #define HGD_SHA_SALT_SZ		20
 #define HGD_MAX_PASS_SZ		20
 #define HGD_MAX_USER_QUEUE	5
+#define HGD_MAX_UPLOAD_JOBS	8
 #define HGD_MB			(1024L * 1024L)
 #define HGD_UNIQ_FILE_PFX	"XXXXXXXX-"
 
@@ -70,6 +73,7 @@
 #define HGD_FAIL_ENOENT		(4)	/* file non-existent */
 #define HGD_FAIL_DUPVOTE	(5)	/* duplicate vote */
 #define HGD_FAIL_NOPLAY		(6)	/* nothing is playing */
+#define HGD_FAIL_FLOOD		(7)	/* user queue is full */
 
 /* ANSI colours */
 #define ANSI_YELLOW		(colours_on ? "\033[33m" : "")
@@ -94,10 +98,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <netinet/in.h>
+
 #include <unistd.h>
 #include <stdint.h>
 #include <syslog.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -112,6 +119,7 @@ extern char			 *debug_names[];
 extern int			  syslog_error_map[];
 extern pid_t			  pid;
 extern const char		 *hgd_component;
+extern void			(*hgd_exit_cb)(void);
 
 extern char			 *state_path;
 extern char			 *filestore_path;
@@ -153,6 +161,87 @@ struct hgd_playlist {
 	struct hgd_playlist_item	**items;
 };
 
+/* what a client using 'watch' last saw of the playlist */
+struct hgd_watch {
+	int			data_version;
+	int			playing_id;
+	int			num_votes;
+	int			n_ids;
+	int			*ids;
+};
+
+/* buffered replies, see hgd_outbuf_* in net.c */
+struct hgd_outbuf {
+	char			*buf;
+	size_t			len;
+	size_t			sz;
+	char			*frames;	/* SSL framing scratch */
+	size_t			frames_sz;
+	uint8_t			binary;		/* holds a frame, not lines */
+	size_t			frame;		/* offset of open frame */
+	int			queue_max;	/* deepest send queue seen */
+	uint8_t			nowait;		/* see hgd_outbuf_flush() */
+	size_t			wire_off;	/* nowait: frames sent */
+	size_t			wire_len;	/* nowait: frames to send */
+	short			want;		/* nowait: poll for, if late */
+	time_t			stalled;	/* nowait: fell behind at */
+	uint8_t			broken;		/* nowait: a send failed */
+};
+
+/* a binary reply being read, see hgd_sock_recv_frame() in net.c */
+struct hgd_frame {
+	uint8_t			type;
+	char			*buf;
+	size_t			len;
+	size_t			off;		/* read cursor */
+};
+
+/* kinds of I/O deadline, see struct hgd_ctx. Defaults are in net.h */
+#define HGD_DEADLINE_NONE	-1
+#define HGD_DEADLINE_IDLE	0	/* first byte of the next line */
+#define HGD_DEADLINE_HEADER	1	/* rest of the line, TLS handshake */
+#define HGD_DEADLINE_UPLOAD	2	/* each hgd_sock_recv_bin() */
+#define HGD_DEADLINE_SEND	3	/* peer to take each send */
+#define HGD_N_DEADLINES		4
+
+/*
+ * State for the db.c and net.c calls, which each take one of these. Nothing
+ * in it is shared, so threads which each have their own may call in at
+ * once. Set up with hgd_ctx_init(), release with hgd_close_db() and
+ * hgd_cleanup_net().
+ */
+struct hgd_ctx {
+	/* db.c, see hgd_open_db() */
+	struct sqlite3		*db;
+	struct hgd_db_stmt	*stmts;		/* if caching */
+	struct hgd_ctx		*writer;	/* see hgd_db_write_begin() */
+	pthread_mutex_t		*lock;		/* if shared by threads */
+
+	/*
+	 * net.c. How long each kind of receive or send may wait, in seconds,
+	 * 0 to wait forever. When a deadline passes the call fails and
+	 * deadline_missed says which it was, until the next receive (replies
+	 * sent after a missed deadline must not hide it).
+	 */
+	int			deadline_secs[HGD_N_DEADLINES];
+	int			deadline_missed;
+	int			rcv_armed_fd;	/* see hgd_sock_arm() */
+	int			snd_armed_fd;
+	struct hgd_uring	*uring;		/* once set up */
+	void			(*on_dying)(void); /* see hgd_sock_wait() */
+};
+
+/* a track being received, see hgd_cmd_queue() */
+struct hgd_upload {
+	int			f;		/* into the filestore */
+	char			*path;
+	char			*name;		/* as the client called it */
+	ssize_t			len;
+	ssize_t			got;
+	uint64_t		start;		/* usecs, for the stats */
+	time_t			chunk_since;	/* evented: this chunk began */
+};
+
 /* server side client info */
 struct hgd_session {
 	int			sock_fd;
@@ -160,6 +249,64 @@ struct hgd_session {
 	char			*cli_str;
 	struct hgd_user		*user;
 	SSL			*ssl;
+	struct hgd_watch	*watch;
+	struct hgd_outbuf	out;
+	uint8_t			binary;		/* 'proto|18' was chosen */
+	uint8_t			hangup;		/* end without a goodbye */
+	struct hgd_ctx		*ctx;		/* for db.c and net.c calls */
+	uint8_t			bad_commands;	/* in a row */
+	uint8_t			evented;	/* see hgd_core_run() */
+	time_t			last_active;	/* evented: last command */
+	time_t			watch_since;	/* evented: in 'watch', or 0 */
+	char			*in;		/* evented: a line so far */
+	size_t			in_len;
+	time_t			in_since;	/* evented: the line began */
+	struct hgd_upload	*upload;	/* evented: being received */
+	time_t			tls_since;	/* evented: handshaking, or 0 */
+	short			tls_want;	/* evented: handshake waits */
+};
+
+/* a client address's connection allowance, see hgd_admit_rate() */
+struct hgd_conn_bucket {
+	uint32_t		addr;		/* s_addr, network order */
+	uint64_t		credit;		/* tokens * HGD_MINUTE_USECS */
+	uint64_t		last_usecs;	/* 0 if unused */
+};
+
+/* all of the allowances, in memory shared by pool workers */
+struct hgd_conn_table {
+	pthread_mutex_t		lock;		/* process shared */
+	struct hgd_conn_bucket	buckets[];	/* HGD_CONN_BUCKETS */
+};
+
+/* a pre-forked hgd-netd worker, see hgd_pool_loop() */
+struct hgd_worker {
+	pid_t			pid;		/* 0 if not running */
+	time_t			respawn_at;	/* not before, if it crashed */
+};
+
+/* a client handed to a core by the accepting thread, see hgd_threads_loop() */
+struct hgd_core_conn {
+	int			fd;
+	struct sockaddr_in	addr;
+};
+
+/* a connection a core is seeing out, see hgd_core_drop() */
+struct hgd_core_closing {
+	int			fd;
+	time_t			until;
+};
+
+/* an hgd-netd event loop thread (-t), see hgd_core_run() */
+struct hgd_core {
+	int			id;
+	pthread_t		thread;
+	int			wake[2];	/* struct hgd_core_conn in */
+	struct hgd_ctx		ctx;		/* read connection */
+	struct hgd_session	**sess;
+	int			n_sess;
+	struct hgd_core_closing	*closing;
+	int			n_closing;
 };
 
 struct hgd_admin_cmd {
@@ -212,28 +359,32 @@ enum SERVICE {
 #define HGD_D_INFO		2
 #define HGD_D_DEBUG		3
 
+/*
+ * Most verbose level compiled in. Release builds define this to
+ * HGD_D_INFO, so that debug messages cost nothing at all.
+ */
+#ifndef HGD_D_MAX
+#define HGD_D_MAX		HGD_D_DEBUG
+#endif
+
+/*
+ * Logging is buffered, see hgd_log(). Errors and warnings are written
+ * straight away, the rest at least once a second or on hgd_log_flush(),
+ * which should be called before blocking.
+ */
+#define HGD_LOG_BUF_SZ		(16 * 1024)
+#define HGD_LOG_MAX_MSGS	128
+
 /* simple debug facility */
 #define DPRINTF(level, x...)						\
 	do {								\
-		if (level <= hgd_debug) {				\
-			fprintf(stderr, "[%s - %08d %s:%s():%d]\n\t",	\
-			    debug_names[level], getpid(),		\
-			    __FILE__, __func__, __LINE__);		\
-			fprintf(stderr, x);				\
-			fprintf(stderr, "\n");				\
-			/* same again for syslog */			\
-			syslog(syslog_error_map[level],			\
-			    "[%s - %08d %s:%s():%d]\n\t",		\
-			    debug_names[level], getpid(),		\
-			    __FILE__, __func__, __LINE__);		\
-			syslog(syslog_error_map[level], x);		\
-			closelog();					\
-		}							\
+		if ((level <= HGD_D_MAX) && (level <= hgd_debug))	\
+			hgd_log(level, __FILE__, __func__, __LINE__, x);\
 	} while (0)
 
-#define HGD_INIT_SYSLOG_DAEMON()	openlog(hgd_component, 0, LOG_DAEMON);
-#define HGD_INIT_SYSLOG()		openlog(hgd_component, 0, 0);
-#define HGD_CLOSE_SYSLOG()		closelog();
+#define HGD_INIT_SYSLOG_DAEMON()	hgd_log_init(LOG_DAEMON);
+#define HGD_INIT_SYSLOG()		hgd_log_init(0);
+#define HGD_CLOSE_SYSLOG()		hgd_log_close();
 
 #if defined(__linux__)
 	#define RESET_GETOPT() do {optind = 1;} while (0)
@@ -260,16 +411,21 @@ int				 xasprintf(char **buf, char *fmt, ...);
 void				*xcalloc(size_t sz, size_t size);
 char				*xstrdup(const char *s);
 
+/* library contexts */
+void				 hgd_ctx_init(struct hgd_ctx *ctx);
+
 /* socket ops */
 void				 hgd_cleanup_ssl(SSL_CTX **ctx);
-void				 hgd_sock_send(int fd, char *msg);
-void				 hgd_sock_send_line(int fd, SSL* ssl,
+int				 hgd_sock_send(struct hgd_ctx *ctx, int fd,
 				     char *msg);
-char				*hgd_sock_recv_bin(int fd, SSL* ssl,
-				     ssize_t len);
-char				*hgd_sock_recv_line(int fd, SSL* ssl);
-void				 hgd_sock_send_bin(int fd, SSL* ssl,
-				     char *, ssize_t);
+int				 hgd_sock_send_line(struct hgd_ctx *ctx,
+				     int fd, SSL* ssl, char *msg);
+char				*hgd_sock_recv_bin(struct hgd_ctx *ctx,
+				     int fd, SSL* ssl, ssize_t len);
+char				*hgd_sock_recv_line(struct hgd_ctx *ctx,
+				     int fd, SSL* ssl);
+int				 hgd_sock_send_bin(struct hgd_ctx *ctx,
+				     int fd, SSL* ssl, char *, ssize_t);
 int				 hgd_setup_ssl_ctx(SSL_METHOD **method,
 				     SSL_CTX **ctx, int server,
 				     char *, char *);
@@ -279,6 +435,7 @@ uint8_t				 hgd_is_ip_addr(char *str);
 void				 hgd_mk_state_dir(void);
 void				 hgd_print_version(void);
 void				 hgd_exit_nicely(void);
+void				 hgd_fatal(void);
 void				 hgd_kill_sighandler(int sig);
 void				 hgd_register_sig_handlers(void);
 char				*hgd_sha1(const char *msg, const char *salt);
@@ -298,10 +455,20 @@ int				 hgd_file_unlock_and_close( FILE *file);
 int				 hgd_file_open_and_lock(
 				     char *fname, int type, FILE **file);
 void				 hgd_set_line_colour(char *ansi_code);
+void				 hgd_log(int level, const char *file,
+				     const char *func, int line,
+				     const char *fmt, ...)
+				     __attribute__((format(printf, 5, 6)));
+void				 hgd_log_init(int facility);
+void				 hgd_log_flush(void);
+void				 hgd_log_close(void);
 int				 hgd_unlink_pid_file(void);
 int				 hgd_write_pid_file(void);
+int				 hgd_read_component_pid(
+				     char *component, pid_t *pid);
 int				 hgd_check_component_status(
 				     char *component, int *running);
+int				 hgd_signal_component(char *component, int sig);
 
 
 #endif
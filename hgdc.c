@@ -22,6 +22,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -31,6 +33,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 #include <err.h>
 #include <libgen.h>
@@ -50,36 +53,15 @@
 #include "cfg.h"
 #endif
 
-struct hgd_resp_err {
-	char		*code;
-	char		*meaning;
-};
-
-struct hgd_resp_err hgd_resp_errs[] = {
-	{ "E_INT",		"Internal error" },
-	{ "E_DENY",		"Access denied" },
-	{ "E_FLSIZE",		"File size invalid" },
-	{ "E_FLOOD",		"Flood protect triggered" },
-	{ "E_NOPLAY",		"No track is playing" },
-	{ "E_WRTRK",		"Wrong track" },
-	{ "E_DUPVOTE",		"Duplicate vote" },
-	{ "E_SSLAGN",		"Duplicate SSL negotiation" },
-	{ "E_SSLNOAVAIL",	"SSL not available" },
-	{ "E_INVCMD",		"Invalid command" },
-	{ "E_SSLREQ",		"SSL required" },
-	{ "E_SHTDWN",		"Server is going down" },
-	{ "E_KICK",		"Client misbehaving" },
-	{ "E_PERMNOCHG",	"Perms did not change" },
-	{ "E_USREXIST",		"User already exists" },
-	{ "E_USRNOEXIST",	"User does not exist" },
-	{ 0,			0 }
-};
-
-const char		*hgd_component = HGD_COMPONENT_HGDC;
 uint8_t			 hud_max_items = 0;
+uint8_t			 binary_proto = 0;	/* ls and np reply in frames */
 
-/* protos */
-int			 hgd_check_svr_response(char *resp, uint8_t x);
+/* upload progress of all workers, shared via an anonymous mapping */
+struct hgd_upload_state {
+	volatile int		 next_file;	/* next arg to be uploaded */
+	struct hgd_upload_slot	 slots[HGD_MAX_UPLOAD_JOBS];
+	volatile int8_t		 results[];	/* 0 = pending, 1 = ok, -1 = fail */
+};
 
 void
 hgd_exit_nicely()
@@ -135,627 +117,623 @@ hgd_exit_nicely()
 	_exit(!exit_ok);
 }
 
+void
+hgd_usage()
+{
+	printf("Usage: hgdc [opts] command [args]\n\n");
+	printf("  Commands include:\n");
+	printf("    cfg\t\t\tEdit config file with ${EDITOR}\n");
+	printf("    hud\t\t\tHeads up display\n");
+	printf("    id\t\t\tShow user account details and vote info\n");
+	printf("    ls\t\t\tShow playlist\n");
+	printf("    np\t\t\tNow playing\n");
+	printf("    q <file1> [...]\tQueue track(s)\n");
+	printf("    vo\t\t\tVote-off current track\n");
+
+	printf("\n  Admin Commands include:\n");
+	printf("    pause\t\t\tPause the current song\n");
+	printf("    skip\t\t\tSkip the current song\n");
+	printf("    user-add <user> [password]\tAdd a user\n");
+	printf("    user-del <user>\t\tRemove a user\n");
+	printf("    user-list\t\t\tList Users\n");
+	printf("    user-mkadmin <user>\t\tGrant user admin rights\n");
+	printf("    user-noadmin <user>\t\tRevoke user admin rights\n");
+
+	printf("\n  Options include:\n");
+	printf("    -A\t\t\tColours off\n");
+	printf("    -a\t\t\tColours on\n");
+#ifdef HAVE_LIBCONFIG
+	printf("    -c\t\t\tSet config location\n");
+#endif
+	printf("    -E\t\t\tRefuse to use encryption\n");
+	printf("    -e\t\t\tForce encryption\n");
+	printf("    -h\t\t\tShow this message and exit\n");
+	printf("    -j <num>\t\tNumber of parallel uploads (1-%d)\n",
+	    HGD_MAX_UPLOAD_JOBS);
+	printf("    -m <num>\t\tMax num items to show in playlist\n");
+	printf("    -p <port>\t\tSet connection port\n");
+	printf("    -r <secs>\t\tmin secs between hud redraws\n");
+	printf("    -s <host/ip>\tSet connection address\n");
+	printf("    -u <username>\tSet username\n");
+	printf("    -x <level>\t\tSet debug level (0-3)\n");
+	printf("    -v\t\t\tShow version and exit\n");
+}
+
 /*
- * see if the server supports encryption
- * return: 1 = yes, 0 = no, -1 = error
+ * upload worker for 'q -j'. Runs in a child process with its own
+ * connection and takes files from the shared state until none are left.
  */
-int
-hgd_negotiate_crypto()
+void
+hgd_upload_worker(int job, int n_args, char **args,
+    struct hgd_upload_state *st)
 {
-	int			n_toks = 0, ret = HGD_OK;
-	char			*first, *next;
-	char			*ok_tokens[2] = {"", ""};
-
-	if (crypto_pref == HGD_CRYPTO_PREF_NEVER)
-		return (0);	/* fine, no crypto then */
+	struct hgd_upload_slot	*slot = &st->slots[job];
+	char			*resp;
+	int			 fnum;
+
+	/* the parent's connection is not ours to use or shut down */
+	close(sock_fd);
+	sock_fd = -1;
+	ssl = NULL;
+	ctx = NULL;
+	authenticated = 0;
+	server_ssl_capable = 0;
+
+	if ((hgd_setup_socket() != HGD_OK) ||
+	    (hgd_check_svr_proto(NULL) != HGD_OK) ||
+	    (hgd_client_login(sock_fd, ssl, user) != HGD_OK)) {
+		DPRINTF(HGD_D_ERROR, "Upload job %d could not connect", job);
+		hgd_exit_nicely();
+	}
 
-	hgd_sock_send_line(sock_fd, NULL, "encrypt?");
-	first = next = hgd_sock_recv_line(sock_fd, NULL);
+	while ((fnum = __sync_fetch_and_add(&st->next_file, 1)) < n_args) {
+		slot->file = fnum;
+		if (hgd_queue_track(args[fnum], slot) == HGD_OK)
+			st->results[fnum] = 1;
+		else
+			st->results[fnum] = -1;
+		slot->file = -1;
+	}
 
-	hgd_check_svr_response(next, 1);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "bye");
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+	hgd_check_svr_response(resp, 1);
+	free(resp);
 
-	do {
-		ok_tokens[n_toks] = strsep(&next, "|");
-		n_toks++;
-	} while ((n_toks < 2) && (next != NULL));
+	exit_ok = 1;
+	hgd_exit_nicely();
+}
 
-	if (strcmp(ok_tokens[1], "tlsv1") == 0) {
-		server_ssl_capable = 1;
-		DPRINTF(HGD_D_INFO, "Server supports %s crypto", ok_tokens[1]);
+/* draw one progress bar for all running upload jobs */
+void
+hgd_draw_upload_progress(struct hgd_upload_state *st, off_t *sizes,
+    int n_args, int n_done)
+{
+	char			 stars_buf[HGD_TERM_WIDTH + 1], *label;
+	off_t			 total = 0, sent = 0;
+	int			 i, barspace, percent;
+
+	for (i = 0; i < n_args; i++) {
+		total += sizes[i];
+		if (st->results[i] != 0)
+			sent += sizes[i];
 	}
 
-	if ((!server_ssl_capable) && (crypto_pref == HGD_CRYPTO_PREF_ALWAYS)) {
-		DPRINTF(HGD_D_ERROR,
-		    "User forced crypto, but server is incapable");
-		ret = HGD_FAIL;
+	for (i = 0; i < HGD_MAX_UPLOAD_JOBS; i++) {
+		if (st->slots[i].file >= 0)
+			sent += st->slots[i].written;
 	}
 
-	free(first);
+	if (total == 0)
+		total = 1;
 
-	return (ret);
+	xasprintf(&label, "[%d/%d files]", n_done, n_args);
+
+	barspace = HGD_TERM_WIDTH - strlen(label) - 2 - 7;
+	memset(stars_buf, ' ', HGD_TERM_WIDTH);
+	memset(stars_buf, '*', barspace * ((float) sent / total) + 1);
+	stars_buf[0] = '|';
+	stars_buf[barspace - 1] = '|';
+	stars_buf[barspace] = 0;
+	percent = (float) sent / total * 100;
+
+	printf("\r%s: %s %3d%%", label, stars_buf, percent);
+	fflush(stdout);
+
+	free(label);
 }
 
+/*
+ * upload files over several connections at once. Each worker is a
+ * child process with its own authenticated session, so the server applies
+ * its flood limit to every upload just as it would for 'q' on its own.
+ */
 int
-hgd_encrypt(int fd)
+hgd_req_queue_parallel(int n_args, char **args)
 {
-	int			 ssl_res = 0;
-	char			*ok_str = NULL;
-	X509			*cert;
-
-	/* XXX For semi-implemented certificate verification - FAO mex */
-#if 0
-	X509_NAME		*cert_name;
-	EVP_PKEY		*public_key;
-	BIO			*bio;
-#endif
-	hgd_sock_send_line(fd, NULL, "encrypt");
+	struct hgd_upload_state	*st;
+	struct stat		 fst;
+	size_t			 st_sz;
+	off_t			*sizes;
+	pid_t			 pid;
+	uint8_t			*reported;
+	char			 blank[HGD_TERM_WIDTH + 1], *fname;
+	int			 n_jobs, n_running = 0, n_done = 0, i, status;
+	int			 ret = HGD_OK;
 
-	if (hgd_setup_ssl_ctx(&method, &ctx, 0, 0, 0) != 0) {
+	n_jobs = upload_jobs;
+	if (n_jobs > HGD_MAX_UPLOAD_JOBS)
+		n_jobs = HGD_MAX_UPLOAD_JOBS;
+	if (n_jobs > n_args)
+		n_jobs = n_args;
+
+	st_sz = sizeof(struct hgd_upload_state) + n_args;
+	st = mmap(NULL, st_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0);
+	if (st == MAP_FAILED) {
+		DPRINTF(HGD_D_ERROR, "mmap: %s", SERROR);
 		return (HGD_FAIL);
 	}
-
-	DPRINTF(HGD_D_DEBUG, "Setting up SSL_new");
-	ssl = SSL_new(ctx);
-	if (ssl == NULL) {
-		PRINT_SSL_ERR (HGD_D_ERROR, "SSL_new");
-		return (HGD_FAIL);
+	memset(st, 0, st_sz);
+	for (i = 0; i < HGD_MAX_UPLOAD_JOBS; i++)
+		st->slots[i].file = -1;
+
+	sizes = xcalloc(n_args, sizeof(off_t));
+	reported = xcalloc(n_args, sizeof(uint8_t));
+	for (i = 0; i < n_args; i++) {
+		if (stat(args[i], &fst) == 0)
+			sizes[i] = fst.st_size;
 	}
 
-	ssl_res = SSL_set_fd(ssl, fd);
-	if (ssl_res == 0) {
-		PRINT_SSL_ERR (HGD_D_ERROR, "SSL_set_fd");
-		return (HGD_FAIL);
-	}
+	DPRINTF(HGD_D_INFO, "Uploading %d tracks using %d jobs",
+	    n_args, n_jobs);
 
-	ssl_res = SSL_connect(ssl);
-	if (ssl_res != 1) {
-		PRINT_SSL_ERR (HGD_D_ERROR, "SSL_connect");
-		return (HGD_FAIL);
-	}
+	/* don't let the workers inherit anything buffered */
+	fflush(stdout);
+	fflush(stderr);
 
-	cert = SSL_get_peer_certificate(ssl);
-	if (!cert) {
-		DPRINTF(HGD_D_ERROR, "could not get remote cert");
-		exit (HGD_FAIL);
+	for (i = 0; i < n_jobs; i++) {
+		pid = fork();
+		if (pid < 0) {
+			DPRINTF(HGD_D_WARN, "Can't fork upload job: %s", SERROR);
+			break;
+		} else if (pid == 0) {
+			hgd_upload_worker(i, n_args, args, st);
+			_exit(EXIT_FAILURE); /* NOREACH */
+		}
+		n_running++;
 	}
 
-/*
- * unfinished work on checking SSL certs.  Need to work out how to get the
- * hash from the cert to know where to write the cert to. XXX
- */
-#if 0
-	if(SSL_get_verify_result(ssl) != X509_V_OK)
-	{
-		PRINT_SSL_ERR ("SSL_connect");
+	memset(blank, ' ', HGD_TERM_WIDTH);
+	blank[HGD_TERM_WIDTH] = 0;
 
-		cert = SSL_get_peer_certificate(ssl);
+	while (1) {
+		while (waitpid(-1, &status, WNOHANG) > 0)
+			n_running--;
 
-		cert->
-		/* PEM_write_x509(fp!,cert);- */
+		/* report each file once it is finished */
+		for (i = 0; i < n_args; i++) {
+			if ((reported[i]) || (st->results[i] == 0))
+				continue;
 
-		return (-1);
-	}
-#endif
-	ok_str = hgd_sock_recv_line(fd, ssl);
-	hgd_check_svr_response(ok_str, 1);
-	free(ok_str);
+			reported[i] = 1;
+			n_done++;
 
-	DPRINTF(HGD_D_INFO, "SSL connection established");
+			if (hgd_debug > 1)
+				continue;
 
-	return (HGD_OK);
-}
+			fname = xstrdup(basename(args[i]));
+			hgd_truncate_string(fname, 40);
+			if (st->results[i] == 1) {
+				hgd_set_line_colour(ANSI_GREEN);
+				printf("\r%s\r%s: OK\n", blank, fname);
+			} else {
+				hgd_set_line_colour(ANSI_RED);
+				printf("\r%s\r%s: FAILED\n", blank, fname);
+			}
+			hgd_set_line_colour(ANSI_WHITE);
+			free(fname);
+		}
 
-int
-hgd_print_pretty_server_response(char *resp_line)
-{
-	char			*p;
-	struct hgd_resp_err	*resp, *chosen = NULL;
+		if (n_running == 0)
+			break;
 
-	p = strchr(resp_line, '|');
-	if (p == NULL) {
-		DPRINTF(HGD_D_ERROR, "Unspecified server error reponse");
-		return (HGD_FAIL);
-	}
+		if (hgd_debug <= 1)
+			hgd_draw_upload_progress(st, sizes, n_args, n_done);
 
-	p++;
-	for (resp = hgd_resp_errs; resp->code != 0; resp++) {
-		if (strcmp(p, resp->code) == 0) {
-			chosen = resp;
-			break;
-		}
+		usleep(100000);
 	}
 
-	if (chosen == NULL) {
-		DPRINTF(HGD_D_ERROR, "Unknown server error reponse");
-		return (HGD_FAIL);
+	if (hgd_debug <= 1)
+		printf("\r%s\r", blank);
+
+	/* anything not uploaded, either failed or no worker got to it */
+	for (i = 0; i < n_args; i++) {
+		if (st->results[i] != 1) {
+			if (st->results[i] == 0)
+				DPRINTF(HGD_D_ERROR, "'%s' was not uploaded",
+				    args[i]);
+			ret = HGD_FAIL;
+		}
 	}
 
-	DPRINTF(HGD_D_ERROR,
-	    "Server reponded with error '%s': %s", p, chosen->meaning);
+	free(sizes);
+	free(reported);
+	munmap(st, st_sz);
 
-	return (HGD_OK);
+	return (ret);
 }
 
-/*
- * if x == 1 you do not need to check the return value of this method as
- * hgd will have exited before this returns.
- */
+/* upload and queue a file to the playlist */
 int
-hgd_check_svr_response(char *resp, uint8_t x)
+hgd_req_queue(int n_args, char **args)
 {
-	int			err = HGD_OK;
-	char			*trunc = NULL;
-
-	if (resp == NULL) {
-		DPRINTF(HGD_D_ERROR, "failed to read server response");
-		err = HGD_FAIL;
-		goto clean;
-	}
+	int			tnum, ret = HGD_OK;
 
-	if (hgd_debug) {
-		trunc = xstrdup(resp);
-		DPRINTF(HGD_D_DEBUG, "Check reponse '%s'", trunc);
-		free(trunc);
-	}
+	DPRINTF(HGD_D_DEBUG, "Will queue %d tracks", n_args);
 
-	if (strncmp(resp, "ok", 2) == 0) {
-		/* great */
-	} else if (strncmp(resp, "err", 3)) {
-		DPRINTF(HGD_D_ERROR, "Malformed server response");
-	} else {
-		/* we got an 'err' */
-		hgd_print_pretty_server_response(resp);
-		err = HGD_FAIL;
+	if ((upload_jobs > 1) && (n_args > 1))
+		ret = hgd_req_queue_parallel(n_args, args);
+	else {
+		/* one iteration per track which will be uploaded */
+		for (tnum = 0; tnum < n_args; tnum++)
+			if (hgd_queue_track(args[tnum], NULL) != HGD_OK) {
+				ret = HGD_FAIL;
+			}
 	}
 
-clean:
-	/* frees reposonse on error and exit */
-	if ((err == HGD_FAIL) && (x)) {
-		free(resp);
-		hgd_exit_nicely();
-	}
+	if (ret != HGD_OK)
+		DPRINTF(HGD_D_INFO, "Some tracks failed to upload");
+	else
+		DPRINTF(HGD_D_INFO, "Finished uploading tracks");
 
-	return (err);
+	return (ret);
 }
 
-int
-hgd_client_login(int fd, SSL *ssl, char *username)
+/* append a line in the given colour to a list, taking ownership of text */
+void
+hgd_add_line(char ***lines, int *n_lines, char *colour, char *text)
 {
-	char			*resp, *user_cmd, pass[HGD_MAX_PASS_SZ];
-	int			 login_ok = -1;
-	char			*prompt;
-
-	if (password == NULL) {
-		xasprintf(&prompt, "Password for %s@%s: ", user, host);
-		if (readpassphrase(prompt, pass, HGD_MAX_PASS_SZ,
-		    RPP_ECHO_OFF | RPP_REQUIRE_TTY) == NULL) {
-			DPRINTF(HGD_D_ERROR, "Problem reading password from user");
-			memset(pass, 0, HGD_MAX_PASS_SZ);
-			free(prompt);
-			return (HGD_FAIL);
-		}
-		free(prompt);
-	} else {
-		strncpy(pass, password, HGD_MAX_PASS_SZ);
-		if (HGD_MAX_PASS_SZ > 0)
-			pass[HGD_MAX_PASS_SZ-1] = '\0';
-	}
-
-	/* send password */
-	xasprintf(&user_cmd, "user|%s|%s", username, pass);
-	hgd_sock_send_line(fd, ssl, user_cmd);
-	memset(pass, 0, HGD_MAX_PASS_SZ);
-	free(user_cmd);
+	*lines = xrealloc(*lines, sizeof(char *) * (*n_lines + 1));
+	xasprintf(&(*lines)[*n_lines], "%s%s%s", colour, text, ANSI_WHITE);
+	(*n_lines)++;
+	free(text);
+}
 
-	resp = hgd_sock_recv_line(fd, ssl);
-	login_ok = hgd_check_svr_response(resp, 0);
+void
+hgd_free_lines(char **lines, int n_lines)
+{
+	int			i;
 
-	free(resp);
+	for (i = 0; i < n_lines; i++)
+		free(lines[i]);
 
-	if (login_ok == HGD_OK) {
-		authenticated = 1;
-		DPRINTF(HGD_D_DEBUG, "Identified as %s", user);
-	} else
-		DPRINTF(HGD_D_WARN, "Login as %s failed", user);
-
-	return (login_ok);
+	if (lines)
+		free(lines);
 }
 
-int
-hgd_setup_socket()
+/* a tag line, e.g. "   Artist:   'Deftones'" */
+char *
+hgd_format_tag(char *label, char *val, uint8_t known)
 {
-	struct sockaddr_in	addr;
-	char*			resp;
-	struct hostent		*he;
-	int			sockopt = 1, ret = HGD_OK;
-
-	DPRINTF(HGD_D_DEBUG, "Connecting to %s", host);
-
-	/* if they gave a hostname, we look up the IP */
-	if (!hgd_is_ip_addr(host)) {
-		DPRINTF(HGD_D_DEBUG, "Looking up host '%s'", host);
-		he = gethostbyname(host);
-		if (he == NULL) {
-			DPRINTF(HGD_D_ERROR,
-			    "Failure in hostname resolution: '%s'", host);
-			ret = HGD_FAIL;
-			goto clean;
-		}
+	char			*text;
 
-		free(host);
-		host = xstrdup(
-		    inet_ntoa( *(struct in_addr*)(he->h_addr_list[0])));
-		DPRINTF(HGD_D_DEBUG, "Found IP %s", host);
-	}
+	if (known)
+		xasprintf(&text, "%s'%s'", label, hgd_truncate_string(val,
+		    HGD_TERM_WIDTH - strlen(label) - 2));
+	else
+		xasprintf(&text, "%s<unknown>", label);
 
-	DPRINTF(HGD_D_DEBUG, "Connecting to IP %s:%d", host, port);
+	return (text);
+}
 
-	/* set up socket address */
-	memset(&addr, 0, sizeof(struct sockaddr_in));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = inet_addr(host);
-	addr.sin_port = htons(port);
+/* a track from 'ls' or 'np', parsed from a line or a binary frame */
+struct hgd_track {
+	struct hgd_playlist_item	 item;
+	int				 votes_needed;
+	int				 voted;
+	char				*raw;	/* as sent, to spot changes */
+	size_t				 raw_len;
+};
 
-	sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock_fd < 0) {
-		DPRINTF(HGD_D_ERROR, "can't make socket: %s", SERROR);
-		ret = HGD_FAIL;
-		goto clean;
-	}
+void
+hgd_free_track(struct hgd_track *t)
+{
+	hgd_free_playlist_item(&t->item);
+	if (t->raw)
+		free(t->raw);
+	memset(t, 0, sizeof(*t));
+}
 
-	if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR,
-		    &sockopt, sizeof(sockopt)) < 0) {
-		DPRINTF(HGD_D_WARN, "Can't set SO_REUSEADDR");
-	}
+void
+hgd_free_tracks(struct hgd_track *tracks, int n_tracks)
+{
+	int			i;
 
-	if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-		close(sock_fd);
-		DPRINTF(HGD_D_ERROR, "Can't connect to %s", host);
-		ret = HGD_FAIL;
-		goto clean;
-	}
+	for (i = 0; i < n_tracks; i++)
+		hgd_free_track(&tracks[i]);
 
-	/* expect a hello message */
-	resp = hgd_sock_recv_line(sock_fd, ssl);
-	hgd_check_svr_response(resp, 1);
-	free(resp);
+	if (tracks)
+		free(tracks);
+}
+
+/* a track line from the server, see hgd-proto(7) */
+#define HGD_NUM_TRACK_FIELDS		14
+int
+hgd_parse_track_line(char *resp, struct hgd_track *t)
+{
+	int			n_toks = 0;
+	char			*tokens[HGD_NUM_TRACK_FIELDS], *copy, *p;
 
-	DPRINTF(HGD_D_DEBUG, "Connected to %s", host);
+	t->raw = xstrdup(resp);
+	t->raw_len = strlen(resp);
 
-	/* identify ourselves */
-	if (user == NULL) {
-		/* If the user did not set their name use thier system login */
-		user = getenv("USER");
-	}
-	if (user == NULL) {
-		DPRINTF(HGD_D_ERROR, "can't get username");
-		ret = HGD_FAIL;
-		goto clean;
-	}
+	copy = p = xstrdup(resp);
+	while ((n_toks < HGD_NUM_TRACK_FIELDS) && (p != NULL))
+		tokens[n_toks++] = strsep(&p, "|");
 
-	hgd_negotiate_crypto();
-	if ((server_ssl_capable) && (crypto_pref != HGD_CRYPTO_PREF_NEVER)) {
-		if (hgd_encrypt(sock_fd) != HGD_OK) {
-			ret = HGD_FAIL;
-			goto clean;
-		}
+	if (n_toks != HGD_NUM_TRACK_FIELDS) {
+		DPRINTF(HGD_D_ERROR, "Wrong number of tokens from server");
+		free(copy);
+		return (HGD_FAIL);
 	}
 
-	/* annoying error message for those too lazy to set up crypto */
-	if (ssl == NULL)
-		DPRINTF(HGD_D_WARN, "Connection is not encrypted");
-
-clean:
-	return (ret);
+	t->item.id = atoi(tokens[0]);
+	t->item.filename = xstrdup(tokens[1]);
+	t->item.tags.artist = xstrdup(tokens[2]);
+	t->item.tags.title = xstrdup(tokens[3]);
+	t->item.user = xstrdup(tokens[4]);
+	t->item.tags.album = xstrdup(tokens[5]);
+	t->item.tags.genre = xstrdup(tokens[6]);
+	t->item.tags.duration = atoi(tokens[7]);
+	t->item.tags.bitrate = atoi(tokens[8]);
+	t->item.tags.samplerate = atoi(tokens[9]);
+	t->item.tags.channels = atoi(tokens[10]);
+	t->item.tags.year = atoi(tokens[11]);
+	t->votes_needed = atoi(tokens[12]);
+	t->voted = atoi(tokens[13]);
+
+	free(copy);
+	return (HGD_OK);
 }
 
-void
-hgd_usage()
+/* the same, from the next HGD_BIN_TRACK_FIELDS fields of a frame */
+int
+hgd_parse_track_frame(struct hgd_frame *f, struct hgd_track *t)
 {
-	printf("Usage: hgdc [opts] command [args]\n\n");
-	printf("  Commands include:\n");
-	printf("    cfg\t\t\tEdit config file with ${EDITOR}\n");
-	printf("    hud\t\t\tHeads up display\n");
-	printf("    id\t\t\tShow user account details and vote info\n");
-	printf("    ls\t\t\tShow playlist\n");
-	printf("    np\t\t\tNow playing\n");
-	printf("    q <file1> [...]\tQueue track(s)\n");
-	printf("    vo\t\t\tVote-off current track\n");
+	size_t			start = f->off;
+
+	if ((hgd_frame_int(f, &t->item.id) != HGD_OK) ||
+	    (hgd_frame_str(f, &t->item.filename) != HGD_OK) ||
+	    (hgd_frame_str(f, &t->item.tags.artist) != HGD_OK) ||
+	    (hgd_frame_str(f, &t->item.tags.title) != HGD_OK) ||
+	    (hgd_frame_str(f, &t->item.user) != HGD_OK) ||
+	    (hgd_frame_str(f, &t->item.tags.album) != HGD_OK) ||
+	    (hgd_frame_str(f, &t->item.tags.genre) != HGD_OK) ||
+	    (hgd_frame_int(f, &t->item.tags.duration) != HGD_OK) ||
+	    (hgd_frame_int(f, &t->item.tags.bitrate) != HGD_OK) ||
+	    (hgd_frame_int(f, &t->item.tags.samplerate) != HGD_OK) ||
+	    (hgd_frame_int(f, &t->item.tags.channels) != HGD_OK) ||
+	    (hgd_frame_int(f, &t->item.tags.year) != HGD_OK) ||
+	    (hgd_frame_int(f, &t->votes_needed) != HGD_OK) ||
+	    (hgd_frame_int(f, &t->voted) != HGD_OK)) {
+		DPRINTF(HGD_D_ERROR, "Bad track in frame from server");
+		return (HGD_FAIL);
+	}
 
-	printf("\n  Admin Commands include:\n");
-	printf("    pause\t\t\tPause the current song\n");
-	printf("    skip\t\t\tSkip the current song\n");
-	printf("    user-add <user> [password]\tAdd a user\n");
-	printf("    user-del <user>\t\tRemove a user\n");
-	printf("    user-list\t\t\tList Users\n");
-	printf("    user-mkadmin <user>\t\tGrant user admin rights\n");
-	printf("    user-noadmin <user>\t\tRevoke user admin rights\n");
+	t->raw_len = f->off - start;
+	t->raw = xmalloc(t->raw_len);
+	memcpy(t->raw, f->buf + start, t->raw_len);
 
-	printf("\n  Options include:\n");
-	printf("    -A\t\t\tColours off\n");
-	printf("    -a\t\t\tColours on\n");
-#ifdef HAVE_LIBCONFIG
-	printf("    -c\t\t\tSet config location\n");
-#endif
-	printf("    -E\t\t\tRefuse to use encryption\n");
-	printf("    -e\t\t\tForce encryption\n");
-	printf("    -h\t\t\tShow this message and exit\n");
-	printf("    -m <num>\t\tMax num items to show in playlist\n");
-	printf("    -p <port>\t\tSet connection port\n");
-	printf("    -r <secs>\t\trefresh rate (only in hud mode)\n");
-	printf("    -s <host/ip>\tSet connection address\n");
-	printf("    -u <username>\tSet username\n");
-	printf("    -x <level>\t\tSet debug level (0-3)\n");
-	printf("    -v\t\t\tShow version and exit\n");
+	return (HGD_OK);
 }
 
+/* check a frame is of the expected type, reporting errors from the server */
 int
-hgd_queue_track(char *filename)
+hgd_check_frame(struct hgd_frame *f, uint8_t type)
 {
-	FILE			*f;
-	struct stat		st;
-	ssize_t			written = 0, fsize, chunk_sz;
-	char			chunk[HGD_BINARY_CHUNK];
-	char			*q_req = 0, *resp1 = 0, *resp2 = 0;
-	char			 stars_buf[81], *trunc_filename = 0;
-	int			 iters = 0, barspace, percent, ret = HGD_FAIL;
-	float			 n_stars;
-
-	/* maximum length of filename in progress bar */
-	trunc_filename = xstrdup(basename(filename));
-	hgd_truncate_string(trunc_filename, 40);
-
-	DPRINTF(HGD_D_INFO, "Uploading file '%s'", filename);
-
-	if (stat(filename, &st) < 0) {
-		DPRINTF(HGD_D_ERROR, "Can't stat '%s'", filename);
-		ret = HGD_FAIL;
-		goto clean;
-	}
+	char			*err, *resp;
 
-	if (st.st_mode & S_IFDIR) {
-		DPRINTF(HGD_D_ERROR, "Can't upload directories");
-		ret = HGD_FAIL;
-		goto clean;
-	}
+	if (f->type == type)
+		return (HGD_OK);
 
-	fsize = st.st_size;
+	if ((f->type == HGD_BIN_T_ERR) && (hgd_frame_str(f, &err) == HGD_OK)) {
+		xasprintf(&resp, "err|%s", err);
+		hgd_print_pretty_server_response(resp);
+		free(resp);
+		free(err);
+	} else
+		DPRINTF(HGD_D_ERROR, "Unexpected frame type: %d", f->type);
 
-	/* send request to upload */
-	xasprintf(&q_req, "q|%s|%d", filename, fsize);
-	hgd_sock_send_line(sock_fd, ssl, q_req);
+	return (HGD_FAIL);
+}
 
-	/* check we are allowed */
-	resp1 = hgd_sock_recv_line(sock_fd, ssl);
-	if (hgd_check_svr_response(resp1, 0) == HGD_FAIL)
-		goto clean;
+/*
+ * get the playlist with 'ls', as lines or a frame depending on the protocol
+ * in use. Free the tracks with hgd_free_tracks(), even on failure.
+ */
+int
+hgd_fetch_playlist(struct hgd_track **tracks, int *n_tracks)
+{
+	struct hgd_frame	 f;
+	char			*resp, *p;
+	int			 n_items, i, ret = HGD_FAIL;
 
-	DPRINTF(HGD_D_DEBUG, "opening '%s' for reading", filename);
-	f = fopen(filename, "r");
-	if (f == NULL) {
-		DPRINTF(HGD_D_ERROR, "fopen %s: %s", filename, SERROR);
-		ret = HGD_FAIL;
-		goto clean;
-	}
+	*tracks = NULL;
+	*n_tracks = 0;
 
-	/* prepare progress bar */
-	barspace =  (float) (HGD_TERM_WIDTH - strlen(
-	    basename(trunc_filename)) - 2) - 7;
-	memset(stars_buf, ' ', HGD_TERM_WIDTH);
-	stars_buf[HGD_TERM_WIDTH] = 0;
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "ls");
 
-	/*
-	 * start sending the file
-	 */
-	written = 0;
-	while (written != fsize) {
-
-		/* update progress bar */
-		if ((iters % 50 == 0) && (hgd_debug <= 1)) {
-			percent = (float) written/fsize * 100;
-			n_stars = barspace * ((float) written/fsize) + 1;
-			memset(stars_buf, '*', n_stars);
-
-			/* progress bar caps */
-			stars_buf[0] = '|';
-			stars_buf[barspace - 1] = '|';
-			stars_buf[barspace] = 0;
-
-			printf("\r%s: %s %3d%%",
-			    trunc_filename, stars_buf, percent);
-			fflush(stdout);
-		}
-		iters++;
+	if (binary_proto) {
+		if (hgd_sock_recv_frame(&main_ctx, sock_fd, ssl, &f) != HGD_OK)
+			goto clean;
 
-		if (fsize - written < HGD_BINARY_CHUNK)
-			chunk_sz = fsize - written;
-		else
-			chunk_sz = HGD_BINARY_CHUNK;
+		if ((hgd_check_frame(&f, HGD_BIN_T_PLAYLIST) != HGD_OK) ||
+		    (hgd_frame_int(&f, &n_items) != HGD_OK) || (n_items < 0))
+			goto clean;
 
-		if (fread(chunk, chunk_sz, 1, f) != 1) {
-			DPRINTF(HGD_D_WARN, "Retrying fread");
-			continue;
+		/* before we take the server's word for how much to allocate */
+		if ((size_t) n_items > (f.len - f.off) / HGD_BIN_TRACK_MIN_SZ) {
+			DPRINTF(HGD_D_ERROR, "%d items can't fit in the frame",
+			    n_items);
+			goto clean;
 		}
 
-		hgd_sock_send_bin(sock_fd, ssl, chunk, chunk_sz);
+		DPRINTF(HGD_D_DEBUG, "expecting %d items in playlist", n_items);
+		*tracks = xcalloc(n_items, sizeof(struct hgd_track));
+		for (i = 0; i < n_items; i++) {
+			(*n_tracks)++;
+			if (hgd_parse_track_frame(&f, &(*tracks)[i]) != HGD_OK)
+				goto clean;
+		}
 
-		written += chunk_sz;
-		DPRINTF(HGD_D_DEBUG, "Progress %d/%d bytes",
-		    (int)  written, (int) fsize);
+		ret = HGD_OK;
+		goto clean;
 	}
 
-	if (hgd_debug <= 1) {
-		memset(stars_buf, ' ', HGD_TERM_WIDTH);
-
-		hgd_set_line_colour(ANSI_GREEN);
-		printf("\r%s\r%s: OK\n", stars_buf, basename(trunc_filename));
-		hgd_set_line_colour(ANSI_WHITE);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
+		free(resp);
+		return (HGD_FAIL);
 	}
 
-	fclose(f);
-
-	resp2 = hgd_sock_recv_line(sock_fd, ssl);
-	if (hgd_check_svr_response(resp2, 0) == HGD_FAIL) {
-		ret = HGD_FAIL;
-		goto clean;
+	for (p = resp; (*p != 0 && *p != '|'); p ++);
+	if (*p != '|') {
+		DPRINTF(HGD_D_ERROR, "didn't find a argument separator");
+		free(resp);
+		return (HGD_FAIL);
 	}
 
-	DPRINTF(HGD_D_INFO, "Transfer complete");
+	n_items = atoi(++p);
+	free(resp);
+
+	DPRINTF(HGD_D_DEBUG, "expecting %d items in playlist", n_items);
+	*tracks = xcalloc(n_items, sizeof(struct hgd_track));
 
+	/* read every line, even after a bad one, to stay in step */
 	ret = HGD_OK;
-clean:
-	if (trunc_filename)
-		free(trunc_filename);
-	if (resp1)
-		free(resp1);
-	if (resp2)
-		free(resp2);
-	if (q_req)
-		free(q_req);
+	for (i = 0; i < n_items; i++) {
+		resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+		if (resp == NULL)
+			return (HGD_FAIL);
 
+		(*n_tracks)++;
+		if (hgd_parse_track_line(resp, &(*tracks)[i]) != HGD_OK)
+			ret = HGD_FAIL;
+		free(resp);
+	}
+
+	return (ret);
+clean:
+	hgd_frame_free(&f);
 	return (ret);
 }
 
-/* upload and queue a file to the playlist */
-int
-hgd_req_queue(int n_args, char **args)
+/* a number for display, or 'unknown' if it is 0 */
+char *
+hgd_format_num(char *buf, size_t sz, int n, char *unknown)
 {
-	int			tnum, ret = HGD_OK;
-
-	DPRINTF(HGD_D_DEBUG, "Will queue %d tracks", n_args);
-
-	/* one iteration per track which will be uploaded */
-	for (tnum = 0; tnum < n_args; tnum++)
-		if (hgd_queue_track(args[tnum]) != HGD_OK) {
-			ret = HGD_FAIL;
-		}
-
-	if (ret != HGD_OK)
-		DPRINTF(HGD_D_INFO, "Some tracks failed to upload");
+	if (n == 0)
+		snprintf(buf, sz, "%s", unknown);
 	else
-		DPRINTF(HGD_D_INFO, "Finished uploading tracks");
+		snprintf(buf, sz, "%d", n);
 
-	return (ret);
+	return (buf);
 }
 
-#define HGD_NUM_TRACK_FIELDS		14
+/*
+ * format a track from the server as the lines we show the user.
+ * The caller must free the lines with hgd_free_lines().
+ */
 int
-hgd_print_track(char *resp, uint8_t first)
+hgd_format_track(struct hgd_track *t, uint8_t first, char ***lines,
+    int *n_lines)
 {
-	int			n_toks = 0, i, ret = HGD_OK;
-	char			*tokens[HGD_NUM_TRACK_FIELDS];
-
-	do {
-		tokens[n_toks] = xstrdup(strsep(&resp, "|"));
-	} while ((n_toks++ < HGD_NUM_TRACK_FIELDS) && (resp != NULL));
-
-	if (n_toks == HGD_NUM_TRACK_FIELDS) {
-
-		if (first)
-			hgd_set_line_colour(ANSI_GREEN);
-		else
-			hgd_set_line_colour(ANSI_RED);
-
-		printf(" [ #%04d queued by '%s' ]\n",
-		    atoi(tokens[0]), tokens[4]);
-
-		printf("   Filename: '%s'\n",
-		    hgd_truncate_string(tokens[1],
-		    HGD_TERM_WIDTH - strlen("   Filename: ''")));
-
-		printf("   Artist:   ");
-		if (strcmp(tokens[2], "") != 0)
-			printf("'%s'\n", hgd_truncate_string(tokens[2],
-			    HGD_TERM_WIDTH - strlen("   Artist:   ''")));
-		else
-			printf("<unknown>\n");
-
-		printf("   Title:    ");
-		if (strcmp(tokens[3], "") != 0)
-			printf("'%s'\n",
-			    hgd_truncate_string(tokens[3],
-			    HGD_TERM_WIDTH - strlen("   Title:    ''")));
-		else
-			printf("<unknown>\n");
-
-		/* thats it for compact entries */
-		if (!first)
-			goto skip_full;
-
-		printf("   Album:    ");
-		if (strcmp(tokens[5], "") != 0)
-			printf("'%s'\n", hgd_truncate_string(tokens[5],
-			    HGD_TERM_WIDTH - strlen("   Album:    ''")));
-		else
-			printf("<unknown>\n");
+	struct hgd_media_tag	*tags = &t->item.tags;
+	int			 ret = HGD_OK;
+	char			*colour, *text;
+	char			 dur[16], rate[16], kbps[16], chans[16];
+	char			 year[16];
 
-		printf("   Genre:    ");
-		if (strcmp(tokens[6], "") != 0)
-			printf("'%s'\n", hgd_truncate_string(tokens[6],
-			    HGD_TERM_WIDTH - strlen("   Genre:    ''")));
-		else
-			printf("<unknown>\n");
+	*lines = NULL;
+	*n_lines = 0;
 
-		printf("   Year:     ");
-		if (strcmp(tokens[11], "0") != 0)
-			printf("'%s'\n", hgd_truncate_string(tokens[11],
-			    HGD_TERM_WIDTH - strlen("   Year:     ''")));
-		else
-			printf("<unknown>\n");
+	colour = first ? ANSI_GREEN : ANSI_RED;
 
-		/* audio properties all on one line */
-		printf("   Audio:    ");
+	xasprintf(&text, " [ #%04d queued by '%s' ]",
+	    t->item.id, t->item.user);
+	hgd_add_line(lines, n_lines, colour, text);
 
-		if (atoi(tokens[7]) != 0)
-			printf("%4ss", tokens[7]);
-		else
-			printf("%4ss", "????");
+	hgd_add_line(lines, n_lines, colour,
+	    hgd_format_tag("   Filename: ", t->item.filename, 1));
+	hgd_add_line(lines, n_lines, colour, hgd_format_tag("   Artist:   ",
+	    tags->artist, *tags->artist != '\0'));
+	hgd_add_line(lines, n_lines, colour, hgd_format_tag("   Title:    ",
+	    tags->title, *tags->title != '\0'));
 
-		if (atoi(tokens[9]) != 0)
-			printf("   %5shz", tokens[9]);
-		else
-			printf("   %5shz", "?");
+	/* thats it for compact entries */
+	if (!first)
+		goto clean;
 
-		if (atoi(tokens[8]) != 0)
-			printf("   %3skbps", tokens[8]);
-		else
-			printf("   %3skbps", "?");
+	hgd_add_line(lines, n_lines, colour, hgd_format_tag("   Album:    ",
+	    tags->album, *tags->album != '\0'));
+	hgd_add_line(lines, n_lines, colour, hgd_format_tag("   Genre:    ",
+	    tags->genre, *tags->genre != '\0'));
+	hgd_add_line(lines, n_lines, colour, hgd_format_tag("   Year:     ",
+	    hgd_format_num(year, sizeof(year), tags->year, "0"),
+	    tags->year != 0));
+
+	/* audio properties all on one line */
+	xasprintf(&text, "   Audio:    %4ss   %5shz   %3skbps   %s channels",
+	    hgd_format_num(dur, sizeof(dur), tags->duration, "????"),
+	    hgd_format_num(rate, sizeof(rate), tags->samplerate, "?"),
+	    hgd_format_num(kbps, sizeof(kbps), tags->bitrate, "?"),
+	    hgd_format_num(chans, sizeof(chans), tags->channels, "?"));
+	hgd_add_line(lines, n_lines, colour, text);
+
+	/* vote off info */
+	if (t->votes_needed == 0)
+		text = xstrdup("   Votes needed to skip:    none");
+	else
+		xasprintf(&text, "   Votes needed to skip:    %d",
+		    t->votes_needed);
+	hgd_add_line(lines, n_lines, colour, text);
+
+	switch (t->voted) {
+	case 0:
+		hgd_add_line(lines, n_lines, colour,
+		    xstrdup("   You may vote off this track."));
+		break;
+	case 1:
+		hgd_add_line(lines, n_lines, ANSI_CYAN,
+		    xstrdup("   You HAVE voted-off this track."));
+		break;
+	case -1:
+		hgd_add_line(lines, n_lines, colour,
+		    xstrdup("   Could not auhtenticate. "
+		    "Log in to enable vote-off functionality."));
+		break;
+	default:
+		DPRINTF(HGD_D_ERROR, "Bogus 'has_voted' field");
+		ret = HGD_FAIL;
+	};
 
-		if (atoi(tokens[10]) != 0)
-			printf("   %s channels\n", tokens[10]);
-		else
-			printf("   %s channels\n", "?");
+clean:
+	return (ret);
+}
 
-		/* vote off info */
-		printf("   Votes needed to skip:    %s\n",
-		    atoi(tokens[12]) == 0 ? "none" : tokens[12]);
+int
+hgd_print_track(struct hgd_track *t, uint8_t first)
+{
+	char			**lines;
+	int			 n_lines, i, ret;
 
-		switch (atoi(tokens[13])) {
-		case 0:
-			printf("   You may vote off this track.\n");
-			break;
-		case 1:
-			hgd_set_line_colour(ANSI_CYAN);
-			printf("   You HAVE voted-off this track.\n");
-			break;
-		case -1:
-			printf("   Could not auhtenticate. "
-			    "Log in to enable vote-off functionality.\n");
-			break;
-		default:
-			DPRINTF(HGD_D_ERROR, "Bogus 'has_voted' field");
-			ret = HGD_FAIL;
-		};
-skip_full:
-		hgd_set_line_colour(ANSI_WHITE);
+	ret = hgd_format_track(t, first, &lines, &n_lines);
 
-	} else {
-		DPRINTF(HGD_D_ERROR, "Wrong number of tokens from server");
-		ret = HGD_FAIL;
-	}
+	for (i = 0; i < n_lines; i++)
+		printf("%s\n", lines[i]);
 
-	for (i = 0; i < n_toks; i ++)
-		free(tokens[i]);
+	hgd_free_lines(lines, n_lines);
 
 	return (ret);
 }
@@ -778,9 +756,9 @@ hgd_req_vote_off(int n_args, char **args)
 	(void) args;
 	(void) n_args;
 
-	hgd_sock_send_line(sock_fd, ssl, "vo");
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "vo");
 
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
 		DPRINTF(HGD_D_ERROR, "Vote off failed");
 		free(resp);
@@ -794,8 +772,8 @@ hgd_req_vote_off(int n_args, char **args)
 int
 hgd_req_playlist(int n_args, char **args)
 {
-	char			*resp, *track_resp, *p;
-	int			n_items, i;
+	struct hgd_track	*tracks;
+	int			 n_items, i;
 
 	(void) args;
 	(void) n_args;
@@ -807,69 +785,288 @@ hgd_req_playlist(int n_args, char **args)
 	if (!authenticated)
 		hgd_client_login(sock_fd, ssl, user);
 
-	hgd_sock_send_line(sock_fd, ssl, "ls");
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	if (hgd_fetch_playlist(&tracks, &n_items) != HGD_OK) {
+		hgd_free_tracks(tracks, n_items);
+		return (HGD_FAIL);
+	}
+
+	for (i = 0; i < n_items; i++) {
+		if (hud_max_items == 0 || hud_max_items > i) {
+			hgd_hline();
+			hgd_print_track(&tracks[i], i == 0);
+		}
+	}
+
+	if (n_items)
+		hgd_hline();
+	else
+		printf("Nothing to play!\n");
+
+	hgd_free_tracks(tracks, n_items);
+
+	return (HGD_OK);
+}
+
+/*
+ * block until the server reports that the playlist changed.
+ * returns the number of change events, 0 if the watch timed out, or
+ * HGD_FAIL.
+ */
+int
+hgd_watch_playlist()
+{
+	char			*resp, *ev, *p;
+	int			 n_evs, i;
+
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "watch");
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
 		free(resp);
 		return (HGD_FAIL);
 	}
 
-	for (p = resp; (*p != 0 && *p != '|'); p ++);
-	if (*p != '|') {
+	p = strchr(resp, '|');
+	if (p == NULL) {
 		DPRINTF(HGD_D_ERROR, "didn't find a argument separator");
 		free(resp);
 		return (HGD_FAIL);
 	}
 
-	n_items = atoi(++p);
+	n_evs = atoi(++p);
 	free(resp);
 
-	DPRINTF(HGD_D_DEBUG, "expecting %d items in playlist", n_items);
-	for (i = 0; i < n_items; i++) {
-		track_resp = hgd_sock_recv_line(sock_fd, ssl);
+	for (i = 0; i < n_evs; i++) {
+		ev = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+		if (ev == NULL)
+			return (HGD_FAIL);
+		DPRINTF(HGD_D_DEBUG, "Playlist event: %s", ev);
+		free(ev);
+	}
 
-		if (hud_max_items == 0 || hud_max_items > i) {
-			hgd_hline();
-			hgd_print_track(track_resp, i == 0);
+	return (n_evs);
+}
+
+/*
+ * Heads up display mode
+ *
+ * We keep the last frame drawn (one string per terminal row) and, on
+ * refresh, only rewrite rows which differ, using cursor addressing.
+ * Formatted rows are cached per track id and reused while the server's
+ * line (or frame fields) for that track is unchanged, so an unchanged row
+ * is the same pointer in both frames and costs nothing to compare.
+ */
+struct hgd_hud_row {
+	int			 id;
+	uint8_t			 first;
+	char			*raw;		/* as sent by the server */
+	size_t			 raw_len;
+	int			 n_lines;
+	char			**lines;
+};
+
+struct hgd_hud_frame {
+	int			 n_lines;
+	char			**lines;	/* borrowed, not owned */
+};
+
+struct hgd_hud_row		*hud_rows = NULL;
+int				 n_hud_rows = 0;
+struct hgd_hud_frame		 hud_frame = { 0, NULL };
+char				*hud_header = NULL, *hud_hline = NULL;
+char				*hud_empty = NULL;
+int				 hud_term_rows = -1;
+
+void
+hgd_hud_frame_add(struct hgd_hud_frame *f, char *line)
+{
+	f->lines = xrealloc(f->lines, sizeof(char *) * (f->n_lines + 1));
+	f->lines[f->n_lines++] = line;
+}
+
+void
+hgd_hud_free_rows(struct hgd_hud_row *rows, int n_rows)
+{
+	int			i;
+
+	for (i = 0; i < n_rows; i++) {
+		free(rows[i].raw);
+		hgd_free_lines(rows[i].lines, rows[i].n_lines);
+	}
+
+	if (rows)
+		free(rows);
+}
+
+/*
+ * fill in a row for a track, stealing the formatted lines of the previous
+ * frame's row if nothing about the track changed. Both old and new rows
+ * are in playlist order, so the search resumes from where it last hit.
+ */
+int
+hgd_hud_make_row(struct hgd_track *t, uint8_t first, struct hgd_hud_row *row,
+    int *hint)
+{
+	struct hgd_hud_row	*old;
+	int			 i;
+
+	row->id = t->item.id;
+	row->first = first;
+	row->raw = t->raw;
+	row->raw_len = t->raw_len;
+	t->raw = NULL;
+
+	for (i = *hint; i < n_hud_rows; i++) {
+		old = &hud_rows[i];
+		if (old->id != row->id)
+			continue;
+
+		*hint = i + 1;
+		if ((old->first == first) && (old->lines != NULL) &&
+		    (old->raw_len == row->raw_len) &&
+		    (memcmp(old->raw, row->raw, row->raw_len) == 0)) {
+			row->lines = old->lines;
+			row->n_lines = old->n_lines;
+			old->lines = NULL;
+			old->n_lines = 0;
+			return (HGD_OK);
 		}
+		break;
+	}
+
+	return (hgd_format_track(t, first, &row->lines, &row->n_lines));
+}
+
+/* write out the rows which differ from the last frame */
+void
+hgd_hud_draw(struct hgd_hud_frame *old, struct hgd_hud_frame *new,
+    uint8_t full)
+{
+	int			i, n;
+
+	if (full)
+		printf("\033[H\033[2J");
+
+	n = old->n_lines > new->n_lines ? old->n_lines : new->n_lines;
+	for (i = 0; i < n; i++) {
+		if ((!full) && (i < old->n_lines) && (i < new->n_lines) &&
+		    ((old->lines[i] == new->lines[i]) ||
+		    (strcmp(old->lines[i], new->lines[i]) == 0)))
+			continue;
+
+		printf("\033[%d;1H", i + 1);
+		if (i < new->n_lines)
+			printf("%s", new->lines[i]);
+		printf("\033[K");
+	}
+
+	/* park the cursor below the playlist */
+	printf("\033[%d;1H", new->n_lines + 1);
+	fflush(stdout);
+}
+
+/* fetch the playlist and bring the screen up to date */
+int
+hgd_hud_refresh(void)
+{
+	struct hgd_hud_frame	 frame = { 0, NULL };
+	struct hgd_hud_row	*rows = NULL;
+	struct hgd_track	*tracks;
+	struct winsize		 ws;
+	int			 n_items, n_rows = 0, i, j, hint = 0;
+	int			 term_rows = -1;
+
+	if (hud_header == NULL) {
+		xasprintf(&hud_header, "%sHGD Server @ %s -- Playlist:%s",
+		    ANSI_YELLOW, host, ANSI_WHITE);
+		hud_hline = xmalloc(HGD_TERM_WIDTH + 1);
+		memset(hud_hline, '-', HGD_TERM_WIDTH);
+		hud_hline[HGD_TERM_WIDTH] = 0;
+		hud_empty = "Nothing to play!";
+	}
+
+	/* as in 'ls', try to log in to see vote info */
+	if (!authenticated)
+		hgd_client_login(sock_fd, ssl, user);
 
-		free(track_resp);
+	/* the last frame and its rows stay as they are if this fails */
+	if (hgd_fetch_playlist(&tracks, &n_items) != HGD_OK) {
+		hgd_free_tracks(tracks, n_items);
+		return (HGD_FAIL);
 	}
 
+	hgd_hud_frame_add(&frame, hud_header);
+	hgd_hud_frame_add(&frame, "");
+
+	rows = xcalloc(n_items, sizeof(struct hgd_hud_row));
+	for (i = 0; i < n_items; i++) {
+		if ((hud_max_items == 0) || (hud_max_items > i)) {
+			hgd_hud_make_row(&tracks[i], i == 0, &rows[n_rows],
+			    &hint);
+			hgd_hud_frame_add(&frame, hud_hline);
+			for (j = 0; j < rows[n_rows].n_lines; j++)
+				hgd_hud_frame_add(&frame, rows[n_rows].lines[j]);
+			n_rows++;
+		}
+	}
+	hgd_free_tracks(tracks, n_items);
+
 	if (n_items)
-		hgd_hline();
+		hgd_hud_frame_add(&frame, hud_hline);
 	else
-		printf("Nothing to play!\n");
+		hgd_hud_frame_add(&frame, hud_empty);
+
+	/* don't draw past the bottom of the terminal, it would scroll */
+	if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) && (ws.ws_row > 1)) {
+		term_rows = ws.ws_row;
+		if (frame.n_lines > term_rows - 1)
+			frame.n_lines = term_rows - 1;
+	}
+
+	hgd_hud_draw(&hud_frame, &frame,
+	    (hud_frame.lines == NULL) || (term_rows != hud_term_rows));
+	hud_term_rows = term_rows;
+
+	/* the new frame becomes the old one */
+	hgd_hud_free_rows(hud_rows, n_hud_rows);
+	hud_rows = rows;
+	n_hud_rows = n_rows;
+
+	if (hud_frame.lines)
+		free(hud_frame.lines);
+	hud_frame = frame;
 
 	return (HGD_OK);
 }
 
 /*
- * Heads up display mode
- * May make this more spctacular at some stage...
+ * The server tells us when the playlist changes, so we only redraw then,
+ * and at most every hud_refresh_speed seconds.
  */
 int
 hgd_req_hud(int n_args, char **args)
 {
-	int			status;
+	int			n_evs;
+	time_t			last_draw, since;
 
 	(void) args;
 	(void) n_args;
 
-	/* pretty clunky ;) */
 	while (1) {
-		status = system("clear");
-		if (status != 0)
-			DPRINTF(HGD_D_WARN, "clear screen failed");
-
-		hgd_set_line_colour(ANSI_YELLOW);
-		printf("HGD Server @ %s -- Playlist:\n\n", host);
-		hgd_set_line_colour(ANSI_WHITE);
-
-		if (hgd_req_playlist(0, NULL) != HGD_OK)
+		if (hgd_hud_refresh() != HGD_OK)
 			return (HGD_FAIL);
-
-		sleep(hud_refresh_speed);
+		last_draw = time(NULL);
+
+		do {
+			if ((n_evs = hgd_watch_playlist()) == HGD_FAIL)
+				return (HGD_FAIL);
+		} while (n_evs == 0);
+
+		/* let a burst of changes settle into one redraw */
+		since = time(NULL) - last_draw;
+		if (since < hud_refresh_speed) {
+			hgd_log_flush();
+			sleep(hud_refresh_speed - since);
+		}
 	}
 
 	return (HGD_OK);
@@ -883,9 +1080,9 @@ hgd_req_skip(int n_args, char **args)
 	(void) args;
 	(void) n_args;
 
-	hgd_sock_send_line(sock_fd, ssl, "skip");
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "skip");
 
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
 		DPRINTF(HGD_D_ERROR, "Skip failed");
 		free(resp);
@@ -904,9 +1101,9 @@ hgd_req_pause(int n_args, char **args)
 	(void) args;
 	(void) n_args;
 
-	hgd_sock_send_line(sock_fd, ssl, "pause");
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "pause");
 
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
 		DPRINTF(HGD_D_ERROR, "Pause failed");
 		free(resp);
@@ -928,11 +1125,11 @@ hgd_req_user_add(int n_args, char **args)
 
 	xasprintf(&msg, "user-add|%s|%s", args[0], args[1]);
 
-	hgd_sock_send_line(sock_fd, ssl, msg);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, msg);
 
 	free(msg);
 
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
 		DPRINTF(HGD_D_ERROR, "Add user failed");
 		free(resp);
@@ -969,10 +1166,10 @@ hgd_req_user_list(int n_args, char **args)
 	(void) n_args;
 
 	xasprintf(&msg, "user-list");
-	hgd_sock_send_line(sock_fd, ssl, msg);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, msg);
 	free(msg);
 
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
 		DPRINTF(HGD_D_ERROR, "list users failed");
 		free(resp);
@@ -993,7 +1190,7 @@ hgd_req_user_list(int n_args, char **args)
 
 	for (i = 0; i < n_items; i++) {
 		DPRINTF(HGD_D_DEBUG, "getting user %d", i);
-		resp = hgd_sock_recv_line(sock_fd, ssl);
+		resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 
 		if ((p = strchr(resp, '|')) == NULL) {
 			DPRINTF(HGD_D_WARN, "could not find perms field");
@@ -1021,11 +1218,11 @@ hgd_req_user_del(int n_args, char **args)
 
 	xasprintf(&msg, "user-del|%s", args[0]);
 
-	hgd_sock_send_line(sock_fd, ssl, msg);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, msg);
 
 	free(msg);
 
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
 		DPRINTF(HGD_D_ERROR, "del user failed");
 		free(resp);
@@ -1048,11 +1245,11 @@ hgd_req_user_mkadmin(int n_args, char **args)
 
 	xasprintf(&msg, "user-mkadmin|%s", args[0]);
 
-	hgd_sock_send_line(sock_fd, ssl, msg);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, msg);
 
 	free(msg);
 
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
 		DPRINTF(HGD_D_ERROR, "mkadmin failed");
 		free(resp);
@@ -1074,11 +1271,11 @@ hgd_req_user_noadmin(int n_args, char **args)
 
 	xasprintf(&msg, "user-noadmin|%s", args[0]);
 
-	hgd_sock_send_line(sock_fd, ssl, msg);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, msg);
 
 	free(msg);
 
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
 		DPRINTF(HGD_D_ERROR, "noadmin failed");
 		free(resp);
@@ -1092,12 +1289,17 @@ hgd_req_user_noadmin(int n_args, char **args)
 int
 hgd_req_np(int n_args, char **args)
 {
+	struct hgd_track	 t;
+	struct hgd_frame	 f;
 	char			*resp = NULL, *p;
-	int			 ret = HGD_FAIL;
+	int			 ret = HGD_FAIL, playing = 0;
 
 	(void) n_args;
 	(void) args;
 
+	memset(&t, 0, sizeof(t));
+	memset(&f, 0, sizeof(f));
+
 	/*
 	 * we try to log in to get info about vote-off. If it fails,
 	 * so be it. We just won't show any vote info for the user.
@@ -1105,8 +1307,22 @@ hgd_req_np(int n_args, char **args)
 	if (!authenticated)
 		hgd_client_login(sock_fd, ssl, user);
 
-	hgd_sock_send_line(sock_fd, ssl, "np");
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "np");
+
+	if (binary_proto) {
+		if ((hgd_sock_recv_frame(&main_ctx,
+		    sock_fd, ssl, &f) != HGD_OK) ||
+		    (hgd_check_frame(&f, HGD_BIN_T_NP) != HGD_OK) ||
+		    (hgd_frame_int(&f, &playing) != HGD_OK))
+			goto fail;
+
+		if ((playing) && (hgd_parse_track_frame(&f, &t) != HGD_OK))
+			goto fail;
+
+		goto print;
+	}
+
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL)
 		return (HGD_FAIL);
 
@@ -1118,22 +1334,30 @@ hgd_req_np(int n_args, char **args)
 	}
 
 	/* check that something is even playing */
-	if (*(p+1) != '1')
-		printf("Nothing playing right now.\n");
-	else {
+	playing = (*(p+1) == '1');
+	if (playing) {
 		/* find 2nd | */
 		p = strchr(p + 1, '|');
 		if (!p) {
 			DPRINTF(HGD_D_ERROR, "Failed to find separator2");
 			goto fail;
 		}
-		hgd_print_track(p + 1, 1);
+		if (hgd_parse_track_line(p + 1, &t) != HGD_OK)
+			goto fail;
 	}
 
+print:
+	if (!playing)
+		printf("Nothing playing right now.\n");
+	else
+		hgd_print_track(&t, 1);
+
 	ret = HGD_OK;
 fail:
 	if (resp)
 		free(resp);
+	hgd_frame_free(&f);
+	hgd_free_track(&t);
 
 	return (ret);
 }
@@ -1148,8 +1372,8 @@ hgd_req_id(int n_args, char **args)
 	(void) n_args;
 	(void) args;
 
-	hgd_sock_send_line(sock_fd, ssl, "id");
-	resp = next = hgd_sock_recv_line(sock_fd, ssl);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "id");
+	resp = next = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	if (hgd_check_svr_response(resp, 0) == HGD_FAIL)
 		goto fail;
 
@@ -1204,73 +1428,6 @@ struct hgd_req_despatch req_desps[] = {
 	{NULL,		0,	0,		NULL,			0} /* end */
 };
 
-/*
- * check protocol version is correct
- */
-int
-hgd_check_svr_proto()
-{
-	char			*v, *resp = NULL;
-	int			 major = -1, minor = -1, ret = HGD_OK;
-	char			*split = "|";
-	char			*saveptr1;
-
-	hgd_sock_send_line(sock_fd, ssl, "proto");
-	resp = hgd_sock_recv_line(sock_fd, ssl);
-
-	if (hgd_check_svr_response(resp, 0) != HGD_OK) {
-		DPRINTF(HGD_D_ERROR, "Could not check server proto version");
-		ret = HGD_FAIL;
-		goto clean;
-	}
-
-	v = strtok_r(resp, split, &saveptr1);
-	(void) v;
-
-	/* major */
-	v = strtok_r(NULL, split, &saveptr1);
-	if (v == NULL) {
-		DPRINTF(HGD_D_ERROR, "Could not find protocol MAJOR version");
-		ret = HGD_FAIL;
-		goto clean;
-	}
-
-	major = atoi(v);
-
-	/* minor */
-	v = strtok_r(NULL, split, &saveptr1);
-	if (v == NULL) {
-		DPRINTF(HGD_D_ERROR, "Could not find protocol MINOR version");
-		ret = HGD_FAIL;
-		goto clean;
-	}
-
-	minor = atoi(v);
-
-	if (major == HGD_PROTO_VERSION_MAJOR && minor >= HGD_PROTO_VERSION_MINOR) {
-		if (minor > HGD_PROTO_VERSION_MINOR) {
-			DPRINTF(HGD_D_INFO, "Server is running a newer minor version"
-			    "of the server.Server=%d,%d, Client=%d,%d", major, minor,
-			    HGD_PROTO_VERSION_MAJOR, HGD_PROTO_VERSION_MINOR);
-		}
-	} else {
-		DPRINTF(HGD_D_ERROR, "Protocol mismatch: "
-		    "Server=%d,%d, Client=%d,%d", major, minor,
-		    HGD_PROTO_VERSION_MAJOR, HGD_PROTO_VERSION_MINOR);
-		ret = HGD_FAIL;
-		goto clean;
-	}
-
-
-	DPRINTF(HGD_D_DEBUG, "Protocol version matches server");
-
-clean:
-	if (resp)
-		free(resp);
-
-	return (ret);
-}
-
 /* parse command line args */
 int
 hgd_exec_req(int argc, char **argv)
@@ -1314,7 +1471,7 @@ hgd_exec_req(int argc, char **argv)
 	}
 
 	/* check protocol matches the server before we continue */
-	if (hgd_check_svr_proto() != HGD_OK)
+	if (hgd_check_svr_proto(&binary_proto) != HGD_OK)
 		return (HGD_FAIL);
 
 	DPRINTF(HGD_D_DEBUG, "Despatching request '%s'", correct_desp->req);
@@ -1352,6 +1509,7 @@ hgd_read_config(char **config_locations)
 	hgd_cfg_c_colours(cf, &colours_on);
 	hgd_cfg_crypto(cf, "hgdc", &crypto_pref);
 	hgd_cfg_c_maxitems(cf, &hud_max_items);
+	hgd_cfg_c_upload_jobs(cf, &upload_jobs);
 	hgd_cfg_c_hostname(cf, &host);
 	hgd_cfg_c_port(cf, &port);
 	hgd_cfg_c_password(cf, &password, *config_locations);
@@ -1371,10 +1529,15 @@ main(int argc, char **argv)
 {
 	char			*resp;
 	char			*config_path[4] = {NULL, NULL, NULL, NULL};
-	int			 num_config = 2, ch;
+	int			 num_config = 2, ch, jobs;
+
+	/* before anything which might log or fail */
+	hgd_component = HGD_COMPONENT_HGDC;
+	hgd_exit_cb = hgd_exit_nicely;
 
 	/* open syslog as soon as possible */
 	HGD_INIT_SYSLOG();
+	hgd_ctx_init(&main_ctx);
 
 	host = xstrdup(HGD_DFL_HOST);
 #ifdef HAVE_LIBCONFIG
@@ -1387,7 +1550,7 @@ main(int argc, char **argv)
 	 * Need to do getopt twice because x and c need to be done before
 	 * reading the config
 	 */
-	while ((ch = getopt(argc, argv, "aAc:Eehm:p:r:s:u:vx:")) != -1) {
+	while ((ch = getopt(argc, argv, "aAc:Eehj:m:p:r:s:u:vx:")) != -1) {
 		switch (ch) {
 		case 'x':
 			hgd_debug = atoi(optarg);
@@ -1425,7 +1588,7 @@ main(int argc, char **argv)
 
 	RESET_GETOPT();
 
-	while ((ch = getopt(argc, argv, "aAc:Eehm:p:r:s:u:vx:")) != -1) {
+	while ((ch = getopt(argc, argv, "aAc:Eehj:m:p:r:s:u:vx:")) != -1) {
 		switch (ch) {
 		case 'a':
 			DPRINTF(HGD_D_DEBUG, "ANSI colours on");
@@ -1446,6 +1609,16 @@ main(int argc, char **argv)
 			   " no crypto");
 			crypto_pref = HGD_CRYPTO_PREF_NEVER;
 			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1)
+				jobs = 1;
+			if (jobs > HGD_MAX_UPLOAD_JOBS)
+				jobs = HGD_MAX_UPLOAD_JOBS;
+			upload_jobs = jobs;
+			DPRINTF(HGD_D_DEBUG, "Set upload jobs to %d",
+			    upload_jobs);
+			break;
 		case 'm':
 			hud_max_items = atoi(optarg);
 			DPRINTF(HGD_D_DEBUG, "Set max playlist items to %d",
@@ -1505,8 +1678,8 @@ main(int argc, char **argv)
 	}
 
 	/* try to sign off */
-	hgd_sock_send_line(sock_fd, ssl, "bye");
-	resp = hgd_sock_recv_line(sock_fd, ssl);
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "bye");
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
 	hgd_check_svr_response(resp, 1);
 	free(resp);
 
@@ -37,6 +37,7 @@
 #include "hgd.h"
 #include "mplayer.h"
 #include "db.h"
+#include "stats.h"
 
 char			*mplayer_fifo_path = 0;
 
@@ -111,5 +112,14 @@ hgd_pause_track()
 int
 hgd_skip_track()
 {
-	return (hgd_mplayer_pipe_send("stop\n"));
+	int			ret;
+
+	/* hgd-playd times how long the player takes to go */
+	HGD_STATS_SET(skip_requested, hgd_stats_now_usecs());
+
+	ret = hgd_mplayer_pipe_send("stop\n");
+	if (ret != HGD_OK)
+		HGD_STATS_SET(skip_requested, 0);
+
+	return (ret);
 }
@@ -24,6 +24,8 @@ extern char		*mplayer_fifo_path;
 
 #define HGD_MPLAYER_PIPE_NAME	"mplayer.pipe"
 #define HGD_PLAYING_FILE	"hgd.playing"
+/* how long hgd-playd's null player plays an untagged track for (secs) */
+#define HGD_NULL_PLAY_DFL_SECS	180
 
 int			 hgd_mplayer_pipe_send(char *what);
 int			 hgd_make_mplayer_input_fifo(void);
@@ -18,6 +18,7 @@
 #define _GNU_SOURCE	/* linux */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <stdio.h>
 #include <curses.h>
@@ -25,11 +26,23 @@
 #include <stdlib.h>
 #include <menu.h>
 #include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <bsd/readpassphrase.h>
+#else
+#include <readpassphrase.h>
+#endif
 
 #include "hgd.h"
 #include "config.h"
 #include "cfg.h"
 #include "client.h"
+#include "net.h"
 #include "nchgdc.h"
 
 #define	HGD_CPAIR_BARS				1
@@ -38,6 +51,11 @@
 
 #define HGD_LOG_BACKBUFFER			4096
 
+/* how often the UI looks for news from the network thread */
+#define HGD_NC_UI_POLL_MS			250
+/* how long the network thread waits before reconnecting */
+#define HGD_NC_RETRY_SECS			5
+
 /* status bar positioning */
 #define HGD_POS_STATUS_X			0
 #define HGD_POS_STATUS_Y			LINES - 1
@@ -56,35 +74,27 @@
 #define HGD_POS_CONT_W				COLS
 #define HGD_POS_CONT_H				LINES - 2
 
-const char					*hgd_component = "nchgdc";
-
 const char *window_names[] = {
 	"Playlist",
 	"File Browser",
 	"Debug Console"
 };
 
-const char *test_playlist[] = {
-	"Gunther.ogg",
-	"Crabs.mp3",
-	"Some longer file name with spaces.ogg",
-	"Some track4",
-	"Some track5",
-	"Some track6",
-	"Some track7",
-	"Some track8",
-	"Some track10",
-	"Some track11",
-	"Some track11",
-	"Some track12",
-	"Some track15",
-	"Some track13",
-	"Some track12",
-	NULL
-};
-
 struct hgd_ui_log			logs;
 
+/*
+ * The network thread owns the connection (and the connection globals in
+ * client.c); the UI never touches the network. They talk over two queues
+ * and the UI pokes net_wake to interrupt the thread's 'watch'. The
+ * settings (host, port, user, password) are fixed before the thread
+ * starts and only read after, and a failed connect neither exits nor
+ * leaves anything open, so the thread can keep retrying.
+ */
+struct hgd_nc_queue			to_ui, to_net;
+int					net_wake[2] = {-1, -1};
+pthread_t				net_thread;
+struct hgd_upload_slot			upload_progress = {0, 0, -1};
+
 void
 hgd_exit_nicely()
 {
@@ -99,6 +109,309 @@ hgd_exit_nicely()
 	_exit(!exit_ok);
 }
 
+/* called only by the queue's producer */
+int
+hgd_nc_queue_push(struct hgd_nc_queue *q, void *p)
+{
+	unsigned int		tail = q->tail;
+
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) ==
+	    HGD_NC_QUEUE_SZ)
+		return (HGD_FAIL); /* full */
+
+	q->slots[tail & (HGD_NC_QUEUE_SZ - 1)] = p;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return (HGD_OK);
+}
+
+/* called only by the queue's consumer, returns NULL if empty */
+void *
+hgd_nc_queue_pop(struct hgd_nc_queue *q)
+{
+	unsigned int		 head = q->head;
+	void			*p;
+
+	if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+		return (NULL);
+
+	p = q->slots[head & (HGD_NC_QUEUE_SZ - 1)];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	return (p);
+}
+
+struct hgd_nc_msg *
+hgd_nc_new_msg(int type, char *text)
+{
+	struct hgd_nc_msg	*msg = xcalloc(1, sizeof(struct hgd_nc_msg));
+
+	msg->type = type;
+	msg->text = text;
+
+	return (msg);
+}
+
+void
+hgd_nc_free_msg(struct hgd_nc_msg *msg)
+{
+	int			i;
+
+	if (msg->text)
+		free(msg->text);
+
+	for (i = 0; i < msg->n_items; i++)
+		free(msg->items[i]);
+
+	if (msg->items)
+		free(msg->items);
+
+	free(msg);
+}
+
+/* hand a message to the UI, or drop it if the UI is not keeping up */
+void
+hgd_nc_send_ui(struct hgd_nc_msg *msg)
+{
+	if (hgd_nc_queue_push(&to_ui, msg) != HGD_OK) {
+		DPRINTF(HGD_D_WARN, "UI queue full, dropping message");
+		hgd_nc_free_msg(msg);
+	}
+}
+
+/* takes ownership of text */
+void
+hgd_nc_send_status(char *text)
+{
+	DPRINTF(HGD_D_INFO, "%s", text);
+	hgd_nc_send_ui(hgd_nc_new_msg(HGD_NC_MSG_STATUS, text));
+}
+
+void
+hgd_nc_disconnect(void)
+{
+	if (ssl) {
+		SSL_free(ssl);
+		ssl = NULL;
+	}
+
+	if (sock_fd >= 0) {
+		close(sock_fd);
+		sock_fd = -1;
+	}
+
+	authenticated = 0;
+	server_ssl_capable = 0;
+}
+
+int
+hgd_nc_connect(void)
+{
+	if (hgd_setup_socket() != HGD_OK)
+		return (HGD_FAIL);
+
+	if (hgd_check_svr_proto(NULL) != HGD_OK) {
+		hgd_nc_disconnect();
+		return (HGD_FAIL);
+	}
+
+	/* without a password we can still show the playlist */
+	if (password != NULL)
+		hgd_client_login(sock_fd, ssl, user);
+
+	return (HGD_OK);
+}
+
+/* fetch the playlist and send it to the UI as one line per track */
+int
+hgd_nc_fetch_playlist(void)
+{
+	struct hgd_nc_msg	*msg;
+	char			*resp, *p, *next, *toks[5];
+	int			 n_items, i, n_toks;
+
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "ls");
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+	if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
+		free(resp);
+		return (HGD_FAIL);
+	}
+
+	if ((p = strchr(resp, '|')) == NULL) {
+		DPRINTF(HGD_D_ERROR, "didn't find a argument separator");
+		free(resp);
+		return (HGD_FAIL);
+	}
+
+	n_items = atoi(++p);
+	free(resp);
+
+	msg = hgd_nc_new_msg(HGD_NC_MSG_PLAYLIST, NULL);
+	msg->items = xcalloc(n_items, sizeof(char *));
+
+	for (i = 0; i < n_items; i++) {
+		if ((resp = hgd_sock_recv_line(&main_ctx,
+		    sock_fd, ssl)) == NULL) {
+			hgd_nc_free_msg(msg);
+			return (HGD_FAIL);
+		}
+
+		/* id, filename, artist, title, user */
+		next = resp;
+		for (n_toks = 0; (n_toks < 5) && (next != NULL); n_toks++)
+			toks[n_toks] = strsep(&next, "|");
+
+		if (n_toks != 5) {
+			DPRINTF(HGD_D_WARN, "Wrong number of tokens from server");
+			xasprintf(&msg->items[i], "???");
+		} else if ((*toks[2] != 0) && (*toks[3] != 0)) {
+			xasprintf(&msg->items[i], "#%04d  %s - %s  (%s)",
+			    atoi(toks[0]), toks[2], toks[3], toks[4]);
+		} else {
+			xasprintf(&msg->items[i], "#%04d  %s  (%s)",
+			    atoi(toks[0]), toks[1], toks[4]);
+		}
+		msg->n_items++;
+
+		free(resp);
+	}
+
+	hgd_nc_send_ui(msg);
+
+	return (HGD_OK);
+}
+
+void
+hgd_nc_upload(char *path)
+{
+	if (!authenticated) {
+		hgd_nc_send_status(xstrdup("Not logged in, can't upload"));
+		return;
+	}
+
+	hgd_nc_send_status(xstrdup("Uploading..."));
+
+	upload_progress.written = 0;
+	upload_progress.size = 0;
+	upload_progress.file = 0;
+
+	if (hgd_queue_track(path, &upload_progress) == HGD_OK)
+		hgd_nc_send_status(xstrdup("Upload complete"));
+	else
+		hgd_nc_send_status(xstrdup("Upload failed"));
+
+	upload_progress.file = -1;
+}
+
+/*
+ * wait for the playlist to change or for the UI to want something.
+ * Returns 1 if the playlist changed, 0 if not and HGD_FAIL on error.
+ */
+int
+hgd_nc_wait(void)
+{
+	struct pollfd		 pfds[2];
+	char			 buf[16], *resp, *p;
+	int			 n_evs, i, woken = 0;
+
+	hgd_sock_send_line(&main_ctx, sock_fd, ssl, "watch");
+
+	pfds[0].fd = sock_fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = net_wake[0];
+	pfds[1].events = POLLIN;
+
+	hgd_log_flush();
+	if ((poll(pfds, 2, INFTIM) < 0) && (errno != EINTR)) {
+		DPRINTF(HGD_D_ERROR, "poll: %s", SERROR);
+		return (HGD_FAIL);
+	}
+
+	if (pfds[1].revents & POLLIN) {
+		/* any line makes the server stop waiting, proto is harmless */
+		if (read(net_wake[0], buf, sizeof(buf)) < 0)
+			DPRINTF(HGD_D_WARN, "read: %s", SERROR);
+		hgd_sock_send_line(&main_ctx, sock_fd, ssl, "proto");
+		woken = 1;
+	}
+
+	resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+	if ((hgd_check_svr_response(resp, 0) == HGD_FAIL) ||
+	    ((p = strchr(resp, '|')) == NULL)) {
+		free(resp);
+		return (HGD_FAIL);
+	}
+
+	n_evs = atoi(++p);
+	free(resp);
+
+	for (i = 0; i < n_evs; i++) {
+		if ((resp = hgd_sock_recv_line(&main_ctx,
+		    sock_fd, ssl)) == NULL)
+			return (HGD_FAIL);
+		DPRINTF(HGD_D_DEBUG, "Playlist event: %s", resp);
+		free(resp);
+	}
+
+	if (woken) {
+		resp = hgd_sock_recv_line(&main_ctx, sock_fd, ssl);
+		if (hgd_check_svr_response(resp, 0) == HGD_FAIL) {
+			free(resp);
+			return (HGD_FAIL);
+		}
+		free(resp);
+	}
+
+	return (n_evs > 0);
+}
+
+/* the network thread; all network I/O happens here */
+void *
+hgd_nc_net_thread(void *arg)
+{
+	struct hgd_nc_msg	*msg;
+	char			*status;
+	int			 refetch = 1;
+
+	(void) arg;
+
+	while (1) {
+		if (sock_fd < 0) {
+			if (hgd_nc_connect() != HGD_OK) {
+				hgd_nc_send_status(xstrdup(
+				    "Can't connect to server, will retry"));
+				hgd_log_flush();
+				sleep(HGD_NC_RETRY_SECS);
+				continue;
+			}
+
+			xasprintf(&status, "Connected to %s", host);
+			hgd_nc_send_status(status);
+			refetch = 1;
+		}
+
+		/* uploads the UI asked for */
+		while ((msg = hgd_nc_queue_pop(&to_net)) != NULL) {
+			if (msg->type == HGD_NC_MSG_QUEUE)
+				hgd_nc_upload(msg->text);
+			hgd_nc_free_msg(msg);
+			refetch = 1;
+		}
+
+		if ((refetch) && (hgd_nc_fetch_playlist() != HGD_OK)) {
+			hgd_nc_disconnect();
+			continue;
+		}
+
+		if ((refetch = hgd_nc_wait()) == HGD_FAIL) {
+			hgd_nc_send_status(xstrdup("Lost connection to server"));
+			hgd_nc_disconnect();
+		}
+	}
+
+	return (NULL);
+}
+
 int
 hgd_empty_menu(MENU *m)
 {
@@ -116,6 +429,30 @@ hgd_empty_menu(MENU *m)
 	return (HGD_OK);
 }
 
+/* unpost and free a menu along with its items */
+void
+hgd_free_menu(MENU *m)
+{
+	ITEM			**items;
+	int			  n_items, i;
+
+	if (m == NULL)
+		return;
+
+	unpost_menu(m);
+	items = menu_items(m);
+	n_items = item_count(m);
+	free_menu(m);
+
+	for (i = 0; i < n_items; i++) {
+		free((char *) item_name(items[i]));
+		free_item(items[i]);
+	}
+
+	if (items)
+		free(items);
+}
+
 int
 hgd_prepare_item_string(char **ret_p, char *str)
 {
@@ -164,14 +501,23 @@ hgd_prepare_item_string(char **ret_p, char *str)
 void
 hgd_update_statusbar(struct ui *u)
 {
-	char			*fmt;
+	char			*fmt, *msg;
 
 	wclear(u->status);
 	wattron(u->status, COLOR_PAIR(HGD_CPAIR_BARS));
 
+	if (upload_progress.file >= 0 && upload_progress.size > 0) {
+		xasprintf(&msg, "User: %s :: Uploading %d%%", user,
+		    (int) (upload_progress.written * 100 / upload_progress.size));
+	} else {
+		xasprintf(&msg, "User: %s :: %s", user,
+		    u->status_msg ? u->status_msg : "");
+	}
+
 	xasprintf(&fmt, "%%-%ds", COLS);
-	wprintw(u->status, fmt,  "User: edd\tHasVote: Yes");
-	free (fmt);
+	mvwprintw(u->status, 0, 0, fmt, msg);
+	free(fmt);
+	free(msg);
 }
 
 void
@@ -239,119 +585,321 @@ hgd_update_titlebar(struct ui *u)
 	free(fmt);
 }
 
+/* rebuild the playlist menu from what the network thread last sent */
 int
 hgd_update_playlist_win(struct ui *u)
 {
+	ITEM			**items;
+	char			 *item_str;
+	int			  i, n_items;
+
 	DPRINTF(HGD_D_INFO, "Update playlist window");
-	/* XXX */
+
+	hgd_free_menu(u->content_menus[HGD_WIN_PLAYLIST]);
+	wclear(u->content_wins[HGD_WIN_PLAYLIST]);
+
+	/* a menu can't be empty, so show a placeholder */
+	n_items = u->n_playlist ? u->n_playlist : 1;
+	items = xcalloc(n_items + 1, sizeof(ITEM *));
+
+	for (i = 0; i < n_items; i++) {
+		if (u->n_playlist)
+			hgd_prepare_item_string(&item_str, u->playlist[i]);
+		else if (u->playlist)
+			hgd_prepare_item_string(&item_str, "Nothing to play!");
+		else
+			hgd_prepare_item_string(&item_str, "Waiting for server...");
+
+		items[i] = new_item(item_str, NULL);
+		if (items[i] == NULL)
+			DPRINTF(HGD_D_WARN, "Could not make new item: %s", SERROR);
+	}
+
+	u->content_menus[HGD_WIN_PLAYLIST] = new_menu(items);
+	if (u->content_menus[HGD_WIN_PLAYLIST] == NULL) {
+		DPRINTF(HGD_D_ERROR, "Could not make menu");
+		return (HGD_FAIL);
+	}
+
+	set_menu_win(u->content_menus[HGD_WIN_PLAYLIST], u->content_wins[HGD_WIN_PLAYLIST]);
+	set_menu_mark(u->content_menus[HGD_WIN_PLAYLIST], "");
+	set_menu_format(u->content_menus[HGD_WIN_PLAYLIST], LINES - 2, 1);
+	set_menu_fore(u->content_menus[HGD_WIN_PLAYLIST], COLOR_PAIR(HGD_CPAIR_SELECTED));
+
+	if ((post_menu(u->content_menus[HGD_WIN_PLAYLIST])) != E_OK)
+		DPRINTF(HGD_D_ERROR, "Could not post menu");
+
 	return (HGD_OK);
 }
 
+/* deal with anything the network thread has sent us */
+void
+hgd_nc_poll_msgs(struct ui *u)
+{
+	struct hgd_nc_msg	*msg;
+	int			 i;
+
+	while ((msg = hgd_nc_queue_pop(&to_ui)) != NULL) {
+		switch (msg->type) {
+		case HGD_NC_MSG_PLAYLIST:
+			for (i = 0; i < u->n_playlist; i++)
+				free(u->playlist[i]);
+			if (u->playlist)
+				free(u->playlist);
+
+			/* steal the items */
+			u->playlist = msg->items;
+			u->n_playlist = msg->n_items;
+			if (u->playlist == NULL)
+				u->playlist = xcalloc(1, sizeof(char *));
+			msg->items = NULL;
+			msg->n_items = 0;
+
+			if (u->active_content_win == HGD_WIN_PLAYLIST)
+				hgd_switch_content(u, HGD_WIN_PLAYLIST);
+			break;
+		case HGD_NC_MSG_STATUS:
+			if (u->status_msg)
+				free(u->status_msg);
+			u->status_msg = msg->text;
+			msg->text = NULL;
+			break;
+		default:
+			DPRINTF(HGD_D_WARN, "Bogus message for UI");
+		};
+
+		hgd_nc_free_msg(msg);
+	}
+
+	hgd_update_statusbar(u);
+	wrefresh(u->status);
+}
+
+/* directories first, then by name */
 int
-hgd_update_files_win(struct ui *u)
+hgd_dir_ent_cmp(const void *a, const void *b)
 {
-	ITEM			**items = NULL;
-	DIR			 *dir = NULL;
-	int			  cur_index = 0, pass = 0;
-	struct dirent		 *dirent, *dirent_copy = NULL;
-	char			 *copy, *slash_append;
+	const struct hgd_dir_ent	*ea = a, *eb = b;
 
-	wclear(u->content_wins[HGD_WIN_FILES]);
+	if (ea->is_dir != eb->is_dir)
+		return (eb->is_dir - ea->is_dir);
 
-	DPRINTF(HGD_D_INFO, "Update files window");
+	return (strcmp(ea->name, eb->name));
+}
+
+void
+hgd_free_dir_cache(struct hgd_dir_cache *dc)
+{
+	int			i;
+
+	for (i = 0; i < dc->n_ents; i++)
+		free(dc->ents[i].name);
 
-	if ((dir = opendir(u->cwd)) == NULL) {
-		DPRINTF(HGD_D_WARN, "Could not read dir: '%s'", u->cwd);
+	free(dc->ents);
+	free(dc->path);
+	memset(dc, 0, sizeof(*dc));
+}
+
+/* read a directory in one pass and sort it */
+int
+hgd_scan_dir(struct hgd_dir_cache *dc, char *path, time_t mtime)
+{
+	DIR			*dir;
+	struct dirent		*dirent;
+	struct hgd_dir_ent	*ent;
+	struct stat		 st;
+	char			*full;
+
+	DPRINTF(HGD_D_INFO, "Scanning dir: '%s'", path);
+
+	if ((dir = opendir(path)) == NULL) {
+		DPRINTF(HGD_D_WARN, "Could not read dir: '%s'", path);
 		return (HGD_FAIL);
 	}
 
-	/* make our menu items */
-	items = xcalloc(sizeof(ITEM *), cur_index + 1);
+	hgd_free_dir_cache(dc);
+	dc->path = xstrdup(path);
+	dc->mtime = mtime;
 
-	/*
-	 * 2 passes over directory:
-	 *   1 - directories
-	 *   2 - standard files
-	 */
-	for (pass = 0; pass < 2; pass++) {
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strcmp(dirent->d_name, ".") == 0)
+			continue;
 
-		rewinddir(dir);
+		if (dc->n_ents == dc->n_alloc) {
+			dc->n_alloc = dc->n_alloc ? dc->n_alloc * 2 : 64;
+			dc->ents = xrealloc(dc->ents,
+			    sizeof(struct hgd_dir_ent) * dc->n_alloc);
+		}
 
-		/* loop over directory adding items for files */
-		while ((dirent = readdir(dir)) != NULL) {
+		ent = &dc->ents[dc->n_ents++];
+		ent->name = xstrdup(dirent->d_name);
+		ent->is_dir = (dirent->d_type == DT_DIR);
 
-			if (dirent < 0) {
-				DPRINTF(HGD_D_WARN,
-				    "readdir failed: %s", SERROR);
-				return (HGD_FAIL);
-			}
+		/* not all filesystems fill in d_type */
+		if (dirent->d_type == DT_UNKNOWN) {
+			xasprintf(&full, "%s/%s", path, dirent->d_name);
+			if (stat(full, &st) == 0)
+				ent->is_dir = S_ISDIR(st.st_mode);
+			free(full);
+		}
+	}
 
-			/* skip entries not for this pass */
-			if ((pass == 0) && (dirent->d_type != DT_DIR))
-				continue;
-			else if ((pass == 1) && (dirent->d_type == DT_DIR))
-				continue;
+	closedir(dir);
 
-			if (strcmp(dirent->d_name, ".") == 0)
-				continue;
+	qsort(dc->ents, dc->n_ents, sizeof(struct hgd_dir_ent), hgd_dir_ent_cmp);
 
-			/* could be more efficient */
-			items = xrealloc(
-			    items, sizeof(ITEM *) * (cur_index + 2));
-			items[cur_index + 1] = NULL;
-
-			/* pretty it up a bit */
-			if (dirent->d_type == DT_DIR) {
-				xasprintf(&slash_append, "%s/", dirent->d_name);
-				hgd_prepare_item_string(&copy, slash_append);
-				free(slash_append);
-			} else {
-				hgd_prepare_item_string(&copy, dirent->d_name);
-			}
+	return (HGD_OK);
+}
 
-			items[cur_index] = new_item(copy, NULL);
+/* find the listing of a directory, rescanning only if it changed */
+struct hgd_dir_cache *
+hgd_get_dir_cache(char *path)
+{
+	static struct hgd_dir_cache	 cache[HGD_NC_DIR_CACHE_SZ];
+	static int			 next_slot = 0;
+	struct hgd_dir_cache		*dc = NULL;
+	struct stat			 st;
+	int				 i;
+
+	if (stat(path, &st) < 0) {
+		DPRINTF(HGD_D_WARN, "Could not stat '%s': %s", path, SERROR);
+		return (NULL);
+	}
 
-			if (items[cur_index] == NULL) {
-				DPRINTF(HGD_D_WARN,
-				    "Could not make new menu item: %s", SERROR);
-				free(copy);
-			}
+	for (i = 0; i < HGD_NC_DIR_CACHE_SZ; i++) {
+		if ((cache[i].path) && (strcmp(cache[i].path, path) == 0)) {
+			dc = &cache[i];
+			break;
+		}
+	}
 
-			/* jam away the dirent for later use */
-			dirent_copy = xcalloc(1, sizeof(struct dirent));
-			DPRINTF(HGD_D_INFO, "TEST TEST TEST1: %s", dirent->d_name);
-			memcpy(dirent_copy, dirent, sizeof(struct dirent));
-			DPRINTF(HGD_D_INFO, "TEST TEST TEST: %s", dirent_copy->d_name);
-			set_item_userptr(items[cur_index], dirent_copy);
+	if ((dc) && (dc->mtime == st.st_mtime))
+		return (dc);
 
-			if (items[cur_index] == NULL)
-				continue;
+	/* evict the oldest listing */
+	if (dc == NULL) {
+		dc = &cache[next_slot];
+		next_slot = (next_slot + 1) % HGD_NC_DIR_CACHE_SZ;
+	}
 
-			cur_index++;
-		}
+	if (hgd_scan_dir(dc, path, st.st_mtime) != HGD_OK) {
+		hgd_free_dir_cache(dc);
+		return (NULL);
 	}
 
-	/* make the menu */
-	if (u->content_menus[HGD_WIN_FILES] != NULL) {
-		/* XXX clean up old menu */
+	return (dc);
+}
+
+/*
+ * Only the entries that fit on the screen are made into menu items, the
+ * menu is rebuilt when the selection scrolls off it.
+ */
+int
+hgd_update_files_win(struct ui *u)
+{
+	ITEM			**items = NULL;
+	struct hgd_dir_cache	 *dc;
+	struct hgd_dir_ent	 *ent;
+	int			  i, n_items, page = HGD_POS_CONT_H;
+	char			 *copy, *slash_append;
+
+	DPRINTF(HGD_D_INFO, "Update files window");
+
+	if ((dc = hgd_get_dir_cache(u->cwd)) == NULL)
+		return (HGD_FAIL);
+	u->files = dc;
+
+	hgd_free_menu(u->content_menus[HGD_WIN_FILES]);
+	u->content_menus[HGD_WIN_FILES] = NULL;
+	wclear(u->content_wins[HGD_WIN_FILES]);
+
+	if (dc->n_ents == 0)
+		return (HGD_OK);
+
+	/* keep the selection on the screen */
+	if (page < 1)
+		page = 1;
+	if (dc->sel >= dc->n_ents)
+		dc->sel = dc->n_ents - 1;
+	if (dc->sel < dc->top)
+		dc->top = dc->sel;
+	if (dc->sel >= dc->top + page)
+		dc->top = dc->sel - page + 1;
+
+	n_items = dc->n_ents - dc->top;
+	if (n_items > page)
+		n_items = page;
+
+	items = xcalloc(n_items + 1, sizeof(ITEM *));
+	for (i = 0; i < n_items; i++) {
+		ent = &dc->ents[dc->top + i];
+
+		/* pretty it up a bit */
+		if (ent->is_dir) {
+			xasprintf(&slash_append, "%s/", ent->name);
+			hgd_prepare_item_string(&copy, slash_append);
+			free(slash_append);
+		} else {
+			hgd_prepare_item_string(&copy, ent->name);
+		}
+
+		if ((items[i] = new_item(copy, NULL)) == NULL) {
+			DPRINTF(HGD_D_WARN,
+			    "Could not make new menu item: %s", SERROR);
+			free(copy);
+			continue;
+		}
+
+		set_item_userptr(items[i], ent);
 	}
 
 	u->content_menus[HGD_WIN_FILES] = new_menu(items);
+	if (u->content_menus[HGD_WIN_FILES] == NULL) {
+		DPRINTF(HGD_D_ERROR, "Could not make menu");
+		return (HGD_FAIL);
+	}
 
-	keypad(u->content_wins[HGD_WIN_FILES], TRUE);
 	set_menu_win(u->content_menus[HGD_WIN_FILES],
 	    u->content_wins[HGD_WIN_FILES]);
 	set_menu_mark(u->content_menus[HGD_WIN_FILES], "");
-	set_menu_format(u->content_menus[HGD_WIN_FILES],
-	    LINES - 2, 1);
+	set_menu_format(u->content_menus[HGD_WIN_FILES], page, 1);
 	set_menu_fore(u->content_menus[HGD_WIN_FILES],
 	    COLOR_PAIR(HGD_CPAIR_SELECTED));
 
 	if ((post_menu(u->content_menus[HGD_WIN_FILES])) != E_OK)
 		DPRINTF(HGD_D_WARN, "Could not post menu");
 
+	set_current_item(u->content_menus[HGD_WIN_FILES],
+	    items[dc->sel - dc->top]);
+
 	return (HGD_OK);
+}
 
+/* move the file browser selection, rebuilding the menu if it scrolls */
+int
+hgd_files_move(struct ui *u, int delta)
+{
+	struct hgd_dir_cache	*dc = u->files;
+	int			 sel;
+
+	if ((dc == NULL) || (dc->n_ents == 0))
+		return (HGD_OK);
+
+	sel = dc->sel + delta;
+	if (sel < 0)
+		sel = 0;
+	if (sel >= dc->n_ents)
+		sel = dc->n_ents - 1;
+	dc->sel = sel;
+
+	if ((sel >= dc->top) && (sel < dc->top + item_count(
+	    u->content_menus[HGD_WIN_FILES]))) {
+		set_current_item(u->content_menus[HGD_WIN_FILES],
+		    menu_items(u->content_menus[HGD_WIN_FILES])[sel - dc->top]);
+		return (HGD_OK);
+	}
+
+	return (hgd_switch_content(u, HGD_WIN_FILES));
 }
 
 int
@@ -516,10 +1064,6 @@ hgd_init_statusbar(struct ui *u)
 int
 hgd_init_playlist_win(struct ui *u)
 {
-	ITEM			**items;
-	int			  n_items, i;
-	char			 *item_str;
-
 	DPRINTF(HGD_D_INFO, "Initialise playlist window");
 
 	/* make window */
@@ -530,38 +1074,13 @@ hgd_init_playlist_win(struct ui *u)
 	}
 
 	keypad(u->content_wins[HGD_WIN_PLAYLIST], TRUE);
+	wtimeout(u->content_wins[HGD_WIN_PLAYLIST], HGD_NC_UI_POLL_MS);
 
-	/* and now populate the menu */
-	n_items = ARRAY_SIZE(test_playlist);
-
-	items = xcalloc(n_items, sizeof(ITEM *));
-	for (i = 0; i < n_items - 1; i++) {
-		DPRINTF(HGD_D_DEBUG, "Adding item \"%s\"", test_playlist[i]);
-
-		hgd_prepare_item_string(&item_str, (char *) test_playlist[i]);
-
-		items[i] = new_item(item_str, NULL);
-		if (items[i] == NULL)
-			DPRINTF(HGD_D_WARN, "Could not make new item: %s", SERROR);
-	}
-
-	u->content_menus[HGD_WIN_PLAYLIST] = new_menu(items);
-	if (u->content_menus[HGD_WIN_PLAYLIST] == NULL)
-			DPRINTF(HGD_D_ERROR, "Could not make menu");
-
-	set_menu_win(u->content_menus[HGD_WIN_PLAYLIST], u->content_wins[HGD_WIN_PLAYLIST]);
-	set_menu_mark(u->content_menus[HGD_WIN_PLAYLIST], "");
-	set_menu_format(u->content_menus[HGD_WIN_PLAYLIST], LINES - 2, 1);
-	set_menu_fore(u->content_menus[HGD_WIN_PLAYLIST], COLOR_PAIR(HGD_CPAIR_SELECTED));
-
-	if ((post_menu(u->content_menus[HGD_WIN_PLAYLIST])) != E_OK)
-		DPRINTF(HGD_D_ERROR, "Could not post menu");
-
-
-	/* refresh handler */
+	/* the menu is populated once the network thread sends a playlist */
+	u->content_menus[HGD_WIN_PLAYLIST] = NULL;
 	u->content_refresh_handler[HGD_WIN_PLAYLIST] = hgd_update_playlist_win;
 
-	return (HGD_OK);
+	return (hgd_update_playlist_win(u));
 }
 
 /* initialise the file browser content pane */
@@ -577,6 +1096,7 @@ hgd_init_files_win(struct ui *u)
 	}
 
 	keypad(u->content_wins[HGD_WIN_FILES], TRUE);
+	wtimeout(u->content_wins[HGD_WIN_FILES], HGD_NC_UI_POLL_MS);
 
 	u->content_menus[HGD_WIN_FILES] = NULL; /* no menu */
 	u->content_refresh_handler[HGD_WIN_FILES] = hgd_update_files_win;
@@ -598,6 +1118,7 @@ hgd_init_console_win(struct ui *u)
 	}
 
 	keypad(u->content_wins[HGD_WIN_CONSOLE], TRUE);
+	wtimeout(u->content_wins[HGD_WIN_CONSOLE], HGD_NC_UI_POLL_MS);
 	mvwprintw(u->content_wins[HGD_WIN_CONSOLE], 0, 0, "Insert console here");
 
 	u->content_menus[HGD_WIN_CONSOLE] = NULL; /* no menu */
@@ -753,33 +1274,24 @@ hgd_show_dialog(struct ui *u, const char *title, const char *msg, int secs)
 	return (HGD_OK);
 }
 
+/* ask the network thread to upload a file, takes ownership of path */
 int
-hgd_ui_queue_track(struct ui *u)
+hgd_ui_queue_track(struct ui *u, char *path)
 {
-	WINDOW			*win;
-	int			 x, y, h, w;
-
-	hgd_calc_dialog_win_dims(&y, &x, &h, &w);
+	struct hgd_nc_msg	*msg;
 
-	DPRINTF(HGD_D_INFO, "Queue a track");
+	DPRINTF(HGD_D_INFO, "Queue a track: %s", path);
 
-	if ((win = newwin(h, w, y, x)) == NULL) {
-		DPRINTF(HGD_D_ERROR, "Could not initialise progress window");
+	msg = hgd_nc_new_msg(HGD_NC_MSG_QUEUE, path);
+	if (hgd_nc_queue_push(&to_net, msg) != HGD_OK) {
+		hgd_nc_free_msg(msg);
+		hgd_show_dialog(u, "[ Error ]", "Too many uploads pending", 0);
 		return (HGD_FAIL);
 	}
 
-	wattron(win, COLOR_PAIR(HGD_CPAIR_DIALOG));
-	wclear(win);
-	wbkgd(win, COLOR_PAIR(HGD_CPAIR_DIALOG));
-	box(win, '|', '-');
-
-	/* XXX progress logic here */
-
-	redrawwin(win);
-	wrefresh(win);
-
-	sleep(5);
-	delwin(win);
+	/* interrupt the network thread if it is waiting on the server */
+	if (write(net_wake[1], "q", 1) != 1)
+		DPRINTF(HGD_D_WARN, "Could not wake network thread: %s", SERROR);
 
 	return (HGD_OK);
 }
@@ -790,36 +1302,35 @@ hgd_enter_on_files_menu(struct ui *u)
 {
 	DPRINTF(HGD_D_INFO, "Selected item on files menu");
 
-	char			*new_cwd = NULL;
+	char			*new_cwd = NULL, *path;
 	ITEM			*item;
-	struct dirent		*dirent;
+	struct hgd_dir_ent	*ent;
 
-	if ((item = current_item(u->content_menus[HGD_WIN_FILES])) == NULL) {
+	if ((u->content_menus[HGD_WIN_FILES] == NULL) ||
+	    ((item = current_item(u->content_menus[HGD_WIN_FILES])) == NULL)) {
 	    DPRINTF(HGD_D_WARN, "Could not get current item");
 	    return (HGD_FAIL);
 	}
 
-	dirent = (struct dirent *) item_userptr(item);
+	ent = (struct hgd_dir_ent *) item_userptr(item);
 
-	DPRINTF(HGD_D_INFO, "dirent: %s", dirent->d_name);
+	DPRINTF(HGD_D_INFO, "entry: %s", ent->name);
 
-	switch (dirent->d_type) {
-	case DT_DIR:
-		DPRINTF(HGD_D_INFO, "switch cwd: dirent->d_name");
+	if (ent->is_dir) {
+		DPRINTF(HGD_D_INFO, "switch cwd: %s", ent->name);
 
-		if (strcmp(dirent->d_name, "..") == 0)
+		if (strcmp(ent->name, "..") == 0)
 			new_cwd = xstrdup(dirname(u->cwd));
 		else
-			xasprintf(&new_cwd, "%s/%s", u->cwd, dirent->d_name);
+			xasprintf(&new_cwd, "%s/%s", u->cwd, ent->name);
 
 		free(u->cwd);
 		u->cwd = new_cwd;
-
-		break;
-	default:
-		hgd_ui_queue_track(u);
-		break;
-	};
+		u->files = NULL; /* may be evicted from the cache */
+	} else {
+		xasprintf(&path, "%s/%s", u->cwd, ent->name);
+		hgd_ui_queue_track(u, path);
+	}
 
 	return (HGD_OK);
 }
@@ -832,7 +1343,28 @@ hgd_event_loop(struct ui *u)
 	/* XXX catch C^c */
 	while (1) {
 
+		hgd_log_flush();
 		c = wgetch(u->content_wins[u->active_content_win]);
+		hgd_nc_poll_msgs(u);
+
+		/* the file browser only has a menu for what is on screen */
+		if (u->active_content_win == HGD_WIN_FILES) {
+			switch (c) {
+			case KEY_DOWN:
+				hgd_files_move(u, 1);
+				continue;
+			case KEY_UP:
+				hgd_files_move(u, -1);
+				continue;
+			case KEY_NPAGE:
+				hgd_files_move(u, HGD_POS_CONT_H);
+				continue;
+			case KEY_PPAGE:
+				hgd_files_move(u, -(HGD_POS_CONT_H));
+				continue;
+			}
+		}
+
 		switch(c) {
 		case KEY_DOWN:
 			menu_driver(u->content_menus[u->active_content_win],
@@ -918,10 +1450,47 @@ int
 main(int argc, char **argv)
 {
 	struct ui	u;
+	char		*config_path[4] = {NULL, NULL, NULL, NULL};
+	char		 pass[HGD_MAX_PASS_SZ], *prompt;
+
+	/* before anything which might log or fail */
+	hgd_component = "nchgdc";
+	hgd_exit_cb = hgd_exit_nicely;
+
+	memset(&u, 0, sizeof(u));
 
 	hgd_debug = 3; /* XXX config file or getopt */
 
 	init_log();
+	hgd_ctx_init(&main_ctx);
+
+	host = xstrdup(HGD_DFL_HOST);
+#ifdef HAVE_LIBCONFIG
+	xasprintf(&config_path[1], "%s",  HGD_GLOBAL_CFG_DIR HGD_CLI_CFG);
+	config_path[2] = hgd_get_XDG_userprefs_location(hgdc);
+#endif
+	hgd_read_config(config_path + 2);
+
+	if (user == NULL)
+		user = getenv("USER");
+
+	/* the network thread can't ask, so get the password up front */
+	if (password == NULL) {
+		xasprintf(&prompt, "Password for %s@%s: ", user, host);
+		if (readpassphrase(prompt, pass, HGD_MAX_PASS_SZ,
+		    RPP_ECHO_OFF | RPP_REQUIRE_TTY) != NULL)
+			password = xstrdup(pass);
+		memset(pass, 0, HGD_MAX_PASS_SZ);
+		free(prompt);
+	}
+
+	if (pipe(net_wake) < 0) {
+		DPRINTF(HGD_D_ERROR, "pipe: %s", SERROR);
+		hgd_exit_nicely();
+	}
+
+	/* a dead connection should not kill us */
+	signal(SIGPIPE, SIG_IGN);
 
 	initscr();
 
@@ -957,6 +1526,11 @@ main(int argc, char **argv)
 	hgd_switch_content(&u, HGD_WIN_PLAYLIST);
 	hgd_show_splash(&u);
 
+	if (pthread_create(&net_thread, NULL, hgd_nc_net_thread, NULL) != 0) {
+		DPRINTF(HGD_D_ERROR, "Could not start network thread");
+		hgd_exit_nicely();
+	}
+
 	/* main event loop */
 	DPRINTF(HGD_D_INFO, "nchgdc event loop starting");
 	while (1)
@@ -20,6 +20,27 @@
 
 #define HGD_MAX_CONTENT_WINS		3
 
+/* an entry in the file browser */
+struct hgd_dir_ent {
+	char			*name;
+	int			 is_dir;
+};
+
+/*
+ * A sorted directory listing. Kept until the directory's mtime changes,
+ * so revisiting a directory costs a stat(2) rather than a rescan.
+ */
+#define HGD_NC_DIR_CACHE_SZ		8
+struct hgd_dir_cache {
+	char			*path;
+	time_t			 mtime;
+	struct hgd_dir_ent	*ents;
+	int			 n_ents;
+	int			 n_alloc;
+	int			 sel;	/* selected entry */
+	int			 top;	/* first entry on screen */
+};
+
 struct ui {
 	WINDOW		*title;		/* title bar */
 	/*
@@ -38,6 +59,34 @@ struct ui {
 	int			 (*content_refresh_handler[HGD_MAX_CONTENT_WINS])(struct ui *);
 	/* current directory in browser */
 	char			*cwd;
+	struct hgd_dir_cache	*files;	/* listing of cwd */
+	/* last playlist sent by the network thread */
+	char			**playlist;
+	int			 n_playlist;
+	/* last status message from the network thread */
+	char			*status_msg;
+};
+
+/*
+ * Lock-free, single producer, single consumer queue of pointers.
+ * The UI and the network thread talk over a pair of these.
+ */
+#define HGD_NC_QUEUE_SZ			64	/* must be a power of 2 */
+struct hgd_nc_queue {
+	void			*slots[HGD_NC_QUEUE_SZ];
+	unsigned int		 head;	/* next to pop, consumer writes */
+	unsigned int		 tail;	/* next to push, producer writes */
+};
+
+/* a message on a queue */
+struct hgd_nc_msg {
+	int			 type;
+#define HGD_NC_MSG_PLAYLIST		0	/* net -> ui: new playlist */
+#define HGD_NC_MSG_STATUS		1	/* net -> ui: status text */
+#define HGD_NC_MSG_QUEUE		2	/* ui -> net: upload text */
+	char			*text;
+	char			**items;
+	int			 n_items;
 };
 
 /* We have 2 handles on the UI log, read/write */
@@ -47,5 +96,6 @@ struct hgd_ui_log {
 };
 
 void			hgd_update_titlebar(struct ui *u);
+int			hgd_switch_content(struct ui *u, int w);
 
 #endif /* __NCHGDC_H */
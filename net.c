@@ -17,23 +17,37 @@
 
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#ifdef __linux__
+#include <linux/sockios.h>	/* SIOCOUTQ */
+#endif
+
+#include "config.h"
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 #define _GNU_SOURCE	/* linux */
 #include <errno.h>
 #include <poll.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
 
 #include <openssl/ssl.h>
 
-#include "config.h"
 #include "hgd.h"
 #include "net.h"
 
-
 void
 hgd_cleanup_ssl(SSL_CTX **ctx) {
 	(void) ERR_free_strings();
@@ -141,158 +155,779 @@ done:
 	return (HGD_OK);
 }
 
-void
-hgd_sock_send_bin_nossl(int fd, char *msg, ssize_t sz)
+static uint64_t
+hgd_now_msecs(void)
 {
-	ssize_t		tot_sent = 0, sent;
-	char		*next = msg;
+	struct timespec		ts;
 
-	while (tot_sent != sz) {
-		sent = send(fd, next, sz - tot_sent, 0);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-		if (sent < 0) {
-			DPRINTF(HGD_D_WARN, "Send failed");
-			continue;
-		} else
-			DPRINTF(HGD_D_DEBUG, "Sent %d bytes", (int) sent);
+	return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* when a deadline of the given kind, starting now, passes. 0 for never */
+static uint64_t
+hgd_deadline(struct hgd_ctx *ctx, int which)
+{
+	if (ctx->deadline_secs[which] <= 0)
+		return (0);
+
+	return (hgd_now_msecs() + (uint64_t) ctx->deadline_secs[which] * 1000);
+}
+
+/*
+ * wait for fd to become readable (POLLIN) or to take more data (POLLOUT).
+ * returns 0 if the deadline passed first. If we are dying, ctx->on_dying
+ * is called, and if there is none (or it returns) we give up as for a
+ * deadline.
+ */
+static int
+hgd_sock_wait(struct hgd_ctx *ctx, int fd, short events, uint64_t deadline)
+{
+	struct pollfd		pfd;
+	uint64_t		now;
+	int			data_ready = 0, wait_ms;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	hgd_log_flush();
+
+	while (!dying && !data_ready) {
+		wait_ms = INFTIM;
+		if (deadline != 0) {
+			now = hgd_now_msecs();
+			if (now >= deadline)
+				return (0);
+			wait_ms = deadline - now;
+		}
 
-		msg += sent;
-		tot_sent += sent;
+		data_ready = poll(&pfd, 1, wait_ms);
+		if (data_ready == -1) {
+			if (errno != EINTR) {
+				DPRINTF(HGD_D_WARN, "Poll error: %s", SERROR);
+				dying = 1;
+			}
+			data_ready = 0;
+		}
 	}
+
+	if (dying) {
+		if (ctx->on_dying != NULL)
+			ctx->on_dying();
+		return (0);
+	}
+
+	return (1);
 }
 
+/*
+ * SSL_read(), SSL_write() and SSL_accept() block until a whole record has
+ * arrived or gone, so bound them with a timeout on the socket (opt is
+ * SO_RCVTIMEO or SO_SNDTIMEO) instead of a poll. Sockets which were never
+ * armed are left alone.
+ */
+static void
+hgd_sock_arm(struct hgd_ctx *ctx, int fd, int opt, uint64_t deadline)
+{
+	struct timeval		tv;
+	uint64_t		now, left = 0;
+	int			*armed_fd;
+
+	if (opt == SO_SNDTIMEO)
+		armed_fd = &ctx->snd_armed_fd;
+	else
+		armed_fd = &ctx->rcv_armed_fd;
+	if ((deadline == 0) && (fd != *armed_fd))
+		return;
+
+	if (deadline != 0) {
+		now = hgd_now_msecs();
+		left = (deadline > now) ? deadline - now : 1;
+	}
+	tv.tv_sec = left / 1000;
+	tv.tv_usec = (left % 1000) * 1000;
+
+	if (setsockopt(fd, SOL_SOCKET, opt, &tv, sizeof(tv)) == -1) {
+		DPRINTF(HGD_D_WARN, "Can't set socket timeout: %s", SERROR);
+		return;
+	}
+
+	*armed_fd = (deadline == 0) ? -1 : fd;
+}
+
+/* bound blocking reads on fd by a deadline of the given kind from now */
 void
-hgd_sock_send_bin_ssl(SSL *ssl, char *msg, ssize_t sz)
+hgd_sock_arm_deadline(struct hgd_ctx *ctx, int fd, int which)
+{
+	ctx->deadline_missed = HGD_DEADLINE_NONE;
+	hgd_sock_arm(ctx, fd, SO_RCVTIMEO, hgd_deadline(ctx, which));
+}
+
+/* did a failed read or write on an armed socket time out? */
+static int
+hgd_sock_timed_out(void)
+{
+	return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+}
+
+/*
+ * Send all of msg without blocking, waiting for the peer to make room when
+ * the socket is full rather than spinning. Gives up on an error, or when
+ * the send deadline passes, counting from when the peer first fell behind.
+ */
+static int
+hgd_sock_send_all_nossl(struct hgd_ctx *ctx, int fd, const char *msg,
+    size_t len)
 {
-	ssize_t		sent = 0;
+	ssize_t			sent;
+	size_t			sent_tot = 0;
+	uint64_t		deadline = 0;
+	uint8_t			stalled = 0;
 
-	/* SSL_write is all or nothing */
-	while (!sent) {
-		sent = SSL_write(ssl, msg, sz);
+	while (sent_tot != len) {
+		sent = send(fd, msg + sent_tot, len - sent_tot, MSG_DONTWAIT);
+		if (sent >= 0) {
+			sent_tot += sent;
+			continue;
+		}
 
-		if (sent <= 0) {
-			DPRINTF(HGD_D_WARN, "Send failed");
-			sent = 0;
+		if (errno == EINTR)
 			continue;
-		} else
-			DPRINTF(HGD_D_DEBUG, "Sent %d bytes", (int) sent);
+
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			DPRINTF(HGD_D_WARN, "send: %s", SERROR);
+			return (HGD_FAIL);
+		}
+
+		if (!stalled) {
+			deadline = hgd_deadline(ctx, HGD_DEADLINE_SEND);
+			stalled = 1;
+			DPRINTF(HGD_D_DEBUG, "Peer is behind, %d bytes queued",
+			    hgd_sock_send_queue(fd));
+		}
+
+		if (!hgd_sock_wait(ctx, fd, POLLOUT, deadline)) {
+			DPRINTF(HGD_D_INFO, "Send deadline passed, "
+			    "%d bytes queued", hgd_sock_send_queue(fd));
+			ctx->deadline_missed = HGD_DEADLINE_SEND;
+			return (HGD_FAIL);
+		}
 	}
+
+	DPRINTF(HGD_D_DEBUG, "Sent %d bytes", (int) sent_tot);
+	return (HGD_OK);
 }
 
-/* send binary over the socket */
-void
-hgd_sock_send_bin(int fd, SSL *ssl, char *msg, ssize_t sz)
+/*
+ * As above, over SSL. The socket blocks, so SSL_write() is bounded by a
+ * send timeout and asks to be retried, with the same arguments, when it
+ * expires or when it needs to read (a renegotiation).
+ */
+static int
+hgd_sock_send_all_ssl(struct hgd_ctx *ctx, SSL *ssl, const char *msg, int len)
 {
-	if (ssl == NULL) {
-		hgd_sock_send_bin_nossl(fd, msg, sz);
-	} else {
-		hgd_sock_send_bin_ssl(ssl, msg, sz);
+	uint64_t		deadline;
+	int			fd, sent;
+	short			events;
+
+	fd = SSL_get_fd(ssl);
+	deadline = hgd_deadline(ctx, HGD_DEADLINE_SEND);
+
+	while (1) {
+		hgd_sock_arm(ctx, fd, SO_SNDTIMEO, deadline);
+
+		errno = 0;
+		sent = SSL_write(ssl, msg, len);
+		if (sent > 0)
+			break; /* SSL_write is all or nothing */
+
+		switch (SSL_get_error(ssl, sent)) {
+		case SSL_ERROR_WANT_WRITE:
+			events = POLLOUT;
+			break;
+		case SSL_ERROR_WANT_READ:
+			events = POLLIN;
+			break;
+		case SSL_ERROR_SYSCALL:
+			if (errno == EINTR)
+				continue;
+			if (hgd_sock_timed_out()) {
+				events = POLLOUT;
+				break;
+			}
+			/* FALLTHROUGH */
+		default:
+			PRINT_SSL_ERR(HGD_D_WARN, "SSL_write");
+			return (HGD_FAIL);
+		}
+
+		if (!hgd_sock_wait(ctx, fd, events, deadline)) {
+			DPRINTF(HGD_D_INFO, "Send deadline passed, "
+			    "%d bytes queued", hgd_sock_send_queue(fd));
+			ctx->deadline_missed = HGD_DEADLINE_SEND;
+			return (HGD_FAIL);
+		}
 	}
+
+	DPRINTF(HGD_D_DEBUG, "SSL sent %d bytes", len);
+	return (HGD_OK);
+}
+
+/*
+ * bytes sent but not yet acknowledged by the peer, which grows when the
+ * peer stops reading. -1 if the platform can't tell us.
+ */
+int
+hgd_sock_send_queue(int fd)
+{
+	int			queued = -1;
+
+#if defined(SIOCOUTQ)
+	if (ioctl(fd, SIOCOUTQ, &queued) == -1)
+		queued = -1;
+#elif defined(FIONWRITE)
+	if (ioctl(fd, FIONWRITE, &queued) == -1)
+		queued = -1;
+#else
+	(void) fd;
+#endif
+
+	return (queued);
+}
+
+int
+hgd_sock_send_bin_nossl(struct hgd_ctx *ctx, int fd, char *msg, ssize_t sz)
+{
+	return (hgd_sock_send_all_nossl(ctx, fd, msg, sz));
+}
+
+int
+hgd_sock_send_bin_ssl(struct hgd_ctx *ctx, SSL *ssl, char *msg, ssize_t sz)
+{
+	return (hgd_sock_send_all_ssl(ctx, ssl, msg, sz));
+}
+
+/* send binary over the socket */
+int
+hgd_sock_send_bin(struct hgd_ctx *ctx, int fd, SSL *ssl, char *msg, ssize_t sz)
+{
+	if (ssl == NULL)
+		return (hgd_sock_send_bin_nossl(ctx, fd, msg, sz));
+	else
+		return (hgd_sock_send_bin_ssl(ctx, ssl, msg, sz));
 }
 
 /* send a SSL encrypted message onto the network */
-void
-hgd_sock_send_ssl(SSL *ssl, char *msg)
+int
+hgd_sock_send_ssl(struct hgd_ctx *ctx, SSL *ssl, char *msg)
 {
 	char			*buffer = NULL;
+	int			 ret;
 
 	DPRINTF(HGD_D_DEBUG, "SSL send '%s'", msg);
 
 	buffer = xcalloc(HGD_MAX_LINE, sizeof(char));
 	strncpy(buffer, msg, HGD_MAX_LINE);
 
-	SSL_write(ssl, buffer, HGD_MAX_LINE);
+	ret = hgd_sock_send_all_ssl(ctx, ssl, buffer, HGD_MAX_LINE);
 	free(buffer);
+
+	return (ret);
 }
 
 /* send a message onto the network */
-void
-hgd_sock_send(int fd, char *msg)
+int
+hgd_sock_send(struct hgd_ctx *ctx, int fd, char *msg)
 {
-	ssize_t			sent_tot = 0, sent, len;
-
-	len = strlen(msg);
-
-	while (sent_tot != len) {
-		sent = send(fd, msg, len - sent_tot, 0);
-		if (sent < 0) {
-			DPRINTF(HGD_D_WARN, "send: %s", SERROR);
-			sent = 0;
-		}
-		sent_tot += sent;
-	}
-
-	DPRINTF(HGD_D_DEBUG, "Sent %d bytes", (int) len);
+	return (hgd_sock_send_all_nossl(ctx, fd, msg, strlen(msg)));
 }
 
-void
-hgd_sock_send_line_ssl(SSL *ssl, char *msg)
+int
+hgd_sock_send_line_ssl(struct hgd_ctx *ctx, SSL *ssl, char *msg)
 {
 	char			*term;
+	int			 ret;
 
 	DPRINTF(HGD_D_DEBUG, "Trying to send SSL message: '%s'", msg);
 
 	xasprintf(&term, "%s\r\n", msg);
-	hgd_sock_send_ssl(ssl, term);
+	ret = hgd_sock_send_ssl(ctx, ssl, term);
 
 	free(term);
+	return (ret);
 }
 
-void
-hgd_sock_send_line_nossl(int fd, char *msg)
+int
+hgd_sock_send_line_nossl(struct hgd_ctx *ctx, int fd, char *msg)
 {
 	char			*term;
+	int			 ret;
 
 	xasprintf(&term, "%s\r\n", msg);
-	hgd_sock_send(fd, term);
+	ret = hgd_sock_send(ctx, fd, term);
 	free(term);
 
 	DPRINTF(HGD_D_DEBUG, "Sent line: %s", msg);
 
+	return (ret);
 }
 
 /* send a \r\n terminated line */
-void
-hgd_sock_send_line(int fd, SSL *ssl, char *msg)
+int
+hgd_sock_send_line(struct hgd_ctx *ctx, int fd, SSL *ssl, char *msg)
 {
 	if (ssl == NULL)
-		return (hgd_sock_send_line_nossl(fd, msg));
+		return (hgd_sock_send_line_nossl(ctx, fd, msg));
 	else
-		return (hgd_sock_send_line_ssl(ssl, msg));
+		return (hgd_sock_send_line_ssl(ctx, ssl, msg));
 }
 
-/* recieve a specific size, free when done */
-char *
-hgd_sock_recv_bin_nossl(int fd, ssize_t len)
+/*
+ * Session output buffers.
+ *
+ * Replies are appended here and sent with a single hgd_outbuf_flush(), so
+ * a multi-line reply costs one syscall rather than a malloc and a send per
+ * line. The buffer is kept for the life of the session.
+ */
+void
+hgd_outbuf_init(struct hgd_outbuf *ob)
 {
-	ssize_t			recvd_tot = 0, recvd;
-	char			*msg, *full_msg = NULL;
-	struct pollfd		pfd;
-	int			data_ready = 0, tries_left = 3;
+	memset(ob, 0, sizeof(*ob));
+	ob->sz = HGD_OUTBUF_DFL_SZ;
+	ob->buf = xmalloc(ob->sz);
+}
 
-	/* spin until something is ready */
-	pfd.fd = fd;
-	pfd.events = POLLIN;
+void
+hgd_outbuf_free(struct hgd_outbuf *ob)
+{
+	free(ob->buf);
+	free(ob->frames);
+	memset(ob, 0, sizeof(*ob));
+}
 
-	while (!dying && !data_ready) {
-		data_ready = poll(&pfd, 1, INFTIM);
-		if (data_ready == -1) {
-			if (errno != EINTR) {
-				DPRINTF(HGD_D_WARN, "poll error: %s", SERROR);
-				dying = 1;
+/* make sure there is room for 'need' more bytes */
+static void
+hgd_outbuf_reserve(struct hgd_outbuf *ob, size_t need)
+{
+	if (ob->len + need <= ob->sz)
+		return;
+
+	while (ob->len + need > ob->sz)
+		ob->sz *= 2;
+
+	ob->buf = xrealloc(ob->buf, ob->sz);
+}
+
+static void
+hgd_outbuf_vprintf(struct hgd_outbuf *ob, const char *fmt, va_list ap)
+{
+	va_list			 ap2;
+	int			 n;
+
+	va_copy(ap2, ap);
+	n = vsnprintf(ob->buf + ob->len, ob->sz - ob->len, fmt, ap2);
+	va_end(ap2);
+
+	if (n < 0) {
+		DPRINTF(HGD_D_WARN, "vsnprintf failed");
+		ob->buf[ob->len] = '\0';
+		return;
+	}
+
+	if ((size_t) n >= ob->sz - ob->len) {
+		hgd_outbuf_reserve(ob, n + 1);
+		vsnprintf(ob->buf + ob->len, ob->sz - ob->len, fmt, ap);
+	}
+
+	ob->len += n;
+}
+
+/* append to the line being built, without a terminator */
+void
+hgd_outbuf_printf(struct hgd_outbuf *ob, const char *fmt, ...)
+{
+	va_list			 ap;
+
+	va_start(ap, fmt);
+	hgd_outbuf_vprintf(ob, fmt, ap);
+	va_end(ap);
+}
+
+/* append and terminate a line */
+void
+hgd_outbuf_line(struct hgd_outbuf *ob, const char *fmt, ...)
+{
+	va_list			 ap;
+
+	va_start(ap, fmt);
+	hgd_outbuf_vprintf(ob, fmt, ap);
+	va_end(ap);
+
+	hgd_outbuf_reserve(ob, 3);
+	memcpy(ob->buf + ob->len, "\r\n", 3);
+	ob->len += 2;
+}
+
+static int
+hgd_outbuf_flush_nossl(struct hgd_ctx *ctx, struct hgd_outbuf *ob, int fd)
+{
+	return (hgd_sock_send_all_nossl(ctx, fd, ob->buf, ob->len));
+}
+
+/* make sure ob->frames holds at least sz bytes */
+static void
+hgd_outbuf_frames_reserve(struct hgd_outbuf *ob, size_t sz)
+{
+	if (ob->frames_sz < sz) {
+		ob->frames_sz = sz;
+		ob->frames = xrealloc(ob->frames, ob->frames_sz);
+	}
+}
+
+/*
+ * Over SSL each line travels in its own zero padded HGD_MAX_LINE frame,
+ * which is what hgd_sock_recv_line_ssl() reads. Lay the buffered lines out
+ * as consecutive frames in ob->frames, from offset at, and return where
+ * they end. They go to SSL_write() in one go; records are a multiple of
+ * HGD_MAX_LINE, so the frames stay aligned for the reader.
+ */
+static size_t
+hgd_outbuf_frame_lines(struct hgd_outbuf *ob, size_t at)
+{
+	char			*line, *end, *eol, *frame;
+	size_t			 n_lines = 0, len;
+
+	for (line = ob->buf, end = ob->buf + ob->len; line < end; n_lines++) {
+		eol = memchr(line, '\n', end - line);
+		line = (eol == NULL) ? end : eol + 1;
+	}
+
+	hgd_outbuf_frames_reserve(ob, at + n_lines * HGD_MAX_LINE);
+	memset(ob->frames + at, 0, n_lines * HGD_MAX_LINE);
+
+	frame = ob->frames + at;
+	for (line = ob->buf; line < end; frame += HGD_MAX_LINE) {
+		eol = memchr(line, '\n', end - line);
+		len = ((eol == NULL) ? end : eol + 1) - line;
+
+		if (len > HGD_MAX_LINE - 1) {
+			/* too long for a frame, truncate but keep the CRLF */
+			DPRINTF(HGD_D_WARN, "Truncating long line");
+			memcpy(frame, line, HGD_MAX_LINE - 3);
+			memcpy(frame + HGD_MAX_LINE - 3, "\r\n", 2);
+		} else
+			memcpy(frame, line, len);
+
+		line += len;
+	}
+
+	return (at + n_lines * HGD_MAX_LINE);
+}
+
+/* Binary frames are read by length, so they go as they are. */
+static int
+hgd_outbuf_flush_ssl(struct hgd_ctx *ctx, struct hgd_outbuf *ob, SSL *ssl)
+{
+	if (ob->binary)
+		return (hgd_sock_send_all_ssl(ctx, ssl, ob->buf, ob->len));
+
+	return (hgd_sock_send_all_ssl(ctx, ssl, ob->frames,
+	    hgd_outbuf_frame_lines(ob, 0)));
+}
+
+/*
+ * For a session on an event loop (ob->nowait), which can't wait on any
+ * one peer: send what the socket takes now and keep the rest in
+ * ob->frames, laid out as it would have been sent, with ob->want saying
+ * what to poll for before flushing again. SSL_write() is retried with the
+ * same arguments, as it must be. Replies buffered meanwhile wait in ob->buf
+ * until the last flush has all gone, so that each flush starts on a fresh
+ * record and SSL frames stay aligned for the reader.
+ */
+static int
+hgd_outbuf_flush_nowait(struct hgd_outbuf *ob, int fd, SSL *ssl)
+{
+	ssize_t			 sent;
+	int			 ret = HGD_OK;
+
+	do {
+		if ((ob->wire_len == 0) && (ob->len > 0)) {
+			if ((ssl != NULL) && (!ob->binary))
+				ob->wire_len = hgd_outbuf_frame_lines(ob, 0);
+			else {
+				hgd_outbuf_frames_reserve(ob, ob->len);
+				memcpy(ob->frames, ob->buf, ob->len);
+				ob->wire_len = ob->len;
 			}
-			data_ready = 0;
+			ob->len = 0;
+			ob->binary = 0;
 		}
+
+		ob->want = 0;
+		while ((ob->want == 0) && (ret == HGD_OK) &&
+		    (ob->wire_off < ob->wire_len)) {
+			if (ssl == NULL) {
+				sent = send(fd, ob->frames + ob->wire_off,
+				    ob->wire_len - ob->wire_off, MSG_DONTWAIT);
+				if (sent >= 0)
+					ob->wire_off += sent;
+				else if ((errno == EAGAIN) ||
+				    (errno == EWOULDBLOCK))
+					ob->want = POLLOUT;
+				else if (errno != EINTR) {
+					DPRINTF(HGD_D_WARN, "send: %s", SERROR);
+					ret = HGD_FAIL;
+				}
+				continue;
+			}
+
+			sent = SSL_write(ssl, ob->frames + ob->wire_off,
+			    ob->wire_len - ob->wire_off);
+			if (sent > 0) {
+				ob->wire_off += sent;
+				continue;
+			}
+
+			switch (SSL_get_error(ssl, sent)) {
+			case SSL_ERROR_WANT_WRITE:
+				ob->want = POLLOUT;
+				break;
+			case SSL_ERROR_WANT_READ:
+				ob->want = POLLIN;
+				break;
+			default:
+				PRINT_SSL_ERR(HGD_D_WARN, "SSL_write");
+				ret = HGD_FAIL;
+				break;
+			}
+		}
+
+		if (ob->want == 0)
+			ob->wire_off = ob->wire_len = 0;
+	} while ((ob->want == 0) && (ret == HGD_OK) && (ob->len > 0));
+
+	if (ret != HGD_OK) {
+		/* it never will go, forget it */
+		ob->broken = 1;
+		ob->wire_off = ob->wire_len = 0;
+		ob->len = 0;
+		ob->binary = 0;
+		ob->want = 0;
+	}
+
+	if (ob->want == 0)
+		ob->stalled = 0;
+	else if (ob->stalled == 0) {
+		ob->stalled = time(NULL);
+		DPRINTF(HGD_D_DEBUG, "Peer is behind, %d bytes queued",
+		    hgd_sock_send_queue(fd));
+	}
+
+	return (ret);
+}
+
+/*
+ * send everything buffered and empty the buffer, or for ob->nowait send
+ * what can go now, see above.
+ */
+int
+hgd_outbuf_flush(struct hgd_ctx *ctx, struct hgd_outbuf *ob, int fd, SSL *ssl)
+{
+	int			 ret, queued;
+
+	if ((ob->len == 0) && (ob->wire_len == 0))
+		return (HGD_OK);
+
+	if (ob->nowait)
+		ret = hgd_outbuf_flush_nowait(ob, fd, ssl);
+	else {
+		if (ssl == NULL)
+			ret = hgd_outbuf_flush_nossl(ctx, ob, fd);
+		else
+			ret = hgd_outbuf_flush_ssl(ctx, ob, ssl);
+
+		ob->len = 0;
+		ob->binary = 0;
+	}
+
+	/* how far behind the peer is, for hgd-netd's session summary */
+	queued = hgd_sock_send_queue(fd);
+	if (queued > ob->queue_max)
+		ob->queue_max = queued;
+
+	return (ret);
+}
+
+/*
+ * Binary replies (protocol 18). A reply is either text lines or a single
+ * frame, which is opened with hgd_outbuf_frame_begin(), filled with typed
+ * fields and closed with hgd_outbuf_frame_end() to fill in its length.
+ */
+void
+hgd_outbuf_frame_begin(struct hgd_outbuf *ob, uint8_t type)
+{
+	if (ob->len != 0)
+		DPRINTF(HGD_D_WARN, "Frame after %d bytes of text",
+		    (int) ob->len);
+
+	ob->binary = 1;
+	ob->frame = ob->len;
+
+	hgd_outbuf_reserve(ob, HGD_BIN_HDR_SZ);
+	memset(ob->buf + ob->len, 0, HGD_BIN_HDR_SZ - 1);
+	ob->buf[ob->len + HGD_BIN_HDR_SZ - 1] = type;
+	ob->len += HGD_BIN_HDR_SZ;
+}
+
+void
+hgd_outbuf_frame_int(struct hgd_outbuf *ob, int32_t v)
+{
+	uint32_t		 n = htonl((uint32_t) v);
+
+	hgd_outbuf_reserve(ob, 1 + sizeof(n));
+	ob->buf[ob->len++] = HGD_BIN_F_INT;
+	memcpy(ob->buf + ob->len, &n, sizeof(n));
+	ob->len += sizeof(n);
+}
+
+void
+hgd_outbuf_frame_str(struct hgd_outbuf *ob, const char *str)
+{
+	size_t			 len = (str == NULL) ? 0 : strlen(str);
+	uint16_t		 n;
+
+	if (len > UINT16_MAX) {
+		DPRINTF(HGD_D_WARN, "Truncating long string field");
+		len = UINT16_MAX;
+	}
+	n = htons((uint16_t) len);
+
+	hgd_outbuf_reserve(ob, 1 + sizeof(n) + len);
+	ob->buf[ob->len++] = HGD_BIN_F_STR;
+	memcpy(ob->buf + ob->len, &n, sizeof(n));
+	ob->len += sizeof(n);
+	if (len)
+		memcpy(ob->buf + ob->len, str, len);
+	ob->len += len;
+}
+
+void
+hgd_outbuf_frame_end(struct hgd_outbuf *ob)
+{
+	uint32_t		 n;
+
+	n = htonl((uint32_t) (ob->len - ob->frame - HGD_BIN_HDR_SZ));
+	memcpy(ob->buf + ob->frame, &n, sizeof(n));
+}
+
+/* recieve a binary reply, free with hgd_frame_free() */
+int
+hgd_sock_recv_frame(struct hgd_ctx *ctx, int fd, SSL *ssl, struct hgd_frame *f)
+{
+	char			*hdr;
+	uint32_t		 n;
+
+	memset(f, 0, sizeof(*f));
+
+	hdr = hgd_sock_recv_bin(ctx, fd, ssl, HGD_BIN_HDR_SZ);
+	if (hdr == NULL) {
+		DPRINTF(HGD_D_ERROR, "Failed to recieve frame header");
+		return (HGD_FAIL);
+	}
+
+	memcpy(&n, hdr, sizeof(n));
+	f->len = ntohl(n);
+	f->type = hdr[HGD_BIN_HDR_SZ - 1];
+	free(hdr);
+
+	if (f->len > HGD_BIN_MAX_FRAME) {
+		DPRINTF(HGD_D_ERROR, "Bogus frame length: %lu",
+		    (unsigned long) f->len);
+		return (HGD_FAIL);
+	}
+
+	if (f->len == 0)
+		return (HGD_OK);
+
+	f->buf = hgd_sock_recv_bin(ctx, fd, ssl, f->len);
+	if (f->buf == NULL) {
+		DPRINTF(HGD_D_ERROR, "Failed to recieve frame");
+		return (HGD_FAIL);
+	}
+
+	return (HGD_OK);
+}
+
+int
+hgd_frame_int(struct hgd_frame *f, int *v)
+{
+	uint32_t		 n;
+
+	if ((f->len - f->off < 1 + sizeof(n)) ||
+	    (f->buf[f->off] != HGD_BIN_F_INT)) {
+		DPRINTF(HGD_D_ERROR, "Expected an integer field");
+		return (HGD_FAIL);
+	}
+
+	memcpy(&n, f->buf + f->off + 1, sizeof(n));
+	*v = (int32_t) ntohl(n);
+	f->off += 1 + sizeof(n);
+
+	return (HGD_OK);
+}
+
+/* the string is copied out and NUL terminated, free when done */
+int
+hgd_frame_str(struct hgd_frame *f, char **str)
+{
+	uint16_t		 n;
+	size_t			 len;
+
+	if ((f->len - f->off < 1 + sizeof(n)) ||
+	    (f->buf[f->off] != HGD_BIN_F_STR)) {
+		DPRINTF(HGD_D_ERROR, "Expected a string field");
+		return (HGD_FAIL);
+	}
+
+	memcpy(&n, f->buf + f->off + 1, sizeof(n));
+	len = ntohs(n);
+	if (f->len - f->off - 1 - sizeof(n) < len) {
+		DPRINTF(HGD_D_ERROR, "String field overruns frame");
+		return (HGD_FAIL);
 	}
 
-	if (dying)
-		hgd_exit_nicely();
+	*str = xmalloc(len + 1);
+	memcpy(*str, f->buf + f->off + 1 + sizeof(n), len);
+	(*str)[len] = '\0';
+	f->off += 1 + sizeof(n) + len;
+
+	return (HGD_OK);
+}
+
+void
+hgd_frame_free(struct hgd_frame *f)
+{
+	free(f->buf);
+	memset(f, 0, sizeof(*f));
+}
+
+/* recieve a specific size, free when done */
+char *
+hgd_sock_recv_bin_nossl(struct hgd_ctx *ctx, int fd, ssize_t len)
+{
+	ssize_t			recvd_tot = 0, recvd;
+	char			*msg, *full_msg = NULL;
+	uint64_t		deadline;
+	int			tries_left = 3;
+
+	ctx->deadline_missed = HGD_DEADLINE_NONE;
+	deadline = hgd_deadline(ctx, HGD_DEADLINE_UPLOAD);
 
 	full_msg = xmalloc(len);
 	msg = full_msg;
 
 	while (recvd_tot != len && tries_left > 0) {
-		recvd = recv(fd, msg, len - recvd_tot, 0);
+		recvd = recv(fd, msg, len - recvd_tot, MSG_DONTWAIT);
 
 		switch (recvd) {
 		case 0:
@@ -303,8 +938,17 @@ hgd_sock_recv_bin_nossl(int fd, ssize_t len)
 		case -1:
 			if (errno == EINTR)
 				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				if (hgd_sock_wait(ctx, fd, POLLIN, deadline))
+					continue;
+				DPRINTF(HGD_D_INFO, "Upload deadline passed");
+				ctx->deadline_missed = HGD_DEADLINE_UPLOAD;
+				free(full_msg);
+				return (NULL);
+			}
 			DPRINTF(HGD_D_WARN, "recv: %s", SERROR);
 			tries_left--;
+			continue;
 		default:
 			/* good */
 			break;
@@ -316,6 +960,7 @@ hgd_sock_recv_bin_nossl(int fd, ssize_t len)
 
 	if (tries_left == 0) {
 		DPRINTF(HGD_D_ERROR, "Gave up trying to recieve: %s", SERROR);
+		free(full_msg);
 		return (NULL);
 	}
 
@@ -324,19 +969,27 @@ hgd_sock_recv_bin_nossl(int fd, ssize_t len)
 
 /* recieve a specific size, free when done */
 char *
-hgd_sock_recv_bin_ssl(SSL *ssl, ssize_t len)
+hgd_sock_recv_bin_ssl(struct hgd_ctx *ctx, SSL *ssl, ssize_t len)
 {
 	ssize_t			recvd_tot = 0, recvd;
 	char			*msg, *full_msg = NULL;
 
+	hgd_sock_arm_deadline(ctx, SSL_get_fd(ssl), HGD_DEADLINE_UPLOAD);
+
 	full_msg = xmalloc(len);
 	msg = full_msg;
 
 	while (recvd_tot != len) {
+		errno = 0;
 		recvd = SSL_read(ssl, msg, len - recvd_tot);
 
 		if (recvd <= 0) {
-			PRINT_SSL_ERR(HGD_D_ERROR, __func__);
+			if (hgd_sock_timed_out()) {
+				DPRINTF(HGD_D_INFO, "Upload deadline passed");
+				ctx->deadline_missed = HGD_DEADLINE_UPLOAD;
+			} else
+				PRINT_SSL_ERR(HGD_D_ERROR, __func__);
+			free(full_msg);
 			return (NULL);
 		}
 
@@ -349,46 +1002,465 @@ hgd_sock_recv_bin_ssl(SSL *ssl, ssize_t len)
 
 /* recieve a specific size, free when done */
 char *
-hgd_sock_recv_bin(int fd, SSL *ssl, ssize_t len)
+hgd_sock_recv_bin(struct hgd_ctx *ctx, int fd, SSL *ssl, ssize_t len)
 {
 	if (ssl == NULL)
-		return (hgd_sock_recv_bin_nossl(fd, len));
+		return (hgd_sock_recv_bin_nossl(ctx, fd, len));
 	else
-		return (hgd_sock_recv_bin_ssl(ssl, len));
+		return (hgd_sock_recv_bin_ssl(ctx, ssl, len));
 }
 
-char *
-hgd_sock_recv_line_nossl(int fd)
+/*
+ * receive a len byte upload into file f, a chunk at a time, each chunk
+ * held to the upload deadline. *got is how much went into the file.
+ */
+static int
+hgd_sock_recv_file_poll(struct hgd_ctx *ctx, int fd, SSL *ssl, int f,
+    ssize_t len, ssize_t *got)
 {
-	ssize_t			 recvd_tot = 0, recvd;
-	char			 recv_char, *full_msg = NULL;
-	struct pollfd		 pfd;
-	char			*c;
-	int			 data_ready = 0;
+	char			*payload;
+	ssize_t			 chunk, written;
 
-	/* spin until something is ready */
-	pfd.fd = fd;
-	pfd.events = POLLIN;
+	while (*got < len) {
+		chunk = len - *got;
+		if (chunk > HGD_BINARY_RECV_SZ)
+			chunk = HGD_BINARY_RECV_SZ;
 
-	while (!dying && !data_ready) {
-		data_ready = poll(&pfd, 1, INFTIM);
-		if (data_ready == -1) {
-			if (errno != EINTR) {
-				DPRINTF(HGD_D_WARN, "Poll error: %s", SERROR);
-				dying = 1;
+		DPRINTF(HGD_D_DEBUG, "Waiting for chunk of length %d bytes",
+		    (int) chunk);
+
+		payload = hgd_sock_recv_bin(ctx, fd, ssl, chunk);
+		if (payload == NULL) {
+			DPRINTF(HGD_D_ERROR, "failed to recv binary");
+			return (HGD_FAIL);
+		}
+
+		written = write(f, payload, chunk);
+		free(payload);
+
+		if (written < 0) {
+			DPRINTF(HGD_D_ERROR, "Failed to write %d bytes: %s",
+			    (int) chunk, SERROR);
+			return (HGD_FAIL);
+		} else if (written < chunk) {
+			DPRINTF(HGD_D_ERROR, "Short write: %d vs %d",
+			    (int) written, (int) chunk);
+			return (HGD_FAIL);
+		}
+
+		*got += chunk;
+		DPRINTF(HGD_D_DEBUG, "Expecting a further %d bytes",
+		    (int) (len - *got));
+	}
+
+	return (HGD_OK);
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * An io_uring for plain uploads, set up on first use. Each chunk is a recv
+ * into one of two registered buffers, linked to a write of that buffer
+ * into the file. While the kernel writes one chunk, the next is received
+ * into the other buffer. Only one recv is ever in flight, to keep the
+ * stream in order.
+ */
+#define HGD_URING_ENTRIES	8
+#define HGD_URING_BUFS		2
+#define HGD_URING_CANCEL	0xffffffffULL	/* user_data of a cancel */
+
+struct hgd_uring {
+	int			 fd;	/* -1 if unusable */
+	char			*sq;
+	size_t			 sq_sz;
+	unsigned		*sq_tail, *sq_mask, *sq_array;
+	unsigned		*cq_head, *cq_tail, *cq_mask;
+	unsigned		 sq_local_tail, to_submit;
+	struct io_uring_sqe	*sqes;
+	size_t			 sqes_sz;
+	struct io_uring_cqe	*cqes;
+	char			*bufs[HGD_URING_BUFS];
+};
+
+/* a chunk being received and written by a buffer's chain */
+struct hgd_uring_chunk {
+	off_t			 off;		/* into the file */
+	ssize_t			 len;
+	int			 in_flight;	/* sqes not yet completed */
+};
+
+/*
+ * set up the ring, if the kernel has one we can use. Links must fail on
+ * a short MSG_WAITALL recv, else a linked write could write a buffer that
+ * was only part filled. Kernels which have IORING_FEAT_LINKED_FILE (5.17)
+ * do this.
+ */
+static int
+hgd_uring_setup(struct hgd_ctx *ctx)
+{
+	struct hgd_uring	*ring;
+	struct io_uring_params	 p;
+	struct iovec		 iov[HGD_URING_BUFS];
+	char			*sq, *cq;
+	size_t			 sq_sz, cq_sz;
+	int			 fd, i;
+
+	/* only tried once per context */
+	if (ctx->uring != NULL)
+		return ((ctx->uring->fd >= 0) ? HGD_OK : HGD_FAIL);
+	ring = ctx->uring = xcalloc(1, sizeof(*ring));
+	ring->fd = -1;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, HGD_URING_ENTRIES, &p);
+	if (fd < 0) {
+		DPRINTF(HGD_D_INFO, "No io_uring, using poll: %s", SERROR);
+		return (HGD_FAIL);
+	}
+
+	if ((!(p.features & IORING_FEAT_SINGLE_MMAP)) ||
+	    (!(p.features & IORING_FEAT_NODROP)) ||
+	    (!(p.features & IORING_FEAT_LINKED_FILE))) {
+		DPRINTF(HGD_D_INFO, "io_uring too old, using poll");
+		close(fd);
+		return (HGD_FAIL);
+	}
+
+	/* the sq and cq rings share a mapping */
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_sz > sq_sz)
+		sq_sz = cq_sz;
+
+	sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		DPRINTF(HGD_D_WARN, "Can't map io_uring: %s", SERROR);
+		close(fd);
+		return (HGD_FAIL);
+	}
+	cq = sq;
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		DPRINTF(HGD_D_WARN, "Can't map io_uring sqes: %s", SERROR);
+		munmap(sq, sq_sz);
+		close(fd);
+		return (HGD_FAIL);
+	}
+
+	ring->sq = sq;
+	ring->sq_sz = sq_sz;
+	ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	/* registered, so the kernel needn't map them for every write */
+	for (i = 0; i < HGD_URING_BUFS; i++) {
+		ring->bufs[i] = xmalloc(HGD_BINARY_RECV_SZ);
+		iov[i].iov_base = ring->bufs[i];
+		iov[i].iov_len = HGD_BINARY_RECV_SZ;
+	}
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+	    iov, HGD_URING_BUFS) < 0) {
+		DPRINTF(HGD_D_INFO, "Can't register io_uring buffers, "
+		    "using poll: %s", SERROR);
+		for (i = 0; i < HGD_URING_BUFS; i++)
+			free(ring->bufs[i]);
+		munmap(ring->sqes, ring->sqes_sz);
+		munmap(sq, sq_sz);
+		close(fd);
+		return (HGD_FAIL);
+	}
+
+	DPRINTF(HGD_D_INFO, "Receiving uploads with io_uring");
+	ring->fd = fd;
+	return (HGD_OK);
+}
+
+/* a zeroed sqe, to be sent with hgd_uring_submit() */
+static struct io_uring_sqe *
+hgd_uring_sqe(struct hgd_uring *ring, uint8_t opcode, uint64_t user_data)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned		 idx;
+
+	idx = ring->sq_local_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = user_data;
+
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+	ring->to_submit++;
+
+	return (sqe);
+}
+
+static int
+hgd_uring_submit(struct hgd_uring *ring)
+{
+	int			 ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail,
+	    __ATOMIC_RELEASE);
+
+	while (ring->to_submit > 0) {
+		ret = syscall(__NR_io_uring_enter, ring->fd,
+		    ring->to_submit, 0, 0, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			DPRINTF(HGD_D_ERROR, "io_uring_enter: %s", SERROR);
+			return (HGD_FAIL);
+		}
+		ring->to_submit -= ret;
+	}
+
+	return (HGD_OK);
+}
+
+/* start receiving a chunk into buffer b, and writing it into file f */
+static void
+hgd_uring_chain(struct hgd_uring *ring, int fd, int f, int b,
+    struct hgd_uring_chunk *c)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = hgd_uring_sqe(ring, IORING_OP_RECV, b << 1);
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) ring->bufs[b];
+	sqe->len = c->len;
+	sqe->msg_flags = MSG_WAITALL;
+	sqe->flags = IOSQE_IO_LINK;
+
+	sqe = hgd_uring_sqe(ring, IORING_OP_WRITE_FIXED, (b << 1) | 1);
+	sqe->fd = f;
+	sqe->addr = (uintptr_t) ring->bufs[b];
+	sqe->len = c->len;
+	sqe->off = c->off;
+	sqe->buf_index = b;
+
+	c->in_flight = 2;
+}
+
+/* write what a short recv left in buffer b, its linked write was cancelled */
+static void
+hgd_uring_write(struct hgd_uring *ring, int f, int b, struct hgd_uring_chunk *c)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = hgd_uring_sqe(ring, IORING_OP_WRITE_FIXED, (b << 1) | 1);
+	sqe->fd = f;
+	sqe->addr = (uintptr_t) ring->bufs[b];
+	sqe->len = c->len;
+	sqe->off = c->off;
+	sqe->buf_index = b;
+
+	c->in_flight++;
+}
+
+static int
+hgd_sock_recv_file_uring(struct hgd_ctx *ctx, int fd, int f, ssize_t len,
+    ssize_t *got)
+{
+	struct hgd_uring	*ring = ctx->uring;
+	struct hgd_uring_chunk	 chunks[HGD_URING_BUFS];
+	struct hgd_uring_chunk	*c;
+	struct io_uring_cqe	*cqe;
+	struct io_uring_sqe	*sqe;
+	unsigned		 head, tail;
+	uint64_t		 deadline = 0;
+	off_t			 base, next = 0;
+	int			 b, res, recving = -1, ret = HGD_OK;
+
+	if ((base = lseek(f, 0, SEEK_CUR)) < 0)
+		base = 0;
+	memset(chunks, 0, sizeof(chunks));
+	ctx->deadline_missed = HGD_DEADLINE_NONE;
+
+	for (;;) {
+		/* the next chain, once the last recv is in and a buffer free */
+		for (b = 0; (ret == HGD_OK) && (recving < 0) && (next < len) &&
+		    (b < HGD_URING_BUFS); b++) {
+			if (chunks[b].in_flight)
+				continue;
+
+			chunks[b].off = base + next;
+			chunks[b].len = len - next;
+			if (chunks[b].len > HGD_BINARY_RECV_SZ)
+				chunks[b].len = HGD_BINARY_RECV_SZ;
+			next += chunks[b].len;
+
+			DPRINTF(HGD_D_DEBUG, "Waiting for chunk of length %d "
+			    "bytes", (int) chunks[b].len);
+			hgd_uring_chain(ring, fd, f, b, &chunks[b]);
+			deadline = hgd_deadline(ctx, HGD_DEADLINE_UPLOAD);
+			recving = b;
+		}
+
+		if ((ring->to_submit > 0) && (hgd_uring_submit(ring) != HGD_OK))
+			return (HGD_FAIL); /* can't know what is in flight */
+
+		for (b = 0; b < HGD_URING_BUFS; b++) {
+			if (chunks[b].in_flight)
+				break;
+		}
+		if (b == HGD_URING_BUFS)
+			break; /* nothing in flight */
+
+		/* the client must keep sending, file writes may take as long */
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if ((head == tail) && (!hgd_sock_wait(ctx, ring->fd, POLLIN,
+		    (recving >= 0) ? deadline : 0))) {
+			DPRINTF(HGD_D_INFO, "Upload deadline passed");
+			ctx->deadline_missed = HGD_DEADLINE_UPLOAD;
+			ret = HGD_FAIL;
+
+			/* take back the recv, its write goes with it */
+			sqe = hgd_uring_sqe(ring, IORING_OP_ASYNC_CANCEL,
+			    HGD_URING_CANCEL);
+			sqe->addr = recving << 1;
+			deadline = 0;
+			continue;
+		}
+
+		for (; head != tail; head++) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			if (cqe->user_data == HGD_URING_CANCEL)
+				continue;
+
+			b = cqe->user_data >> 1;
+			c = &chunks[b];
+			res = cqe->res;
+			c->in_flight--;
+
+			if ((cqe->user_data & 1) == 0) {
+				/* recv */
+				recving = -1;
+				if (res == c->len)
+					continue;
+
+				if (res <= 0) {
+					if (ret == HGD_OK)
+						DPRINTF(HGD_D_WARN, "recv: %s",
+						    res ? strerror(-res) :
+						    "client went away");
+					ret = HGD_FAIL;
+					continue;
+				}
+
+				/* short, but what came can still be written */
+				c->len = res;
+				next = c->off - base + res;
+				if (ret == HGD_OK)
+					hgd_uring_write(ring, f, b, c);
+				continue;
 			}
-			data_ready = 0;
+
+			/* write, cancelled if its recv fell short or failed */
+			if (res == -ECANCELED)
+				continue;
+			if (res < 0) {
+				DPRINTF(HGD_D_ERROR, "Failed to write %d bytes: "
+				    "%s", (int) c->len, strerror(-res));
+				ret = HGD_FAIL;
+			} else if (res < c->len) {
+				DPRINTF(HGD_D_ERROR, "Short write: %d vs %d",
+				    res, (int) c->len);
+				ret = HGD_FAIL;
+			} else
+				*got += res;
 		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
 	}
 
-	if (dying)
-		hgd_exit_nicely();
+	if ((ret == HGD_OK) && (*got < len))
+		ret = HGD_FAIL;
+
+	return (ret);
+}
+#endif
 
+/* release what the net.c calls have set up in a context */
+void
+hgd_cleanup_net(struct hgd_ctx *ctx)
+{
+#ifdef HAVE_IO_URING
+	struct hgd_uring	*ring = ctx->uring;
+	int			 i;
+
+	if (ring == NULL)
+		return;
+
+	if (ring->fd >= 0) {
+		for (i = 0; i < HGD_URING_BUFS; i++)
+			free(ring->bufs[i]);
+		munmap(ring->sqes, ring->sqes_sz);
+		munmap(ring->sq, ring->sq_sz);
+		close(ring->fd);
+	}
+
+	free(ring);
+	ctx->uring = NULL;
+#else
+	(void) ctx;
+#endif
+}
+
+/*
+ * receive a len byte upload from a client straight into file f. Plain
+ * uploads go through io_uring when built with it and the kernel has it.
+ * *got is set to how much went into the file, even on failure.
+ */
+int
+hgd_sock_recv_file(struct hgd_ctx *ctx, int fd, SSL *ssl, int f, ssize_t len,
+    ssize_t *got)
+{
+	*got = 0;
+
+#ifdef HAVE_IO_URING
+	/* TLS is decrypted by us, so only plain uploads can go direct */
+	if ((ssl == NULL) && (hgd_uring_setup(ctx) == HGD_OK))
+		return (hgd_sock_recv_file_uring(ctx, fd, f, len, got));
+#endif
+
+	return (hgd_sock_recv_file_poll(ctx, fd, ssl, f, len, got));
+}
+
+char *
+hgd_sock_recv_line_nossl(struct hgd_ctx *ctx, int fd)
+{
+	ssize_t			 recvd_tot = 0, recvd;
+	char			 recv_char = 0, *full_msg = NULL;
+	char			*c;
+	uint64_t		 deadline;
+
+	/* spin until something is ready */
+	ctx->deadline_missed = HGD_DEADLINE_NONE;
+	if (!hgd_sock_wait(ctx, fd, POLLIN,
+	    hgd_deadline(ctx, HGD_DEADLINE_IDLE))) {
+		DPRINTF(HGD_D_INFO, "Idle deadline passed");
+		ctx->deadline_missed = HGD_DEADLINE_IDLE;
+		return (NULL);
+	}
+
+	/* a line has started, the rest of it had better follow */
+	deadline = hgd_deadline(ctx, HGD_DEADLINE_HEADER);
 	full_msg = xmalloc(HGD_MAX_LINE);
 
 	do {
 		/* recieve one byte */
-		recvd = recv(fd, &recv_char, 1, 0);
+		recvd = recv(fd, &recv_char, 1, MSG_DONTWAIT);
 
 		switch (recvd) {
 		case 0:
@@ -399,6 +1471,14 @@ hgd_sock_recv_line_nossl(int fd)
 		case -1:
 			if (errno == EINTR)
 				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				if (hgd_sock_wait(ctx, fd, POLLIN, deadline))
+					continue;
+				DPRINTF(HGD_D_INFO, "Header deadline passed");
+				ctx->deadline_missed = HGD_DEADLINE_HEADER;
+				free(full_msg);
+				return (NULL);
+			}
 			DPRINTF(HGD_D_WARN, "recv: %s", SERROR);
 			free(full_msg);
 			return (NULL);
@@ -413,8 +1493,7 @@ hgd_sock_recv_line_nossl(int fd)
 		full_msg[recvd_tot] = recv_char;
 
 		recvd_tot += recvd;
-	} while ((recvd_tot >= 1) &&
-	    (recvd_tot <= HGD_MAX_LINE) && (recv_char != '\n'));
+	} while ((recvd_tot <= HGD_MAX_LINE) && (recv_char != '\n'));
 
 	/* get rid of \r\n */
 	c = strstr(full_msg, "\r\n");
@@ -431,18 +1510,37 @@ hgd_sock_recv_line_nossl(int fd)
 }
 
 char *
-hgd_sock_recv_line_ssl(SSL *ssl)
+hgd_sock_recv_line_ssl(struct hgd_ctx *ctx, SSL *ssl)
 {
 	char			*buffer = NULL;
-	int			 ssl_ret = 0;
+	int			 ssl_ret = 0, fd;
 	char			*line = NULL, *c;
+	uint64_t		 deadline;
+
+	fd = SSL_get_fd(ssl);
+	ctx->deadline_missed = HGD_DEADLINE_NONE;
 
+	/* anything already decrypted is part of a line which has arrived */
+	deadline = hgd_deadline(ctx, HGD_DEADLINE_IDLE);
+	if ((deadline != 0) && (SSL_pending(ssl) == 0) &&
+	    (!hgd_sock_wait(ctx, fd, POLLIN, deadline))) {
+		DPRINTF(HGD_D_INFO, "Idle deadline passed");
+		ctx->deadline_missed = HGD_DEADLINE_IDLE;
+		return (NULL);
+	}
+	hgd_sock_arm(ctx, fd, SO_RCVTIMEO,
+	    hgd_deadline(ctx, HGD_DEADLINE_HEADER));
 
 	buffer = xcalloc(HGD_MAX_LINE, sizeof(char));
 
+	errno = 0;
 	ssl_ret = SSL_read(ssl, buffer, HGD_MAX_LINE);
 	if (ssl_ret <= 0) {
-		PRINT_SSL_ERR(HGD_D_ERROR, "SSL_read");
+		if (hgd_sock_timed_out()) {
+			DPRINTF(HGD_D_INFO, "Header deadline passed");
+			ctx->deadline_missed = HGD_DEADLINE_HEADER;
+		} else
+			PRINT_SSL_ERR(HGD_D_ERROR, "SSL_read");
 		free(buffer);
 		return (NULL);
 	}
@@ -468,12 +1566,12 @@ hgd_sock_recv_line_ssl(SSL *ssl)
  * returns NULL on error.
  */
 char *
-hgd_sock_recv_line(int fd, SSL *ssl)
+hgd_sock_recv_line(struct hgd_ctx *ctx, int fd, SSL *ssl)
 {
 	if (ssl == NULL) {
-		return (hgd_sock_recv_line_nossl(fd));
+		return (hgd_sock_recv_line_nossl(ctx, fd));
 	} else {
-		return (hgd_sock_recv_line_ssl(ssl));
+		return (hgd_sock_recv_line_ssl(ctx, ssl));
 	}
 }
 
@@ -19,18 +19,57 @@
 #define __NET_H
 
 #define HGD_PROTO_VERSION_MAJOR	17
-#define HGD_PROTO_VERSION_MINOR 0
+#define HGD_PROTO_VERSION_MINOR 4
+#define HGD_PROTO_BINARY	18	/* offered by 'proto', see below */
 
 /* networking */
 #define HGD_DFL_PORT		6633
 #define HGD_DFL_HOST		"127.0.0.1"
 #define HGD_DFL_BACKLOG		10
+#define HGD_DFL_MAX_SESSIONS	100	/* concurrent, 0 for no cap */
+#define HGD_DFL_CONN_RATE	60	/* per client address per minute */
+#define HGD_DFL_CONN_BURST	10
+#define HGD_CONN_BUCKETS	256	/* client addresses remembered */
+#define HGD_CONN_BUCKET_PROBE	8
+#define HGD_MINUTE_USECS	(60 * 1000000ULL)
+#define HGD_DFL_WORKER_SESSIONS	1000	/* served before a worker retires */
+#define HGD_WORKER_RESPAWN_SECS	1	/* after a worker crashes */
 #define HGD_DFL_MAX_UPLOAD	(HGD_MB * 100L)
 #define HGD_MAX_LINE		512
 #define HGD_MAX_BAD_COMMANDS	3
 #define HGD_BINARY_CHUNK	4096
 #define HGD_BINARY_RECV_SZ	16384
+#define HGD_WATCH_POLL_MS	500
+#define HGD_WATCH_TIMEOUT	60
+#define HGD_CORE_LINGER_SECS	2	/* for a client's TLS goodbye */
 #define	HGD_MAX_PROTO_TOKS	3
+#define HGD_OUTBUF_DFL_SZ	4096
+
+/* I/O deadline defaults, in seconds, see struct hgd_ctx */
+#define HGD_DFL_IDLE_TIMEOUT	300
+#define HGD_DFL_HEADER_TIMEOUT	30
+#define HGD_DFL_UPLOAD_TIMEOUT	60
+#define HGD_DFL_SEND_TIMEOUT	30
+
+/*
+ * Binary replies, chosen with 'proto|18'. A frame is a 4 byte payload length
+ * and a 1 byte frame type (HGD_BIN_T_*), then the payload as typed fields.
+ * Integers are 4 bytes and strings are a 2 byte length then the bytes, all
+ * in network order. Only ls and np reply with frames, anything else is text.
+ */
+#define HGD_BIN_HDR_SZ		5
+#define HGD_BIN_MAX_FRAME	(HGD_MB * 16)
+#define HGD_BIN_T_ERR		0	/* str error code */
+#define HGD_BIN_T_PLAYLIST	1	/* int n_items, then n_items tracks */
+#define HGD_BIN_T_NP		2	/* int playing, then a track if 1 */
+#define HGD_BIN_F_INT		'i'
+#define HGD_BIN_F_STR		's'
+#define HGD_BIN_TRACK_FIELDS	14	/* as an 'ls' line */
+#define HGD_BIN_TRACK_MIN_SZ	58	/* 8 ints, 6 empty strings */
+
+/* session markers in a hgd-netd capture file (-C), never sent on the wire */
+#define HGD_CAPTURE_OPEN	"#open"
+#define HGD_CAPTURE_CLOSE	"#close"
 
 /*
  * hgd-netd error, hello and goodbye responses.
@@ -57,6 +96,7 @@
 #define HGD_RESP_E_PERMNOCHG	"E_PERMNOCHG"	/* Perms did not change */
 #define HGD_RESP_E_USREXIST	"E_USREXIST"	/* User already exists */
 #define HGD_RESP_E_USRNOEXIST	"E_USRNOEXIST"	/* User does not exist */
+#define HGD_RESP_E_BUSY		"E_BUSY"	/* Too many connections */
 
 /* SSL */
 #define HGD_DFL_CERT_FILE	HGD_DFL_SVR_CONF_DIR "/certificate.crt"
@@ -79,17 +119,48 @@
 	} while(0)
 
 void				 hgd_cleanup_ssl(SSL_CTX **ssl);
-void				 hgd_sock_send(int fd, char *msg);
-void				 hgd_sock_send_line(int fd, SSL* ssl,
+void				 hgd_cleanup_net(struct hgd_ctx *ctx);
+void				 hgd_sock_arm_deadline(struct hgd_ctx *ctx,
+				     int fd, int which);
+int				 hgd_sock_send_queue(int fd);
+int				 hgd_sock_send(struct hgd_ctx *ctx, int fd,
 				     char *msg);
-char				*hgd_sock_recv_bin(int fd, SSL* ssl,
-				     ssize_t len);
-char				*hgd_sock_recv_line(int fd, SSL* ssl);
-void				 hgd_sock_send_bin(int fd, SSL* ssl,
-				     char *, ssize_t);
+int				 hgd_sock_send_line(struct hgd_ctx *ctx,
+				     int fd, SSL* ssl, char *msg);
+char				*hgd_sock_recv_bin(struct hgd_ctx *ctx,
+				     int fd, SSL* ssl, ssize_t len);
+char				*hgd_sock_recv_line(struct hgd_ctx *ctx,
+				     int fd, SSL* ssl);
+int				 hgd_sock_recv_file(struct hgd_ctx *ctx,
+				     int fd, SSL *ssl, int f, ssize_t len,
+				     ssize_t *got);
+int				 hgd_sock_send_bin(struct hgd_ctx *ctx,
+				     int fd, SSL* ssl, char *, ssize_t);
 int				 hgd_setup_ssl_ctx(SSL_METHOD **method,
 				     SSL_CTX **ctx, int server,
 				     char *, char *);
 uint8_t				 hgd_is_ip_addr(char *str);
+void				 hgd_outbuf_init(struct hgd_outbuf *ob);
+void				 hgd_outbuf_free(struct hgd_outbuf *ob);
+void				 hgd_outbuf_printf(struct hgd_outbuf *ob,
+				     const char *fmt, ...)
+				     __attribute__((format(printf, 2, 3)));
+void				 hgd_outbuf_line(struct hgd_outbuf *ob,
+				     const char *fmt, ...)
+				     __attribute__((format(printf, 2, 3)));
+int				 hgd_outbuf_flush(struct hgd_ctx *ctx,
+				     struct hgd_outbuf *ob, int fd, SSL *ssl);
+void				 hgd_outbuf_frame_begin(struct hgd_outbuf *ob,
+				     uint8_t type);
+void				 hgd_outbuf_frame_int(struct hgd_outbuf *ob,
+				     int32_t v);
+void				 hgd_outbuf_frame_str(struct hgd_outbuf *ob,
+				     const char *str);
+void				 hgd_outbuf_frame_end(struct hgd_outbuf *ob);
+int				 hgd_sock_recv_frame(struct hgd_ctx *ctx,
+				     int fd, SSL *ssl, struct hgd_frame *f);
+int				 hgd_frame_int(struct hgd_frame *f, int *v);
+int				 hgd_frame_str(struct hgd_frame *f, char **str);
+void				 hgd_frame_free(struct hgd_frame *f);
 
 #endif
@@ -24,8 +24,11 @@
 #undef _POSIX_C_SOURCE /* crappy hack for debian python */
 #include <Python.h> /* defines _GNU_SOURCE comes before stdio.h */
 #include <dirent.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <structmember.h>
 
@@ -35,7 +38,15 @@
 #include "net.h"
 
 struct hgd_py_modules		 hgd_py_mods;
+struct hgd_py_executor		 hgd_py_ex;
 char				*hgd_py_plugin_dir;
+uint8_t				 hgd_py_user_scripts = 0;
+
+/* the python function for a hook is "hgd_hook_" followed by its name */
+char				*hgd_py_hook_names[HGD_PY_N_HOOKS] = {
+				    "init", "pre_play", "post_play",
+				    "nothing_to_play"
+				};
 
 /*
  * methods exposed to python
@@ -139,12 +150,224 @@ clean:
 	return (NULL);
 }
 
+/*
+ * PlaylistItem type
+ */
+static void
+hgd_py_meth_PlaylistItem_dealloc(PlaylistItem *self)
+{
+	Py_XDECREF(self->filename);
+	Py_XDECREF(self->tag_artist);
+	Py_XDECREF(self->tag_title);
+	Py_XDECREF(self->user);
+	Py_XDECREF(self->album);
+	Py_XDECREF(self->genre);
+	self->ob_type->tp_free((PyObject *) self);
+}
+
+static PyObject *
+hgd_py_meth_PlaylistItem_str(PlaylistItem *self)
+{
+	return (PyString_FromFormat("Hgd.PlayListItem: "
+	    "tid=%d, filename='%s', tag_artist='%s', tag_title='%s', "
+	    "user='%s', album='%s', genre='%s', duration=%d, "
+	    "bitrate=%d, samplerate=%d, channels=%d, year=%d",
+	    self->tid, PyString_AsString(self->filename),
+	    PyString_AsString(self->tag_artist),
+	    PyString_AsString(self->tag_title),
+	    PyString_AsString(self->user), PyString_AsString(self->album),
+	    PyString_AsString(self->genre), self->duration, self->bitrate,
+	    self->samplerate, self->channels, self->year));
+}
+
+/* the old python class had getter methods, keep them for plugins */
+#define HGD_PY_ITEM_INT_GETTER(f)					\
+static PyObject *							\
+hgd_py_meth_PlaylistItem_get_##f(PlaylistItem *self)			\
+{									\
+	return (PyInt_FromLong(self->f));				\
+}
+#define HGD_PY_ITEM_STR_GETTER(f)					\
+static PyObject *							\
+hgd_py_meth_PlaylistItem_get_##f(PlaylistItem *self)			\
+{									\
+	Py_INCREF(self->f);						\
+	return (self->f);						\
+}
+
+HGD_PY_ITEM_INT_GETTER(tid)
+HGD_PY_ITEM_STR_GETTER(filename)
+HGD_PY_ITEM_STR_GETTER(tag_artist)
+HGD_PY_ITEM_STR_GETTER(tag_title)
+HGD_PY_ITEM_STR_GETTER(user)
+HGD_PY_ITEM_STR_GETTER(album)
+HGD_PY_ITEM_STR_GETTER(genre)
+HGD_PY_ITEM_INT_GETTER(duration)
+HGD_PY_ITEM_INT_GETTER(bitrate)
+HGD_PY_ITEM_INT_GETTER(samplerate)
+HGD_PY_ITEM_INT_GETTER(channels)
+HGD_PY_ITEM_INT_GETTER(year)
+
+#define HGD_PY_ITEM_METHOD(f, doc)					\
+	{"get_" #f, (PyCFunction) hgd_py_meth_PlaylistItem_get_##f,	\
+	    METH_NOARGS, doc}
+
+/* method table for the PlaylistItem type */
+static PyMethodDef hgd_py_PlaylistItem_methods[] = {
+	HGD_PY_ITEM_METHOD(tid, "Return the track's track id as an integer."),
+	HGD_PY_ITEM_METHOD(filename, "Return the track's filename."),
+	HGD_PY_ITEM_METHOD(tag_artist,
+	    "Return artist metadata extracted by taglib."),
+	HGD_PY_ITEM_METHOD(tag_title,
+	    "Return title metadata extracted by taglib."),
+	HGD_PY_ITEM_METHOD(user,
+	    "Return the name of the user who queued this track."),
+	HGD_PY_ITEM_METHOD(album, "Return album metadata extracted by taglib"),
+	HGD_PY_ITEM_METHOD(genre, "Return genre metadata extracted by taglib"),
+	HGD_PY_ITEM_METHOD(duration,
+	    "Return duration metadata extracted by taglib"),
+	HGD_PY_ITEM_METHOD(bitrate,
+	    "Return bitrate metadata extracted by taglib"),
+	HGD_PY_ITEM_METHOD(samplerate,
+	    "Return samplerate metadata extracted by taglib"),
+	HGD_PY_ITEM_METHOD(channels,
+	    "Return channels metadata extracted by taglib"),
+	HGD_PY_ITEM_METHOD(year, "Return year metadata extracted by taglib"),
+	{ 0, 0, 0, 0 }
+};
+
+/* member table for PlaylistItem type, all read only */
+static PyMemberDef hgd_py_PlaylistItem_members[] = {
+	{"tid", T_INT, offsetof(PlaylistItem, tid), READONLY,
+	    "track id"},
+	{"filename", T_OBJECT_EX, offsetof(PlaylistItem, filename), READONLY,
+	    "filename"},
+	{"tag_artist", T_OBJECT_EX, offsetof(PlaylistItem, tag_artist),
+	    READONLY, "artist metadata"},
+	{"tag_title", T_OBJECT_EX, offsetof(PlaylistItem, tag_title),
+	    READONLY, "title metadata"},
+	{"user", T_OBJECT_EX, offsetof(PlaylistItem, user), READONLY,
+	    "user who queued the track"},
+	{"album", T_OBJECT_EX, offsetof(PlaylistItem, album), READONLY,
+	    "album metadata"},
+	{"genre", T_OBJECT_EX, offsetof(PlaylistItem, genre), READONLY,
+	    "genre metadata"},
+	{"duration", T_INT, offsetof(PlaylistItem, duration), READONLY,
+	    "duration metadata"},
+	{"bitrate", T_INT, offsetof(PlaylistItem, bitrate), READONLY,
+	    "bitrate metadata"},
+	{"samplerate", T_INT, offsetof(PlaylistItem, samplerate), READONLY,
+	    "samplerate metadata"},
+	{"channels", T_INT, offsetof(PlaylistItem, channels), READONLY,
+	    "channels metadata"},
+	{"year", T_INT, offsetof(PlaylistItem, year), READONLY,
+	    "year metadata"},
+	{0, 0, 0, 0, 0}
+};
+
+/*
+ * Describe the PlaylistItem type. No __dict__, so instances are just the
+ * struct above. Only made from C, so no tp_new.
+ */
+static PyTypeObject PlaylistItemType = {
+	PyObject_HEAD_INIT(NULL)
+	0,				/* ob_size */
+	"hgd.playlist.PlaylistItem",	/* tp_name */
+	sizeof(PlaylistItem),		/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor) hgd_py_meth_PlaylistItem_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	(reprfunc) hgd_py_meth_PlaylistItem_str,	/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	"Wrapper for a track in the playlist, whose items are read-only",
+					/* ^^^ tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	0,				/* tp_iter */
+	0,				/* tp_iternext */
+	hgd_py_PlaylistItem_methods,	/* tp_methods */
+	hgd_py_PlaylistItem_members,	/* tp_members */
+	0,				/* tp_getset */
+	0,				/* tp_base */
+	0,				/* tp_dict */
+	0,				/* tp_descr_get */
+	0,				/* tp_descr_set */
+	0,				/* tp_dictoffset */
+	0,				/* tp_init */
+	0,				/* tp_alloc */
+	0,				/* tp_new */
+	0,				/* tp_free */
+	0,				/* tp_is_gc */
+	0,				/* tp_bases */
+	0,				/* tp_mro */
+	0,				/* tp_cache */
+	0,				/* tp_subclasses */
+	0,				/* tp_weaklis */
+	0,				/* destructor */
+	0,				/* tp_version_tag */
+#ifdef COUNT_ALLOCS
+	0,				/* tp_allocs */
+	0,				/* tp_frees */
+	0,				/* tp_maxalloc */
+	0,				/* tp_prev */
+	0,				/* tp_next */
+#endif
+};
+
+static PyObject *
+hgd_py_new_playlist_item(struct hgd_playlist_item *it)
+{
+	PlaylistItem		*item;
+
+	item = PyObject_New(PlaylistItem, &PlaylistItemType);
+	if (item == NULL)
+		return (NULL);
+
+	item->tid = it->id;
+	item->filename = PyString_FromString(it->filename);
+	item->tag_artist = PyString_FromString(it->tags.artist);
+	item->tag_title = PyString_FromString(it->tags.title);
+	item->user = PyString_FromString(it->user);
+	item->album = PyString_FromString(it->tags.album);
+	item->genre = PyString_FromString(it->tags.genre);
+	item->duration = it->tags.duration;
+	item->bitrate = it->tags.bitrate;
+	item->samplerate = it->tags.samplerate;
+	item->channels = it->tags.channels;
+	item->year = it->tags.year;
+
+	if ((!item->filename) || (!item->tag_artist) || (!item->tag_title) ||
+	    (!item->user) || (!item->album) || (!item->genre)) {
+		Py_DECREF(item);
+		return (NULL);
+	}
+
+	return ((PyObject *) item);
+}
+
 /*
  * get the contents of the playlist
  *
  * needs to lock database when we make
  * the playlist re-orderable.
  *
+ * The items are cached until the playlist changes, so hooks calling this
+ * repeatedly get the same objects back. Each call gets its own list.
+ *
  * args:
  * ret: list of hgd.playlist.PlaylistItem
  */
@@ -152,91 +375,64 @@ static PyObject *
 hgd_py_meth_Hgd_get_playlist(Hgd *self)
 {
 	struct hgd_playlist	  list;
-	struct hgd_playlist_item *it;
 	unsigned int		  i, err = 0, free_playlist = 0;
-	PyObject		 *rec = NULL, *ret_list = NULL;
-	PyObject		 *plist_item = NULL;
-	PyObject		 *ctor = NULL, *args = NULL;
+	PyObject		 *ret_list = NULL, *plist_item = NULL;
+	uint64_t		  gen;
+	struct hgd_ctx		 *ctx = &hgd_py_mods.ctx;
 
 	(void) self;
 
-	if (hgd_get_playlist(&list) == HGD_FAIL) {
+	if (((ctx->db == NULL) && (hgd_open_db(ctx, db_path, 0) != HGD_OK)) ||
+	    (hgd_get_playlist_gen(ctx, &gen) == HGD_FAIL)) {
 		(void) PyErr_Format(PyExc_RuntimeError,
 		    "Failed to get playlist from HGD");
-		err = 1;
-		goto clean;
+		return (NULL);
 	}
-	free_playlist = 1;
 
-	ret_list = PyList_New(list.n_items);
-	if (!ret_list) {
-		err = 1;
-		goto clean;
+	if ((hgd_py_mods.playlist_cache != NULL) &&
+	    (hgd_py_mods.playlist_cache_gen == gen)) {
+		return (PyList_GetSlice(hgd_py_mods.playlist_cache,
+		    0, PyList_GET_SIZE(hgd_py_mods.playlist_cache)));
 	}
 
-	/* get ready to construct some stuff */
-	ctor = PyObject_GetAttrString(hgd_py_mods.playlist_mod, "PlaylistItem");
-	if (!ctor) {
+	if (hgd_get_playlist(ctx, &list) == HGD_FAIL) {
+		(void) PyErr_Format(PyExc_RuntimeError,
+		    "Failed to get playlist from HGD");
 		err = 1;
 		goto clean;
 	}
+	free_playlist = 1;
 
-	if (!PyCallable_Check(ctor)) {
+	ret_list = PyList_New(list.n_items);
+	if (!ret_list) {
 		err = 1;
 		goto clean;
 	}
 
 	for (i = 0; i < list.n_items; i++) {
-		it = list.items[i];
-
-		rec = Py_BuildValue("{sisssssssssssssisisisisi}",
-		    "tid", it->id,
-		    "filename", it->filename,
-		    "tag_artist", it->tags.artist,
-		    "tag_title", it->tags.title,
-		    "user", it->user,
-		    "album", it->tags.album,
-		    "genre", it->tags.genre,
-		    "duration", it->tags.duration,
-		    "bitrate", it->tags.bitrate,
-		    "samplerate", it->tags.samplerate,
-		    "channels", it->tags.channels,
-		    "year", it->tags.year);
-
-		if (rec == NULL) {
-			err = 1;
-			goto clean;
-		}
-
-		args = Py_BuildValue("(O)", rec);
-		if (args == NULL) {
-			err = 1;
-			goto clean;
-		}
-
-		plist_item = PyObject_CallObject(ctor, args);
-		Py_XDECREF(args);
-		Py_XDECREF(rec);
+		plist_item = hgd_py_new_playlist_item(list.items[i]);
 		if (plist_item == NULL) {
 			err = 1;
 			goto clean;
 		}
 
 		/* steals ref */
-		if (PyList_SetItem(ret_list, i, plist_item) != 0) {
-			err = 1;
-			goto clean;
-		}
+		PyList_SET_ITEM(ret_list, i, plist_item);
 	}
 
+	Py_XDECREF(hgd_py_mods.playlist_cache);
+	hgd_py_mods.playlist_cache = ret_list;
+	hgd_py_mods.playlist_cache_gen = gen;
+
 clean:
-	Py_XDECREF(ctor);
 	if (free_playlist)
 		hgd_free_playlist(&list);
 
-	if (err)
+	if (err) {
+		Py_XDECREF(ret_list);
 		return (NULL);
-	return (ret_list);
+	}
+	return (PyList_GetSlice(ret_list, 0, PyList_GET_SIZE(ret_list)));
 }
 
 /* make some stuff read only */
@@ -503,21 +699,243 @@ hgd_init_hgd_mod(void)
 
 	Py_INCREF(&HgdType);
 	PyModule_AddObject(m, "Hgd", (PyObject *) &HgdType);
+
+	/* PlaylistItem lives in hgd.playlist, where it used to be in python */
+	if (PyType_Ready(&PlaylistItemType) < 0) {
+		DPRINTF(HGD_D_ERROR, "PlaylistItem type not ready");
+		return;
+	}
+
+	Py_INCREF(&PlaylistItemType);
+	PyModule_AddObject(hgd_py_mods.playlist_mod, "PlaylistItem",
+	    (PyObject *) &PlaylistItemType);
 }
 
 /*
  * Back to HGD land
  */
 
-/* embed the Python interpreter */
+/* drop all resolved hook callables */
+void
+hgd_py_clear_hooks(void)
+{
+	int			 hook, i;
+
+	for (hook = 0; hook < HGD_PY_N_HOOKS; hook++) {
+		for (i = 0; i < hgd_py_mods.n_hooks[hook]; i++)
+			Py_XDECREF(hgd_py_mods.hooks[hook][i].func);
+		hgd_py_mods.n_hooks[hook] = 0;
+	}
+}
+
+/* read an optional integer attribute of a hook function */
+long
+hgd_py_hook_attr(PyObject *func, char *attr, long dflt)
+{
+	PyObject		*val;
+	long			 ret = dflt;
+
+	if ((val = PyObject_GetAttrString(func, attr)) == NULL) {
+		PyErr_Clear();
+		return (dflt);
+	}
+
+	if (PyObject_IsTrue(val) == 0)
+		ret = 0;
+	else if ((ret = PyInt_AsLong(val)) == -1 && PyErr_Occurred()) {
+		PyErr_Clear();
+		ret = dflt;
+	}
+
+	Py_XDECREF(val);
+	return (ret);
+}
+
+/*
+ * look up every hook in every user module once, so that running a hook
+ * is just a walk of the modules that define it.
+ *
+ * A hook function may have a 'blocking' attribute, meaning playback waits
+ * for it, and a 'timeout' attribute in seconds.
+ */
 int
-hgd_embed_py(uint8_t enable_user_scripts)
+hgd_py_build_hooks(void)
+{
+	PyObject		*func;
+	struct hgd_py_hook	*h;
+	int			 hook, i, n_hooks = 0;
+	uint8_t			 n_blocking[HGD_PY_N_HOOKS];
+	int			 blocking_timeout[HGD_PY_N_HOOKS];
+	char			*func_name;
+
+	hgd_py_clear_hooks();
+	memset(n_blocking, 0, sizeof(n_blocking));
+	memset(blocking_timeout, 0, sizeof(blocking_timeout));
+
+	for (hook = 0; hook < HGD_PY_N_HOOKS; hook++) {
+		xasprintf(&func_name, "hgd_hook_%s", hgd_py_hook_names[hook]);
+
+		for (i = 0; i < hgd_py_mods.n_user_mods; i++) {
+			func = PyObject_GetAttrString(
+			    hgd_py_mods.user_mods[i], func_name);
+
+			/* if a hook func is not defined, that is fine, skip */
+			if (!func) {
+				DPRINTF(HGD_D_DEBUG,
+				    "Python hook '%s.%s' undefined",
+				    hgd_py_mods.user_mod_names[i], func_name);
+				PyErr_Clear();
+				continue;
+			}
+
+			if (!PyCallable_Check(func)) {
+				DPRINTF(HGD_D_WARN,
+				    "Python hook '%s.%s' is not callable",
+				    hgd_py_mods.user_mod_names[i], func_name);
+				Py_XDECREF(func);
+				continue;
+			}
+
+			h = &hgd_py_mods.hooks[hook][hgd_py_mods.n_hooks[hook]];
+			h->func = func;
+			h->mod = i;
+			h->blocking = hgd_py_hook_attr(func, "blocking", 0) != 0;
+			h->timeout = hgd_py_hook_attr(func, "timeout",
+			    HGD_PY_HOOK_TIMEOUT);
+			if (h->timeout <= 0)
+				h->timeout = HGD_PY_HOOK_TIMEOUT;
+
+			if (h->blocking) {
+				n_blocking[hook]++;
+				blocking_timeout[hook] += h->timeout;
+			}
+
+			hgd_py_mods.n_hooks[hook]++;
+			n_hooks++;
+		}
+
+		free(func_name);
+	}
+
+	/* the main thread decides whether to wait using these */
+	if (hgd_py_ex.running)
+		pthread_mutex_lock(&hgd_py_ex.lock);
+
+	for (hook = 0; hook < HGD_PY_N_HOOKS; hook++) {
+		hgd_py_ex.n_blocking[hook] = n_blocking[hook];
+		hgd_py_ex.n_async[hook] =
+		    hgd_py_mods.n_hooks[hook] - n_blocking[hook];
+		hgd_py_ex.blocking_timeout[hook] = blocking_timeout[hook];
+	}
+
+	if (hgd_py_ex.running)
+		pthread_mutex_unlock(&hgd_py_ex.lock);
+
+	DPRINTF(HGD_D_INFO, "Resolved %d Python hooks", n_hooks);
+
+	return (HGD_OK);
+}
+
+/*
+ * (re)load the user scripts from the plugin dir. If reload is set,
+ * modules which are already loaded are re-read from disk.
+ */
+int
+hgd_py_load_user_mods(uint8_t reload)
 {
 	DIR			*script_dir;
 	struct dirent		*ent;
+	PyObject		*mod, *new_mod;
+	size_t			 s_nm_len;
+
+	/* forget the old ones, python keeps them in sys.modules */
+	while (hgd_py_mods.n_user_mods) {
+		hgd_py_mods.n_user_mods--;
+		Py_XDECREF(hgd_py_mods.user_mods[hgd_py_mods.n_user_mods]);
+		free(hgd_py_mods.user_mod_names[hgd_py_mods.n_user_mods]);
+	}
+
+	script_dir = opendir(hgd_py_plugin_dir);
+	if (script_dir == NULL) {
+		DPRINTF(HGD_D_WARN, "Can't read script dir '%s': %s",
+		   hgd_py_plugin_dir, SERROR);
+		return (HGD_FAIL);
+	}
+
+	/* loop over user script dir loading modules for hooks */
+	while ((ent = readdir(script_dir)) != NULL) {
+
+		if ((strcmp(ent->d_name, ".") == 0) ||
+		    (strcmp(ent->d_name, "..") == 0) ||
+		    (strcmp(ent->d_name, "hgd.py") == 0)) {
+			continue;
+		}
+
+		if (hgd_py_mods.n_user_mods == HGD_MAX_PY_MODS) {
+			DPRINTF(HGD_D_WARN,
+			    "Too many python modules loaded");
+			break;
+		}
+
+		s_nm_len = strlen(ent->d_name);
+		if (s_nm_len < 4) {
+			DPRINTF(HGD_D_INFO,
+			    "skipping '%s', filename too short",
+			    ent->d_name);
+			continue;
+		}
+
+		/* scripts must end '.py' */
+		if ((ent->d_name[s_nm_len - 1] != 'y') ||
+		    (ent->d_name[s_nm_len - 2] != 'p') ||
+		    (ent->d_name[s_nm_len - 3] != '.')) {
+			DPRINTF(HGD_D_INFO,
+			    "skipping '%s', not a '.py' suffix",
+			    ent->d_name);
+			continue;
+		}
+
+		/* remove .py  suffix */
+		ent->d_name[s_nm_len - 3] = 0;
+
+		/* load */
+		DPRINTF(HGD_D_DEBUG, "Loading '%s'", ent->d_name);
+		mod = PyImport_ImportModule(ent->d_name);
+		if (!mod) {
+			PRINT_PY_ERROR();
+			continue;
+		}
+
+		/* an import of a loaded module would give us the old code */
+		if (reload) {
+			new_mod = PyImport_ReloadModule(mod);
+			Py_XDECREF(mod);
+			if (!new_mod) {
+				PRINT_PY_ERROR();
+				continue;
+			}
+			mod = new_mod;
+		}
+
+		hgd_py_mods.user_mods[hgd_py_mods.n_user_mods] = mod;
+		hgd_py_mods.user_mod_names[hgd_py_mods.n_user_mods] =
+		    xstrdup(ent->d_name);
+		hgd_py_mods.n_user_mods++;
+	}
+	DPRINTF(HGD_D_INFO,
+	    "Loaded %d user scripts.", hgd_py_mods.n_user_mods);
+
+	(void) closedir(script_dir);
+
+	return (HGD_OK);
+}
+
+/* embed the Python interpreter */
+int
+hgd_embed_py(uint8_t enable_user_scripts)
+{
 	PyObject		*mod;
 	char			*search_path;
-	size_t			 s_nm_len;
 
 	DPRINTF(HGD_D_INFO, "Initialising Python");
 
@@ -540,7 +958,10 @@ hgd_embed_py(uint8_t enable_user_scripts)
 	free(search_path);
 
 	Py_InitializeEx(0); /* 0, no sighandlers thanks */
+	PyEval_InitThreads(); /* hooks run on another thread */
 	memset(&hgd_py_mods, 0, sizeof(hgd_py_mods));
+	memset(&hgd_py_ex, 0, sizeof(hgd_py_ex));
+	hgd_ctx_init(&hgd_py_mods.ctx);
 
 	/* import inspect for hgd.dprint */
 	mod = PyImport_ImportModule("inspect");
@@ -558,86 +979,76 @@ hgd_embed_py(uint8_t enable_user_scripts)
 	}
 	hgd_py_mods.playlist_mod = mod;
 
-	/* if we want to enable user scripts */
-	if (enable_user_scripts) {
-
-		script_dir = opendir(hgd_py_plugin_dir);
-		if (script_dir == NULL) {
-			DPRINTF(HGD_D_WARN, "Can't read script dir '%s': %s",
-			   hgd_py_plugin_dir, SERROR);
-		}
-
-		/* loop over user script dir loading modules for hooks */
-		while ((script_dir != NULL)
-		    && (ent = readdir(script_dir)) != NULL) {
-
-			if ((strcmp(ent->d_name, ".") == 0) ||
-			    (strcmp(ent->d_name, "..") == 0) ||
-			    (strcmp(ent->d_name, "hgd.py") == 0)) {
-				continue;
-			}
-
-			if (hgd_py_mods.n_user_mods == HGD_MAX_PY_MODS) {
-				DPRINTF(HGD_D_WARN,
-				    "Too many python modules loaded");
-				break;
-			}
-
-			s_nm_len = strlen(ent->d_name);
-			if (s_nm_len < 4) {
-				DPRINTF(HGD_D_INFO,
-				    "skipping '%s', filename too short",
-				    ent->d_name);
-				continue;
-			}
-
-			/* scripts must end '.py' */
-			if ((ent->d_name[s_nm_len - 1] != 'y') ||
-			    (ent->d_name[s_nm_len - 2] != 'p') ||
-			    (ent->d_name[s_nm_len - 3] != '.')) {
-				DPRINTF(HGD_D_INFO,
-				    "skipping '%s', not a '.py' suffix",
-				    ent->d_name);
-				continue;
-			}
+	/*
+	 * init hgd module and stash an instance. Before the user scripts,
+	 * which may use hgd.playlist.PlaylistItem as they are imported.
+	 */
+	hgd_init_hgd_mod();
+	hgd_py_mods.hgd_o = hgd_py_meth_Hgd_new(&HgdType, NULL, NULL);
 
-			/* remove .py  suffix */
-			ent->d_name[s_nm_len - 3] = 0;
+	/* if we want to enable user scripts */
+	hgd_py_user_scripts = enable_user_scripts;
+	if (enable_user_scripts)
+		hgd_py_load_user_mods(0);
 
-			/* load */
-			DPRINTF(HGD_D_DEBUG, "Loading '%s'", ent->d_name);
-			mod = PyImport_ImportModule(ent->d_name);
-			if (!mod) {
-				PRINT_PY_ERROR();
-				continue;
-			}
+	/* every hook gets the same arguments, so build them once */
+	hgd_py_mods.hook_args = Py_BuildValue("(O)", hgd_py_mods.hgd_o);
+	if (hgd_py_mods.hook_args == NULL) {
+		PRINT_PY_ERROR();
+		hgd_exit_nicely();
+	}
 
-			hgd_py_mods.user_mods[hgd_py_mods.n_user_mods] = mod;
-			hgd_py_mods.user_mod_names[hgd_py_mods.n_user_mods] =
-			    xstrdup(ent->d_name);
-			hgd_py_mods.n_user_mods++;
-		}
-		DPRINTF(HGD_D_INFO,
-		    "Loaded %d user scripts.", hgd_py_mods.n_user_mods);
+	hgd_py_build_hooks();
+	hgd_execute_py_hook(HGD_PY_HOOK_INIT);
 
-	if (script_dir != NULL)	(void) closedir(script_dir);
+	/* from here on hooks are run by the executor */
+	if (enable_user_scripts)
+		return (hgd_py_start_executor());
 
-	} /* if enable_user_scripts */
+	return (HGD_OK);
+}
 
-	/* init hgd module and stash an instance */
-	hgd_init_hgd_mod();
-	hgd_py_mods.hgd_o = hgd_py_meth_Hgd_new(&HgdType, NULL, NULL);
+/* re-read the user scripts and rebuild the hook table */
+int
+hgd_reload_py(void)
+{
+	DPRINTF(HGD_D_INFO, "Reloading Python user scripts");
+
+	if (!hgd_py_user_scripts)
+		return (HGD_OK);
+
+	/* the executor owns the interpreter, so it has to do it */
+	if (hgd_py_ex.running) {
+		pthread_mutex_lock(&hgd_py_ex.lock);
+		hgd_py_ex.reload = 1;
+		pthread_cond_signal(&hgd_py_ex.work_cv);
+		pthread_mutex_unlock(&hgd_py_ex.lock);
+		return (HGD_OK);
+	}
 
-	hgd_execute_py_hook("init");
+	hgd_py_clear_hooks();
+	hgd_py_load_user_mods(1);
+	hgd_py_build_hooks();
 
-	return (HGD_OK);
+	return (hgd_py_run_hooks(HGD_PY_HOOK_INIT, -1));
 }
 
 void
 hgd_free_py()
 {
 	DPRINTF(HGD_D_INFO, "Clearing up python stuff");
+
+	if (hgd_py_stop_executor() != HGD_OK) {
+		/* a hook is stuck, finalising under it would be worse */
+		DPRINTF(HGD_D_WARN, "Not finalising Python, a hook is stuck");
+		return;
+	}
+
+	hgd_py_clear_hooks();
+	Py_XDECREF(hgd_py_mods.hook_args);
+	Py_XDECREF(hgd_py_mods.playlist_cache);
 	hgd_py_meth_Hgd_dealloc((Hgd *) hgd_py_mods.hgd_o);
+	hgd_close_db(&hgd_py_mods.ctx);
 
 	if (hgd_py_plugin_dir != NULL)
 		free(hgd_py_plugin_dir);
@@ -648,60 +1059,53 @@ hgd_free_py()
 
 }
 
+/*
+ * call the functions for a hook. if blocking is 0 or 1 only call the
+ * functions which are (not) blocking, -1 calls all of them.
+ * The caller holds the GIL.
+ */
 int
-hgd_execute_py_hook(char *hook)
+hgd_py_run_hooks(int hook, int blocking)
 {
-	PyObject		*func, *ret, *args;
+	PyObject		*ret;
+	struct hgd_py_hook	*h;
 	int			 i, c_ret, any_errors = HGD_OK;
-	char			*func_name = NULL;
+	char			*mod_name;
 
-	DPRINTF(HGD_D_DEBUG, "Executing Python hooks for '%s'", hook);
+	for (i = 0; i < hgd_py_mods.n_hooks[hook]; i++) {
+		h = &hgd_py_mods.hooks[hook][i];
+		if ((blocking != -1) && (h->blocking != blocking))
+			continue;
 
-	xasprintf(&func_name, "hgd_hook_%s", hook);
+		mod_name = hgd_py_mods.user_mod_names[h->mod];
 
-	for (i = 0; i < hgd_py_mods.n_user_mods; i++) {
-		func = PyObject_GetAttrString(
-		    hgd_py_mods.user_mods[i], func_name);
+		DPRINTF(HGD_D_INFO, "Calling Python hook '%s.hgd_hook_%s'",
+		    mod_name, hgd_py_hook_names[hook]);
 
-		/* if a hook func is not defined, that is fine, skip */
-		if (!func) {
-			DPRINTF(HGD_D_DEBUG, "Python hook '%s.%s' undefined",
-			    hgd_py_mods.user_mod_names[i], func_name);
-			PyErr_Clear();
-			continue;
+		/* let the watchdog know */
+		if (hgd_py_ex.running) {
+			pthread_mutex_lock(&hgd_py_ex.lock);
+			hgd_py_ex.calling = 1;
+			hgd_py_ex.call_seq++;
+			hgd_py_ex.call_deadline = time(NULL) + h->timeout;
+			hgd_py_ex.n_calls++;
+			pthread_cond_signal(&hgd_py_ex.watch_cv);
+			pthread_mutex_unlock(&hgd_py_ex.lock);
 		}
 
-		if (!PyCallable_Check(func)) {
-			PRINT_PY_ERROR();
-			DPRINTF(HGD_D_WARN,
-			    "Python hook '%s.%s' is not callable",
-			    hgd_py_mods.user_mod_names[i], func_name);
-			Py_XDECREF(func);
-			any_errors = HGD_FAIL;
-			continue;
-		}
+		ret = PyObject_CallObject(h->func, hgd_py_mods.hook_args);
 
-		args = Py_BuildValue("(O)", hgd_py_mods.hgd_o);
-		if (args == NULL) {
-			DPRINTF(HGD_D_WARN,
-			    "Failed to build args for '%s.%s'",
-			    hgd_py_mods.user_mod_names[i], func_name);
-			any_errors = HGD_FAIL;
-			Py_XDECREF(func);
-			continue;
+		if (hgd_py_ex.running) {
+			pthread_mutex_lock(&hgd_py_ex.lock);
+			hgd_py_ex.calling = 0;
+			pthread_mutex_unlock(&hgd_py_ex.lock);
 		}
 
-		DPRINTF(HGD_D_INFO, "Calling Python hook '%s.%s'",
-		    hgd_py_mods.user_mod_names[i], func_name);
-
-		ret = PyObject_CallObject(func, args);
-		Py_XDECREF(func);
-		Py_XDECREF(args);
 		if (ret == NULL) {
 			PRINT_PY_ERROR();
 			DPRINTF(HGD_D_WARN,
-			    "failed to call Python hook '%s.%s'",
-			    hgd_py_mods.user_mod_names[i], func_name);
+			    "failed to call Python hook '%s.hgd_hook_%s'",
+			    mod_name, hgd_py_hook_names[hook]);
 			any_errors = HGD_FAIL;
 			continue;
 		}
@@ -711,15 +1115,292 @@ hgd_execute_py_hook(char *hook)
 
 		/* if the user returns non HGD_OK (non-zero), indicates fail */
 		if (c_ret != HGD_OK) {
-			DPRINTF(HGD_D_WARN, "%s.%s returned non-zero",
-			    hgd_py_mods.user_mod_names[i], func_name);
+			DPRINTF(HGD_D_WARN, "%s.hgd_hook_%s returned non-zero",
+			    mod_name, hgd_py_hook_names[hook]);
 			any_errors = HGD_FAIL;
 		}
 	}
 
-	free(func_name);
-
 	return (any_errors);
 }
 
+/* the executor thread, the only thread to run Python once started */
+void *
+hgd_py_executor_thread(void *arg)
+{
+	PyThreadState		*ts;
+	PyGILState_STATE	 gil;
+	int			 hook, reload;
+	uint64_t		 seq;
+
+	(void) arg;
+
+	gil = PyGILState_Ensure();
+
+	pthread_mutex_lock(&hgd_py_ex.lock);
+	hgd_py_ex.py_thread_id = PyThreadState_Get()->thread_id;
+	pthread_mutex_unlock(&hgd_py_ex.lock);
+
+	/* drop the GIL while waiting for work, and take it without the lock */
+	ts = PyEval_SaveThread();
+	pthread_mutex_lock(&hgd_py_ex.lock);
+
+	while (!hgd_py_ex.stop) {
+		/* blocking hooks first, playback is waiting */
+		if (hgd_py_ex.blocking_hook != -1) {
+			hook = hgd_py_ex.blocking_hook;
+			seq = hgd_py_ex.blocking_seq;
+			hgd_py_ex.blocking_hook = -1;
+			pthread_mutex_unlock(&hgd_py_ex.lock);
+
+			PyEval_RestoreThread(ts);
+			hgd_py_run_hooks(hook, 1);
+			ts = PyEval_SaveThread();
+
+			pthread_mutex_lock(&hgd_py_ex.lock);
+			hgd_py_ex.blocking_done = seq;
+			pthread_cond_broadcast(&hgd_py_ex.done_cv);
+			continue;
+		}
+
+		if ((hgd_py_ex.reload) || (hgd_py_ex.q_len > 0)) {
+			reload = hgd_py_ex.reload;
+			hook = -1;
+			if (reload) {
+				hgd_py_ex.reload = 0;
+			} else {
+				hook = hgd_py_ex.queue[hgd_py_ex.q_head];
+				hgd_py_ex.q_head =
+				    (hgd_py_ex.q_head + 1) % HGD_PY_QUEUE_SZ;
+				hgd_py_ex.q_len--;
+			}
+			pthread_mutex_unlock(&hgd_py_ex.lock);
+
+			PyEval_RestoreThread(ts);
+			if (reload) {
+				hgd_py_load_user_mods(1);
+				hgd_py_build_hooks();
+				hgd_py_run_hooks(HGD_PY_HOOK_INIT, -1);
+			} else
+				hgd_py_run_hooks(hook, 0);
+			ts = PyEval_SaveThread();
+
+			pthread_mutex_lock(&hgd_py_ex.lock);
+			continue;
+		}
+
+		pthread_cond_wait(&hgd_py_ex.work_cv, &hgd_py_ex.lock);
+	}
+
+	hgd_py_ex.stopped = 1;
+	pthread_cond_broadcast(&hgd_py_ex.done_cv);
+	pthread_mutex_unlock(&hgd_py_ex.lock);
+
+	PyEval_RestoreThread(ts);
+	PyGILState_Release(gil);
+
+	return (NULL);
+}
+
+/* interrupts hooks which run for longer than their timeout */
+void *
+hgd_py_watchdog_thread(void *arg)
+{
+	PyGILState_STATE	 gil;
+	struct timespec		 ts;
+	uint64_t		 seq;
+	long			 tid;
+
+	(void) arg;
+
+	pthread_mutex_lock(&hgd_py_ex.lock);
+	while (!hgd_py_ex.stop) {
+		if (!hgd_py_ex.calling) {
+			pthread_cond_wait(&hgd_py_ex.watch_cv, &hgd_py_ex.lock);
+			continue;
+		}
+
+		seq = hgd_py_ex.call_seq;
+		ts.tv_sec = hgd_py_ex.call_deadline;
+		ts.tv_nsec = 0;
+
+		if (pthread_cond_timedwait(&hgd_py_ex.watch_cv,
+		    &hgd_py_ex.lock, &ts) != ETIMEDOUT)
+			continue;
+
+		if ((!hgd_py_ex.calling) || (hgd_py_ex.call_seq != seq))
+			continue;
+
+		/* not waiting for the GIL with the lock held, see py.h */
+		pthread_mutex_unlock(&hgd_py_ex.lock);
+		gil = PyGILState_Ensure();
+		pthread_mutex_lock(&hgd_py_ex.lock);
+
+		/* make sure the hook didn't finish while we waited */
+		if ((hgd_py_ex.calling) && (hgd_py_ex.call_seq == seq)) {
+			DPRINTF(HGD_D_WARN, "Python hook timed out, interrupting");
+			tid = hgd_py_ex.py_thread_id;
+			PyThreadState_SetAsyncExc(tid, PyExc_RuntimeError);
+			hgd_py_ex.n_timeouts++;
+			/* don't interrupt it again */
+			hgd_py_ex.call_deadline = time(NULL) + HGD_PY_HOOK_TIMEOUT;
+		}
+
+		pthread_mutex_unlock(&hgd_py_ex.lock);
+		PyGILState_Release(gil);
+		pthread_mutex_lock(&hgd_py_ex.lock);
+	}
+	pthread_mutex_unlock(&hgd_py_ex.lock);
+
+	return (NULL);
+}
+
+/* hand the interpreter over to the executor thread */
+int
+hgd_py_start_executor(void)
+{
+	sigset_t		 all, old;
+
+	DPRINTF(HGD_D_INFO, "Starting Python hook executor");
+
+	pthread_mutex_init(&hgd_py_ex.lock, NULL);
+	pthread_cond_init(&hgd_py_ex.work_cv, NULL);
+	pthread_cond_init(&hgd_py_ex.done_cv, NULL);
+	pthread_cond_init(&hgd_py_ex.watch_cv, NULL);
+	hgd_py_ex.blocking_hook = -1;
+	hgd_py_ex.running = 1;
+
+	hgd_py_ex.main_ts = PyEval_SaveThread();
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	if (pthread_create(&hgd_py_ex.thread, NULL,
+	    hgd_py_executor_thread, NULL) != 0) {
+		DPRINTF(HGD_D_ERROR, "Can't start Python hook executor");
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		PyEval_RestoreThread(hgd_py_ex.main_ts);
+		hgd_py_ex.running = 0;
+		return (HGD_FAIL);
+	}
+
+	if (pthread_create(&hgd_py_ex.watchdog, NULL,
+	    hgd_py_watchdog_thread, NULL) != 0) {
+		/* hooks will still run, just without timeouts */
+		DPRINTF(HGD_D_WARN, "Can't start Python hook watchdog");
+	} else
+		hgd_py_ex.watching = 1;
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return (HGD_OK);
+}
+
+/* take the interpreter back, fails if a hook won't finish */
+int
+hgd_py_stop_executor(void)
+{
+	struct timespec		ts;
+
+	if (!hgd_py_ex.running)
+		return (HGD_OK);
+
+	DPRINTF(HGD_D_INFO, "Stopping Python hook executor: "
+	    "%llu calls, %llu dropped, %llu timed out",
+	    (unsigned long long) hgd_py_ex.n_calls,
+	    (unsigned long long) hgd_py_ex.n_dropped,
+	    (unsigned long long) hgd_py_ex.n_timeouts);
+
+	ts.tv_sec = time(NULL) + HGD_PY_STOP_TIMEOUT;
+	ts.tv_nsec = 0;
+
+	pthread_mutex_lock(&hgd_py_ex.lock);
+	hgd_py_ex.stop = 1;
+	pthread_cond_broadcast(&hgd_py_ex.work_cv);
+	pthread_cond_broadcast(&hgd_py_ex.watch_cv);
+
+	while (!hgd_py_ex.stopped) {
+		if (pthread_cond_timedwait(&hgd_py_ex.done_cv,
+		    &hgd_py_ex.lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&hgd_py_ex.lock);
+
+	if (!hgd_py_ex.stopped)
+		return (HGD_FAIL);
+
+	pthread_join(hgd_py_ex.thread, NULL);
+	if (hgd_py_ex.watching)
+		pthread_join(hgd_py_ex.watchdog, NULL);
+
+	hgd_py_ex.running = 0;
+	PyEval_RestoreThread(hgd_py_ex.main_ts);
+
+	return (HGD_OK);
+}
+
+/*
+ * run a hook. Blocking hook functions are waited for (up to their
+ * timeouts), the rest are queued for the executor.
+ */
+int
+hgd_execute_py_hook(int hook)
+{
+	struct timespec		 ts;
+	uint64_t		 seq;
+	int			 ret = HGD_OK;
+
+	DPRINTF(HGD_D_DEBUG, "Executing Python hooks for '%s'",
+	    hgd_py_hook_names[hook]);
+
+	/* not started yet (or not wanted), run in this thread */
+	if (!hgd_py_ex.running)
+		return (hgd_py_run_hooks(hook, -1));
+
+	pthread_mutex_lock(&hgd_py_ex.lock);
+
+	if (hgd_py_ex.n_blocking[hook] > 0) {
+		if (hgd_py_ex.blocking_hook != -1)
+			hgd_py_ex.n_dropped++; /* last one never started */
+
+		hgd_py_ex.blocking_hook = hook;
+		seq = ++hgd_py_ex.blocking_seq;
+		pthread_cond_signal(&hgd_py_ex.work_cv);
+
+		ts.tv_sec = time(NULL) + hgd_py_ex.blocking_timeout[hook];
+		ts.tv_nsec = 0;
+
+		while (hgd_py_ex.blocking_done < seq) {
+			if (pthread_cond_timedwait(&hgd_py_ex.done_cv,
+			    &hgd_py_ex.lock, &ts) == ETIMEDOUT) {
+				DPRINTF(HGD_D_WARN, "Gave up waiting for "
+				    "blocking '%s' hooks",
+				    hgd_py_hook_names[hook]);
+				ret = HGD_FAIL;
+				break;
+			}
+		}
+	}
+
+	if (hgd_py_ex.n_async[hook] > 0) {
+		if (hgd_py_ex.q_len == HGD_PY_QUEUE_SZ) {
+			hgd_py_ex.n_dropped++;
+			DPRINTF(HGD_D_WARN, "Python hook queue full, "
+			    "dropped '%s' (%llu dropped so far)",
+			    hgd_py_hook_names[hook],
+			    (unsigned long long) hgd_py_ex.n_dropped);
+		} else {
+			hgd_py_ex.queue[(hgd_py_ex.q_head + hgd_py_ex.q_len) %
+			    HGD_PY_QUEUE_SZ] = hook;
+			hgd_py_ex.q_len++;
+			pthread_cond_signal(&hgd_py_ex.work_cv);
+		}
+	}
+
+	pthread_mutex_unlock(&hgd_py_ex.lock);
+
+	return (ret);
+}
+
 #endif
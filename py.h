@@ -21,6 +21,8 @@
 #undef _POSIX_C_SOURCE /* crappy hack for debian python */
 #include <Python.h>
 
+#include <pthread.h>
+
 #include "hgd.h"
 
 #define PRINT_PY_ERROR()	do { \
@@ -44,6 +46,46 @@ typedef struct {
 	PyObject		*component;	/* "hgd-playd", "hgd-netd"... */
 } Hgd;
 
+/* hooks, index into hgd_py_hook_names[] */
+#define HGD_PY_HOOK_INIT		0
+#define HGD_PY_HOOK_PRE_PLAY		1
+#define HGD_PY_HOOK_POST_PLAY		2
+#define HGD_PY_HOOK_NOTHING_TO_PLAY	3
+#define HGD_PY_N_HOOKS			4
+
+/* hooks run on their own thread, these are queued for it */
+#define HGD_PY_QUEUE_SZ			16
+#define HGD_PY_HOOK_TIMEOUT		10	/* secs, if the hook doesn't say */
+#define HGD_PY_STOP_TIMEOUT		5	/* secs to wait for hooks on exit */
+
+/* a resolved hook function */
+struct hgd_py_hook {
+	PyObject		*func;
+	uint8_t			 mod;		/* index into user_mods */
+	uint8_t			 blocking;	/* playback waits for it */
+	int			 timeout;	/* secs before it is interrupted */
+};
+
+/*
+ * hgd.playlist.PlaylistItem, a read-only track in the playlist.
+ * Strings are kept as Python objects so that getting them is just a ref.
+ */
+typedef struct {
+	PyObject_HEAD
+	int			 tid;
+	PyObject		*filename;
+	PyObject		*tag_artist;
+	PyObject		*tag_title;
+	PyObject		*user;
+	PyObject		*album;
+	PyObject		*genre;
+	int			 duration;
+	int			 bitrate;
+	int			 samplerate;
+	int			 channels;
+	int			 year;
+} PlaylistItem;
+
 /* module table - these are user moduels which we load and call hooks on */
 struct hgd_py_modules {
 	/* native modules */
@@ -56,11 +98,68 @@ struct hgd_py_modules {
 	PyObject		*user_mods[HGD_MAX_PY_MODS];
 	char			*user_mod_names[HGD_MAX_PY_MODS];
 	uint8_t			 n_user_mods;
+	/* hook callables, resolved once, per hook */
+	struct hgd_py_hook	 hooks[HGD_PY_N_HOOKS][HGD_MAX_PY_MODS];
+	uint8_t			 n_hooks[HGD_PY_N_HOOKS];
+	PyObject		*hook_args;		/* (hgd_o,) */
+	/* last get_playlist() result and the playlist generation of it */
+	PyObject		*playlist_cache;
+	uint64_t		 playlist_cache_gen;
+	/* hooks run on their own thread, so have their own db connection */
+	struct hgd_ctx		 ctx;
 };
 extern struct hgd_py_mods	 hgd_pys;
 
+/*
+ * The hook executor. Once started, hooks are only run by its thread, so a
+ * slow hook does not hold up playback, unless it is marked blocking.
+ * A watchdog thread interrupts hooks which overrun their timeout.
+ * Everything below lock is protected by it. lock may be taken while
+ * holding the GIL, but the GIL is never waited for while holding lock.
+ */
+struct hgd_py_executor {
+	uint8_t			 running;
+	uint8_t			 watching;	/* the watchdog started */
+	pthread_t		 thread;
+	pthread_t		 watchdog;
+	PyThreadState		*main_ts;	/* main thread, while detached */
+	long			 py_thread_id;	/* of the executor thread */
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 work_cv;	/* executor: something to do */
+	pthread_cond_t		 done_cv;	/* caller: blocking hooks ran */
+	pthread_cond_t		 watch_cv;	/* watchdog: a call started */
+	/* non-blocking hooks waiting to run */
+	int			 queue[HGD_PY_QUEUE_SZ];
+	int			 q_head;
+	int			 q_len;
+	/* blocking hooks waiting to run, the caller waits */
+	int			 blocking_hook;	/* -1 if none */
+	uint64_t		 blocking_seq;
+	uint64_t		 blocking_done;
+	/* what the main thread needs to know about the hook table */
+	uint8_t			 n_blocking[HGD_PY_N_HOOKS];
+	uint8_t			 n_async[HGD_PY_N_HOOKS];
+	int			 blocking_timeout[HGD_PY_N_HOOKS];
+	/* hook call in progress */
+	uint8_t			 calling;
+	uint64_t		 call_seq;
+	time_t			 call_deadline;
+	uint8_t			 reload;
+	uint8_t			 stop;
+	uint8_t			 stopped;
+	/* accounting */
+	uint64_t		 n_calls;
+	uint64_t		 n_dropped;	/* queue was full */
+	uint64_t		 n_timeouts;
+};
+extern struct hgd_py_executor	 hgd_py_ex;
+
 int				 hgd_embed_py(uint8_t enable_user_scripts);
 void				 hgd_free_py(void);
-int				 hgd_execute_py_hook(char *hook);
+int				 hgd_reload_py(void);
+int				 hgd_execute_py_hook(int hook);
+int				 hgd_py_run_hooks(int hook, int blocking);
+int				 hgd_py_start_executor(void);
+int				 hgd_py_stop_executor(void);
 
 #endif
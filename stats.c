@@ -0,0 +1,630 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Martin Ellis <ellism88@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "hgd.h"
+#include "stats.h"
+
+struct hgd_stats		*hgd_stats = NULL;
+pid_t				 metrics_pid = 0;	/* owner of the socket */
+
+const char			*hgd_stats_timing_names[HGD_STATS_N_TIMINGS] = {
+				    "track-gap", "play-start", "skip" };
+
+/*
+ * map the stats file. Daemons open it writable, creating it if need be,
+ * hgd-admin opens it read only.
+ */
+int
+hgd_stats_open(uint8_t writable)
+{
+	char			*path = NULL;
+	int			 fd = -1, ret = HGD_FAIL;
+	struct stat		 st;
+	void			*map;
+
+	xasprintf(&path, "%s/%s", state_path, HGD_STATS_FILE);
+	DPRINTF(HGD_D_DEBUG, "Mapping stats file '%s'", path);
+
+	if (writable)
+		fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	else
+		fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		DPRINTF(writable ? HGD_D_WARN : HGD_D_ERROR,
+		    "Can't open stats file '%s': %s", path, SERROR);
+		goto clean;
+	}
+
+	/* hgd-netd and hgd-playd may be initialising it at the same time */
+	if ((writable) && (flock(fd, LOCK_EX) < 0)) {
+		DPRINTF(HGD_D_WARN, "Can't lock '%s': %s", path, SERROR);
+		goto clean;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		DPRINTF(HGD_D_WARN, "Can't stat '%s': %s", path, SERROR);
+		goto clean;
+	}
+
+	/* new, or from an hgd with a different layout */
+	if (st.st_size != sizeof(struct hgd_stats)) {
+		if (!writable) {
+			DPRINTF(HGD_D_ERROR, "Stats file '%s' is the wrong size",
+			    path);
+			goto clean;
+		}
+
+		if ((ftruncate(fd, 0) < 0) ||
+		    (ftruncate(fd, sizeof(struct hgd_stats)) < 0)) {
+			DPRINTF(HGD_D_WARN, "Can't size stats file: %s", SERROR);
+			goto clean;
+		}
+	}
+
+	map = mmap(NULL, sizeof(struct hgd_stats),
+	    writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		DPRINTF(HGD_D_WARN, "Can't map stats file: %s", SERROR);
+		goto clean;
+	}
+	hgd_stats = map;
+
+	if (hgd_stats->magic != HGD_STATS_MAGIC) {
+		if (!writable) {
+			DPRINTF(HGD_D_ERROR, "Stats file '%s' is corrupt", path);
+			hgd_stats_close();
+			goto clean;
+		}
+
+		memset(hgd_stats, 0, sizeof(struct hgd_stats));
+		hgd_stats->size = sizeof(struct hgd_stats);
+		hgd_stats->magic = HGD_STATS_MAGIC;
+	}
+
+	ret = HGD_OK;
+clean:
+	if (fd >= 0)
+		close(fd); /* the mapping stays, the lock goes */
+	free(path);
+
+	return (ret);
+}
+
+void
+hgd_stats_close(void)
+{
+	if (hgd_stats == NULL)
+		return;
+
+	munmap(hgd_stats, sizeof(struct hgd_stats));
+	hgd_stats = NULL;
+}
+
+/*
+ * find (or make) the counters for a command. Only hgd-netd's parent does
+ * this, at startup, so no locking is needed.
+ */
+int
+hgd_stats_cmd_slot(char *name)
+{
+	uint32_t		i;
+
+	if (hgd_stats == NULL)
+		return (-1);
+
+	for (i = 0; i < hgd_stats->n_cmds; i++) {
+		if (strncmp(hgd_stats->cmds[i].name,
+		    name, HGD_STATS_CMD_NAME_SZ) == 0)
+			return (i);
+	}
+
+	if (hgd_stats->n_cmds == HGD_STATS_MAX_CMDS) {
+		DPRINTF(HGD_D_WARN, "No stats slot for command '%s'", name);
+		return (-1);
+	}
+
+	strncpy(hgd_stats->cmds[i].name, name, HGD_STATS_CMD_NAME_SZ - 1);
+	hgd_stats->n_cmds++;
+
+	return (i);
+}
+
+uint64_t
+hgd_stats_now_usecs(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* count a command which took usecs */
+void
+hgd_stats_cmd_done(int slot, uint64_t usecs)
+{
+	struct hgd_stats_cmd	*c;
+	int			 bucket = 0;
+
+	if ((hgd_stats == NULL) || (slot < 0))
+		return;
+
+	/* bucket n holds times under 2^n usecs */
+	while ((bucket < HGD_STATS_N_BUCKETS - 1) &&
+	    (usecs >= (1ULL << bucket)))
+		bucket++;
+
+	c = &hgd_stats->cmds[slot];
+	__sync_fetch_and_add(&c->count, 1);
+	__sync_fetch_and_add(&c->usecs, usecs);
+	__sync_fetch_and_add(&c->buckets[bucket], 1);
+}
+
+void
+hgd_stats_timing(int which, uint64_t usecs)
+{
+	struct hgd_stats_timing	*t;
+	uint64_t		 max;
+
+	if (hgd_stats == NULL)
+		return;
+
+	t = &hgd_stats->timings[which];
+	__sync_fetch_and_add(&t->count, 1);
+	__sync_fetch_and_add(&t->usecs, usecs);
+	t->last_usecs = usecs;
+
+	/* only hgd-playd writes these, but be tidy */
+	max = t->max_usecs;
+	while ((usecs > max) &&
+	    (!__sync_bool_compare_and_swap(&t->max_usecs, max, usecs)))
+		max = t->max_usecs;
+}
+
+/* describe the upper bound of a latency bucket */
+int
+hgd_stats_bucket_max_usecs(int bucket, char *buf, size_t sz)
+{
+	uint64_t		max;
+
+	if (bucket == HGD_STATS_N_BUCKETS - 1)
+		return (snprintf(buf, sz, "inf"));
+
+	max = 1ULL << bucket;
+	if (max >= 1000000)
+		return (snprintf(buf, sz, "%llus",
+		    (unsigned long long) max / 1000000));
+	if (max >= 1000)
+		return (snprintf(buf, sz, "%llums",
+		    (unsigned long long) max / 1000));
+
+	return (snprintf(buf, sz, "%lluus", (unsigned long long) max));
+}
+
+/* human readable dump, for hgd-admin */
+void
+hgd_stats_print(FILE *out)
+{
+	struct hgd_stats	*s = hgd_stats;
+	struct hgd_stats_cmd	*c;
+	struct hgd_stats_timing	*t;
+	uint32_t		 i;
+	int			 b;
+	char			 bound[16];
+	const char		*descrs[HGD_STATS_N_TIMINGS] = {
+				    "Gap between tracks",
+				    "Database to play start",
+				    "Skip to player stopped" };
+
+	if (s == NULL)
+		return;
+
+	fprintf(out, "\n  Network (hgd-netd):\n\n");
+	fprintf(out, "    %-30s: %llu\n", "Connections accepted",
+	    (unsigned long long) s->conns_accepted);
+	fprintf(out, "    %-30s: %lld\n", "Connections active",
+	    (long long) s->conns_active);
+	fprintf(out, "    %-30s: %llu\n", "TLS handshakes",
+	    (unsigned long long) s->tls_handshakes);
+	fprintf(out, "    %-30s: %llu\n", "Bytes uploaded",
+	    (unsigned long long) s->bytes_uploaded);
+	fprintf(out, "    %-30s: %llu\n", "Sessions reaped (idle)",
+	    (unsigned long long) s->reaped_idle);
+	fprintf(out, "    %-30s: %llu\n", "Sessions reaped (header)",
+	    (unsigned long long) s->reaped_header);
+	fprintf(out, "    %-30s: %llu\n", "Sessions reaped (upload)",
+	    (unsigned long long) s->reaped_upload);
+	fprintf(out, "    %-30s: %llu\n", "Sessions reaped (send)",
+	    (unsigned long long) s->reaped_send);
+	fprintf(out, "    %-30s: %llu\n", "Connections refused (busy)",
+	    (unsigned long long) s->refused_busy);
+	fprintf(out, "    %-30s: %llu\n", "Connections refused (rate)",
+	    (unsigned long long) s->refused_rate);
+
+	fprintf(out, "\n  Commands:\n\n");
+	fprintf(out, "    %-16s %10s %12s\n", "command", "count", "avg (us)");
+	for (i = 0; i < s->n_cmds; i++) {
+		c = &s->cmds[i];
+		fprintf(out, "    %-16.16s %10llu %12llu\n", c->name,
+		    (unsigned long long) c->count,
+		    (unsigned long long) (c->count ? c->usecs / c->count : 0));
+	}
+
+	fprintf(out, "\n  Command latency (count under each bound):\n");
+	for (i = 0; i < s->n_cmds; i++) {
+		c = &s->cmds[i];
+		if (c->count == 0)
+			continue;
+
+		fprintf(out, "\n    %s:\n", c->name);
+		for (b = 0; b < HGD_STATS_N_BUCKETS; b++) {
+			if (c->buckets[b] == 0)
+				continue;
+			hgd_stats_bucket_max_usecs(b, bound, sizeof(bound));
+			fprintf(out, "      < %-8s %llu\n", bound,
+			    (unsigned long long) c->buckets[b]);
+		}
+	}
+
+	fprintf(out, "\n  Database:\n\n");
+	fprintf(out, "    %-30s: %llu\n", "Busy retries",
+	    (unsigned long long) s->db_busy_retries);
+
+	fprintf(out, "\n  Player (hgd-playd):\n\n");
+	fprintf(out, "    %-24s %8s %10s %10s %10s\n", "", "count",
+	    "last (ms)", "avg (ms)", "max (ms)");
+	for (i = 0; i < HGD_STATS_N_TIMINGS; i++) {
+		t = &s->timings[i];
+		fprintf(out, "    %-24s %8llu %10.1f %10.1f %10.1f\n", descrs[i],
+		    (unsigned long long) t->count,
+		    (double) t->last_usecs / 1000,
+		    t->count ? (double) t->usecs / t->count / 1000 : 0,
+		    (double) t->max_usecs / 1000);
+	}
+	fprintf(out, "\n");
+}
+
+/* note that this process is running, for the uptime metrics */
+void
+hgd_stats_register(int component)
+{
+	if (hgd_stats == NULL)
+		return;
+
+	hgd_stats->components[component].started = time(NULL);
+	hgd_stats->components[component].pid = getpid();
+}
+
+/* only the registered process unregisters, not its forked children */
+void
+hgd_stats_unregister(int component)
+{
+	if (hgd_stats == NULL)
+		return;
+
+	if (hgd_stats->components[component].pid == getpid())
+		hgd_stats->components[component].pid = 0;
+}
+
+/*
+ * make a listening unix socket for the metrics in the state dir.
+ * Anyone who can get into the state dir may read them.
+ */
+int
+hgd_metrics_listen(const char *component)
+{
+	struct sockaddr_un	 addr;
+	char			*path = NULL;
+	int			 fd = -1;
+
+	xasprintf(&path, "%s/%s%s", state_path, component, HGD_METRICS_SUFFIX);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		DPRINTF(HGD_D_WARN, "Metrics socket path too long: %s", path);
+		goto clean;
+	}
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		DPRINTF(HGD_D_WARN, "socket(): %s", SERROR);
+		goto clean;
+	}
+
+	/* a stale socket from a previous run */
+	if ((unlink(path) < 0) && (errno != ENOENT))
+		DPRINTF(HGD_D_WARN, "Can't unlink '%s': %s", path, SERROR);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		DPRINTF(HGD_D_WARN, "Can't bind '%s': %s", path, SERROR);
+		goto fail;
+	}
+
+	if (chmod(path, S_IRUSR | S_IWUSR) < 0)
+		DPRINTF(HGD_D_WARN, "Can't secure '%s': %s", path, SERROR);
+
+	if ((listen(fd, 5) < 0) ||
+	    (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) ||
+	    (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)) {
+		DPRINTF(HGD_D_WARN, "Can't listen on '%s': %s", path, SERROR);
+		goto fail;
+	}
+
+	DPRINTF(HGD_D_INFO, "Serving metrics on '%s'", path);
+	metrics_pid = getpid();
+	goto clean;
+fail:
+	close(fd);
+	fd = -1;
+clean:
+	free(path);
+
+	return (fd);
+}
+
+void
+hgd_metrics_close(const char *component, int fd)
+{
+	char			*path = NULL;
+
+	if (fd < 0)
+		return;
+
+	close(fd);
+
+	/* forked children just drop their copy */
+	if (getpid() != metrics_pid)
+		return;
+
+	xasprintf(&path, "%s/%s%s", state_path, component, HGD_METRICS_SUFFIX);
+	unlink(path);
+	free(path);
+}
+
+#define HGD_METRICS_APPEND(...)						\
+	do {								\
+		if (len < sz)						\
+			len += snprintf(buf + len, sz - len, __VA_ARGS__); \
+	} while (0)
+
+/*
+ * render the metrics in the Prometheus text format. Only reads the
+ * shared counters, the work done is the same however busy hgd is.
+ */
+size_t
+hgd_metrics_format(char *buf, size_t sz)
+{
+	struct hgd_stats	*s = hgd_stats;
+	struct hgd_stats_cmd	*c;
+	const char		*names[HGD_STATS_N_COMPONENTS] = {
+				    HGD_COMPONENT_HGD_NETD,
+				    HGD_COMPONENT_HGD_PLAYD };
+	size_t			 len = 0;
+	time_t			 now = time(NULL);
+	pid_t			 pid;
+	uint32_t		 i;
+
+	if (s == NULL)
+		return (0);
+
+	HGD_METRICS_APPEND("# HELP hgd_up_seconds Time since the daemon "
+	    "started, absent if it is not running.\n"
+	    "# TYPE hgd_up_seconds gauge\n");
+	for (i = 0; i < HGD_STATS_N_COMPONENTS; i++) {
+		pid = s->components[i].pid;
+		if ((pid == 0) || (kill(pid, 0) < 0 && errno == ESRCH))
+			continue;
+		HGD_METRICS_APPEND("hgd_up_seconds{component=\"%s\"} %lld\n",
+		    names[i], (long long) (now - s->components[i].started));
+	}
+
+	HGD_METRICS_APPEND("# HELP hgd_queue_length Tracks in the playlist, "
+	    "including the one playing.\n"
+	    "# TYPE hgd_queue_length gauge\n"
+	    "hgd_queue_length %d\n", s->queue_len);
+	HGD_METRICS_APPEND("# HELP hgd_votes Votes to skip the playing "
+	    "track.\n"
+	    "# TYPE hgd_votes gauge\n"
+	    "hgd_votes %d\n", s->votes);
+	HGD_METRICS_APPEND("# HELP hgd_votes_needed Votes needed to skip "
+	    "a track.\n"
+	    "# TYPE hgd_votes_needed gauge\n"
+	    "hgd_votes_needed %d\n", s->votes_needed);
+
+	HGD_METRICS_APPEND("# HELP hgd_upload_bytes_total Bytes of media "
+	    "uploaded.\n"
+	    "# TYPE hgd_upload_bytes_total counter\n"
+	    "hgd_upload_bytes_total %llu\n",
+	    (unsigned long long) s->bytes_uploaded);
+	HGD_METRICS_APPEND("# HELP hgd_upload_seconds_total Time spent "
+	    "receiving uploads.\n"
+	    "# TYPE hgd_upload_seconds_total counter\n"
+	    "hgd_upload_seconds_total %.6f\n",
+	    (double) s->upload_usecs / 1000000);
+
+	HGD_METRICS_APPEND("# HELP hgd_connections_total Client "
+	    "connections accepted.\n"
+	    "# TYPE hgd_connections_total counter\n"
+	    "hgd_connections_total %llu\n",
+	    (unsigned long long) s->conns_accepted);
+	HGD_METRICS_APPEND("# HELP hgd_connections Client connections "
+	    "being serviced.\n"
+	    "# TYPE hgd_connections gauge\n"
+	    "hgd_connections %lld\n", (long long) s->conns_active);
+	HGD_METRICS_APPEND("# HELP hgd_tls_handshakes_total TLS sessions "
+	    "established.\n"
+	    "# TYPE hgd_tls_handshakes_total counter\n"
+	    "hgd_tls_handshakes_total %llu\n",
+	    (unsigned long long) s->tls_handshakes);
+	HGD_METRICS_APPEND("# HELP hgd_sessions_reaped_total Client sessions "
+	    "dropped for missing a receive deadline.\n"
+	    "# TYPE hgd_sessions_reaped_total counter\n"
+	    "hgd_sessions_reaped_total{deadline=\"idle\"} %llu\n"
+	    "hgd_sessions_reaped_total{deadline=\"header\"} %llu\n"
+	    "hgd_sessions_reaped_total{deadline=\"upload\"} %llu\n"
+	    "hgd_sessions_reaped_total{deadline=\"send\"} %llu\n",
+	    (unsigned long long) s->reaped_idle,
+	    (unsigned long long) s->reaped_header,
+	    (unsigned long long) s->reaped_upload,
+	    (unsigned long long) s->reaped_send);
+	HGD_METRICS_APPEND("# HELP hgd_connections_refused_total Client "
+	    "connections turned away by the session cap or rate limit.\n"
+	    "# TYPE hgd_connections_refused_total counter\n"
+	    "hgd_connections_refused_total{why=\"busy\"} %llu\n"
+	    "hgd_connections_refused_total{why=\"rate\"} %llu\n",
+	    (unsigned long long) s->refused_busy,
+	    (unsigned long long) s->refused_rate);
+	HGD_METRICS_APPEND("# HELP hgd_db_busy_retries_total Waits for a "
+	    "locked database.\n"
+	    "# TYPE hgd_db_busy_retries_total counter\n"
+	    "hgd_db_busy_retries_total %llu\n",
+	    (unsigned long long) s->db_busy_retries);
+	HGD_METRICS_APPEND("# HELP hgd_player_seconds_total Time taken by "
+	    "hgd-playd between tracks, starting tracks and skipping.\n"
+	    "# TYPE hgd_player_seconds_total counter\n");
+	for (i = 0; i < HGD_STATS_N_TIMINGS; i++)
+		HGD_METRICS_APPEND(
+		    "hgd_player_seconds_total{what=\"%s\"} %.6f\n",
+		    hgd_stats_timing_names[i],
+		    (double) s->timings[i].usecs / 1000000);
+	HGD_METRICS_APPEND("# HELP hgd_player_events_total Track gaps, starts "
+	    "and skips measured.\n"
+	    "# TYPE hgd_player_events_total counter\n");
+	for (i = 0; i < HGD_STATS_N_TIMINGS; i++)
+		HGD_METRICS_APPEND(
+		    "hgd_player_events_total{what=\"%s\"} %llu\n",
+		    hgd_stats_timing_names[i],
+		    (unsigned long long) s->timings[i].count);
+
+	HGD_METRICS_APPEND("# HELP hgd_commands_total Protocol commands "
+	    "handled.\n"
+	    "# TYPE hgd_commands_total counter\n");
+	for (i = 0; i < s->n_cmds; i++) {
+		c = &s->cmds[i];
+		HGD_METRICS_APPEND("hgd_commands_total{command=\"%.*s\"} %llu\n",
+		    HGD_STATS_CMD_NAME_SZ, c->name,
+		    (unsigned long long) c->count);
+	}
+
+	HGD_METRICS_APPEND("# HELP hgd_command_seconds_total Time spent "
+	    "handling protocol commands.\n"
+	    "# TYPE hgd_command_seconds_total counter\n");
+	for (i = 0; i < s->n_cmds; i++) {
+		c = &s->cmds[i];
+		HGD_METRICS_APPEND(
+		    "hgd_command_seconds_total{command=\"%.*s\"} %.6f\n",
+		    HGD_STATS_CMD_NAME_SZ, c->name,
+		    (double) c->usecs / 1000000);
+	}
+
+	return ((len < sz) ? len : sz - 1);
+}
+
+/* answer one scrape, if there is one waiting: write the metrics and hang up */
+void
+hgd_metrics_serve(int fd)
+{
+	char			 buf[HGD_METRICS_BUF_SZ];
+	size_t			 len, done = 0;
+	ssize_t			 wrote;
+	int			 cli_fd;
+
+	if ((cli_fd = accept(fd, NULL, NULL)) < 0) {
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			DPRINTF(HGD_D_WARN, "Metrics accept: %s", SERROR);
+		return;
+	}
+
+	len = hgd_metrics_format(buf, sizeof(buf));
+	while (done < len) {
+		wrote = write(cli_fd, buf + done, len - done);
+		if (wrote < 0) {
+			if (errno == EINTR)
+				continue;
+			DPRINTF(HGD_D_WARN, "Metrics write: %s", SERROR);
+			break;
+		}
+		done += wrote;
+	}
+
+	close(cli_fd);
+}
+
+void *
+hgd_metrics_thread(void *arg)
+{
+	struct pollfd		pfd;
+
+	pfd.fd = *(int *) arg;
+	pfd.events = POLLIN;
+	free(arg);
+
+	while (1) {
+		if (poll(&pfd, 1, INFTIM) > 0)
+			hgd_metrics_serve(pfd.fd);
+	}
+
+	return (NULL); /* NOREACH */
+}
+
+/* serve metrics from a thread, for daemons which block elsewhere */
+int
+hgd_metrics_start_thread(int fd)
+{
+	pthread_t		 thread;
+	sigset_t		 all, old;
+	int			*arg, ret = HGD_OK;
+
+	arg = xmalloc(sizeof(int));
+	*arg = fd;
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	if (pthread_create(&thread, NULL, hgd_metrics_thread, arg) != 0) {
+		DPRINTF(HGD_D_WARN, "Can't start metrics thread");
+		free(arg);
+		ret = HGD_FAIL;
+	} else
+		pthread_detach(thread);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return (ret);
+}
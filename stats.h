@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Martin Ellis <ellism88@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "hgd.h"
+
+/*
+ * Runtime counters, kept in a file in the state dir which every hgd
+ * process maps shared, so forked children and other daemons can all
+ * update them and hgd-admin can read them. Updates are atomic adds.
+ */
+#define HGD_STATS_FILE		"hgd.stats"
+#define HGD_STATS_MAGIC		0x48474453	/* "HGDS" */
+#define HGD_STATS_MAX_CMDS	32
+#define HGD_STATS_CMD_NAME_SZ	16
+/* latency buckets are powers of 2 in microseconds, the last is unbounded */
+#define HGD_STATS_N_BUCKETS	22
+
+struct hgd_stats_cmd {
+	char			 name[HGD_STATS_CMD_NAME_SZ];
+	uint64_t		 count;
+	uint64_t		 usecs;		/* total time spent */
+	uint64_t		 buckets[HGD_STATS_N_BUCKETS];
+};
+
+/* daemons which register in the stats */
+#define HGD_STATS_NETD		0
+#define HGD_STATS_PLAYD		1
+#define HGD_STATS_N_COMPONENTS	2
+
+/* an interval measured over and over */
+struct hgd_stats_timing {
+	uint64_t		 count;
+	uint64_t		 usecs;		/* total */
+	uint64_t		 last_usecs;
+	uint64_t		 max_usecs;
+};
+
+/* the timings, in the order we report them */
+#define HGD_STATS_TRACK_GAP	0	/* end of a track to start of next */
+#define HGD_STATS_PLAY_START	1	/* db lookup to player started */
+#define HGD_STATS_SKIP		2	/* skip requested to player gone */
+#define HGD_STATS_N_TIMINGS	3
+
+struct hgd_stats_component {
+	pid_t			 pid;		/* 0 if not running */
+	time_t			 started;
+};
+
+struct hgd_stats {
+	uint32_t		 magic;
+	uint32_t		 size;		/* of this struct */
+	struct hgd_stats_component components[HGD_STATS_N_COMPONENTS];
+	/* playlist state, refreshed by db.c whenever it changes */
+	int32_t			 queue_len;	/* unfinished, inc. playing */
+	int32_t			 votes;
+	int32_t			 votes_needed;
+	/* hgd-netd */
+	uint64_t		 conns_accepted;
+	int64_t			 conns_active;
+	uint64_t		 tls_handshakes;
+	uint64_t		 bytes_uploaded;
+	uint64_t		 upload_usecs;	/* time spent receiving them */
+	/* sessions dropped for missing a receive deadline */
+	uint64_t		 reaped_idle;
+	uint64_t		 reaped_header;
+	uint64_t		 reaped_upload;
+	uint64_t		 reaped_send;
+	/* connections turned away before forking, see hgd_admit() */
+	uint64_t		 refused_busy;
+	uint64_t		 refused_rate;
+	uint32_t		 n_cmds;
+	struct hgd_stats_cmd	 cmds[HGD_STATS_MAX_CMDS];
+	/* database */
+	uint64_t		 db_busy_retries;
+	/* hgd-playd */
+	struct hgd_stats_timing	 timings[HGD_STATS_N_TIMINGS];
+	uint64_t		 skip_requested;	/* when, 0 if not */
+};
+
+extern const char		*hgd_stats_timing_names[HGD_STATS_N_TIMINGS];
+
+extern struct hgd_stats		*hgd_stats;
+
+/* no-ops if the stats file isn't mapped */
+#define HGD_STATS_ADD(field, n)						\
+	do {								\
+		if (hgd_stats != NULL)					\
+			__sync_fetch_and_add(&hgd_stats->field, (n));	\
+	} while (0)
+#define HGD_STATS_INC(field)	HGD_STATS_ADD(field, 1)
+#define HGD_STATS_SET(field, n)						\
+	do {								\
+		if (hgd_stats != NULL)					\
+			hgd_stats->field = (n);				\
+	} while (0)
+
+/* metrics endpoint, a unix socket in the state dir per daemon */
+#define HGD_METRICS_SUFFIX	".metrics"
+#define HGD_METRICS_BUF_SZ	8192
+
+int			 hgd_stats_open(uint8_t writable);
+void			 hgd_stats_close(void);
+int			 hgd_stats_cmd_slot(char *name);
+void			 hgd_stats_cmd_done(int slot, uint64_t usecs);
+void			 hgd_stats_timing(int which, uint64_t usecs);
+uint64_t		 hgd_stats_now_usecs(void);
+int			 hgd_stats_bucket_max_usecs(int bucket, char *buf,
+			     size_t sz);
+void			 hgd_stats_print(FILE *out);
+void			 hgd_stats_register(int component);
+void			 hgd_stats_unregister(int component);
+int			 hgd_metrics_listen(const char *component);
+void			 hgd_metrics_close(const char *component, int fd);
+size_t			 hgd_metrics_format(char *buf, size_t sz);
+void			 hgd_metrics_serve(int fd);
+int			 hgd_metrics_start_thread(int fd);
+
+#endif
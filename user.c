@@ -24,7 +24,7 @@
 #include "mplayer.h"
 
 int
-hgd_user_add(char *user, char *pass)
+hgd_user_add(struct hgd_ctx *ctx, char *user, char *pass)
 {
 	unsigned char		 salt[HGD_SHA_SALT_SZ];
 	char			*salt_hex = NULL, *hash_hex = NULL;
@@ -35,10 +35,7 @@ hgd_user_add(char *user, char *pass)
 
 	DPRINTF(HGD_D_INFO, "Adding user '%s'", user);
 
-	if (db == NULL)
-		db = hgd_open_db(db_path, 0);
-
-	if (db == NULL)
+	if ((ctx->db == NULL) && (hgd_open_db(ctx, db_path, 0) != HGD_OK))
 		goto clean;
 
 	memset(salt, 0, HGD_SHA_SALT_SZ);
@@ -56,7 +53,7 @@ hgd_user_add(char *user, char *pass)
 	hgd_bytes_to_hex_buf(hash_hex, hash_ascii, HGD_SHA_SALT_SZ);
 	DPRINTF(HGD_D_DEBUG, "new_user's hash '%s'", hash_ascii);
 
-	ret = hgd_user_add_db(user, salt_hex, hash_hex);
+	ret = hgd_user_add_db(ctx, user, salt_hex, hash_hex);
 clean:
 	if (salt_hex)
 		free(salt_hex);
@@ -67,17 +64,14 @@ clean:
 }
 
 int
-hgd_user_list(struct hgd_user_list **list)
+hgd_user_list(struct hgd_ctx *ctx, struct hgd_user_list **list)
 {
 	int		ret = HGD_FAIL;
 
-	if (db == NULL)
-		db = hgd_open_db(db_path, 0);
-
-	if (db == NULL)
+	if ((ctx->db == NULL) && (hgd_open_db(ctx, db_path, 0) != HGD_OK))
 		goto clean;
 
-	if ((*list = hgd_get_all_users()) == NULL) {
+	if ((*list = hgd_get_all_users(ctx)) == NULL) {
 		DPRINTF(HGD_D_WARN, "Failed to get userlist");
 		goto clean;
 	}
@@ -92,20 +86,18 @@ clean:
  * indicated by 'perm_mask'.
  */
 int
-hgd_user_mod_perms(char *uname, int perm_mask, uint8_t set)
+hgd_user_mod_perms(struct hgd_ctx *ctx, char *uname, int perm_mask,
+    uint8_t set)
 {
 	struct hgd_user		user;
 	int			ret = HGD_FAIL, new_perms = 0;
 
 	memset(&user, 0, sizeof(struct hgd_user));
 
-	if (db == NULL)
-		db = hgd_open_db(db_path, 0);
-
-	if (db == NULL)
+	if ((ctx->db == NULL) && (hgd_open_db(ctx, db_path, 0) != HGD_OK))
 		goto clean;
 
-	if (hgd_get_user(uname, &user) == HGD_FAIL_USRNOEXIST) {
+	if (hgd_get_user(ctx, uname, &user) == HGD_FAIL_USRNOEXIST) {
 		DPRINTF(HGD_D_ERROR, "User %s does not exist.", user.name);
 		ret = HGD_FAIL_USRNOEXIST;
 		goto clean;
@@ -126,7 +118,7 @@ hgd_user_mod_perms(char *uname, int perm_mask, uint8_t set)
 
 	/* otherwise, update */
 	user.perms = new_perms;
-	ret = hgd_user_mod_perms_db(&user);
+	ret = hgd_user_mod_perms_db(ctx, &user);
 clean:
 	if (user.name)
 		free(user.name);
@@ -135,8 +127,8 @@ clean:
 }
 
 int
-hgd_user_del(char *uname)
+hgd_user_del(struct hgd_ctx *ctx, char *uname)
 {
-	return (hgd_user_del_db(uname));
+	return (hgd_user_del_db(ctx, uname));
 }
 
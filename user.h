@@ -20,10 +20,12 @@
 
 #include "hgd.h"
 
-int			 hgd_user_list(struct hgd_user_list **);
-int			 hgd_user_mod_perms(char *uname,
+int			 hgd_user_list(struct hgd_ctx *ctx,
+			    struct hgd_user_list **);
+int			 hgd_user_mod_perms(struct hgd_ctx *ctx, char *uname,
 			    int perm_mask, uint8_t set);
-int			 hgd_user_del(char *uname);
-int			 hgd_user_add(char *user, char *pass);
+int			 hgd_user_del(struct hgd_ctx *ctx, char *uname);
+int			 hgd_user_add(struct hgd_ctx *ctx, char *user,
+			    char *pass);
 
 #endif